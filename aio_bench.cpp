@@ -0,0 +1,131 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <magic_enum.hpp>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "async_io.hpp"
+#include "container_printer.hpp"
+#include "logging.hpp"
+namespace bpo = boost::program_options;
+namespace stdfsys = std::filesystem;
+using namespace nyulan::container_ostream;
+namespace {
+constexpr std::size_t ALIGNMENT = 4096;  // O_DIRECTのため
+
+// queue_depth個の読み込みを常に投げたままにして、ファイル全体を読む
+double read_throughput(const std::string &filename, nyulan::AsyncIo::Backend backend, unsigned queue_depth,
+                       std::size_t block_size, bool direct) {
+    int fd = ::open(filename.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+    if (fd == -1) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+    auto file_size = static_cast<std::uint64_t>(stdfsys::file_size(filename));
+    // NOTE: ioより先に破棄されないように、バッファを先に置く(ioのデストラクタが実行中のものを待つ)
+    std::vector<std::unique_ptr<std::uint8_t, decltype(&std::free)>> buffers;
+    auto buffer_size = (block_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;  // aligned_alloc()は倍数しか受け付けない
+    for (unsigned i = 0; i < queue_depth; i++) {
+        buffers.emplace_back(static_cast<std::uint8_t *>(std::aligned_alloc(ALIGNMENT, buffer_size)), &std::free);
+        if (buffers.back() == nullptr) {
+            ::close(fd);
+            throw std::runtime_error("failed to allocate buffers");
+        }
+    }
+    auto io = nyulan::AsyncIo::create(queue_depth, backend);
+    auto begin = std::chrono::steady_clock::now();
+    std::uint64_t next_offset = 0;
+    std::uint64_t bytes_read = 0;
+    unsigned in_flight = 0;
+    std::int64_t error = 0;
+    for (unsigned slot = 0; slot < queue_depth && next_offset < file_size; slot++, next_offset += block_size) {
+        io->submit({slot, fd, false, buffers[slot].get(), block_size, next_offset});
+        in_flight++;
+    }
+    while (in_flight > 0) {
+        auto completion = io->wait();
+        in_flight--;
+        if (completion.result < 0) {
+            error = completion.result;  // 残りが終わるのを待ってから投げる
+        } else {
+            bytes_read += completion.result;
+        }
+        if (error == 0 && next_offset < file_size) {  // 空いたバッファで次を読む
+            io->submit({completion.ticket, fd, false, buffers[completion.ticket].get(), block_size, next_offset});
+            next_offset += block_size;
+            in_flight++;
+        }
+    }
+    if (error < 0) {
+        ::close(fd);
+        throw std::runtime_error("read failed with errno " + std::to_string(-error));
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    ::close(fd);
+    return bytes_read / elapsed / (1024 * 1024);
+}
+}  // namespace
+int main(int argc, char **argv) {
+    bpo::options_description opt("option");
+    std::stringstream backend_description;
+    backend_description << "async io backend " << magic_enum::enum_names<nyulan::AsyncIo::Backend>();
+    opt.add_options()("help,h", "show this help")("file,f", bpo::value<std::string>(),
+                                                   "file to read (a temporary file is created if omitted)")(
+        "size-mib", bpo::value<std::size_t>()->default_value(64), "size of the temporary file")(
+        "block-kib", bpo::value<std::size_t>()->default_value(4), "size of each read")(
+        "backend,b", bpo::value<std::string>()->default_value("AUTO"), backend_description.str().c_str())(
+        "direct", "open with O_DIRECT to bypass the page cache")("debug,d", "enable debug outputs");
+
+    bpo::variables_map varmap;
+    bpo::store(bpo::parse_command_line(argc, argv, opt), varmap);
+    bpo::notify(varmap);
+    if (varmap.count("help")) {
+        std::cout << opt << std::endl;
+        std::exit(EXIT_SUCCESS);
+    }
+    nyulan::logging::init(varmap.count("debug") ? boost::log::trivial::debug : boost::log::trivial::warning);
+    auto backend = magic_enum::enum_cast<nyulan::AsyncIo::Backend>(varmap["backend"].as<std::string>());
+    if (!backend) {
+        std::cerr << "can't understand backend \"" << varmap["backend"].as<std::string>() << "\"" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    auto block_size = varmap["block-kib"].as<std::size_t>() * 1024;
+
+    std::string filename;
+    bool remove_file = false;
+    if (varmap.count("file")) {
+        filename = varmap["file"].as<std::string>();
+    } else {
+        filename = (stdfsys::temp_directory_path() / "nyulan_aio_bench.dat").string();
+        remove_file = true;
+        std::ofstream tmp(filename, std::ios_base::binary);
+        std::vector<char> chunk(1024 * 1024, 'n');
+        for (size_t i = 0; i < varmap["size-mib"].as<std::size_t>(); i++) {
+            tmp.write(chunk.data(), chunk.size());
+        }
+        tmp.close();
+    }
+
+    std::cout << "backend: " << nyulan::AsyncIo::create(1, backend.value())->backend_name()
+              << ", block size: " << block_size << " bytes" << (varmap.count("direct") ? ", O_DIRECT" : "")
+              << std::endl;
+    std::cout << std::setw(12) << "queue depth" << std::setw(16) << "MiB/s" << std::endl;
+    for (unsigned queue_depth = 1; queue_depth <= 64; queue_depth *= 2) {
+        auto throughput = read_throughput(filename, backend.value(), queue_depth, block_size, varmap.count("direct"));
+        std::cout << std::setw(12) << queue_depth << std::setw(16) << std::fixed << std::setprecision(1) << throughput
+                  << std::endl;
+    }
+    if (remove_file) {
+        stdfsys::remove(filename);
+    }
+    return 0;
+}
@@ -0,0 +1,393 @@
+#include "async_io.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    define NYULAN_HAS_IO_URING
+#endif
+
+#include "logging.hpp"
+namespace nyulan {
+namespace {
+#ifdef NYULAN_HAS_IO_URING
+// NOTE: liburingには依存せず、システムコールを直接呼ぶ
+class IoUring final : public AsyncIo {
+   public:
+    static std::unique_ptr<AsyncIo> try_create(unsigned queue_depth) {
+        io_uring_params params{};
+        int ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, queue_depth, &params));
+        if (ring_fd < 0) {
+            TRIVIAL_LOG_WITH_FUNCNAME(debug) << "io_uring_setup failed: " << std::strerror(errno);
+            return nullptr;
+        }
+        if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {  // NOTE: IORING_OP_READ/WRITEと同じ5.6から
+            TRIVIAL_LOG_WITH_FUNCNAME(debug) << "io_uring of this kernel is too old";
+            ::close(ring_fd);
+            return nullptr;
+        }
+        std::unique_ptr<IoUring> result(new IoUring(ring_fd, params));
+        if (not result->mapped()) {
+            return nullptr;
+        }
+        result->completion_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (result->completion_fd_ == -1 ||
+            syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD, &result->completion_fd_, 1) < 0) {
+            TRIVIAL_LOG_WITH_FUNCNAME(debug) << "failed to register eventfd to io_uring: " << std::strerror(errno);
+            return nullptr;
+        }
+        return result;
+    }
+    ~IoUring() override {
+        // NOTE: バッファが解放される前に、実行中のものを取り消して完了を待つ
+        for (auto ticket : this->in_flight_) {
+            auto &sqe = this->prepare_sqe();
+            sqe.opcode = IORING_OP_ASYNC_CANCEL;
+            sqe.fd = -1;
+            sqe.addr = ticket;
+            sqe.user_data = CANCEL_TICKET;
+            this->commit_sqe();
+        }
+        while (not this->in_flight_.empty()) {
+            this->reap(true);
+        }
+        if (this->sqes_ != MAP_FAILED) {
+            munmap(this->sqes_, this->sqes_size_);
+        }
+        if (this->cq_ptr_ != MAP_FAILED && this->cq_ptr_ != this->sq_ptr_) {
+            munmap(this->cq_ptr_, this->cq_size_);
+        }
+        if (this->sq_ptr_ != MAP_FAILED) {
+            munmap(this->sq_ptr_, this->sq_size_);
+        }
+        ::close(this->ring_fd_);
+        if (this->completion_fd_ != -1) {
+            ::close(this->completion_fd_);
+        }
+    }
+    void submit(const Request &request) override {
+        while (this->in_flight_.size() >= this->sq_entries_) {
+            this->stashed_.push_back(this->reap(true).value());  // 空きができるまで待つ
+        }
+        auto &sqe = this->prepare_sqe();
+        sqe.opcode = request.is_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = request.fd;
+        sqe.addr = reinterpret_cast<std::uint64_t>(request.buffer);
+        // NOTE: sqe.lenは32bitなので、それを超える分は切り詰めて短い読み書きとして返す(read(2)も一度には全部読まない)
+        sqe.len = static_cast<std::uint32_t>(std::min<std::size_t>(request.len, UINT32_MAX));
+        sqe.off = request.offset;  // NOTE: -1なら現在位置から(IORING_FEAT_RW_CUR_POS)
+        sqe.user_data = request.ticket;
+        this->in_flight_.insert(request.ticket);
+        this->commit_sqe();
+    }
+    std::optional<Completion> poll() override {
+        if (not this->stashed_.empty()) {
+            auto result = this->stashed_.front();
+            this->stashed_.pop_front();
+            return result;
+        }
+        return this->reap(false);
+    }
+    Completion wait() override {
+        if (this->stashed_.empty() && this->in_flight_.empty()) {
+            throw std::logic_error("error: waited for async io with no request in flight");
+        }
+        if (auto result = this->poll()) {
+            return result.value();
+        }
+        return this->reap(true).value();
+    }
+    int completion_fd() const override { return this->completion_fd_; }
+    std::string backend_name() const override { return "io_uring"; }
+
+   private:
+    static constexpr std::uint64_t CANCEL_TICKET = ~UINT64_C(0);
+    int ring_fd_;
+    int completion_fd_ = -1;  // NOTE: 取り消しの完了でも書き込まれる
+    unsigned sq_entries_;
+    void *sq_ptr_ = MAP_FAILED;
+    std::size_t sq_size_;
+    void *cq_ptr_ = MAP_FAILED;
+    std::size_t cq_size_;
+    io_uring_sqe *sqes_ = static_cast<io_uring_sqe *>(MAP_FAILED);
+    std::size_t sqes_size_;
+    unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+    unsigned *cq_head_, *cq_tail_, *cq_mask_;
+    io_uring_cqe *cqes_;
+    std::unordered_set<std::uint64_t> in_flight_;
+    std::deque<Completion> stashed_;  // submit()で空きを作るために取り出したもの
+
+    IoUring(int ring_fd, const io_uring_params &params) : ring_fd_(ring_fd), sq_entries_(params.sq_entries) {
+        this->sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        this->cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            this->sq_size_ = this->cq_size_ = std::max(this->sq_size_, this->cq_size_);
+        }
+        this->sq_ptr_ = mmap(nullptr, this->sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                             IORING_OFF_SQ_RING);
+        if (this->sq_ptr_ == MAP_FAILED) {
+            return;
+        }
+        this->cq_ptr_ = single_mmap ? this->sq_ptr_
+                                    : mmap(nullptr, this->cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ring_fd, IORING_OFF_CQ_RING);
+        if (this->cq_ptr_ == MAP_FAILED) {
+            return;
+        }
+        this->sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        this->sqes_ = static_cast<io_uring_sqe *>(mmap(nullptr, this->sqes_size_, PROT_READ | PROT_WRITE,
+                                                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        auto sq = static_cast<char *>(this->sq_ptr_);
+        this->sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        this->sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        this->sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        this->sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        auto cq = static_cast<char *>(this->cq_ptr_);
+        this->cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        this->cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        this->cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        this->cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+    bool mapped() const {
+        return this->sq_ptr_ != MAP_FAILED && this->cq_ptr_ != MAP_FAILED && this->sqes_ != MAP_FAILED;
+    }
+    io_uring_sqe &prepare_sqe() {
+        auto index = *this->sq_tail_ & *this->sq_mask_;
+        auto &sqe = this->sqes_[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        this->sq_array_[index] = index;
+        return sqe;
+    }
+    void commit_sqe() {
+        auto tail = *this->sq_tail_;
+        std::atomic_ref<unsigned>(*this->sq_tail_).store(tail + 1, std::memory_order_release);
+        this->enter(1, 0, 0);
+    }
+    void enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+        while (syscall(__NR_io_uring_enter, this->ring_fd_, to_submit, min_complete, flags, nullptr, 0) < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::runtime_error(std::string("error: io_uring_enter failed: ") + std::strerror(errno));
+            }
+        }
+    }
+    std::optional<Completion> reap(bool block) {
+        while (true) {
+            auto head = *this->cq_head_;
+            auto tail = std::atomic_ref<unsigned>(*this->cq_tail_).load(std::memory_order_acquire);
+            if (head != tail) {
+                const auto &cqe = this->cqes_[head & *this->cq_mask_];
+                Completion result{cqe.user_data, cqe.res};
+                std::atomic_ref<unsigned>(*this->cq_head_).store(head + 1, std::memory_order_release);
+                if (result.ticket == CANCEL_TICKET) {
+                    continue;
+                }
+                this->in_flight_.erase(result.ticket);
+                return result;
+            }
+            if (not block) {
+                return std::nullopt;
+            }
+            this->enter(0, 1, IORING_ENTER_GETEVENTS);
+        }
+    }
+};
+#endif
+
+class ThreadPoolIo final : public AsyncIo {
+   public:
+    explicit ThreadPoolIo(unsigned num_threads) {
+        this->epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        this->wakeup_fd_ = eventfd(0, EFD_CLOEXEC);
+        this->completion_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (this->epoll_fd_ == -1 || this->wakeup_fd_ == -1 || this->completion_fd_ == -1) {
+            throw std::runtime_error(std::string("error: failed to set up async io: ") + std::strerror(errno));
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, this->wakeup_fd_, &event);
+        for (unsigned i = 0; i < std::max(num_threads, 1u); i++) {
+            this->workers_.emplace_back([this] { this->work(); });
+        }
+        this->poller_ = std::thread([this] { this->poll_readiness(); });
+    }
+    ~ThreadPoolIo() override {
+        {
+            std::lock_guard lock(this->mutex_);
+            this->stopping_ = true;
+        }
+        this->queue_cv_.notify_all();
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto written = ::write(this->wakeup_fd_, &one, sizeof(one));
+        for (auto &worker : this->workers_) {
+            worker.join();
+        }
+        this->poller_.join();
+        for (auto request : this->waiting_) {
+            delete request;
+        }
+        for (auto request : this->queue_) {
+            delete request;
+        }
+        ::close(this->completion_fd_);
+        ::close(this->wakeup_fd_);
+        ::close(this->epoll_fd_);
+    }
+    void submit(const Request &request) override {
+        std::lock_guard lock(this->mutex_);
+        this->in_flight_++;
+        this->dispatch(new Request(request));
+    }
+    std::optional<Completion> poll() override {
+        std::lock_guard lock(this->mutex_);
+        return this->pop_completion();
+    }
+    Completion wait() override {
+        std::unique_lock lock(this->mutex_);
+        if (this->in_flight_ == 0) {
+            throw std::logic_error("error: waited for async io with no request in flight");
+        }
+        this->completed_cv_.wait(lock, [this] { return not this->completed_.empty(); });
+        return this->pop_completion().value();
+    }
+    int completion_fd() const override { return this->completion_fd_; }
+    std::string backend_name() const override { return "thread pool"; }
+
+   private:
+    int epoll_fd_;
+    int wakeup_fd_;
+    int completion_fd_;
+    std::mutex mutex_;
+    std::condition_variable queue_cv_;
+    std::condition_variable completed_cv_;
+    std::deque<Request *> queue_;
+    std::unordered_set<Request *> waiting_;  // epollで待っているもの
+    std::deque<Completion> completed_;
+    std::size_t in_flight_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+    std::thread poller_;
+
+    std::optional<Completion> pop_completion() {
+        if (this->completed_.empty()) {
+            return std::nullopt;
+        }
+        auto result = this->completed_.front();
+        this->completed_.pop_front();
+        this->in_flight_--;
+        return result;
+    }
+    // mutex_を取ってから呼ぶ
+    void dispatch(Request *request) {
+        struct stat status;
+        if (fstat(request->fd, &status) == 0 && not S_ISREG(status.st_mode)) {
+            // NOTE: パイプやソケットは準備ができるまでepollで待ち、スレッドを塞がない
+            epoll_event event{};
+            event.events = (request->is_write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+            event.data.ptr = request;
+            if (epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, request->fd, &event) == 0) {
+                this->waiting_.insert(request);
+                return;
+            }
+            // 同じfdを既に待っているときなどは、スレッドで直接読み書きする
+        }
+        this->queue_.push_back(request);
+        this->queue_cv_.notify_one();
+    }
+    void work() {
+        while (true) {
+            std::unique_ptr<Request> request;
+            {
+                std::unique_lock lock(this->mutex_);
+                this->queue_cv_.wait(lock, [this] { return this->stopping_ || not this->queue_.empty(); });
+                if (this->stopping_) {
+                    return;
+                }
+                request.reset(this->queue_.front());
+                this->queue_.pop_front();
+            }
+            std::int64_t result;
+            do {
+                if (request->offset == CURRENT_POSITION) {
+                    result = request->is_write ? ::write(request->fd, request->buffer, request->len)
+                                               : ::read(request->fd, request->buffer, request->len);
+                } else {
+                    result = request->is_write ? ::pwrite(request->fd, request->buffer, request->len, request->offset)
+                                               : ::pread(request->fd, request->buffer, request->len, request->offset);
+                }
+            } while (result == -1 && errno == EINTR);
+            std::lock_guard lock(this->mutex_);
+            if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                this->dispatch(request.release());  // 準備ができたと思ったが違った
+                continue;
+            }
+            this->completed_.push_back(Completion{request->ticket, result == -1 ? -errno : result});
+            this->completed_cv_.notify_all();
+            std::uint64_t one = 1;
+            [[maybe_unused]] auto written = ::write(this->completion_fd_, &one, sizeof(one));
+        }
+    }
+    void poll_readiness() {
+        constexpr int MAX_EVENTS = 64;
+        epoll_event events[MAX_EVENTS];
+        while (true) {
+            auto num_events = epoll_wait(this->epoll_fd_, events, MAX_EVENTS, -1);
+            if (num_events == -1) {
+                if (errno != EINTR) {
+                    TRIVIAL_LOG_WITH_FUNCNAME(error) << "epoll_wait failed: " << std::strerror(errno);
+                }
+                continue;
+            }
+            std::lock_guard lock(this->mutex_);
+            for (int i = 0; i < num_events; i++) {
+                auto request = static_cast<Request *>(events[i].data.ptr);
+                if (request == nullptr) {
+                    return;
+                }
+                epoll_ctl(this->epoll_fd_, EPOLL_CTL_DEL, request->fd, nullptr);
+                this->waiting_.erase(request);
+                this->queue_.push_back(request);
+                this->queue_cv_.notify_one();
+            }
+        }
+    }
+};
+}  // namespace
+
+std::unique_ptr<AsyncIo> AsyncIo::create(unsigned queue_depth, Backend backend) {
+    queue_depth = std::max(queue_depth, 1u);
+#ifdef NYULAN_HAS_IO_URING
+    if (backend != Backend::THREAD_POOL) {
+        if (auto result = IoUring::try_create(queue_depth)) {
+            return result;
+        }
+        if (backend == Backend::IO_URING) {
+            throw std::runtime_error("error: io_uring is not available");
+        }
+    }
+#else
+    if (backend == Backend::IO_URING) {
+        throw std::runtime_error("error: io_uring is not available");
+    }
+#endif
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << "falling back to thread pool async io";
+    return std::make_unique<ThreadPoolIo>(std::min(queue_depth, std::max(std::thread::hardware_concurrency(), 4u)));
+}
+}  // namespace nyulan
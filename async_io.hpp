@@ -0,0 +1,44 @@
+#ifndef NYULAN_ASYNC_IO
+#define NYULAN_ASYNC_IO
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace nyulan {
+// ホストのfdに対する非同期な読み書き。io_uringが使えればio_uringで、使えなければepollとスレッドプールで行う
+class AsyncIo {
+   public:
+    static constexpr std::uint64_t CURRENT_POSITION = ~UINT64_C(0);  // offsetにこれを渡すとファイルの現在位置から
+
+    struct Request {
+        std::uint64_t ticket;
+        int fd;
+        bool is_write;
+        std::uint8_t *buffer;  // 完了するまで生きていること
+        std::size_t len;
+        std::uint64_t offset;
+    };
+    struct Completion {
+        std::uint64_t ticket;
+        std::int64_t result;  // 読み書きしたバイト数か、-errno lenより短いこともある
+    };
+    enum class Backend {
+        AUTO,
+        IO_URING,
+        THREAD_POOL,
+    };
+
+    static std::unique_ptr<AsyncIo> create(unsigned queue_depth, Backend backend = Backend::AUTO);
+    virtual ~AsyncIo() = default;
+
+    virtual void submit(const Request &request) = 0;
+    virtual std::optional<Completion> poll() = 0;  // 完了したものがなければすぐに戻る
+    virtual Completion wait() = 0;                 // 完了したものがなければ待つ
+    // 完了するたびに読めるようになるeventfd(EFD_NONBLOCK)。スレッドを止めずに待つときにepollする
+    // NOTE: 読んで空にしてからpoll()すること。空振りで起こされることもある
+    virtual int completion_fd() const = 0;
+    virtual std::string backend_name() const = 0;
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,69 @@
+#include "builtin.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace nyulan {
+namespace builtin {
+void Registry::add_handler(Register::ValueType number, Handler handler) {
+    if (number >= MAX_BUILTIN_NUMBER) {
+        throw std::invalid_argument("built in function number " + std::to_string(number) + " is too big");
+    }
+    if (number >= this->handlers_.size()) {
+        this->handlers_.resize(number + 1);
+    }
+    this->handlers_[number] = std::move(handler);
+}
+void Registry::remove(Register::ValueType number) {
+    if (number < this->handlers_.size()) {
+        this->handlers_[number] = nullptr;
+    }
+}
+std::shared_ptr<const Registry> Registry::defaults() {
+    static const auto registry = [] {
+        auto result = std::make_shared<Registry>();
+        result->add(BuiltinFuncs::READ, [](VirtualMachine &vm, Register fd, Address buf, std::size_t len) {
+            return vm.read(fd, buf, len);
+        });
+        result->add(BuiltinFuncs::WRITE, [](VirtualMachine &vm, Register fd, Address buf, std::size_t len) {
+            vm.write(fd, buf, len);
+        });
+        result->add(BuiltinFuncs::OPEN,
+                    [](VirtualMachine &vm, Address fname, Register flags) { return vm.open(fname, flags); });
+        result->add(BuiltinFuncs::CLOSE, [](VirtualMachine &vm, Register fd) { vm.close(fd); });
+        result->add(BuiltinFuncs::EXIT, [](VirtualMachine &vm, Register exit_code) { vm.exit(exit_code); });
+        result->add(BuiltinFuncs::SPAWN,
+                    [](VirtualMachine &vm, Address entry_point, Register arg) { return vm.spawn(entry_point, arg); });
+        result->add(BuiltinFuncs::JOIN, [](VirtualMachine &vm, Register thread_id) { return vm.join(thread_id); });
+        result->add(BuiltinFuncs::AIO_READ,
+                    [](VirtualMachine &vm, Register fd, Address buf, std::size_t len, Register offset) {
+                        return vm.aio_submit(fd, buf, len, offset, false);
+                    });
+        result->add(BuiltinFuncs::AIO_WRITE,
+                    [](VirtualMachine &vm, Register fd, Address buf, std::size_t len, Register offset) {
+                        return vm.aio_submit(fd, buf, len, offset, true);
+                    });
+        result->add(BuiltinFuncs::AIO_POLL, [](VirtualMachine &vm, Register ticket) { return vm.aio_poll(ticket); });
+        result->add(BuiltinFuncs::AIO_WAIT, [](VirtualMachine &vm, Register ticket) { return vm.aio_wait(ticket); });
+        result->add(BuiltinFuncs::CHANNEL_CREATE,
+                    [](VirtualMachine &vm, std::size_t capacity, std::size_t message_size, Register kind) {
+                        return vm.channel_create(capacity, message_size, kind);
+                    });
+        result->add(BuiltinFuncs::CHANNEL_SEND, [](VirtualMachine &vm, Register channel, Address buf, std::size_t len) {
+            return vm.channel_send(channel, buf, len);
+        });
+        result->add(BuiltinFuncs::CHANNEL_RECEIVE,
+                    [](VirtualMachine &vm, Register channel, Address buf, std::size_t len) {
+                        return vm.channel_receive(channel, buf, len);
+                    });
+        result->add(BuiltinFuncs::CHANNEL_CLOSE, [](VirtualMachine &vm, Register channel) { vm.channel_close(channel); });
+        result->add(BuiltinFuncs::MALLOC, [](VirtualMachine &vm, std::size_t size) { return vm.malloc(size); });
+        result->add(BuiltinFuncs::FREE, [](VirtualMachine &vm, Address addr) { vm.free(addr); });
+        return std::shared_ptr<const Registry>(std::move(result));
+    }();
+    return registry;
+}
+}  // namespace builtin
+}  // namespace nyulan
@@ -1,17 +1,108 @@
 #ifndef NYULAN_BUILTIN
 #define NYULAN_BUILTIN
+#include <array>
+#include <bit>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "nyulan.hpp"
+#include "vm.hpp"
 namespace nyulan {
 namespace builtin {
-std::uint64_t read(int fd, std::uint8_t *buf, std::size_t len);
-void write(int fd, std::uint8_t *buf, std::uint64_t len);
-int open(char *fname);
-void close(int fd);
-// void exit(int exit_code);
-// void *malloc(std::size_t size);
-// void free(Address addr,std::size_t size);
+template <typename T>
+T from_register(Register::ValueType value) {
+    if constexpr (std::is_floating_point_v<T>) {
+        static_assert(sizeof(T) == sizeof(Register::ValueType), "only double can be passed via register");
+        return std::bit_cast<T>(value);
+    } else {
+        return T(static_cast<std::conditional_t<std::is_integral_v<T>, T, Register::ValueType>>(value));
+    }
+}
+template <typename T>
+Register to_register(T value) {
+    if constexpr (std::is_floating_point_v<T>) {
+        static_assert(sizeof(T) == sizeof(Register::ValueType), "only double can be passed via register");
+        return std::bit_cast<Register::ValueType>(value);
+    } else if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+        return static_cast<Register::ValueType>(value);
+    } else {
+        return static_cast<Register::ValueType>(value.value());
+    }
+}
+
+// 組み込み関数がI/Oを待つ必要があるときに投げる。VMは引数を積み直してBLOCKEDで戻る
+struct WouldBlock {
+    IoWait wait;
+};
+
+// 組み込み関数はVMと、スタックから順にポップされた引数を受け取る
+using Handler = std::function<std::optional<Register>(VirtualMachine &)>;
+class Registry {
+   public:
+    static constexpr Register::ValueType MAX_BUILTIN_NUMBER = 4096;  // テーブルの大きさの上限
+
+    // funcはR(VirtualMachine&, Args...)の形で呼べる関数ポインタ、ラムダなど
+    template <typename F>
+    void add(Register::ValueType number, F func) {
+        this->add_handler(number, make_handler(std::function(std::move(func))));
+    }
+    template <typename F>
+    void add(BuiltinFuncs number, F func) {
+        this->add(static_cast<Register::ValueType>(number), std::move(func));
+    }
+    void remove(Register::ValueType number);
+    const Handler *find(Register::ValueType number) const {
+        if (number >= this->handlers_.size() || not this->handlers_[number]) {
+            return nullptr;
+        }
+        return &this->handlers_[number];
+    }
+
+    // nyulan.hppのBuiltinFuncsのうち、実装されているものが登録されたもの
+    static std::shared_ptr<const Registry> defaults();
+
+   private:
+    std::vector<Handler> handlers_;
+
+    void add_handler(Register::ValueType number, Handler handler);
+    template <typename R, typename... Args>
+    static Handler make_handler(std::function<R(VirtualMachine &, Args...)> func) {
+        return [func = std::move(func)](VirtualMachine &vm) -> std::optional<Register> {
+            // NOTE: 波括弧初期化なので、引数は左から順にポップされる
+            std::array<Register::ValueType, sizeof...(Args)> raw_args{pop_for<Args>(vm)...};
+            try {
+                return invoke(func, vm, raw_args, std::index_sequence_for<Args...>());
+            } catch (const WouldBlock &) {
+                for (auto arg = raw_args.rbegin(); arg != raw_args.rend(); arg++) {  // CALLをやり直せるように戻す
+                    vm.push_argument(*arg);
+                }
+                throw;
+            }
+        };
+    }
+    template <typename>
+    static Register::ValueType pop_for(VirtualMachine &vm) {
+        return vm.pop_argument();
+    }
+    template <typename R, typename... Args, std::size_t... I>
+    static std::optional<Register> invoke(const std::function<R(VirtualMachine &, Args...)> &func, VirtualMachine &vm,
+                                          const std::array<Register::ValueType, sizeof...(Args)> &raw_args,
+                                          std::index_sequence<I...>) {
+        if constexpr (std::is_void_v<R>) {
+            func(vm, from_register<Args>(raw_args[I])...);
+            return std::nullopt;
+        } else {
+            return to_register(func(vm, from_register<Args>(raw_args[I])...));
+        }
+    }
+};
 }  // namespace builtin
 }  // namespace nyulan
 #endif
@@ -0,0 +1,108 @@
+#include "callgraph.hpp"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace nyulan {
+void CallGraphProfiler::enter(std::uint64_t function, std::optional<std::uint64_t> call_site) {
+    auto caller = this->shadow_stack_.empty() ? function : this->shadow_stack_.back().function;
+    this->shadow_stack_.push_back(Frame{function, call_site, caller, this->steps_, Clock::now()});
+    auto &cost = this->functions_[function];
+    cost.calls++;
+    cost.active++;
+    if (call_site) {
+        this->edges_[{caller, call_site.value(), function}].calls++;
+    }
+}
+void CallGraphProfiler::leave() {
+    if (this->shadow_stack_.empty()) {
+        return;  // 数え始める前の呼び出しから戻った
+    }
+    auto frame = this->shadow_stack_.back();
+    this->shadow_stack_.pop_back();
+    auto steps = this->steps_ - frame.entry_steps;
+    auto time = Clock::now() - frame.entry_time;
+
+    auto &cost = this->functions_[frame.function];
+    cost.steps += steps - frame.child_steps;
+    cost.time += time - frame.child_time;
+    if (--cost.active == 0) {
+        cost.inclusive_steps += steps;
+        cost.inclusive_time += time;
+    }
+    if (frame.call_site) {
+        auto &edge = this->edges_[{frame.caller, frame.call_site.value(), frame.function}];
+        edge.steps += steps;
+        edge.time += time;
+    }
+    if (not this->shadow_stack_.empty()) {
+        this->shadow_stack_.back().child_steps += steps;
+        this->shadow_stack_.back().child_time += time;
+    }
+}
+void CallGraphProfiler::finish() {
+    while (not this->shadow_stack_.empty()) {
+        this->leave();
+    }
+}
+
+void CallGraphProfiler::write_callgrind(std::ostream &out, const Profiler::Symbols &symbols,
+                                        const std::string &command) const {
+    auto nanoseconds = [](Clock::duration time) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+    };
+    auto file_of = [&symbols](std::uint64_t address) -> std::string {
+        if (address >= symbols.lines.size() || symbols.lines[address].first >= symbols.sourcefiles.size()) {
+            return "???";
+        }
+        return symbols.sourcefiles[symbols.lines[address].first];
+    };
+    auto position_of = [&symbols](std::uint64_t address) {  // "命令 行"
+        auto line = address < symbols.lines.size() ? symbols.lines[address].second : 0;
+        return std::to_string(address) + " " + std::to_string(line);
+    };
+    std::uint64_t total_steps = 0;
+    Clock::duration total_time{0};
+    for (const auto &[function, cost] : this->functions_) {
+        total_steps += cost.steps;
+        total_time += cost.time;
+    }
+    out << "# callgrind format" << "\n";
+    out << "version: 1" << "\n";
+    out << "creator: nyulanVM" << "\n";
+    out << "cmd: " << command << "\n";
+    out << "positions: instr line" << "\n";
+    out << "events: Ir ns" << "\n";
+    out << "summary: " << total_steps << " " << nanoseconds(total_time) << "\n";
+    for (const auto &[function, cost] : this->functions_) {
+        out << "\n";
+        out << "fl=" << file_of(function) << "\n";
+        out << "fn=" << symbols.function_of(function) << "\n";
+        out << position_of(function) << " " << cost.steps << " " << nanoseconds(cost.time) << "\n";
+        for (auto edge = this->edges_.lower_bound({function, 0, 0});
+             edge != this->edges_.end() && std::get<0>(edge->first) == function; edge++) {
+            auto [caller, call_site, callee] = edge->first;
+            out << "cfl=" << file_of(callee) << "\n";
+            out << "cfn=" << symbols.function_of(callee) << "\n";
+            out << "calls=" << edge->second.calls << " " << position_of(callee) << "\n";
+            out << position_of(call_site) << " " << edge->second.steps << " " << nanoseconds(edge->second.time)
+                << "\n";
+        }
+    }
+    out << "\n" << "totals: " << total_steps << " " << nanoseconds(total_time) << std::endl;
+}
+void CallGraphProfiler::write_report(std::ostream &out, const Profiler::Symbols &symbols) const {
+    std::vector<std::pair<std::uint64_t, Cost>> functions(this->functions_.begin(), this->functions_.end());
+    std::stable_sort(functions.begin(), functions.end(), [](const auto &a, const auto &b) {
+        return a.second.inclusive_steps > b.second.inclusive_steps;
+    });
+    auto milliseconds = [](Clock::duration time) { return std::chrono::duration<double, std::milli>(time).count(); };
+    out << std::setw(10) << "calls" << std::setw(14) << "self steps" << std::setw(14) << "total steps" << std::setw(12)
+        << "self ms" << std::setw(12) << "total ms" << "  function" << std::endl;
+    for (const auto &[function, cost] : functions) {
+        out << std::setw(10) << cost.calls << std::setw(14) << cost.steps << std::setw(14) << cost.inclusive_steps
+            << std::fixed << std::setprecision(3) << std::setw(12) << milliseconds(cost.time) << std::setw(12)
+            << milliseconds(cost.inclusive_time) << "  " << symbols.function_of(function) << std::endl;
+    }
+}
+}  // namespace nyulan
@@ -0,0 +1,57 @@
+#ifndef NYULAN_CALLGRAPH
+#define NYULAN_CALLGRAPH
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "nyulan.hpp"
+#include "profiler.hpp"
+namespace nyulan {
+// CALL、RETを影のスタックで追い、関数ごとの呼び出し回数、命令数、実時間と、呼び出し元→呼び出し先の辺を数える
+// 関数は呼び出し先のアドレスで区別する。名前はProfiler::Symbolsで付ける
+// NOTE: 付けたVMのスレッドだけを数える。SPAWNしたスレッドには引き継がない
+class CallGraphProfiler {
+   public:
+    using Clock = std::chrono::steady_clock;
+
+    void step() { this->steps_++; }  // 命令ごと
+    // call_siteが無いのは、start()、start_call()で始めた一番外側の関数
+    void enter(std::uint64_t function, std::optional<std::uint64_t> call_site);
+    void leave();
+    void finish();  // 戻っていない関数を全て戻ったことにする。EXITしたときなど
+
+    // callgrindの形式(kcachegrind、callgrind_annotateなどで読める)。イベントは命令数(Ir)と実時間(ns)
+    void write_callgrind(std::ostream &out, const Profiler::Symbols &symbols, const std::string &command) const;
+    // gprofのflat profileに近い、関数ごとの表。含む命令数の多い順
+    void write_report(std::ostream &out, const Profiler::Symbols &symbols) const;
+
+   private:
+    struct Frame {
+        std::uint64_t function;
+        std::optional<std::uint64_t> call_site;
+        std::uint64_t caller;
+        std::uint64_t entry_steps;
+        Clock::time_point entry_time;
+        std::uint64_t child_steps = 0;
+        Clock::duration child_time{0};
+    };
+    struct Cost {
+        std::uint64_t calls = 0;
+        std::uint64_t steps = 0;  // 関数では自身だけ、辺では呼び出し先を含む
+        Clock::duration time{0};
+        std::uint64_t inclusive_steps = 0;  // 関数だけ。再帰しているときは一番外側の呼び出しだけを数える
+        Clock::duration inclusive_time{0};
+        std::uint64_t active = 0;
+    };
+    std::uint64_t steps_ = 0;
+    std::vector<Frame> shadow_stack_;
+    std::map<std::uint64_t, Cost> functions_;
+    std::map<std::tuple<std::uint64_t, std::uint64_t, std::uint64_t>, Cost> edges_;  // (呼び出し元, 呼び出した場所, 先)
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,117 @@
+#include "channel.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+#include <string>
+
+namespace nyulan {
+Channel::Channel(std::size_t capacity, std::size_t message_size, Kind kind)
+    : kind_(kind), mask_(std::bit_ceil(std::max<std::size_t>(capacity, 1)) - 1), message_size_(message_size) {
+    if (capacity == 0 || capacity > (std::size_t(1) << 20)) {
+        throw std::runtime_error("error: invalid channel capacity " + std::to_string(capacity));
+    }
+    if (message_size == 0 || message_size > (std::size_t(1) << 20)) {
+        throw std::runtime_error("error: invalid channel message size " + std::to_string(message_size));
+    }
+    this->slots_ = std::make_unique<Slot[]>(this->mask_ + 1);
+    for (std::size_t i = 0; i <= this->mask_; i++) {
+        this->slots_[i].sequence.store(i, std::memory_order_relaxed);
+        this->slots_[i].size = 0;
+    }
+    this->payloads_ = std::make_unique<std::uint8_t[]>((this->mask_ + 1) * message_size);
+}
+void Channel::close() {
+    this->closed_.store(true, std::memory_order_release);
+    this->senders_.wake_all();
+    this->receivers_.wake_all();
+}
+bool Channel::can_send() const {
+    if (this->closed()) {
+        return true;  // NOTE: 送れないことがすぐにわかる
+    }
+    auto position = this->tail_.load(std::memory_order_acquire);
+    if (this->kind_ == Kind::SPSC) {
+        return position - this->head_.load(std::memory_order_acquire) <= this->mask_;
+    }
+    return this->slots_[position & this->mask_].sequence.load(std::memory_order_acquire) == position;
+}
+bool Channel::can_receive() const {
+    if (this->closed()) {
+        return true;
+    }
+    auto position = this->head_.load(std::memory_order_acquire);
+    if (this->kind_ == Kind::SPSC) {
+        return this->tail_.load(std::memory_order_acquire) != position;
+    }
+    return this->slots_[position & this->mask_].sequence.load(std::memory_order_acquire) == position + 1;
+}
+void Channel::add_waiter(Side side, int eventfd) {
+    (side == Side::SENDER ? this->senders_ : this->receivers_).add(eventfd);
+    // NOTE: notify()のフェンスと対になる。登録してから確かめれば、起こし損ねない
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+void Channel::remove_waiter(Side side, int eventfd) {
+    (side == Side::SENDER ? this->senders_ : this->receivers_).remove(eventfd);
+}
+void Channel::notify(WaitQueue &queue) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (not queue.empty()) {
+        queue.wake_one();
+    }
+}
+
+void Channel::WaitQueue::add(int eventfd) {
+    std::lock_guard lock(this->mutex_);
+    if (std::find(this->eventfds_.begin(), this->eventfds_.end(), eventfd) == this->eventfds_.end()) {
+        this->eventfds_.push_back(eventfd);
+        this->num_waiting_.fetch_add(1, std::memory_order_seq_cst);
+    }
+}
+void Channel::WaitQueue::remove(int eventfd) {
+    std::lock_guard lock(this->mutex_);
+    auto found = std::find(this->eventfds_.begin(), this->eventfds_.end(), eventfd);
+    if (found != this->eventfds_.end()) {
+        this->eventfds_.erase(found);
+        this->num_waiting_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+namespace {
+void ring(int eventfd) {
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(eventfd, &one, sizeof(one));
+}
+}  // namespace
+void Channel::WaitQueue::wake_one() {
+    std::lock_guard lock(this->mutex_);
+    if (this->eventfds_.empty()) {
+        return;
+    }
+    ring(this->eventfds_.front());  // NOTE: 起こされた側はもう一度確かめて、だめなら登録し直す
+    this->eventfds_.erase(this->eventfds_.begin());
+    this->num_waiting_.fetch_sub(1, std::memory_order_relaxed);
+}
+void Channel::WaitQueue::wake_all() {
+    std::lock_guard lock(this->mutex_);
+    for (auto eventfd : this->eventfds_) {
+        ring(eventfd);
+    }
+    this->eventfds_.clear();
+    this->num_waiting_.store(0, std::memory_order_relaxed);
+}
+
+Register::ValueType ChannelTable::create(std::size_t capacity, std::size_t message_size, Channel::Kind kind) {
+    auto channel = std::make_shared<Channel>(capacity, message_size, kind);
+    std::unique_lock lock(this->mutex_);
+    auto id = this->next_id_++;
+    this->channels_.emplace(id, std::move(channel));
+    return id;
+}
+std::shared_ptr<Channel> ChannelTable::find(Register::ValueType id) {
+    std::shared_lock lock(this->mutex_);
+    auto channel = this->channels_.find(id);
+    return channel == this->channels_.end() ? nullptr : channel->second;
+}
+}  // namespace nyulan
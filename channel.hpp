@@ -0,0 +1,186 @@
+#ifndef NYULAN_CHANNEL
+#define NYULAN_CHANNEL
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <vector>
+
+#include "nyulan.hpp"
+namespace nyulan {
+// VM間でメッセージを渡す、容量固定のリングバッファ
+// 送受信はロックフリーで、空(満杯)で待つときだけ待ち行列のロックを取る
+// メッセージは各スロットに直接コピーされる。スロットの大きさはmessage_sizeバイト
+class Channel {
+   public:
+    enum class Kind {
+        SPSC,  // 送信側、受信側がそれぞれ1つのVMだけのとき
+        MPMC,
+    };
+
+    Channel(std::size_t capacity, std::size_t message_size, Kind kind);
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    // fill(std::uint8_t *slot)はslotに書き込んだバイト数を返す。満杯か閉じられていればfalse
+    template <typename F>
+    bool try_send(F fill);
+    // drain(const std::uint8_t *slot, std::size_t size)でメッセージを受け取る。空ならnullopt
+    template <typename F>
+    std::optional<std::size_t> try_receive(F drain);
+    void close();  // 待っている全員を起こす。残っているメッセージは受け取れる
+
+    bool closed() const { return this->closed_.load(std::memory_order_acquire); }
+    bool can_send() const;
+    bool can_receive() const;  // 空でないか、閉じられている
+    std::size_t message_size() const { return this->message_size_; }
+
+    // 待つ側は自分のeventfdを登録してから、もう一度can_send()、can_receive()を確かめること
+    enum class Side { SENDER, RECEIVER };
+    void add_waiter(Side side, int eventfd);
+    void remove_waiter(Side side, int eventfd);
+
+   private:
+    static constexpr std::size_t CACHE_LINE = 64;
+    struct Slot {
+        std::atomic<std::size_t> sequence;  // MPMCのときだけ使う
+        std::size_t size;
+    };
+    class WaitQueue {
+       public:
+        void add(int eventfd);
+        void remove(int eventfd);
+        void wake_one();
+        void wake_all();
+        bool empty() const { return this->num_waiting_.load(std::memory_order_relaxed) == 0; }
+
+       private:
+        std::mutex mutex_;
+        std::vector<int> eventfds_;
+        std::atomic<std::size_t> num_waiting_ = 0;
+    };
+
+    Kind kind_;
+    std::size_t mask_;  // 容量は2のべき乗に切り上げる
+    std::size_t message_size_;
+    std::unique_ptr<Slot[]> slots_;
+    std::unique_ptr<std::uint8_t[]> payloads_;
+    alignas(CACHE_LINE) std::atomic<std::size_t> head_ = 0;  // 次に受信する位置
+    alignas(CACHE_LINE) std::atomic<std::size_t> tail_ = 0;  // 次に送信する位置
+    alignas(CACHE_LINE) std::atomic<bool> closed_ = false;
+    WaitQueue senders_;
+    WaitQueue receivers_;
+
+    std::uint8_t *payload_of(std::size_t position) {
+        return &this->payloads_[(position & this->mask_) * this->message_size_];
+    }
+    void notify(WaitQueue &queue);
+};
+
+template <typename F>
+bool Channel::try_send(F fill) {
+    if (this->closed()) {
+        return false;
+    }
+    auto position = this->tail_.load(std::memory_order_relaxed);
+    Slot *slot;
+    if (this->kind_ == Kind::SPSC) {
+        if (position - this->head_.load(std::memory_order_acquire) > this->mask_) {
+            return false;
+        }
+        slot = &this->slots_[position & this->mask_];
+    } else {
+        // NOTE: D. Vyukovの有界MPMCキュー。sequence == positionなら空いている
+        while (true) {
+            slot = &this->slots_[position & this->mask_];
+            auto sequence = slot->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::intptr_t>(sequence - position);
+            if (difference == 0) {
+                if (this->tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = this->tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    // NOTE: 確保したスロットは必ず公開する。fillが投げたら空のメッセージになる
+    slot->size = 0;
+    struct Publish {
+        Channel *channel;
+        Slot *slot;
+        std::size_t position;
+        ~Publish() {
+            if (channel->kind_ == Kind::SPSC) {
+                channel->tail_.store(position + 1, std::memory_order_release);
+            } else {
+                slot->sequence.store(position + 1, std::memory_order_release);
+            }
+            channel->notify(channel->receivers_);
+        }
+    } publish{this, slot, position};
+    slot->size = fill(this->payload_of(position));
+    return true;
+}
+template <typename F>
+std::optional<std::size_t> Channel::try_receive(F drain) {
+    auto position = this->head_.load(std::memory_order_relaxed);
+    Slot *slot;
+    if (this->kind_ == Kind::SPSC) {
+        if (this->tail_.load(std::memory_order_acquire) == position) {
+            return std::nullopt;
+        }
+        slot = &this->slots_[position & this->mask_];
+    } else {
+        // NOTE: sequence == position + 1なら埋まっている
+        while (true) {
+            slot = &this->slots_[position & this->mask_];
+            auto sequence = slot->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::intptr_t>(sequence - (position + 1));
+            if (difference == 0) {
+                if (this->head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return std::nullopt;
+            } else {
+                position = this->head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    struct Release {
+        Channel *channel;
+        Slot *slot;
+        std::size_t position;
+        ~Release() {
+            if (channel->kind_ == Kind::SPSC) {
+                channel->head_.store(position + 1, std::memory_order_release);
+            } else {
+                slot->sequence.store(position + channel->mask_ + 1, std::memory_order_release);
+            }
+            channel->notify(channel->senders_);
+        }
+    } release{this, slot, position};
+    auto size = slot->size;
+    drain(static_cast<const std::uint8_t *>(this->payload_of(position)), size);
+    return size;
+}
+
+// チャネルの番号 => チャネル。同じ表を持つVMの間でチャネルを共有する
+class ChannelTable {
+   public:
+    Register::ValueType create(std::size_t capacity, std::size_t message_size, Channel::Kind kind);
+    std::shared_ptr<Channel> find(Register::ValueType id);  // なければnullptr
+
+   private:
+    std::shared_mutex mutex_;
+    std::map<Register::ValueType, std::shared_ptr<Channel>> channels_;
+    Register::ValueType next_id_ = 1;
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,83 @@
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "logging.hpp"
+namespace nyulan {
+Checkpoints::Checkpoints(Limits limits) : limits_(limits), interval_(std::max<std::uint64_t>(limits.min_interval, 1)) {}
+
+std::uint64_t Checkpoints::next_position() const {
+    if (not this->last_attempt_) {
+        return 0;
+    }
+    return this->last_attempt_.value() + this->interval_;
+}
+void Checkpoints::take(VirtualMachine &vm, std::uint64_t position, std::chrono::nanoseconds ran) {
+    this->last_attempt_ = position;
+    auto started = std::chrono::steady_clock::now();
+    std::shared_ptr<Snapshot> snapshot;
+    try {
+        snapshot = Snapshot::take(vm);
+    } catch (const std::runtime_error &except) {
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "no checkpoint at step " << position << ": " << except.what();
+        return;
+    }
+    auto took = std::chrono::steady_clock::now() - started;
+    this->bytes_ += snapshot->file_size();
+    this->checkpoints_.push_back(Checkpoint{position, std::move(snapshot)});
+
+    // NOTE: 最初のもの(ran == 0)では測れないので変えない
+    if (ran.count() != 0) {
+        auto budget = this->limits_.max_overhead * static_cast<double>(ran.count());
+        auto cost = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(took).count());
+        if (cost > budget && this->interval_ <= std::numeric_limits<std::uint64_t>::max() / 4) {
+            this->interval_ *= 2;
+        } else if (cost * 4 < budget && this->interval_ / 2 >= this->limits_.min_interval) {
+            this->interval_ /= 2;
+        }
+    }
+    this->thin_out(position);
+}
+const Checkpoints::Checkpoint *Checkpoints::before(std::uint64_t position) const {
+    auto found = std::upper_bound(this->checkpoints_.begin(), this->checkpoints_.end(), position,
+                                  [](std::uint64_t value, const Checkpoint &checkpoint) {
+                                      return value < checkpoint.position;
+                                  });
+    if (found == this->checkpoints_.begin()) {
+        return nullptr;
+    }
+    return &*std::prev(found);
+}
+void Checkpoints::discard_after(std::uint64_t position) {
+    while (not this->checkpoints_.empty() && this->checkpoints_.back().position > position) {
+        this->bytes_ -= this->checkpoints_.back().snapshot->file_size();
+        this->checkpoints_.pop_back();
+    }
+    if (this->checkpoints_.empty()) {
+        this->last_attempt_ = std::nullopt;
+    } else {
+        this->last_attempt_ = this->checkpoints_.back().position;
+    }
+}
+void Checkpoints::thin_out(std::uint64_t now) {
+    // NOTE: 最初(実行の開始)と最後のものは残す
+    while (this->checkpoints_.size() > 2 && (this->checkpoints_.size() > this->limits_.max_checkpoints ||
+                                             this->bytes_ > this->limits_.max_bytes)) {
+        // 消したときにできる間の広さを、今からの距離で割ったものが一番小さいものを消す
+        std::size_t victim = 1;
+        double best = std::numeric_limits<double>::infinity();
+        for (std::size_t i = 1; i + 1 < this->checkpoints_.size(); i++) {
+            auto gap = this->checkpoints_[i + 1].position - this->checkpoints_[i - 1].position;
+            auto age = now - this->checkpoints_[i - 1].position + 1;
+            auto cost = static_cast<double>(gap) / static_cast<double>(age);
+            if (cost < best) {
+                best = cost;
+                victim = i;
+            }
+        }
+        this->bytes_ -= this->checkpoints_[victim].snapshot->file_size();
+        this->checkpoints_.erase(this->checkpoints_.begin() + static_cast<std::ptrdiff_t>(victim));
+    }
+}
+}  // namespace nyulan
@@ -0,0 +1,52 @@
+#ifndef NYULAN_CHECKPOINT
+#define NYULAN_CHECKPOINT
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "snapshot.hpp"
+namespace nyulan {
+// 逆実行のためのチェックポイント。実行したステップ数ごとにSnapshotを持ち、戻るときは手前のものから実行し直す
+// 間隔は、スナップショットを取る時間が実行時間のmax_overhead以下になるように広げる
+// 数か大きさが上限を越えたら一つ間引く。古いものほど間が空くように選ぶので、今に近いところへはすぐ戻れる
+class Checkpoints {
+   public:
+    struct Limits {
+        std::size_t max_checkpoints = 64;
+        std::uint64_t max_bytes = 256 * 1024 * 1024;
+        double max_overhead = 0.05;
+        std::uint64_t min_interval = 1 << 14;  // ステップ数
+    };
+    struct Checkpoint {
+        std::uint64_t position;  // それまでに実行したステップ数
+        std::shared_ptr<Snapshot> snapshot;
+    };
+
+    explicit Checkpoints(Limits limits);
+
+    // 次にチェックポイントを取るステップ数
+    std::uint64_t next_position() const;
+    // ranは前回のチェックポイントから実行にかかった時間。スナップショットを取れない状態なら(ゲストスレッドがある等)何もしない
+    void take(VirtualMachine &vm, std::uint64_t position, std::chrono::nanoseconds ran);
+    // position以前で一番近いもの。一つも無ければnullptr
+    const Checkpoint *before(std::uint64_t position) const;
+    // 巻き戻したので、positionより後のものを捨てる
+    void discard_after(std::uint64_t position);
+
+    const std::vector<Checkpoint> &list() const { return this->checkpoints_; }
+    std::uint64_t interval() const { return this->interval_; }
+    std::uint64_t bytes() const { return this->bytes_; }
+
+   private:
+    Limits limits_;
+    std::vector<Checkpoint> checkpoints_;  // positionの昇順
+    std::uint64_t interval_;
+    std::uint64_t bytes_ = 0;
+    std::optional<std::uint64_t> last_attempt_ = std::nullopt;  // 取れなかったときも、次は間隔を空ける
+
+    void thin_out(std::uint64_t now);
+};
+}  // namespace nyulan
+#endif
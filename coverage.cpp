@@ -0,0 +1,108 @@
+#include "coverage.hpp"
+
+#include <bit>
+#include <iomanip>
+#include <map>
+#include <optional>
+
+namespace nyulan {
+namespace {
+struct SourceLine {
+    std::uint64_t file;
+    std::uint64_t line;
+};
+// 行の情報が無い、または壊れているアドレスはnullopt
+std::optional<SourceLine> source_of(const Profiler::Symbols &symbols, std::uint64_t address) {
+    if (symbols.lines.empty()) {
+        return SourceLine{0, address + 1};
+    }
+    if (address >= symbols.lines.size() || symbols.lines[address].first >= symbols.sourcefiles.size()) {
+        return std::nullopt;
+    }
+    return SourceLine{symbols.lines[address].first, symbols.lines[address].second};
+}
+double percent(std::size_t part, std::size_t whole) { return whole == 0 ? 0.0 : 100.0 * part / whole; }
+}  // namespace
+
+Coverage::Coverage(std::size_t code_size)
+    : code_size_(code_size), bitmap_(new std::atomic<std::uint64_t>[(code_size + 63) / 64]) {
+    for (std::size_t i = 0; i < (code_size + 63) / 64; i++) {
+        this->bitmap_[i].store(0, std::memory_order_relaxed);
+    }
+}
+std::size_t Coverage::num_covered() const {
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < (this->code_size_ + 63) / 64; i++) {
+        result += std::popcount(this->bitmap_[i].load(std::memory_order_relaxed));
+    }
+    return result;
+}
+
+void Coverage::write_lcov(std::ostream &out, const Profiler::Symbols &symbols, const std::string &test_name,
+                          const std::string &fallback_file) const {
+    std::map<std::uint64_t, std::map<std::uint64_t, bool>> lines;  // ファイル => 行 => 実行したか
+    for (std::uint64_t address = 0; address < this->code_size_; address++) {
+        if (auto source = source_of(symbols, address)) {
+            auto &hit = lines[source->file][source->line];
+            hit = hit || this->covered(address);
+        }
+    }
+    std::map<std::uint64_t, std::vector<std::pair<std::uint64_t, std::string>>> functions;  // ファイル => (行, 名前)
+    for (const auto &[address, name] : symbols.functions) {
+        if (auto source = source_of(symbols, address); source && address < this->code_size_) {
+            functions[source->file].emplace_back(address, name);
+        }
+    }
+    auto file_name = [&](std::uint64_t file) {
+        return symbols.lines.empty() ? fallback_file : symbols.sourcefiles[file];
+    };
+    for (const auto &[file, hits] : lines) {
+        out << "TN:" << test_name << "\n";
+        out << "SF:" << file_name(file) << "\n";
+        std::size_t functions_hit = 0;
+        for (const auto &[address, name] : functions[file]) {
+            out << "FN:" << source_of(symbols, address)->line << "," << name << "\n";
+        }
+        for (const auto &[address, name] : functions[file]) {
+            out << "FNDA:" << (this->covered(address) ? 1 : 0) << "," << name << "\n";
+            functions_hit += this->covered(address) ? 1 : 0;
+        }
+        out << "FNF:" << functions[file].size() << "\n";
+        out << "FNH:" << functions_hit << "\n";
+        std::size_t lines_hit = 0;
+        for (const auto &[line, hit] : hits) {
+            out << "DA:" << line << "," << (hit ? 1 : 0) << "\n";  // NOTE: 回数は数えていないので0か1
+            lines_hit += hit ? 1 : 0;
+        }
+        out << "LF:" << hits.size() << "\n";
+        out << "LH:" << lines_hit << "\n";
+        out << "end_of_record" << "\n";
+    }
+    out.flush();
+}
+void Coverage::write_summary(std::ostream &out, const Profiler::Symbols &symbols) const {
+    std::size_t blocks = 0;
+    std::size_t blocks_hit = 0;
+    for (auto start : symbols.block_starts) {
+        if (start < this->code_size_) {
+            blocks++;
+            blocks_hit += this->covered(start) ? 1 : 0;  // NOTE: 途中から飛び込まれたブロックは数えない
+        }
+    }
+    std::size_t functions = 0;
+    std::size_t functions_hit = 0;
+    for (const auto &[address, name] : symbols.functions) {
+        if (address < this->code_size_) {
+            functions++;
+            functions_hit += this->covered(address) ? 1 : 0;
+        }
+    }
+    auto covered = this->num_covered();
+    out << std::fixed << std::setprecision(1);
+    out << "instructions: " << covered << "/" << this->code_size_ << " (" << percent(covered, this->code_size_)
+        << "%)" << std::endl;
+    out << "basic blocks: " << blocks_hit << "/" << blocks << " (" << percent(blocks_hit, blocks) << "%)" << std::endl;
+    out << "functions:    " << functions_hit << "/" << functions << " (" << percent(functions_hit, functions) << "%)"
+        << std::endl;
+}
+}  // namespace nyulan
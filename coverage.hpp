@@ -0,0 +1,48 @@
+#ifndef NYULAN_COVERAGE
+#define NYULAN_COVERAGE
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "profiler.hpp"
+namespace nyulan {
+// 実行した命令に1bitずつ印を付ける。ビットマップは最初に全て確保しておき、命令ごとの処理はビットを確かめるだけ
+// SPAWNしたスレッドやバッチの他のVMと共有してよい。立っていないビットを立てるときだけアトミックに書く
+class Coverage {
+   public:
+    explicit Coverage(std::size_t code_size);
+    Coverage(const Coverage &) = delete;
+    Coverage &operator=(const Coverage &) = delete;
+
+    void hit(std::uint64_t address) {
+        if (address >= this->code_size_) [[unlikely]] {
+            return;
+        }
+        auto &word = this->bitmap_[address / 64];
+        auto bit = UINT64_C(1) << (address % 64);
+        if ((word.load(std::memory_order_relaxed) & bit) == 0) [[unlikely]] {
+            word.fetch_or(bit, std::memory_order_relaxed);
+        }
+    }
+    bool covered(std::uint64_t address) const {
+        return address < this->code_size_ &&
+               (this->bitmap_[address / 64].load(std::memory_order_relaxed) & (UINT64_C(1) << (address % 64))) != 0;
+    }
+    std::size_t code_size() const { return this->code_size_; }
+    std::size_t num_covered() const;
+
+    // debug.addr2lineで行に直したlcovの.info。行の情報が無ければ、命令のアドレス+1を行とする
+    // fallback_fileは行の情報が無いときのSF:
+    void write_lcov(std::ostream &out, const Profiler::Symbols &symbols, const std::string &test_name,
+                    const std::string &fallback_file) const;
+    // 命令、基本ブロック、関数の網羅率
+    void write_summary(std::ostream &out, const Profiler::Symbols &symbols) const;
+
+   private:
+    std::size_t code_size_;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> bitmap_;
+};
+}  // namespace nyulan
+#endif
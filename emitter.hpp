@@ -0,0 +1,48 @@
+#ifndef NYULAN_EMITTER
+#define NYULAN_EMITTER
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nyulan.hpp"
+namespace nyulan {
+// ベンチマーク用のプログラムを直接組み立てる
+class Emitter {
+   public:
+    std::vector<OneStep> code;
+
+    void emit(Instruction instruction, int dst = 0, int src = 0) {
+        this->code.emplace_back(
+            static_cast<std::uint16_t>((static_cast<int>(instruction) << 8) | ((dst & 0b1111) << 4) | (src & 0b1111)));
+    }
+    void load_immediate(int dst, std::uint64_t value) {  // PUSHL*8 POP64
+        for (std::size_t i = 0; i < 8; i++) {
+            this->emit_literal(static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+        this->emit(Instruction::POP64, dst);
+    }
+    std::size_t load_label(int dst) {  // 後でpatch()する
+        auto position = this->code.size();
+        this->load_immediate(dst, 0);
+        return position;
+    }
+    void patch(std::size_t position, std::uint64_t value) {
+        for (std::size_t i = 0; i < 8; i++) {
+            this->code[position + i] = static_cast<std::uint16_t>(
+                (static_cast<int>(Instruction::PUSHL) << 8) | static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+    }
+    // 引数は積んでおくこと。tmpは壊れる
+    void call_builtin(BuiltinFuncs function, int tmp = 15) {
+        this->load_immediate(tmp, (UINT64_C(1) << 63) | static_cast<std::uint64_t>(function));
+        this->emit(Instruction::CALL, tmp);
+    }
+    std::size_t here() const { return this->code.size(); }
+
+   private:
+    void emit_literal(std::uint8_t literal) {
+        this->code.emplace_back(static_cast<std::uint16_t>((static_cast<int>(Instruction::PUSHL) << 8) | literal));
+    }
+};
+}  // namespace nyulan
+#endif
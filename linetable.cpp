@@ -0,0 +1,138 @@
+#include "linetable.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+namespace nyulan {
+namespace {
+void put_varint(std::vector<std::uint8_t> &out, std::uint64_t value) {
+    while (value >= 0b1000'0000) {
+        out.push_back(static_cast<std::uint8_t>(value | 0b1000'0000));
+        value >>= 7;
+    }
+    out.push_back(static_cast<std::uint8_t>(value));
+}
+std::uint64_t get_varint(const std::vector<std::uint8_t> &data, std::size_t &position) {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (position >= data.size()) {
+            throw std::runtime_error("error: " + std::string(LineTable::SECTION_NAME) + " is truncated");
+        }
+        auto byte = data[position++];
+        value |= static_cast<std::uint64_t>(byte & 0b0111'1111) << shift;
+        if ((byte & 0b1000'0000) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("error: broken varint in " + std::string(LineTable::SECTION_NAME));
+}
+std::uint64_t zigzag(std::uint64_t to, std::uint64_t from) {
+    auto difference = static_cast<std::int64_t>(to - from);
+    return (static_cast<std::uint64_t>(difference) << 1) ^ static_cast<std::uint64_t>(difference >> 63);
+}
+std::uint64_t unzigzag(std::uint64_t value, std::uint64_t from) {
+    return from + ((value >> 1) ^ (~(value & 1) + 1));
+}
+}  // namespace
+
+LineTable::LineTable(const ObjectFile &objectfile) {
+    auto found = std::find_if(objectfile.optional_sections.begin(), objectfile.optional_sections.end(),
+                              [](const auto &section) { return section->name == SECTION_NAME; });
+    if (found != objectfile.optional_sections.end()) {
+        this->decode((*found)->data);
+    } else {
+        *this = LineTable(objectfile.source_lines());
+    }
+    this->files_ = objectfile.source_files();
+    for (const auto &file : this->files_) {
+        this->basenames_.push_back(std::filesystem::path(file).filename().string());
+    }
+}
+LineTable::LineTable(const std::vector<std::pair<std::uint64_t, std::uint64_t>> &lines) {
+    for (const auto &[file, line] : lines) {
+        this->append(Location{file, line}, 1);
+    }
+}
+void LineTable::append(Location location, std::uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (this->locations_.empty() || not(this->locations_.back() == location)) {
+        this->starts_.push_back(this->code_size_);
+        this->locations_.push_back(location);
+    }
+    this->code_size_ += count;
+}
+void LineTable::decode(const std::vector<std::uint8_t> &data) {
+    std::size_t position = 0;
+    auto code_size = get_varint(data, position);
+    auto num_ranges = get_varint(data, position);
+    Location location{0, 0};
+    for (std::uint64_t i = 0; i < num_ranges; i++) {
+        auto count = get_varint(data, position);
+        location.file = unzigzag(get_varint(data, position), location.file);
+        location.line = unzigzag(get_varint(data, position), location.line);
+        this->append(location, count);
+    }
+    if (this->code_size_ != code_size) {
+        throw std::runtime_error("error: " + std::string(SECTION_NAME) + " covers " + std::to_string(this->code_size_) +
+                                 " instructions, but says " + std::to_string(code_size));
+    }
+}
+std::vector<std::uint8_t> LineTable::encode() const {
+    std::vector<std::uint8_t> result;
+    put_varint(result, this->code_size_);
+    put_varint(result, this->starts_.size());
+    Location previous{0, 0};
+    for (std::size_t i = 0; i < this->starts_.size(); i++) {
+        auto end = i + 1 == this->starts_.size() ? this->code_size_ : this->starts_[i + 1];
+        put_varint(result, end - this->starts_[i]);
+        put_varint(result, zigzag(this->locations_[i].file, previous.file));
+        put_varint(result, zigzag(this->locations_[i].line, previous.line));
+        previous = this->locations_[i];
+    }
+    return result;
+}
+const LineTable::Location *LineTable::find(std::uint64_t address) const {
+    std::size_t hint = this->starts_.size();
+    return this->find(address, hint);
+}
+const LineTable::Location *LineTable::search(std::uint64_t address, std::size_t &hint) const {
+    if (address >= this->code_size_) {
+        return nullptr;
+    }
+    // NOTE: starts_[0]は0なので、address以下のものが必ずある
+    hint = static_cast<std::size_t>(std::upper_bound(this->starts_.begin(), this->starts_.end(), address) -
+                                    this->starts_.begin()) -
+           1;
+    return &this->locations_[hint];
+}
+std::vector<std::uint64_t> LineTable::find_line(const std::string &file, std::uint64_t line) const {
+    std::vector<std::uint64_t> result;
+    for (std::size_t i = 0; i < this->starts_.size(); i++) {
+        const auto &location = this->locations_[i];
+        if (location.line == line && location.file < this->files_.size() &&
+            (this->files_[location.file] == file || this->basenames_[location.file] == file)) {
+            result.push_back(this->starts_[i]);
+        }
+    }
+    return result;
+}
+std::string LineTable::describe(std::uint64_t address) const {
+    auto location = this->find(address);
+    if (location == nullptr || location->file >= this->basenames_.size()) {
+        return "@" + std::to_string(address);
+    }
+    return this->basenames_[location->file] + ":" + std::to_string(location->line);
+}
+std::vector<std::pair<std::uint64_t, std::uint64_t>> LineTable::expand() const {
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> result;
+    result.reserve(this->code_size_);
+    for (std::size_t i = 0; i < this->starts_.size(); i++) {
+        auto end = i + 1 == this->starts_.size() ? this->code_size_ : this->starts_[i + 1];
+        result.insert(result.end(), end - this->starts_[i], {this->locations_[i].file, this->locations_[i].line});
+    }
+    return result;
+}
+}  // namespace nyulan
@@ -0,0 +1,71 @@
+#ifndef NYULAN_LINETABLE
+#define NYULAN_LINETABLE
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "objectfile.hpp"
+namespace nyulan {
+// アドレスから(ファイル番号, 行)を引く表。同じ行が続く命令を一つの区間にまとめ、区間の先頭のアドレスを二分探索する
+// 次の二つのセクションのどちらからでも作れる。両方あればdebug.linetableを使う
+//   debug.addr2line: 先頭2バイトがファイル番号と行のビット幅。その後ろに命令ごとの(ファイル番号, 行)が固定長で並ぶ
+//   debug.linetable: 全てLEB128で、命令数 区間の数 (区間の命令数 ファイル番号の差 行の差)...
+//                    差は一つ前の区間との差をzigzagにしたもの。最初の区間は(0, 0)との差
+class LineTable {
+   public:
+    static constexpr const char *SECTION_NAME = "debug.linetable";
+    struct Location {
+        std::uint64_t file;
+        std::uint64_t line;
+
+        bool operator==(const Location &) const = default;
+    };
+
+    LineTable() = default;
+    explicit LineTable(const ObjectFile &objectfile);
+    // アドレスごとの(ファイル番号, 行)から作る
+    explicit LineTable(const std::vector<std::pair<std::uint64_t, std::uint64_t>> &lines);
+
+    // 行の情報が無いアドレスならnullptr
+    const Location *find(std::uint64_t address) const;
+    // hintには前回の結果の区間が入る。順に実行している間は同じ区間か次の区間なので、二分探索しない
+    const Location *find(std::uint64_t address, std::size_t &hint) const {
+        if (hint < this->starts_.size() && this->starts_[hint] <= address) [[likely]] {
+            if (hint + 1 == this->starts_.size() ? address < this->code_size_ : address < this->starts_[hint + 1]) {
+                return &this->locations_[hint];
+            }
+            if (hint + 2 < this->starts_.size() && this->starts_[hint + 1] <= address &&
+                address < this->starts_[hint + 2]) {
+                return &this->locations_[++hint];
+            }
+        }
+        return this->search(address, hint);
+    }
+    // fileの行lineになる区間の先頭のアドレス。fileはフルパスか、ディレクトリを除いたファイル名
+    std::vector<std::uint64_t> find_line(const std::string &file, std::uint64_t line) const;
+    // "ファイル名:行"。ファイル名はディレクトリを除いたもの。行の情報が無ければ"@アドレス"
+    std::string describe(std::uint64_t address) const;
+
+    const std::vector<std::string> &files() const { return this->files_; }
+    std::uint64_t code_size() const { return this->code_size_; }
+    std::size_t num_ranges() const { return this->starts_.size(); }
+    bool empty() const { return this->starts_.empty(); }
+    // ObjectFile::source_lines()と同じ、アドレスごとの(ファイル番号, 行)
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> expand() const;
+    // debug.linetableの中身
+    std::vector<std::uint8_t> encode() const;
+
+   private:
+    std::vector<std::uint64_t> starts_;  // 区間の先頭のアドレス。区間は隙間なく並び、最後の区間はcode_size_まで
+    std::vector<Location> locations_;
+    std::uint64_t code_size_ = 0;
+    std::vector<std::string> files_;
+    std::vector<std::string> basenames_;
+
+    const Location *search(std::uint64_t address, std::size_t &hint) const;
+    void append(Location location, std::uint64_t count);
+    void decode(const std::vector<std::uint8_t> &data);
+};
+}  // namespace nyulan
+#endif
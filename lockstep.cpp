@@ -0,0 +1,396 @@
+#include "lockstep.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#if defined(__x86_64__)
+#    include <immintrin.h>
+#endif
+
+namespace nyulan {
+namespace {
+// NOTE: シフト量はx86のシフト命令と同じく下位6bitだけを使う(vm.cppの<<=がそうなる)
+template <Instruction OP>
+std::uint64_t apply_scalar(std::uint64_t a, std::uint64_t b) {
+    auto as_double = [](std::uint64_t value) { return std::bit_cast<double>(value); };
+    if constexpr (OP == Instruction::MOV) {
+        return b;
+    } else if constexpr (OP == Instruction::AND) {
+        return a & b;
+    } else if constexpr (OP == Instruction::OR) {
+        return a | b;
+    } else if constexpr (OP == Instruction::XOR) {
+        return a ^ b;
+    } else if constexpr (OP == Instruction::NOT) {
+        return ~a;
+    } else if constexpr (OP == Instruction::ADD) {
+        return a + b;
+    } else if constexpr (OP == Instruction::SUB) {
+        return a - b;
+    } else if constexpr (OP == Instruction::MUL) {
+        return a * b;
+    } else if constexpr (OP == Instruction::LSHIFT) {
+        return a << (b & 63);
+    } else if constexpr (OP == Instruction::RSHIFT) {
+        return a >> (b & 63);
+    } else if constexpr (OP == Instruction::DADD) {
+        return std::bit_cast<std::uint64_t>(as_double(a) + as_double(b));
+    } else if constexpr (OP == Instruction::DSUB) {
+        return std::bit_cast<std::uint64_t>(as_double(a) - as_double(b));
+    } else if constexpr (OP == Instruction::DMUL) {
+        return std::bit_cast<std::uint64_t>(as_double(a) * as_double(b));
+    } else if constexpr (OP == Instruction::DDIV) {
+        return std::bit_cast<std::uint64_t>(as_double(a) / as_double(b));
+    }
+}
+template <Instruction OP>
+void kernel_scalar(std::uint64_t *dst, const std::uint64_t *src, const std::uint64_t *mask, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        if (mask[i] != 0) {
+            dst[i] = apply_scalar<OP>(dst[i], src[i]);
+        }
+    }
+}
+#if defined(__x86_64__)
+template <Instruction OP>
+__attribute__((target("avx2"))) void kernel_avx2(std::uint64_t *dst, const std::uint64_t *src,
+                                                 const std::uint64_t *mask, std::size_t n) {
+    if constexpr (OP == Instruction::MUL) {
+        kernel_scalar<OP>(dst, src, mask, n);  // NOTE: AVX2には64bitの乗算がない
+        return;
+    } else {
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+            auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            auto m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+            __m256i r;
+            if constexpr (OP == Instruction::MOV) {
+                r = b;
+            } else if constexpr (OP == Instruction::AND) {
+                r = _mm256_and_si256(a, b);
+            } else if constexpr (OP == Instruction::OR) {
+                r = _mm256_or_si256(a, b);
+            } else if constexpr (OP == Instruction::XOR) {
+                r = _mm256_xor_si256(a, b);
+            } else if constexpr (OP == Instruction::NOT) {
+                r = _mm256_xor_si256(a, _mm256_set1_epi64x(-1));
+            } else if constexpr (OP == Instruction::ADD) {
+                r = _mm256_add_epi64(a, b);
+            } else if constexpr (OP == Instruction::SUB) {
+                r = _mm256_sub_epi64(a, b);
+            } else if constexpr (OP == Instruction::LSHIFT) {
+                r = _mm256_sllv_epi64(a, _mm256_and_si256(b, _mm256_set1_epi64x(63)));
+            } else if constexpr (OP == Instruction::RSHIFT) {
+                r = _mm256_srlv_epi64(a, _mm256_and_si256(b, _mm256_set1_epi64x(63)));
+            } else {
+                auto x = _mm256_castsi256_pd(a);
+                auto y = _mm256_castsi256_pd(b);
+                if constexpr (OP == Instruction::DADD) {
+                    r = _mm256_castpd_si256(_mm256_add_pd(x, y));
+                } else if constexpr (OP == Instruction::DSUB) {
+                    r = _mm256_castpd_si256(_mm256_sub_pd(x, y));
+                } else if constexpr (OP == Instruction::DMUL) {
+                    r = _mm256_castpd_si256(_mm256_mul_pd(x, y));
+                } else {
+                    r = _mm256_castpd_si256(_mm256_div_pd(x, y));
+                }
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_blendv_epi8(a, r, m));
+        }
+        kernel_scalar<OP>(dst + i, src + i, mask + i, n - i);
+    }
+}
+template <Instruction OP>
+__attribute__((target("avx512f,avx512dq"))) void kernel_avx512(std::uint64_t *dst, const std::uint64_t *src,
+                                                               const std::uint64_t *mask, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto a = _mm512_loadu_si512(dst + i);
+        auto b = _mm512_loadu_si512(src + i);
+        auto m = _mm512_loadu_si512(mask + i);
+        auto k = _mm512_test_epi64_mask(m, m);
+        // NOTE: マスクなしの_mm512_sllv_epi64()などは、GCC 12で-Wmaybe-uninitializedの警告が出るので、全レーンのマスクで呼ぶ
+        constexpr __mmask8 ALL_LANES = 0xff;
+        __m512i r;
+        if constexpr (OP == Instruction::MOV) {
+            r = b;
+        } else if constexpr (OP == Instruction::AND) {
+            r = _mm512_and_si512(a, b);
+        } else if constexpr (OP == Instruction::OR) {
+            r = _mm512_or_si512(a, b);
+        } else if constexpr (OP == Instruction::XOR) {
+            r = _mm512_xor_si512(a, b);
+        } else if constexpr (OP == Instruction::NOT) {
+            r = _mm512_xor_si512(a, _mm512_set1_epi64(-1));
+        } else if constexpr (OP == Instruction::ADD) {
+            r = _mm512_add_epi64(a, b);
+        } else if constexpr (OP == Instruction::SUB) {
+            r = _mm512_sub_epi64(a, b);
+        } else if constexpr (OP == Instruction::MUL) {
+            r = _mm512_mullo_epi64(a, b);
+        } else if constexpr (OP == Instruction::LSHIFT) {
+            r = _mm512_maskz_sllv_epi64(ALL_LANES, a, _mm512_and_si512(b, _mm512_set1_epi64(63)));
+        } else if constexpr (OP == Instruction::RSHIFT) {
+            r = _mm512_maskz_srlv_epi64(ALL_LANES, a, _mm512_and_si512(b, _mm512_set1_epi64(63)));
+        } else {
+            auto x = _mm512_castsi512_pd(a);
+            auto y = _mm512_castsi512_pd(b);
+            if constexpr (OP == Instruction::DADD) {
+                r = _mm512_castpd_si512(_mm512_add_pd(x, y));
+            } else if constexpr (OP == Instruction::DSUB) {
+                r = _mm512_castpd_si512(_mm512_sub_pd(x, y));
+            } else if constexpr (OP == Instruction::DMUL) {
+                r = _mm512_castpd_si512(_mm512_mul_pd(x, y));
+            } else {
+                r = _mm512_castpd_si512(_mm512_div_pd(x, y));
+            }
+        }
+        _mm512_storeu_si512(dst + i, _mm512_mask_blend_epi64(k, a, r));
+    }
+    kernel_scalar<OP>(dst + i, src + i, mask + i, n - i);
+}
+#endif
+template <Instruction OP>
+void run_kernel(LockstepEngine::Isa isa, std::uint64_t *dst, const std::uint64_t *src, const std::uint64_t *mask,
+                std::size_t n) {
+    switch (isa) {
+#if defined(__x86_64__)
+        case LockstepEngine::Isa::AVX512:
+            return kernel_avx512<OP>(dst, src, mask, n);
+        case LockstepEngine::Isa::AVX2:
+            return kernel_avx2<OP>(dst, src, mask, n);
+#endif
+        default:
+            return kernel_scalar<OP>(dst, src, mask, n);
+    }
+}
+// dst[i] = mask[i] ? dst[i] OP src[i] : dst[i]
+void dispatch_kernel(Instruction instruction, LockstepEngine::Isa isa, std::uint64_t *dst, const std::uint64_t *src,
+                     const std::uint64_t *mask, std::size_t n) {
+    switch (instruction) {
+#define NYULAN_LOCKSTEP_KERNEL(name)                                   \
+    case Instruction::name:                                            \
+        return run_kernel<Instruction::name>(isa, dst, src, mask, n);
+        NYULAN_LOCKSTEP_KERNEL(MOV)
+        NYULAN_LOCKSTEP_KERNEL(AND)
+        NYULAN_LOCKSTEP_KERNEL(OR)
+        NYULAN_LOCKSTEP_KERNEL(XOR)
+        NYULAN_LOCKSTEP_KERNEL(NOT)
+        NYULAN_LOCKSTEP_KERNEL(ADD)
+        NYULAN_LOCKSTEP_KERNEL(SUB)
+        NYULAN_LOCKSTEP_KERNEL(MUL)
+        NYULAN_LOCKSTEP_KERNEL(LSHIFT)
+        NYULAN_LOCKSTEP_KERNEL(RSHIFT)
+        NYULAN_LOCKSTEP_KERNEL(DADD)
+        NYULAN_LOCKSTEP_KERNEL(DSUB)
+        NYULAN_LOCKSTEP_KERNEL(DMUL)
+        NYULAN_LOCKSTEP_KERNEL(DDIV)
+#undef NYULAN_LOCKSTEP_KERNEL
+        default:
+            throw std::logic_error("error: instruction can't be vectorized");
+    }
+}
+bool is_vectorizable(Instruction instruction) {
+    switch (instruction) {
+        case Instruction::MOV:
+        case Instruction::AND:
+        case Instruction::OR:
+        case Instruction::XOR:
+        case Instruction::NOT:
+        case Instruction::ADD:
+        case Instruction::SUB:
+        case Instruction::MUL:
+        case Instruction::LSHIFT:
+        case Instruction::RSHIFT:
+        case Instruction::DADD:
+        case Instruction::DSUB:
+        case Instruction::DMUL:
+        case Instruction::DDIV:
+            return true;
+        default:  // NOTE: DIV、MODは0除算でvm.cppと同じように落ちるよう、レーンごとに実行する
+            return false;
+    }
+}
+}  // namespace
+
+LockstepEngine::Isa LockstepEngine::best_isa() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+        return Isa::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return Isa::AVX2;
+    }
+#endif
+    return Isa::SCALAR;
+}
+LockstepEngine::LockstepEngine(std::shared_ptr<const std::vector<OneStep>> code,
+                               const std::vector<std::uint8_t> &static_datas, std::size_t num_lanes, Isa isa)
+    : code_(std::move(code)), isa_(isa) {
+    if (isa != Isa::SCALAR && best_isa() < isa) {
+        throw std::runtime_error("error: this cpu doesn't support the requested instruction set");
+    }
+    for (std::size_t i = 0; i < num_lanes; i++) {
+        this->lanes_.push_back(std::make_unique<VirtualMachine>(static_datas));
+        this->lanes_.back()->load_code(this->code_);
+    }
+    for (auto &registers : this->registers_) {
+        registers.assign(num_lanes, 0);
+    }
+    this->decode();
+}
+void LockstepEngine::set_register(std::size_t lane, std::size_t index, Register value) {
+    this->registers_.at(index).at(lane) = value.value();
+}
+void LockstepEngine::decode() {
+    const auto &code = *this->code_;
+    this->decoded_.resize(code.size());
+    for (std::size_t pc = 0; pc < code.size(); pc++) {
+        auto instruction = static_cast<Instruction>(code[pc].value() >> 8);
+        auto dst = static_cast<std::uint8_t>((code[pc].value() >> 4) & 0b1111);
+        auto src = static_cast<std::uint8_t>(code[pc].value() & 0b1111);
+        Decoded decoded{Kind::SCALAR, instruction, dst, src, 1, 0};
+        if (instruction == Instruction::NOP) {
+            decoded.kind = Kind::NOP;
+        } else if (is_vectorizable(instruction)) {
+            decoded.kind = Kind::VECTOR;
+        } else if (instruction == Instruction::IFZ || instruction == Instruction::IFP ||
+                   instruction == Instruction::IFN || instruction == Instruction::GOTO) {
+            decoded.kind = Kind::BRANCH;
+        } else if (instruction == Instruction::PUSHL && pc + 8 < code.size()) {
+            // NOTE: 最後にPUSHLしたものが最上位バイトになる
+            bool matched = static_cast<Instruction>(code[pc + 8].value() >> 8) == Instruction::POP64;
+            std::uint64_t immediate = 0;
+            for (std::size_t i = 0; matched && i < 8; i++) {
+                matched = static_cast<Instruction>(code[pc + i].value() >> 8) == Instruction::PUSHL;
+                immediate |= static_cast<std::uint64_t>(code[pc + i].value() & 0b1111'1111) << (8 * i);
+            }
+            if (matched) {
+                decoded = Decoded{Kind::LOAD_IMMEDIATE, Instruction::POP64,
+                                  static_cast<std::uint8_t>((code[pc + 8].value() >> 4) & 0b1111), 0, 9, immediate};
+            }
+        }
+        this->decoded_[pc] = decoded;
+    }
+}
+void LockstepEngine::finish(std::size_t lane, ExecResult result, std::exception_ptr error) {
+    this->finished_[lane] = true;
+    this->results_[lane] = LaneResult{result, error};
+}
+void LockstepEngine::step_scalar(std::size_t lane) {
+    auto &vm = *this->lanes_[lane];
+    for (std::size_t i = 0; i < vm.registers.size(); i++) {
+        vm.registers[i] = this->registers_[i][lane];
+    }
+    vm.program_counter = this->program_counters_[lane];
+    try {
+        auto result = vm.run(1);
+        switch (result.status) {
+            case ExecStatus::SUSPENDED:
+                break;
+            case ExecStatus::BLOCKED:
+                throw std::runtime_error("error: lockstep lanes can't wait for io");
+            default:
+                this->finish(lane, result, nullptr);
+                break;
+        }
+    } catch (...) {
+        this->finish(lane, ExecResult{ExecStatus::FINISHED, 0}, std::current_exception());
+    }
+    for (std::size_t i = 0; i < vm.registers.size(); i++) {
+        this->registers_[i][lane] = vm.registers[i].value();
+    }
+    this->program_counters_[lane] = vm.program_counter.value();
+}
+std::vector<LockstepEngine::LaneResult> LockstepEngine::run(Address entry_point) {
+    const auto num_lanes = this->lanes_.size();
+    const auto code_size = this->code_->size();
+    this->program_counters_.assign(num_lanes, entry_point.value());
+    this->mask_.assign(num_lanes, 0);
+    this->finished_.assign(num_lanes, false);
+    this->results_.assign(num_lanes, LaneResult{ExecResult{ExecStatus::FINISHED, 0}, nullptr});
+    for (auto &lane : this->lanes_) {
+        lane->start(entry_point);
+    }
+    while (true) {
+        // pcが最も小さいレーンのグループを実行する。遅れたレーンが追いつくので、分岐の後で合流できる
+        auto current = std::numeric_limits<std::uint64_t>::max();
+        for (std::size_t lane = 0; lane < num_lanes; lane++) {
+            if (this->finished_[lane]) {
+                continue;
+            }
+            if (this->program_counters_[lane] >= code_size) {
+                this->finish(lane, ExecResult{ExecStatus::FINISHED, 0}, nullptr);
+                continue;
+            }
+            current = std::min(current, this->program_counters_[lane]);
+        }
+        if (current == std::numeric_limits<std::uint64_t>::max()) {
+            break;
+        }
+        std::size_t num_active = 0;
+        for (std::size_t lane = 0; lane < num_lanes; lane++) {
+            bool active = not this->finished_[lane] && this->program_counters_[lane] == current;
+            this->mask_[lane] = active ? ~UINT64_C(0) : 0;
+            num_active += active;
+        }
+        this->stats_.cycles++;
+        this->stats_.lane_steps += num_active;
+        const auto &decoded = this->decoded_[current];
+        switch (decoded.kind) {
+            case Kind::NOP:
+                break;
+            case Kind::VECTOR:
+                dispatch_kernel(decoded.instruction, this->isa_, this->registers_[decoded.dst].data(),
+                                this->registers_[decoded.src].data(), this->mask_.data(), num_lanes);
+                this->stats_.vector_steps++;
+                break;
+            case Kind::LOAD_IMMEDIATE: {
+                auto &dst = this->registers_[decoded.dst];
+                for (std::size_t lane = 0; lane < num_lanes; lane++) {
+                    dst[lane] = this->mask_[lane] ? decoded.immediate : dst[lane];
+                }
+                this->stats_.vector_steps++;
+                break;
+            }
+            case Kind::BRANCH:
+                for (std::size_t lane = 0; lane < num_lanes; lane++) {
+                    if (this->mask_[lane] == 0) {
+                        continue;
+                    }
+                    Register condition = this->registers_[decoded.dst][lane];
+                    bool taken = decoded.instruction == Instruction::GOTO ||
+                                 (decoded.instruction == Instruction::IFZ && condition == 0) ||
+                                 (decoded.instruction == Instruction::IFP && condition > 0) ||
+                                 (decoded.instruction == Instruction::IFN && condition < 0);
+                    if (taken) {
+                        // NOTE: GOTOだけはdstがアドレス
+                        auto target = decoded.instruction == Instruction::GOTO ? decoded.dst : decoded.src;
+                        this->program_counters_[lane] = this->registers_[target][lane];
+                        this->mask_[lane] = 0;  // 下でpcを進めない
+                    }
+                }
+                this->stats_.vector_steps++;
+                break;
+            case Kind::SCALAR:
+                for (std::size_t lane = 0; lane < num_lanes; lane++) {
+                    if (this->mask_[lane] != 0) {
+                        this->step_scalar(lane);
+                        this->mask_[lane] = 0;  // pcはVMが進めた
+                    }
+                }
+                this->stats_.scalar_steps += num_active;
+                break;
+        }
+        for (std::size_t lane = 0; lane < num_lanes; lane++) {
+            if (this->mask_[lane] != 0) {
+                this->program_counters_[lane] += decoded.length;
+            }
+        }
+    }
+    return this->results_;
+}
+}  // namespace nyulan
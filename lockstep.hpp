@@ -0,0 +1,79 @@
+#ifndef NYULAN_LOCKSTEP
+#define NYULAN_LOCKSTEP
+#include <array>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include "nyulan.hpp"
+#include "vm.hpp"
+namespace nyulan {
+// 実験的: 同じプログラムのN個のインスタンスを、同じ命令ずつ揃えて実行する
+// レジスタはレジスタ番号ごとにレーンを並べた形(structure of arrays)で持ち、算術命令はSIMDで全レーンに対して行う
+// 分岐で別れたレーンは、pcが最も小さいレーンのグループから実行し、それ以外はマスクする。pcが揃えば合流する
+// メモリ、スタック、CALL、RETなどは、レーンごとのVirtualMachineで1ステップずつ実行するので、意味はvm.cppと同じ
+class LockstepEngine {
+   public:
+    enum class Isa {
+        SCALAR,
+        AVX2,
+        AVX512,
+    };
+    struct LaneResult {
+        ExecResult result;
+        std::exception_ptr error;  // 空でなければ、このレーンは例外で止まった
+    };
+    struct Stats {
+        std::uint64_t cycles = 0;        // 命令を発行した回数
+        std::uint64_t vector_steps = 0;  // 全レーンまとめて実行した命令
+        std::uint64_t scalar_steps = 0;  // レーンごとのVMで実行した命令(レーン数分数える)
+        std::uint64_t lane_steps = 0;    // 実行に参加したレーン数の合計
+    };
+
+    static Isa best_isa();  // このCPUで使える一番広いもの
+    LockstepEngine(std::shared_ptr<const std::vector<OneStep>> code, const std::vector<std::uint8_t> &static_datas,
+                   std::size_t num_lanes, Isa isa = best_isa());
+
+    std::size_t num_lanes() const { return this->lanes_.size(); }
+    Isa isa() const { return this->isa_; }
+    // run()の前に、redirect_stdio()などの設定をする
+    VirtualMachine &lane(std::size_t index) { return *this->lanes_[index]; }
+    void set_register(std::size_t lane, std::size_t index, Register value);
+    std::vector<LaneResult> run(Address entry_point);
+    const Stats &stats() const { return this->stats_; }
+
+   private:
+    enum class Kind : std::uint8_t {
+        NOP,
+        VECTOR,          // レーンごとに独立した算術命令
+        LOAD_IMMEDIATE,  // PUSHL*8 POP64 即値の読み込みとして、まとめて実行する
+        BRANCH,
+        SCALAR,
+    };
+    struct Decoded {
+        Kind kind;
+        Instruction instruction;
+        std::uint8_t dst;
+        std::uint8_t src;
+        std::uint8_t length;  // 何命令分か
+        std::uint64_t immediate;
+    };
+
+    std::shared_ptr<const std::vector<OneStep>> code_;
+    std::vector<Decoded> decoded_;
+    Isa isa_;
+    std::vector<std::unique_ptr<VirtualMachine>> lanes_;
+    std::array<std::vector<std::uint64_t>, 16> registers_;  // registers_[レジスタ番号][レーン]
+    std::vector<std::uint64_t> program_counters_;
+    std::vector<std::uint64_t> mask_;  // 実行するレーンは全ビット1、しないレーンは0
+    std::vector<LaneResult> results_;
+    std::vector<bool> finished_;
+    Stats stats_;
+
+    void decode();
+    void step_scalar(std::size_t lane);
+    void finish(std::size_t lane, ExecResult result, std::exception_ptr error);
+};
+}  // namespace nyulan
+#endif
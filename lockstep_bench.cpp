@@ -0,0 +1,143 @@
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <magic_enum.hpp>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "container_printer.hpp"
+#include "emitter.hpp"
+#include "lockstep.hpp"
+#include "logging.hpp"
+#include "vm.hpp"
+namespace bpo = boost::program_options;
+using namespace nyulan::container_ostream;
+namespace {
+using nyulan::Emitter;
+using nyulan::Instruction;
+// r0を種にした線形合同法を回し、上位ビットの偶奇で分岐しながら畳み込む。下位8bitを終了コードにする
+std::vector<nyulan::OneStep> make_workload(std::uint64_t iterations) {
+    Emitter e;
+    e.load_immediate(1, 6364136223846793005ULL);
+    e.load_immediate(2, 1442695040888963407ULL);
+    e.load_immediate(3, iterations);
+    e.load_immediate(4, 1);
+    e.load_immediate(5, 33);
+    e.load_immediate(6, 0);
+    e.load_immediate(11, std::bit_cast<std::uint64_t>(1.0));
+    e.load_immediate(12, std::bit_cast<std::uint64_t>(0.999));
+    e.load_immediate(13, std::bit_cast<std::uint64_t>(0.5));
+    auto loop = e.here();
+    e.emit(Instruction::MUL, 0, 1);
+    e.emit(Instruction::ADD, 0, 2);
+    e.emit(Instruction::MOV, 8, 0);
+    e.emit(Instruction::RSHIFT, 8, 5);
+    e.emit(Instruction::MOV, 9, 8);
+    e.emit(Instruction::AND, 9, 4);
+    e.emit(Instruction::DMUL, 11, 12);
+    e.emit(Instruction::DADD, 11, 13);
+    auto to_even = e.load_label(10);
+    e.emit(Instruction::IFZ, 9, 10);
+    e.emit(Instruction::XOR, 6, 8);  // 奇数
+    auto to_join = e.load_label(10);
+    e.emit(Instruction::GOTO, 10);
+    e.patch(to_even, e.here());
+    e.emit(Instruction::ADD, 6, 8);  // 偶数
+    e.patch(to_join, e.here());
+    e.emit(Instruction::SUB, 3, 4);
+    auto to_end = e.load_label(10);
+    e.emit(Instruction::IFZ, 3, 10);
+    auto to_loop = e.load_label(10);
+    e.patch(to_loop, loop);
+    e.emit(Instruction::GOTO, 10);
+    e.patch(to_end, e.here());
+    e.load_immediate(10, 0b1111'1111);
+    e.emit(Instruction::AND, 6, 10);
+    e.emit(Instruction::PUSHR64, 6);
+    e.call_builtin(nyulan::BuiltinFuncs::EXIT);
+    return e.code;
+}
+double seconds_since(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+}  // namespace
+int main(int argc, char **argv) {
+    bpo::options_description opt("option");
+    std::stringstream isa_description;
+    isa_description << "instruction set for the lockstep engine AUTO"
+                    << magic_enum::enum_names<nyulan::LockstepEngine::Isa>();
+    opt.add_options()("help,h", "show this help")("lanes,n", bpo::value<std::size_t>()->default_value(64),
+                                                   "number of guest instances")(
+        "iterations,i", bpo::value<std::uint64_t>()->default_value(2000), "loop iterations per instance")(
+        "isa", bpo::value<std::string>()->default_value("AUTO"), isa_description.str().c_str())("debug,d",
+                                                                                                "enable debug outputs");
+
+    bpo::variables_map varmap;
+    bpo::store(bpo::parse_command_line(argc, argv, opt), varmap);
+    bpo::notify(varmap);
+    if (varmap.count("help")) {
+        std::cout << opt << std::endl;
+        std::exit(EXIT_SUCCESS);
+    }
+    nyulan::logging::init(varmap.count("debug") ? boost::log::trivial::debug : boost::log::trivial::warning);
+    auto isa = nyulan::LockstepEngine::best_isa();
+    if (varmap["isa"].as<std::string>() != "AUTO") {
+        auto requested = magic_enum::enum_cast<nyulan::LockstepEngine::Isa>(varmap["isa"].as<std::string>());
+        if (not requested) {
+            std::cerr << "can't understand isa \"" << varmap["isa"].as<std::string>() << "\"" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        isa = requested.value();
+    }
+    auto num_lanes = varmap["lanes"].as<std::size_t>();
+    auto code =
+        std::make_shared<const std::vector<nyulan::OneStep>>(make_workload(varmap["iterations"].as<std::uint64_t>()));
+    std::vector<std::uint8_t> static_datas;
+
+    // 比較対象: 独立したスカラーのVMをN個
+    std::vector<std::uint64_t> expected(num_lanes);
+    auto begin = std::chrono::steady_clock::now();
+    for (std::size_t lane = 0; lane < num_lanes; lane++) {
+        nyulan::VirtualMachine vm(static_datas);
+        vm.load_code(code);
+        nyulan::Register args[] = {lane};
+        expected[lane] = vm.call(0, args).value.value();
+    }
+    auto scalar_seconds = seconds_since(begin);
+
+    nyulan::LockstepEngine engine(code, static_datas, num_lanes, isa);
+    for (std::size_t lane = 0; lane < num_lanes; lane++) {
+        engine.set_register(lane, 0, lane);
+    }
+    begin = std::chrono::steady_clock::now();
+    auto results = engine.run(0);
+    auto lockstep_seconds = seconds_since(begin);
+
+    std::size_t mismatches = 0;
+    for (std::size_t lane = 0; lane < num_lanes; lane++) {
+        if (results[lane].error || results[lane].result.value.value() != expected[lane]) {
+            mismatches++;
+        }
+    }
+    const auto &stats = engine.stats();
+    std::cout << "lanes: " << num_lanes << ", isa: " << magic_enum::enum_name(engine.isa()) << std::endl;
+    std::cout << std::setw(24) << "scalar VMs [s]" << std::setw(16) << std::fixed << std::setprecision(4)
+              << scalar_seconds << std::endl;
+    std::cout << std::setw(24) << "lockstep [s]" << std::setw(16) << lockstep_seconds << std::endl;
+    std::cout << std::setw(24) << "speedup" << std::setw(16) << std::setprecision(2)
+              << scalar_seconds / lockstep_seconds << std::endl;
+    std::cout << std::setw(24) << "vector steps" << std::setw(16) << stats.vector_steps << std::endl;
+    std::cout << std::setw(24) << "scalar lane steps" << std::setw(16) << stats.scalar_steps << std::endl;
+    std::cout << std::setw(24) << "lane utilization" << std::setw(16)
+              << (stats.cycles == 0 ? 0.0 : static_cast<double>(stats.lane_steps) / (stats.cycles * num_lanes))
+              << std::endl;
+    if (mismatches != 0) {
+        std::cerr << "error: " << mismatches << " lanes disagree with the scalar VMs" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -1,18 +1,211 @@
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <boost/program_options.hpp>
 #include <boost/stacktrace.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "coverage.hpp"
 #include "logging.hpp"
+#include "metrics.hpp"
 #include "objectfile.hpp"
+#include "profiler.hpp"
+#include "scheduler.hpp"
+#include "server.hpp"
+#include "snapshot.hpp"
 #include "vm.hpp"
 namespace bpo = boost::program_options;
+namespace stdfsys = std::filesystem;
 
 #ifndef NDEBUG
 [[noreturn]] void terminate_with_stacktrace() noexcept;
 #endif
+namespace {
+struct MemoryOptions {
+    bool guard_pages = false;
+    nyulan::Memory::HugePages huge_pages = nyulan::Memory::HugePages::NONE;  // NONE以外ならguard_pagesも有効にする
+
+    void apply(nyulan::VirtualMachine &vm) const {
+        if (this->guard_pages || this->huge_pages != nyulan::Memory::HugePages::NONE) {
+            vm.enable_guard_pages(nyulan::Memory::DEFAULT_GUARD_RESERVE, this->huge_pages);
+        }
+    }
+};
+nyulan::Memory::HugePages parse_huge_pages(const std::string &name) {
+    if (name == "none") {
+        return nyulan::Memory::HugePages::NONE;
+    } else if (name == "transparent") {
+        return nyulan::Memory::HugePages::TRANSPARENT;
+    } else if (name == "explicit") {
+        return nyulan::Memory::HugePages::EXPLICIT;
+    }
+    throw std::runtime_error("error: unknown huge page mode " + name + " (none, transparent or explicit)");
+}
+nyulan::Profiler::Symbols profile_symbols(const nyulan::ObjectFile &objectfile) {
+    nyulan::Profiler::Symbols symbols;
+    for (const auto &label : objectfile.global_labels) {
+        symbols.functions.emplace_back(label.label_address, label.real_name);
+    }
+    std::sort(symbols.functions.begin(), symbols.functions.end());
+    symbols.sourcefiles = objectfile.source_files();
+    symbols.lines = objectfile.source_lines();
+    symbols.find_blocks(objectfile.code);
+    return symbols;
+}
+// pathが"-"なら標準エラー出力に書く
+void write_profile(const std::string &path, const std::function<void(std::ostream &)> &write) {
+    if (path == "-") {
+        write(std::cerr);
+        return;
+    }
+    std::ofstream out(path);
+    if (not out) {
+        throw std::runtime_error("error: failed to open " + path);
+    }
+    write(out);
+}
+// --coverage、--coverage-summaryの出力
+void write_coverage(const nyulan::Coverage &coverage, const nyulan::ObjectFile &objectfile,
+                    const bpo::variables_map &varmap) {
+    auto symbols = profile_symbols(objectfile);
+    if (varmap.count("coverage")) {
+        write_profile(varmap["coverage"].as<std::string>(), [&](std::ostream &out) {
+            auto name = stdfsys::path(objectfile.filename).stem().string();
+            coverage.write_lcov(out, symbols, name, objectfile.filename);
+        });
+    }
+    if (varmap.count("coverage-summary")) {
+        coverage.write_summary(std::cerr, symbols);
+    }
+}
+// ディレクトリならその中の通常ファイル全て、そうでなければ一行に一つ入力のパスが書かれたリスト
+std::vector<stdfsys::path> list_inputs(const stdfsys::path &source) {
+    std::vector<stdfsys::path> result;
+    if (stdfsys::is_directory(source)) {
+        for (const auto &entry : stdfsys::directory_iterator(source)) {
+            if (entry.is_regular_file()) {
+                result.push_back(entry.path());
+            }
+        }
+        std::sort(result.begin(), result.end());
+    } else {
+        std::ifstream list(source);
+        if (not list) {
+            throw std::runtime_error("error: failed to open input list " + source.string());
+        }
+        for (std::string line; std::getline(list, line);) {
+            if (not line.empty()) {
+                result.emplace_back(line);
+            }
+        }
+    }
+    return result;
+}
+// 同じプログラムを入力ごとに別のVMで動かす。コードのデコードは一度だけ
+// 入力をゲストの標準入力に、出力をoutput_dir/<入力のファイル名>.outに繋ぐ
+int run_batch(nyulan::ObjectFile &objectfile, const stdfsys::path &source, const stdfsys::path &output_dir,
+              std::size_t jobs, bool pin_workers, const MemoryOptions &memory_options,
+              std::shared_ptr<nyulan::MetricsFile> metrics, std::shared_ptr<nyulan::Coverage> coverage) {
+    auto inputs = list_inputs(source);
+    auto code = std::make_shared<const std::vector<nyulan::OneStep>>(objectfile.code);
+    auto entry_point = objectfile.find_label("_start").label_address;
+    stdfsys::create_directories(output_dir);
+
+    struct Outcome {
+        std::string message;  // 終了コードか、エラー
+        bool succeeded = false;
+    };
+    std::vector<Outcome> outcomes(inputs.size());
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    std::size_t in_flight = 0;
+    const std::size_t max_in_flight = jobs * 4;  // NOTE: 一度に開くfdの数を抑える
+
+    auto begin = std::chrono::steady_clock::now();
+    {
+        nyulan::Scheduler scheduler(jobs, 10000, pin_workers);
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+            {
+                std::unique_lock lock(mutex);
+                finished_cv.wait(lock, [&] { return in_flight < max_in_flight; });
+            }
+            auto output = output_dir / (inputs[i].filename().string() + ".out");
+            int in_fd = ::open(inputs[i].c_str(), O_RDONLY | O_CLOEXEC);
+            int out_fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (in_fd == -1 || out_fd == -1) {
+                outcomes[i].message = std::string("error: failed to open: ") + std::strerror(errno);
+                ::close(in_fd);
+                ::close(out_fd);
+                continue;
+            }
+            auto vm = std::make_unique<nyulan::VirtualMachine>(objectfile.literal_datas);
+            vm->load_code(code);
+            vm->map_static_segments(objectfile.filename, objectfile.static_segments);
+            memory_options.apply(*vm);
+            vm->redirect_stdio(in_fd, out_fd, STDERR_FILENO);
+            if (coverage != nullptr) {
+                vm->attach_coverage(coverage);
+            }
+            if (metrics != nullptr) {
+                if (auto slot = metrics->acquire(inputs[i].filename().string())) {
+                    vm->attach_metrics(metrics, slot.value());
+                }
+            }
+            vm->start(entry_point);
+            {
+                std::lock_guard lock(mutex);
+                in_flight++;
+            }
+            scheduler.submit(std::move(vm), [&, i, in_fd, out_fd](auto, auto vm, nyulan::ExecResult result,
+                                                                std::exception_ptr error) {
+                vm.reset();
+                ::close(in_fd);
+                ::close(out_fd);
+                auto &outcome = outcomes[i];
+                if (error) {
+                    try {
+                        std::rethrow_exception(error);
+                    } catch (const std::exception &except) {
+                        outcome.message = except.what();
+                    }
+                } else {
+                    auto exit_code = result.status == nyulan::ExecStatus::EXITED ? result.value.value() : 0;
+                    outcome.message = std::to_string(exit_code);
+                    outcome.succeeded = exit_code == 0;
+                }
+                {
+                    std::lock_guard lock(mutex);
+                    in_flight--;
+                }
+                finished_cv.notify_one();
+            });
+        }
+        scheduler.wait_all();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::size_t num_failed = 0;
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        std::cout << outcomes[i].message << "\t" << inputs[i].string() << std::endl;
+        num_failed += outcomes[i].succeeded ? 0 : 1;
+    }
+    std::cerr << inputs.size() << " inputs, " << num_failed << " failed, " << elapsed << " s ("
+              << (elapsed > 0 ? inputs.size() / elapsed : 0) << " inputs/s, " << jobs << " jobs)" << std::endl;
+    return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+}  // namespace
 
 int main(int argc, char **argv) {
 #ifndef NDEBUG
@@ -20,7 +213,41 @@ int main(int argc, char **argv) {
 #endif
     bpo::options_description opt("option");
     opt.add_options()("help,h", "show this help")("objectfile,s", bpo::value<std::string>(), "object file")(
-        "debug,d", "enable debug outputs");
+        "debug,d", "enable debug outputs")("batch", bpo::value<std::string>(),
+                                           "run the program once per input (a directory, or a file listing inputs)")(
+        "jobs,j", bpo::value<std::size_t>()->default_value(std::max(1u, std::thread::hardware_concurrency())),
+        "number of worker threads for --batch")("output-dir,o", bpo::value<std::string>()->default_value("."),
+                                                "directory for the outputs of --batch")(
+        "serve", bpo::value<std::string>(), "serve run requests on this unix domain socket (see nyulanc)")(
+        "pool-size", bpo::value<std::size_t>()->default_value(4), "number of VMs prepared per program for --serve")(
+        "max-steps", bpo::value<std::uint64_t>()->default_value(0), "step limit per request for --serve (0: none)")(
+        "timeout-ms", bpo::value<std::uint64_t>()->default_value(0), "time limit per request for --serve (0: none)")(
+        "snapshot-at", bpo::value<std::string>(), "save a snapshot when execution first reaches this label")(
+        "snapshot-file", bpo::value<std::string>(), "where to save --snapshot-at (default: <objectfile>.snap)")(
+        "restore", bpo::value<std::string>(), "resume execution from a snapshot instead of an objectfile")(
+        "guard-pages",
+        "place the dynamic memory in a reserved region protected by guard pages (blocks are packed, so only accesses "
+        "to pages holding no live block are caught)")(
+        "huge-pages", bpo::value<std::string>()->default_value("none"),
+        "back the guarded region with huge pages: none, transparent or explicit (implies --guard-pages)")(
+        "pin-workers", "pin the --batch workers to cpus and keep each VM on the NUMA node it started on")(
+        "profile", bpo::value<std::string>(), "sample the program and write a hot spot report here (-: stderr)")(
+        "profile-collapsed", bpo::value<std::string>(),
+        "write sampled call stacks in the collapsed format for flame graphs")(
+        "profile-interval-us", bpo::value<std::uint64_t>()->default_value(1000), "sampling interval for --profile")(
+        "profile-every", bpo::value<std::uint64_t>()->default_value(0),
+        "sample every N steps instead of on a timer (0: use the timer)")(
+        "profile-top", bpo::value<std::size_t>()->default_value(20), "number of entries per table in --profile")(
+        "callgraph", bpo::value<std::string>(), "trace CALL/RET and write a callgrind profile here (-: stderr)")(
+        "callgraph-report", bpo::value<std::string>(), "trace CALL/RET and write a per-function table here")(
+        "stats", bpo::value<std::string>()->implicit_value("text"),
+        "count executed instructions, builtin latencies etc. and print them to stderr: text or json")(
+        "stats-top", bpo::value<std::size_t>()->default_value(20), "number of instruction pairs in --stats")(
+        "metrics", bpo::value<std::string>(), "publish live counters to this file for nyustat")(
+        "metrics-interval-ms", bpo::value<std::uint64_t>()->default_value(500), "how often to publish --metrics")(
+        "metrics-slots", bpo::value<std::size_t>()->default_value(64), "number of VMs shown at once in --metrics")(
+        "coverage", bpo::value<std::string>(), "record executed instructions and write lcov .info here (-: stderr)")(
+        "coverage-summary", "record executed instructions and print the coverage ratios to stderr");
 
     bpo::variables_map varmap;
     bpo::store(bpo::parse_command_line(argc, argv, opt), varmap);
@@ -29,6 +256,31 @@ int main(int argc, char **argv) {
         std::cout << opt << std::endl;
         std::exit(EXIT_SUCCESS);
     }
+    if (varmap.count("serve")) {
+        nyulan::logging::init(varmap.count("debug") ? boost::log::trivial::debug : boost::log::trivial::info);
+        nyulan::Server::Options options;
+        options.pool_size = varmap["pool-size"].as<std::size_t>();
+        options.max_steps = varmap["max-steps"].as<std::uint64_t>();
+        options.timeout_ms = varmap["timeout-ms"].as<std::uint64_t>();
+        try {
+            nyulan::Server server(varmap["serve"].as<std::string>(), options);
+            server.serve();
+        } catch (const std::exception &except) {
+            std::cerr << except.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (varmap.count("restore")) {
+        nyulan::logging::init(varmap.count("debug") ? boost::log::trivial::debug : boost::log::trivial::info);
+        try {
+            auto VM = nyulan::Snapshot::open(varmap["restore"].as<std::string>())->instantiate();
+            auto result = VM->resume();
+            return result.status == nyulan::ExecStatus::EXITED ? static_cast<int>(result.value.value()) : 0;
+        } catch (const std::exception &except) {
+            std::cerr << except.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
     if (!varmap.count("objectfile")) {
         std::cerr << "error: no objectfile speciried" << std::endl;
         std::cout << opt << std::endl;
@@ -48,8 +300,141 @@ int main(int argc, char **argv) {
         std::cerr << except->what() << std::endl;
         exit(EXIT_FAILURE);
     }
+    MemoryOptions memory_options;
+    try {
+        memory_options.guard_pages = varmap.count("guard-pages");
+        memory_options.huge_pages = parse_huge_pages(varmap["huge-pages"].as<std::string>());
+    } catch (const std::exception &except) {
+        std::cerr << except.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::shared_ptr<nyulan::MetricsFile> metrics = nullptr;
+    if (varmap.count("metrics")) {
+        try {
+            auto interval = std::chrono::milliseconds(varmap["metrics-interval-ms"].as<std::uint64_t>());
+            metrics = nyulan::MetricsFile::create(varmap["metrics"].as<std::string>(),
+                                                  std::max<std::size_t>(varmap["metrics-slots"].as<std::size_t>(), 1),
+                                                  interval);
+        } catch (const std::exception &except) {
+            std::cerr << except.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::shared_ptr<nyulan::Coverage> coverage = nullptr;
+    if (varmap.count("coverage") || varmap.count("coverage-summary")) {
+        coverage = std::make_shared<nyulan::Coverage>(objectfile.code.size());
+    }
+    if (varmap.count("batch")) {
+        try {
+            auto exit_code =
+                run_batch(objectfile, varmap["batch"].as<std::string>(), varmap["output-dir"].as<std::string>(),
+                          std::max<std::size_t>(varmap["jobs"].as<std::size_t>(), 1), varmap.count("pin-workers"),
+                          memory_options, metrics, coverage);
+            if (coverage != nullptr) {
+                write_coverage(*coverage, objectfile, varmap);
+            }
+            return exit_code;
+        } catch (const std::exception &except) {
+            std::cerr << except.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
     nyulan::VirtualMachine VM(objectfile.literal_datas);
-    VM.exec(objectfile.code, objectfile.find_label("_start").label_address);
+    VM.map_static_segments(objectfile.filename, objectfile.static_segments);
+    memory_options.apply(VM);
+    if (varmap.count("snapshot-at")) {
+        auto label = objectfile.find_label(varmap["snapshot-at"].as<std::string>()).label_address;
+        auto path = varmap.count("snapshot-file") ? varmap["snapshot-file"].as<std::string>()
+                                                  : varmap["objectfile"].as<std::string>() + ".snap";
+        auto taken = std::make_shared<bool>(false);
+        nyulan::CallBacks callbacks;
+        callbacks.on_loop_head = [&VM, label, path, taken](nyulan::Address program_counter, nyulan::OneStep) {
+            if (*taken || program_counter != label) {
+                return;
+            }
+            *taken = true;  // NOTE: ループの中のラベルでも、取るのは最初の一回だけ
+            try {
+                nyulan::Snapshot::take(VM)->save(path);
+                TRIVIAL_LOG_WITH_FUNCNAME(info) << "saved snapshot to " << path;
+            } catch (const std::exception &except) {
+                std::cerr << except.what() << std::endl;
+            }
+        };
+        VM.install_callbacks(callbacks);
+    }
+    std::shared_ptr<nyulan::Profiler> profiler = nullptr;
+    if (varmap.count("profile") || varmap.count("profile-collapsed")) {
+        profiler = std::make_shared<nyulan::Profiler>(
+            std::chrono::microseconds(varmap["profile-interval-us"].as<std::uint64_t>()),
+            varmap["profile-every"].as<std::uint64_t>());
+        VM.attach_profiler(profiler);
+    }
+    if (varmap.count("stats")) {
+        auto format = varmap["stats"].as<std::string>();
+        if (format != "text" && format != "json") {
+            std::cerr << "error: unknown stats format " << format << " (text or json)" << std::endl;
+            return EXIT_FAILURE;
+        }
+        VM.enable_stats();
+    }
+    if (metrics != nullptr) {
+        VM.attach_metrics(metrics, metrics->acquire(stdfsys::path(objectfile.filename).filename().string()).value());
+    }
+    std::shared_ptr<nyulan::CallGraphProfiler> call_graph = nullptr;
+    if (varmap.count("callgraph") || varmap.count("callgraph-report")) {
+        call_graph = std::make_shared<nyulan::CallGraphProfiler>();
+        VM.attach_call_graph(call_graph);
+    }
+    if (coverage != nullptr) {
+        VM.attach_coverage(coverage);
+    }
+    auto result = VM.exec(objectfile.code, objectfile.find_label("_start").label_address);
+    if (profiler != nullptr || call_graph != nullptr) {
+        try {
+            auto symbols = profile_symbols(objectfile);
+            if (varmap.count("profile")) {
+                write_profile(varmap["profile"].as<std::string>(), [&](std::ostream &out) {
+                    profiler->write_report(out, symbols, varmap["profile-top"].as<std::size_t>());
+                });
+            }
+            if (varmap.count("profile-collapsed")) {
+                write_profile(varmap["profile-collapsed"].as<std::string>(),
+                              [&](std::ostream &out) { profiler->write_collapsed(out, symbols); });
+            }
+            if (call_graph != nullptr) {
+                call_graph->finish();
+            }
+            if (varmap.count("callgraph")) {
+                write_profile(varmap["callgraph"].as<std::string>(), [&](std::ostream &out) {
+                    call_graph->write_callgrind(out, symbols, varmap["objectfile"].as<std::string>());
+                });
+            }
+            if (varmap.count("callgraph-report")) {
+                write_profile(varmap["callgraph-report"].as<std::string>(),
+                              [&](std::ostream &out) { call_graph->write_report(out, symbols); });
+            }
+        } catch (const std::exception &except) {
+            std::cerr << except.what() << std::endl;
+        }
+    }
+    if (coverage != nullptr) {
+        try {
+            write_coverage(*coverage, objectfile, varmap);
+        } catch (const std::exception &except) {
+            std::cerr << except.what() << std::endl;
+        }
+    }
+    if (VM.stats() != nullptr) {
+        auto top = varmap["stats-top"].as<std::size_t>();
+        if (varmap["stats"].as<std::string>() == "json") {
+            VM.stats()->write_json(std::cerr, VM.memory_usage(), top);
+        } else {
+            VM.stats()->write_text(std::cerr, VM.memory_usage(), top);
+        }
+    }
+    if (result.status == nyulan::ExecStatus::EXITED) {
+        return static_cast<int>(result.value.value());
+    }
     return 0;
 }
 #ifndef NDEBUG
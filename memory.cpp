@@ -0,0 +1,653 @@
+#include "memory.hpp"
+
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "logging.hpp"
+namespace nyulan {
+namespace {
+// SIGSEGVハンドラから見えるように、ゲストのメモリとしてmmapしたガードページの領域をここに登録する
+// NOTE: ハンドラの中でロックは取れないので、固定長のアトミックな配列にする
+struct FaultRegion {
+    std::atomic<std::uintptr_t> begin;  // 0なら空き、CLAIMEDなら登録中
+    std::atomic<std::uintptr_t> end;
+    std::atomic<std::uint64_t> guest_address;  // beginに対応するゲストのアドレス
+};
+constexpr std::size_t MAX_FAULT_REGIONS = 4096;
+constexpr std::uintptr_t CLAIMED = 1;
+FaultRegion fault_regions[MAX_FAULT_REGIONS];
+// Memory::watch()で書き込み禁止にしたページ。ガードページの領域と重なるので、こちらを先に調べる
+struct WatchedPage {
+    std::atomic<std::uintptr_t> begin;  // 0なら空き、CLAIMEDなら登録中
+    std::atomic<std::uintptr_t> end;
+    std::atomic<std::uint64_t> guest_address;
+    std::atomic<long> thread;  // WatchFaultを投げるスレッド
+};
+constexpr std::size_t MAX_WATCHED_PAGES = 1024;
+WatchedPage watched_pages[MAX_WATCHED_PAGES];
+struct sigaction previous_segv_action;
+
+// NOTE: 例外はここから、ゲストのメモリに触った命令まで巻き戻る。そのためcoreは-fnon-call-exceptionsでコンパイルする
+void on_segv(int signal_number, siginfo_t* info, void* context) {
+    auto addr = reinterpret_cast<std::uintptr_t>(info->si_addr);
+    for (auto& page : watched_pages) {
+        auto begin = page.begin.load(std::memory_order_acquire);
+        if (begin > CLAIMED && begin <= addr && addr < page.end.load(std::memory_order_relaxed)) {
+            if (page.thread.load(std::memory_order_relaxed) == ::syscall(SYS_gettid)) {
+                throw WatchFault{page.guest_address.load(std::memory_order_relaxed) + (addr - begin)};
+            }
+            // NOTE: 見張っていないスレッドは止められないので、保護を外して書き込ませる
+            ::mprotect(reinterpret_cast<void*>(begin), page.end.load(std::memory_order_relaxed) - begin,
+                       PROT_READ | PROT_WRITE);
+            return;
+        }
+    }
+    for (auto& region : fault_regions) {
+        auto begin = region.begin.load(std::memory_order_acquire);
+        if (begin > CLAIMED && begin <= addr && addr < region.end.load(std::memory_order_relaxed)) {
+            auto guest_address = region.guest_address.load(std::memory_order_relaxed) + (addr - begin);
+            std::string type = ((guest_address & STATIC_ADDRESS_FLAG) == 0) ? "dynamic" : "static";
+            throw std::runtime_error("invalid memory access to " + type +
+                                     " address:" + std::to_string(guest_address & ~STATIC_ADDRESS_FLAG));
+        }
+    }
+    // ゲストのメモリでなければ、元のハンドラに任せる
+    if ((previous_segv_action.sa_flags & SA_SIGINFO) != 0) {
+        previous_segv_action.sa_sigaction(signal_number, info, context);
+    } else if (previous_segv_action.sa_handler != SIG_IGN && previous_segv_action.sa_handler != SIG_DFL) {
+        previous_segv_action.sa_handler(signal_number);
+    } else {
+        ::signal(SIGSEGV, SIG_DFL);  // 戻ると同じ命令がもう一度落ちる
+    }
+}
+void install_segv_handler() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        struct sigaction action{};
+        action.sa_sigaction = on_segv;
+        // NOTE: ハンドラから例外で抜けるとシグナルマスクが戻らないので、SIGSEGVをブロックさせない
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        if (::sigaction(SIGSEGV, &action, &previous_segv_action) == -1) {
+            throw std::runtime_error(std::string("error: failed to install SIGSEGV handler: ") + std::strerror(errno));
+        }
+    });
+}
+std::uint64_t align_down(std::uint64_t value, std::uint64_t alignment) { return value / alignment * alignment; }
+std::uint64_t align_up(std::uint64_t value, std::uint64_t alignment) {
+    return align_down(value + alignment - 1, alignment);
+}
+std::uint64_t huge_page_size() {
+    std::ifstream meminfo("/proc/meminfo");
+    for (std::string line; std::getline(meminfo, line);) {
+        std::uint64_t size_kb;
+        if (std::sscanf(line.c_str(), "Hugepagesize: %" SCNu64 " kB", &size_kb) == 1) {
+            return size_kb * 1024;
+        }
+    }
+    return UINT64_C(2) << 20;
+}
+std::size_t register_fault_region(const void* host, std::uint64_t size, std::uint64_t guest_address) {
+    install_segv_handler();
+    auto begin = reinterpret_cast<std::uintptr_t>(host);
+    for (std::size_t i = 0; i < MAX_FAULT_REGIONS; i++) {
+        std::uintptr_t expected = 0;
+        if (fault_regions[i].begin.compare_exchange_strong(expected, CLAIMED)) {
+            fault_regions[i].guest_address.store(guest_address, std::memory_order_relaxed);
+            fault_regions[i].end.store(begin + size, std::memory_order_relaxed);
+            fault_regions[i].begin.store(begin, std::memory_order_release);
+            return i;
+        }
+    }
+    throw std::runtime_error("error: too many guarded memory regions");
+}
+void unregister_fault_region(std::size_t slot) {
+    fault_regions[slot].end.store(0, std::memory_order_relaxed);
+    fault_regions[slot].begin.store(0, std::memory_order_release);
+}
+std::size_t register_watched_page(std::uintptr_t begin, std::uint64_t size, std::uint64_t guest_address) {
+    install_segv_handler();
+    for (std::size_t i = 0; i < MAX_WATCHED_PAGES; i++) {
+        std::uintptr_t expected = 0;
+        if (watched_pages[i].begin.compare_exchange_strong(expected, CLAIMED)) {
+            watched_pages[i].guest_address.store(guest_address, std::memory_order_relaxed);
+            watched_pages[i].thread.store(::syscall(SYS_gettid), std::memory_order_relaxed);
+            watched_pages[i].end.store(begin + size, std::memory_order_relaxed);
+            watched_pages[i].begin.store(begin, std::memory_order_release);
+            return i;
+        }
+    }
+    throw std::runtime_error("error: too many watched pages");
+}
+void unregister_watched_page(std::size_t slot) {
+    watched_pages[slot].end.store(0, std::memory_order_relaxed);
+    watched_pages[slot].begin.store(0, std::memory_order_release);
+}
+}  // namespace
+Memory::Memory(std::vector<std::uint8_t> static_datas)
+    : static_datas_(std::move(static_datas)), page_size_(static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE))) {}
+Memory::~Memory() {
+    for (auto slot : this->watch_slots_) {
+        unregister_watched_page(slot);
+    }
+    for (auto slot : this->fault_slots_) {
+        unregister_fault_region(slot);
+    }
+    if (this->guard_base_ != nullptr) {
+        ::munmap(this->guard_base_, this->guard_size_);
+    }
+}
+void Memory::enable_guard_pages(std::uint64_t reserve, HugePages huge_pages) {
+    std::unique_lock lock(this->mutex_);
+    if (not this->blocks_.empty() || this->guard_base_ != nullptr) {
+        throw std::runtime_error("error: guard pages must be enabled before the first allocation");
+    }
+    auto flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (huge_pages == HugePages::EXPLICIT) {
+        // NOTE: hugetlbのページはmprotect()も大きいページ単位でしかできないので、保護の単位も大きくなる
+        this->page_size_ = huge_page_size();
+        flags |= MAP_HUGETLB;
+    }
+    reserve = align_up(std::min(reserve, STATIC_ADDRESS_FLAG), this->page_size_);
+    void* base;
+    if (huge_pages == HugePages::TRANSPARENT) {
+        // 大きいページの境界に揃えておかないと、khugepagedがまとめられない
+        auto alignment = huge_page_size();
+        auto mapped = ::mmap(nullptr, reserve + alignment, PROT_NONE, flags, -1, 0);
+        base = mapped;
+        if (mapped != MAP_FAILED) {
+            auto head = align_up(reinterpret_cast<std::uintptr_t>(mapped), alignment) -
+                        reinterpret_cast<std::uintptr_t>(mapped);
+            base = static_cast<std::uint8_t*>(mapped) + head;
+            if (head != 0) {
+                ::munmap(mapped, head);
+            }
+            ::munmap(static_cast<std::uint8_t*>(base) + reserve, alignment - head);
+            ::madvise(base, reserve, MADV_HUGEPAGE);
+        }
+    } else {
+        base = ::mmap(nullptr, reserve, PROT_NONE, flags, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        throw std::runtime_error(std::string("error: failed to reserve guest address space: ") + std::strerror(errno));
+    }
+    try {
+        this->fault_slots_.push_back(register_fault_region(base, reserve, 0));
+    } catch (...) {
+        ::munmap(base, reserve);
+        throw;
+    }
+    this->huge_pages_ = huge_pages;
+    this->guard_base_ = static_cast<std::uint8_t*>(base);
+    this->guard_size_ = reserve;
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << "reserved " << reserve << " bytes of guarded address space";
+}
+void Memory::add_static_segment(std::uint64_t address, std::uint64_t size, std::shared_ptr<std::uint8_t[]> data,
+                                bool read_only) {
+    std::unique_lock lock(this->mutex_);
+    if (address < this->static_datas_.size() || size > (STATIC_ADDRESS_FLAG - 1) - address) {
+        throw std::runtime_error("error: static segment @" + std::to_string(address) + " overlaps static data");
+    }
+    auto next = this->static_segments_.lower_bound(address);
+    auto overlaps_previous = next != this->static_segments_.begin() &&
+                             std::prev(next)->first + std::prev(next)->second.size > address;
+    if ((next != this->static_segments_.end() && next->first < address + size) || overlaps_previous) {
+        throw std::runtime_error("error: static segment @" + std::to_string(address) + " overlaps another segment");
+    }
+    this->static_segments_.emplace(address, StaticBlock{size, std::move(data), read_only});
+}
+void Memory::map_static_segments(const std::string& path, const std::vector<StaticSegment>& segments) {
+    if (segments.empty()) {
+        return;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error("error: failed to open " + path + ": " + std::strerror(errno));
+    }
+    try {
+        for (const auto& segment : segments) {
+            if (segment.size == 0) {
+                continue;
+            }
+            void* mapped;
+            std::uint64_t mapped_size;
+            std::uint64_t head = 0;
+            if (segment.kind == StaticSegment::Kind::RODATA) {
+                // NOTE: mmapのoffsetはページ境界でなければならないので、手前から写して読み飛ばす
+                auto system_page_size = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+                head = segment.file_offset - align_down(segment.file_offset, system_page_size);
+                mapped_size = head + segment.size;
+                mapped = ::mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, fd, segment.file_offset - head);
+            } else {
+                // 無名のページは最初に触ったときに0で埋められるので、触らなければメモリを使わない
+                mapped_size = segment.size;
+                mapped = ::mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            }
+            if (mapped == MAP_FAILED) {
+                throw std::runtime_error("error: failed to map static segment @" + std::to_string(segment.address) +
+                                         ": " + std::strerror(errno));
+            }
+            auto unmap = [mapped_size](std::uint8_t* pointer) { ::munmap(pointer, mapped_size); };
+            std::shared_ptr<std::uint8_t[]> mapping(static_cast<std::uint8_t*>(mapped), unmap);
+            this->add_static_segment(segment.address, segment.size,
+                                     std::shared_ptr<std::uint8_t[]>(mapping, mapping.get() + head),
+                                     segment.kind == StaticSegment::Kind::RODATA);
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+void Memory::prefer_node(int node) {
+    std::unique_lock lock(this->mutex_);
+    constexpr int MAX_NODES = 1024;
+    if (this->guard_base_ == nullptr || node < 0 || node >= MAX_NODES) {
+        return;
+    }
+    constexpr int BITS = 8 * sizeof(unsigned long);
+    unsigned long mask[MAX_NODES / BITS] = {};
+    mask[node / BITS] |= 1UL << (node % BITS);
+    // NOTE: libnumaに依存しないように、直接システムコールを呼ぶ。もう触ったページは動かさない
+    if (::syscall(SYS_mbind, this->guard_base_, this->guard_size_, MPOL_PREFERRED, mask, MAX_NODES, 0) == -1) {
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "mbind failed: " << std::strerror(errno);
+    }
+}
+
+std::uint8_t& Memory::at_checked(Address addr, bool for_write) {
+    std::shared_lock lock(this->mutex_);
+    return this->at_unlocked(addr, for_write);
+}
+std::uint8_t& Memory::at_unlocked(Address addr, bool for_write) {
+    auto offset = addr.value() & ~STATIC_ADDRESS_FLAG;
+    if ((addr.value() & STATIC_ADDRESS_FLAG) != 0) {
+        if (offset < this->static_datas_.size()) {
+            return this->static_datas_[offset];
+        }
+        auto segment = this->static_segments_.upper_bound(offset);
+        if (segment != this->static_segments_.begin()) {
+            segment--;
+            // NOTE: 読み込み専用のものはPROT_READなので、書き込む前にここで投げる(静的アドレスは必ずここを通る)
+            if (offset - segment->first < segment->second.size && not(for_write && segment->second.read_only)) {
+                return segment->second.data[offset - segment->first];
+            }
+        }
+    } else {
+        auto block = this->blocks_.upper_bound(offset);
+        if (block != this->blocks_.begin()) {
+            block--;
+            if (offset - block->first < block->second.size) {
+                return block->second.data[offset - block->first];
+            }
+        }
+    }
+    std::string type = ((addr.value() & STATIC_ADDRESS_FLAG) == 0) ? "dynamic" : "static";
+    throw std::runtime_error("invalid memory access to " + type + " address:" + std::to_string(offset));
+}
+std::uint8_t* Memory::contiguous_unlocked(Address addr, std::size_t len, bool for_write) {
+    if (len == 0) {
+        return nullptr;
+    }
+    // NOTE: ブロックと静的データは連続しているので、両端が同じものに収まっていればまとめて触れる
+    auto first = &this->at_unlocked(addr, for_write);
+    auto last = &this->at_unlocked(addr.value() + len - 1, for_write);
+    if (last - first == static_cast<std::ptrdiff_t>(len - 1)) {
+        return first;
+    }
+    for (std::size_t i = 1; i < len - 1; i++) {
+        this->at_unlocked(addr.value() + i, for_write);  // 範囲外なら投げる
+    }
+    return nullptr;
+}
+// NOTE: 他のゲストスレッドが同時に触っているかもしれないので、memcpy()ではなくload()、store()と同じ操作でコピーする
+void Memory::load_bytes(Address src, std::uint8_t* dst, std::size_t len) {
+    std::shared_lock lock(this->mutex_);
+    if (auto contiguous = this->contiguous_unlocked(src, len)) {
+        for (std::size_t i = 0; i < len; i++) {
+            dst[i] = __atomic_load_n(&contiguous[i], __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < len; i++) {
+        dst[i] = __atomic_load_n(&this->at_unlocked(src.value() + i), __ATOMIC_RELAXED);
+    }
+}
+void Memory::store_bytes(Address dst, const std::uint8_t* src, std::size_t len) {
+    std::shared_lock lock(this->mutex_);
+    if (auto contiguous = this->contiguous_unlocked(dst, len, true)) {
+        for (std::size_t i = 0; i < len; i++) {
+            __atomic_store_n(&contiguous[i], src[i], __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    for (std::size_t i = 0; i < len; i++) {
+        __atomic_store_n(&this->at_unlocked(dst.value() + i, true), src[i], __ATOMIC_RELAXED);
+    }
+}
+void Memory::check_range(Address addr, std::size_t len) {
+    std::shared_lock lock(this->mutex_);
+    this->contiguous_unlocked(addr, len);
+}
+Address Memory::allocate(std::size_t size) {
+    std::unique_lock lock(this->mutex_);
+    if (size == 0) {
+        size = 1;  // NOTE: 0バイトでも他と被らないアドレスを返す
+    }
+    if (size >= STATIC_ADDRESS_FLAG - this->next_address_) {
+        throw std::runtime_error("error: dynamic address space exhausted");
+    }
+    Address result = this->next_address_;
+    if (this->guard_base_ != nullptr) {
+        // NOTE: ブロックごとにページを揃えて間を空けると、大きいページでは1ブロックで2MiBを使うので、詰めて置く
+        //       そのため隣のブロックとページを共有し、その間のはみ出しは検出できない(Memory::enable_guard_pages())
+        if (size > this->guard_size_ - this->next_address_) {
+            throw std::runtime_error("error: dynamic address space exhausted");
+        }
+        auto begin = align_down(this->next_address_, this->page_size_);
+        auto end = align_up(this->next_address_ + size, this->page_size_);
+        if (::mprotect(this->guard_base_ + begin, end - begin, PROT_READ | PROT_WRITE) == -1) {
+            throw std::runtime_error(std::string("error: failed to map guest memory: ") + std::strerror(errno));
+        }
+#ifdef MADV_POPULATE_WRITE
+        // NOTE: 大きいページが足りないと、触ったときにSIGBUSになるので、ここで先に確保して失敗を確かめる
+        if (this->huge_pages_ == HugePages::EXPLICIT &&
+            ::madvise(this->guard_base_ + begin, end - begin, MADV_POPULATE_WRITE) == -1 && errno != EINVAL) {
+            auto error = std::string("error: failed to get huge pages for guest memory: ") + std::strerror(errno);
+            auto fresh = align_up(this->next_address_, this->page_size_);  // 前のブロックと共有していないページ
+            ::mprotect(this->guard_base_ + fresh, end - fresh, PROT_NONE);
+            throw std::runtime_error(error);
+        }
+#endif
+        // NOTE: 新しいページは0で埋まっているが、先頭のページは前のブロックの範囲外の書き込みが残っているかもしれない
+        auto first = this->guard_base_ + this->next_address_;
+        auto first_page_end = align_up(this->next_address_ + 1, this->page_size_);
+        std::memset(first, 0, std::min(size, first_page_end - this->next_address_));
+        // ブロックは領域を指すだけで、所有はしない
+        std::shared_ptr<std::uint8_t[]> data(std::shared_ptr<std::uint8_t[]>(), first);
+        this->blocks_.emplace(this->next_address_, Block{size, std::move(data), true});
+        this->next_address_ += size;
+        this->count_allocation(size);
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "allocated " << size << " guarded bytes @" << result.value();
+        return result;
+    }
+    this->blocks_.emplace(this->next_address_, Block{size, std::make_shared<std::uint8_t[]>(size)});
+    this->next_address_ += size;
+    this->count_allocation(size);
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << "allocated " << size << " bytes @" << result.value();
+    return result;
+}
+void Memory::deallocate(Address addr, bool reclaim) {
+    std::unique_lock lock(this->mutex_);
+    auto block = this->blocks_.find(addr.value());
+    if (block == this->blocks_.end()) {
+        throw std::runtime_error("error: tried to free address " + std::to_string(addr.value()) +
+                                 " which is not allocated");
+    }
+    this->usage_.live_bytes -= block->second.size;
+    this->usage_.live_blocks--;
+    if (this->guard_base_ != nullptr) {
+        // 隣のブロックと共有しているページは残し、このブロックだけのページをPROT_NONEに戻す
+        // NOTE: 他のスレッドがまだ触っていれば、そのスレッドでinvalid memory accessになるので、遅らせる必要はない
+        auto start = block->first;
+        auto finish = block->first + block->second.size;
+        auto begin = align_down(start, this->page_size_);
+        if (block != this->blocks_.begin()) {
+            auto previous = std::prev(block);
+            if (previous->first + previous->second.size > begin) {
+                begin += this->page_size_;
+            }
+        }
+        auto end = align_up(finish, this->page_size_);
+        if (auto next = std::next(block); next != this->blocks_.end() && next->first < end) {
+            end -= this->page_size_;
+        }
+        if (begin < end) {
+            ::mprotect(this->guard_base_ + begin, end - begin, PROT_NONE);
+            ::madvise(this->guard_base_ + begin, end - begin, MADV_DONTNEED);
+        }
+        this->blocks_.erase(block);
+        return;
+    }
+    if (not reclaim) {
+        this->retired_.push_back(std::move(block->second));
+    }
+    this->blocks_.erase(block);
+}
+void Memory::reclaim_retired() {
+    std::unique_lock lock(this->mutex_);
+    this->retired_.clear();
+}
+Memory::Usage Memory::usage() {
+    std::shared_lock lock(this->mutex_);
+    return this->usage_;
+}
+void Memory::count_allocation(std::size_t size) {
+    this->usage_.live_bytes += size;
+    this->usage_.peak_bytes = std::max(this->usage_.peak_bytes, this->usage_.live_bytes);
+    this->usage_.live_blocks++;
+    this->usage_.allocations++;
+}
+
+std::uint64_t* Memory::aligned_word_unlocked(Address addr, bool for_write) {
+    auto contiguous = this->contiguous_unlocked(addr, sizeof(std::uint64_t), for_write);  // 範囲外なら投げる
+    // NOTE: ゲストのメモリはリトルエンディアンなので、ホストも同じときだけ直接触れる
+    if (std::endian::native != std::endian::little || contiguous == nullptr ||
+        reinterpret_cast<std::uintptr_t>(contiguous) % std::atomic_ref<std::uint64_t>::required_alignment != 0) {
+        return nullptr;
+    }
+    return reinterpret_cast<std::uint64_t*>(contiguous);
+}
+// 揃っていないときの代わり。排他ロックを持っていれば、他のアトミック操作は共有ロックを待っている
+std::uint64_t Memory::load_unlocked(Address addr) {
+    std::uint64_t value = 0;
+    for (size_t i = 0; i < sizeof(value); i++) {
+        auto byte = __atomic_load_n(&this->at_unlocked(addr.value() + i), __ATOMIC_RELAXED);
+        value |= static_cast<std::uint64_t>(byte) << (8 * i);
+    }
+    return value;
+}
+void Memory::store_unlocked(Address addr, std::uint64_t value) {
+    // NOTE: 途中で範囲外になって中途半端に書き込まれないよう、先に全部確かめる
+    for (size_t i = 0; i < sizeof(value); i++) {
+        this->at_unlocked(addr.value() + i, true);
+    }
+    for (size_t i = 0; i < sizeof(value); i++) {
+        __atomic_store_n(&this->at_unlocked(addr.value() + i, true),
+                         static_cast<std::uint8_t>((value >> (8 * i)) & 0b1111'1111), __ATOMIC_RELAXED);
+    }
+}
+// NOTE: 共有ロックは、ブロックが触っている間に解放されないためと、揃っていないときの排他ロックとの排他のため
+std::uint64_t Memory::atomic_load(Address addr) {
+    {
+        std::shared_lock lock(this->mutex_);
+        if (auto word = this->aligned_word_unlocked(addr)) {
+            return __atomic_load_n(word, __ATOMIC_SEQ_CST);
+        }
+    }
+    std::unique_lock lock(this->mutex_);
+    return this->load_unlocked(addr);
+}
+void Memory::atomic_store(Address addr, std::uint64_t value) {
+    {
+        std::shared_lock lock(this->mutex_);
+        if (auto word = this->aligned_word_unlocked(addr, true)) {
+            __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+            return;
+        }
+    }
+    std::unique_lock lock(this->mutex_);
+    this->store_unlocked(addr, value);
+}
+std::uint64_t Memory::compare_exchange(Address addr, std::uint64_t expected, std::uint64_t desired) {
+    {
+        std::shared_lock lock(this->mutex_);
+        if (auto word = this->aligned_word_unlocked(addr, true)) {
+            __atomic_compare_exchange_n(word, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            return expected;  // NOTE: 失敗したら元の値が入る
+        }
+    }
+    std::unique_lock lock(this->mutex_);
+    this->contiguous_unlocked(addr, sizeof(std::uint64_t), true);  // NOTE: 比べて失敗するときも、書き込めなければ投げる
+    auto old = this->load_unlocked(addr);
+    if (old == expected) {
+        this->store_unlocked(addr, desired);
+    }
+    return old;
+}
+std::uint64_t Memory::fetch_add(Address addr, std::uint64_t value) {
+    {
+        std::shared_lock lock(this->mutex_);
+        if (auto word = this->aligned_word_unlocked(addr, true)) {
+            return __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+        }
+    }
+    std::unique_lock lock(this->mutex_);
+    auto old = this->load_unlocked(addr);
+    this->store_unlocked(addr, old + value);
+    return old;
+}
+
+bool Memory::watch(Address address, std::uint64_t size) {
+    std::unique_lock lock(this->mutex_);
+    if (size == 0 || size - 1 > ~address.value()) {
+        throw std::runtime_error("error: invalid range to watch");
+    }
+    for (std::uint64_t i = 0; i < size; i++) {
+        this->at_unlocked(address.value() + i);  // 確保されていなければ投げる
+    }
+    auto offset = address.value() & ~STATIC_ADDRESS_FLAG;
+    if ((address.value() & STATIC_ADDRESS_FLAG) != 0 && offset < this->static_datas_.size()) {
+        this->map_static_datas_unlocked();
+    }
+    this->watches_.emplace_back(address.value(), size);
+    auto covered = this->protect_watches_unlocked();
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << "watching " << size << " bytes @" << address.value()
+                                     << (covered ? "" : " (partly unprotectable)");
+    return covered;
+}
+void Memory::unwatch(Address address, std::uint64_t size) {
+    std::unique_lock lock(this->mutex_);
+    auto found = std::find(this->watches_.begin(), this->watches_.end(), std::pair{address.value(), size});
+    if (found == this->watches_.end()) {
+        throw std::runtime_error("error: " + std::to_string(address.value()) + " is not watched");
+    }
+    this->watches_.erase(found);
+    this->protect_watches_unlocked();
+}
+void Memory::disarm_watches() {
+    std::unique_lock lock(this->mutex_);
+    this->watches_armed_ = false;
+    this->protect_watches_unlocked();
+}
+void Memory::arm_watches() {
+    std::unique_lock lock(this->mutex_);
+    this->watches_armed_ = true;
+    this->protect_watches_unlocked();
+}
+bool Memory::protect_watches_unlocked() {
+    // NOTE: 保護している間に解放されたページは無い(組み込み関数は外してから呼ばれる)ので、全て読み書きできるように戻す
+    for (auto slot : this->watch_slots_) {
+        auto begin = watched_pages[slot].begin.load(std::memory_order_relaxed);
+        ::mprotect(reinterpret_cast<void*>(begin), watched_pages[slot].end.load(std::memory_order_relaxed) - begin,
+                   PROT_READ | PROT_WRITE);
+        unregister_watched_page(slot);
+    }
+    this->watch_slots_.clear();
+    this->watching_.store(false, std::memory_order_relaxed);
+    bool covered = true;
+    std::map<std::uintptr_t, std::pair<std::uint64_t, std::uint64_t>> pages;  // 先頭 => (大きさ, ゲストのアドレス)
+    for (const auto& [start, size] : this->watches_) {
+        for (auto address = start; address - start < size;) {
+            auto range = this->host_range_unlocked(address);
+            if (not range) {  // 解放された
+                covered = false;
+                address++;
+                continue;
+            }
+            auto length = std::min(range->size, size - (address - start));
+            if (range->page_size == 0) {
+                covered = false;
+            } else {
+                auto data = reinterpret_cast<std::uintptr_t>(range->data);
+                for (auto page = align_down(data, range->page_size); page < data + length; page += range->page_size) {
+                    pages.emplace(page, std::pair{range->page_size, address - (data - page)});
+                }
+            }
+            address += length;
+        }
+    }
+    if (not this->watches_armed_) {
+        return covered;
+    }
+    for (const auto& [page, info] : pages) {
+        const auto& [page_size, guest_address] = info;
+        this->watch_slots_.push_back(register_watched_page(page, page_size, guest_address));
+        if (::mprotect(reinterpret_cast<void*>(page), page_size, PROT_READ) == -1) {
+            throw std::runtime_error(std::string("error: failed to protect watched page: ") + std::strerror(errno));
+        }
+    }
+    this->watcher_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    this->watching_.store(not this->watch_slots_.empty(), std::memory_order_relaxed);
+    return covered;
+}
+std::optional<Memory::HostRange> Memory::host_range_unlocked(Address addr) {
+    auto offset = addr.value() & ~STATIC_ADDRESS_FLAG;
+    if ((addr.value() & STATIC_ADDRESS_FLAG) != 0) {
+        if (offset < this->static_datas_.size()) {
+            return HostRange{&this->static_datas_[offset], this->static_datas_.size() - offset, 0};
+        }
+        auto segment = this->static_segments_.upper_bound(offset);
+        if (segment != this->static_segments_.begin()) {
+            segment--;
+            if (offset - segment->first < segment->second.size) {
+                auto page_size = segment->second.read_only ? 0 : static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+                return HostRange{segment->second.data.get() + (offset - segment->first),
+                                 segment->second.size - (offset - segment->first), page_size};
+            }
+        }
+    } else {
+        auto block = this->blocks_.upper_bound(offset);
+        if (block != this->blocks_.begin()) {
+            block--;
+            if (offset - block->first < block->second.size) {
+                // NOTE: ガードページを使わないときのpage_size_はシステムのページの大きさ
+                return HostRange{block->second.data.get() + (offset - block->first),
+                                 block->second.size - (offset - block->first),
+                                 block->second.mapped ? this->page_size_ : 0};
+            }
+        }
+    }
+    return std::nullopt;
+}
+void Memory::map_static_datas_unlocked() {
+    // 静的データはホストの他のデータとページを共有しているので、見張るときだけ静的セグメントとしてmmapした領域に移す
+    // NOTE: 他のスレッドが実行中なら、移す前の領域に書き込むかもしれない
+    auto size = this->static_datas_.size();
+    auto mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error(std::string("error: failed to map static data: ") + std::strerror(errno));
+    }
+    std::memcpy(mapped, this->static_datas_.data(), size);
+    auto unmap = [size](std::uint8_t* pointer) { ::munmap(pointer, size); };
+    std::shared_ptr<std::uint8_t[]> data(static_cast<std::uint8_t*>(mapped), unmap);
+    this->static_segments_.emplace(0, StaticBlock{size, std::move(data), false});
+    this->static_datas_.clear();
+    this->static_datas_.shrink_to_fit();
+}
+}  // namespace nyulan
@@ -0,0 +1,158 @@
+#ifndef NYULAN_MEMORY
+#define NYULAN_MEMORY
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "nyulan.hpp"
+namespace nyulan {
+constexpr std::uint64_t STATIC_ADDRESS_FLAG = UINT64_C(1) << 63;  // 最上位ビットが立ったアドレスは静的データ
+
+// 見張っているページへの書き込みで、SIGSEGVハンドラから投げられる。書き込む前に投げるので、命令は何もしていない
+struct WatchFault {
+    std::uint64_t address;  // ゲストのアドレス
+};
+
+// ゲストのスレッド間で共有されるメモリ
+// 構造の変更(確保、解放)は排他ロックの下で行い、中身はアトミック操作でしか触らないので、ゲストがデータ競合を起こしても
+// VMは壊れない
+class Memory {
+   public:
+    static constexpr std::uint64_t DEFAULT_GUARD_RESERVE = UINT64_C(64) << 30;
+    struct Usage {  // 動的メモリ
+        std::uint64_t live_bytes = 0;
+        std::uint64_t peak_bytes = 0;
+        std::uint64_t live_blocks = 0;
+        std::uint64_t allocations = 0;  // これまでのallocate()の回数
+    };
+    enum class HugePages {
+        NONE,
+        TRANSPARENT,  // madvise(MADV_HUGEPAGE)
+        EXPLICIT,     // MAP_HUGETLB 事前に/proc/sys/vm/nr_hugepagesで確保しておくこと
+    };
+
+    explicit Memory(std::vector<std::uint8_t> static_datas);
+    ~Memory();
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+
+    // 動的アドレス空間をreserveバイトの仮想領域に直接置く。確保していないページはPROT_NONEにしておき、
+    // そこへのアクセスはSIGSEGVハンドラで"invalid memory access"の例外にする。最初のallocate()より前に呼ぶこと
+    // NOTE: ブロックは詰めて置き、保護はページ単位なので、検出されるのは生きているブロックのないページへのアクセスだけ
+    //       隣のブロックへのはみ出しや、生きているブロックとページを共有する解放済みブロックへのアクセスは検出されない
+    void enable_guard_pages(std::uint64_t reserve = DEFAULT_GUARD_RESERVE, HugePages huge_pages = HugePages::NONE);
+    // まだ触っていないページを、できればNUMAノードnodeに置く
+    // ガードページを使わないときは何もしない(ブロックは確保したスレッドが0で埋めるので、そのスレッドのノードに置かれる)
+    void prefer_node(int node);
+    // 静的アドレスaddressからsizeバイトをdataに置く。静的データや他のセグメントと重なっていれば投げる
+    // read_onlyなら、dataはPROT_READでmmapされていること。書き込みはinvalid memory accessになる
+    void add_static_segment(std::uint64_t address, std::uint64_t size, std::shared_ptr<std::uint8_t[]> data,
+                            bool read_only);
+    // オブジェクトファイルpathの静的セグメントを置く
+    void map_static_segments(const std::string& path, const std::vector<StaticSegment>& segments);
+    // for_writeなら、読み込み専用の静的セグメントも範囲外と同じく投げる
+    std::uint8_t& at(Address addr, bool for_write = false) {
+        if (addr.value() < this->guard_size_) {
+            return this->guard_base_[addr.value()];  // 確保されていなければ、ここでSIGSEGVになる
+        }
+        return this->at_checked(addr, for_write);
+    }
+    // 通常のLOAD、STORE。バイト単位のrelaxedなアトミック操作なので、他のスレッドとの順序は保証しない
+    // NOTE: std::atomic_refの操作はnoexceptなので、ガードページやウォッチポイントのSIGSEGVハンドラから投げた例外が
+    //       通り抜けられずにstd::terminate()になる。ゲストのメモリには、命令から巻き戻せる__atomic組み込み関数で触る
+    std::uint8_t load(Address addr) { return __atomic_load_n(&this->at(addr), __ATOMIC_RELAXED); }
+    void store(Address addr, std::uint8_t value) { __atomic_store_n(&this->at(addr, true), value, __ATOMIC_RELAXED); }
+    // 範囲をまとめてコピーする。範囲外を含むなら、何もコピーせずに投げる
+    void load_bytes(Address src, std::uint8_t* dst, std::size_t len);
+    void store_bytes(Address dst, const std::uint8_t* src, std::size_t len);
+    void check_range(Address addr, std::size_t len);  // 範囲外を含むなら投げる
+    Address allocate(std::size_t size);
+    // reclaim == falseなら、他のスレッドがまだ触っているかもしれないので、実際の解放はreclaim_retired()まで遅らせる
+    void deallocate(Address addr, bool reclaim);
+    void reclaim_retired();
+    Usage usage();
+
+    // 64bitのアトミック操作。これらどうしは逐次一貫だが、load()、store()との順序は保証しない
+    // NOTE: ホストのアドレスが8バイト境界に揃っていなければ、排他ロックの下で1バイトずつ行う
+    std::uint64_t atomic_load(Address addr);
+    void atomic_store(Address addr, std::uint64_t value);
+    std::uint64_t compare_exchange(Address addr, std::uint64_t expected, std::uint64_t desired);
+    std::uint64_t fetch_add(Address addr, std::uint64_t value);
+
+    // addressからsizeバイトを含むページを書き込み禁止にし、書き込むとWatchFaultが投げられるようにする
+    // ページを保護できない部分(ブロックごとに確保した動的メモリ、読み込み専用のもの)があればfalse
+    // NOTE: 保護はページ単位なので、同じページの見張っていないところへの書き込みでも投げられる
+    //       WatchFaultになるのはarm_watches()したスレッドだけで、他のスレッドが書き込むとそのページの保護を外す
+    bool watch(Address address, std::uint64_t size);
+    void unwatch(Address address, std::uint64_t size);  // watch()と同じ範囲を渡す
+    // 保護を外す、付け直す。見張っているページに書き込む命令は、外してから実行すること
+    // 付け直すときに、その間に確保、解放されたメモリに合わせて保護するページを選び直す
+    void disarm_watches();
+    void arm_watches();
+    // arm_watches()したスレッドから呼ばれて、保護しているページがある
+    bool watching() const {
+        return this->watching_.load(std::memory_order_relaxed) &&
+               this->watcher_.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+   private:
+    struct Block {
+        std::size_t size;
+        std::shared_ptr<std::uint8_t[]> data;  // スナップショットから復元したものは、mmapした領域を指す
+        bool mapped = false;  // ページ単位でmmapした領域にあり、ページをゲストのメモリ以外と共有しない
+    };
+    static constexpr std::uint64_t HEAP_BEGIN = 0x1000;  // 0をヌルとして使えるように
+
+    struct StaticBlock {
+        std::size_t size;
+        std::shared_ptr<std::uint8_t[]> data;  // mmapした領域を指す
+        bool read_only;
+    };
+    std::vector<std::uint8_t> static_datas_;
+    std::map<std::uint64_t, StaticBlock> static_segments_;  // 最上位ビットを除いた先頭アドレス => セグメント
+    std::map<std::uint64_t, Block> blocks_;  // 先頭アドレス => ブロック
+    std::vector<Block> retired_;
+    std::uint64_t next_address_ = HEAP_BEGIN;
+    Usage usage_;
+    std::shared_mutex mutex_;
+    std::uint8_t* guard_base_ = nullptr;
+    std::uint64_t guard_size_ = 0;  // 0なら、ブロックごとに確保する
+    std::uint64_t page_size_;       // 保護の単位
+    HugePages huge_pages_ = HugePages::NONE;
+    std::vector<std::size_t> fault_slots_;  // SIGSEGVハンドラに登録した領域
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> watches_;  // (アドレス, バイト数)
+    bool watches_armed_ = true;
+    std::vector<std::size_t> watch_slots_;  // 保護しているページとして、SIGSEGVハンドラに登録したもの
+    std::atomic<bool> watching_ = false;
+    std::atomic<std::thread::id> watcher_;
+
+    std::uint8_t& at_checked(Address addr, bool for_write = false);
+    std::uint8_t& at_unlocked(Address addr, bool for_write = false);
+    void count_allocation(std::size_t size);
+    // 連続していなければnullptr
+    std::uint8_t* contiguous_unlocked(Address addr, std::size_t len, bool for_write = false);
+    // 8バイトが連続して境界に揃っていなければnullptr
+    std::uint64_t* aligned_word_unlocked(Address addr, bool for_write = false);
+    std::uint64_t load_unlocked(Address addr);
+    void store_unlocked(Address addr, std::uint64_t value);
+    struct HostRange {
+        std::uint8_t* data;
+        std::uint64_t size;       // dataから、同じ領域に連続して置かれているバイト数
+        std::uint64_t page_size;  // 保護できなければ0
+    };
+    std::optional<HostRange> host_range_unlocked(Address addr);  // 確保されていなければnullopt
+    void map_static_datas_unlocked();
+    bool protect_watches_unlocked();  // 保護を付け直す。全て保護できればtrue
+
+    friend class Snapshot;
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,237 @@
+#include "metrics.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+namespace nyulan {
+namespace {
+constexpr char MAGIC[8] = {'N', 'Y', 'U', 'S', 'T', 'A', 'T', '\0'};
+constexpr std::size_t NUM_VALUES = 10;  // Valuesの数値。stateから順に
+bool is_final(MetricsFile::State state) {
+    return state == MetricsFile::State::FINISHED || state == MetricsFile::State::FAILED;
+}
+std::runtime_error system_error(const std::string &what, const std::string &path) {
+    return std::runtime_error("error: failed to " + what + " " + path + ": " + std::strerror(errno));
+}
+}  // namespace
+struct alignas(64) MetricsFile::Header {
+    char magic[8];
+    std::uint64_t version;
+    std::uint64_t num_slots;
+    std::uint64_t pid;
+    std::uint64_t started_ns;
+    std::atomic<std::uint64_t> jobs_started;
+    std::atomic<std::uint64_t> jobs_finished;
+    std::atomic<std::uint64_t> jobs_failed;
+};
+struct alignas(64) MetricsFile::Slot {
+    std::atomic<std::uint64_t> sequence;  // 奇数なら書いている途中
+    std::atomic<std::uint64_t> values[NUM_VALUES];
+    std::atomic<std::uint64_t> name[NAME_SIZE / 8];
+};
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "counters are shared between processes");
+
+std::shared_ptr<MetricsFile> MetricsFile::create(const std::string &path, std::size_t num_slots,
+                                                 std::chrono::milliseconds interval) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw system_error("create", path);
+    }
+    auto size = sizeof(Header) + num_slots * sizeof(Slot);
+    void *mapping = MAP_FAILED;
+    if (::ftruncate(fd, size) == 0) {
+        mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        auto error = system_error("map", path);
+        ::close(fd);
+        throw error;
+    }
+    std::shared_ptr<MetricsFile> result(new MetricsFile(fd, size, mapping));
+    for (std::size_t i = 0; i < num_slots; i++) {
+        new (&result->slots_[i]) Slot{};
+    }
+    auto header = new (mapping) Header{};
+    header->version = FORMAT_VERSION;
+    header->num_slots = num_slots;
+    header->pid = ::getpid();
+    header->started_ns = now_ns();
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, MAGIC, sizeof(MAGIC));  // NOTE: 最後に書くので、読む側は書きかけのヘッダを使わない
+
+    result->interval_ = std::max(interval, std::chrono::milliseconds(1));
+    result->timer_ = std::thread([raw = result.get()] {
+        std::unique_lock lock(raw->timer_mutex_);
+        auto next = std::chrono::steady_clock::now() + raw->interval_;
+        while (not raw->timer_cv_.wait_until(lock, next, [raw] { return raw->stopping_; })) {
+            raw->tick_.fetch_add(1, std::memory_order_relaxed);
+            next += raw->interval_;
+        }
+    });
+    return result;
+}
+std::shared_ptr<MetricsFile> MetricsFile::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw system_error("open", path);
+    }
+    struct stat status;
+    if (::fstat(fd, &status) == -1 || static_cast<std::size_t>(status.st_size) < sizeof(Header)) {
+        ::close(fd);
+        throw std::runtime_error("error: " + path + " is not a metrics file");
+    }
+    auto size = static_cast<std::size_t>(status.st_size);
+    auto mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        auto error = system_error("map", path);
+        ::close(fd);
+        throw error;
+    }
+    std::shared_ptr<MetricsFile> result(new MetricsFile(fd, size, mapping));
+    const auto &header = *result->header_;
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != FORMAT_VERSION ||
+        sizeof(Header) + header.num_slots * sizeof(Slot) > size) {
+        throw std::runtime_error("error: " + path + " is not a metrics file of version " +
+                                 std::to_string(FORMAT_VERSION));
+    }
+    return result;
+}
+MetricsFile::MetricsFile(int fd, std::size_t size, void *mapping)
+    : fd_(fd),
+      size_(size),
+      header_(static_cast<Header *>(mapping)),
+      slots_(reinterpret_cast<Slot *>(static_cast<std::uint8_t *>(mapping) + sizeof(Header))) {}
+MetricsFile::~MetricsFile() {
+    if (this->timer_.joinable()) {
+        {
+            std::lock_guard lock(this->timer_mutex_);
+            this->stopping_ = true;
+        }
+        this->timer_cv_.notify_all();
+        this->timer_.join();
+    }
+    ::munmap(this->header_, this->size_);
+    ::close(this->fd_);
+}
+std::uint64_t MetricsFile::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+MetricsFile::Slot &MetricsFile::slot_at(std::size_t slot) const {
+    if (slot >= this->header_->num_slots) {
+        throw std::out_of_range("error: metrics slot " + std::to_string(slot) + " is out of range");
+    }
+    return this->slots_[slot];
+}
+
+std::optional<std::size_t> MetricsFile::acquire(const std::string &name) {
+    std::lock_guard lock(this->acquire_mutex_);
+    std::optional<std::size_t> found;
+    std::uint64_t oldest = UINT64_MAX;
+    for (std::size_t i = 0; i < this->header_->num_slots; i++) {
+        auto values = this->read(i);
+        if (values.state == State::FREE) {
+            found = i;
+            break;
+        }
+        if (is_final(values.state) && values.updated_ns < oldest) {
+            found = i;
+            oldest = values.updated_ns;
+        }
+    }
+    if (found) {
+        Values values;
+        values.state = State::READY;
+        values.started_ns = values.updated_ns = now_ns();
+        values.name = name;
+        this->publish(found.value(), values);
+        this->header_->jobs_started.fetch_add(1, std::memory_order_relaxed);
+    }
+    return found;
+}
+void MetricsFile::publish(std::size_t slot, const Values &values) {
+    auto &target = this->slot_at(slot);
+    auto previous = static_cast<State>(target.values[0].load(std::memory_order_relaxed));
+    auto sequence = target.sequence.load(std::memory_order_relaxed);
+    target.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    const std::uint64_t numbers[NUM_VALUES] = {static_cast<std::uint64_t>(values.state),
+                                               values.steps,
+                                               values.builtin_calls,
+                                               values.bytes_read,
+                                               values.bytes_written,
+                                               values.heap_live,
+                                               values.heap_peak,
+                                               values.exit_code,
+                                               values.started_ns,
+                                               values.updated_ns};
+    for (std::size_t i = 0; i < NUM_VALUES; i++) {
+        target.values[i].store(numbers[i], std::memory_order_relaxed);
+    }
+    char name[NAME_SIZE] = {};
+    std::memcpy(name, values.name.data(), std::min(values.name.size(), NAME_SIZE - 1));
+    for (std::size_t i = 0; i < NAME_SIZE / 8; i++) {
+        std::uint64_t word;
+        std::memcpy(&word, name + i * 8, 8);
+        target.name[i].store(word, std::memory_order_relaxed);
+    }
+    target.sequence.store(sequence + 2, std::memory_order_release);
+
+    if (is_final(values.state) && not is_final(previous)) {
+        auto &counter = values.state == State::FAILED ? this->header_->jobs_failed : this->header_->jobs_finished;
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+MetricsFile::Summary MetricsFile::summary() const {
+    const auto &header = *this->header_;
+    return Summary{header.pid,
+                   header.started_ns,
+                   header.num_slots,
+                   header.jobs_started.load(std::memory_order_relaxed),
+                   header.jobs_finished.load(std::memory_order_relaxed),
+                   header.jobs_failed.load(std::memory_order_relaxed)};
+}
+MetricsFile::Values MetricsFile::read(std::size_t slot) const {
+    const auto &source = this->slot_at(slot);
+    std::uint64_t numbers[NUM_VALUES];
+    char name[NAME_SIZE];
+    while (true) {
+        auto before = source.sequence.load(std::memory_order_acquire);
+        if (before % 2 != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        for (std::size_t i = 0; i < NUM_VALUES; i++) {
+            numbers[i] = source.values[i].load(std::memory_order_relaxed);
+        }
+        for (std::size_t i = 0; i < NAME_SIZE / 8; i++) {
+            auto word = source.name[i].load(std::memory_order_relaxed);
+            std::memcpy(name + i * 8, &word, 8);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (source.sequence.load(std::memory_order_relaxed) == before) {
+            break;
+        }
+    }
+    name[NAME_SIZE - 1] = '\0';
+    return Values{static_cast<State>(numbers[0]),
+                  numbers[1],
+                  numbers[2],
+                  numbers[3],
+                  numbers[4],
+                  numbers[5],
+                  numbers[6],
+                  numbers[7],
+                  numbers[8],
+                  numbers[9],
+                  std::string(name)};
+}
+}  // namespace nyulan
@@ -0,0 +1,97 @@
+#ifndef NYULAN_METRICS
+#define NYULAN_METRICS
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace nyulan {
+// 動いているVMのカウンタを他のプロセスから読めるように置く、mmapしたファイル(nyustatで見る)
+// ヘッダの後ろにVM(ジョブ)ごとのスロットが並ぶ。スロットはseqlockで守られ、書くのは一つのスレッドだけなので、
+// 書く側も読む側もロックを取らない
+class MetricsFile {
+   public:
+    static constexpr std::uint64_t FORMAT_VERSION = 1;
+    static constexpr std::size_t NAME_SIZE = 48;
+    enum class State : std::uint64_t {
+        FREE,
+        READY,  // Schedulerで順番を待っている
+        RUNNING,
+        BLOCKED,  // I/Oを待っている
+        FINISHED,
+        FAILED,
+    };
+    struct Values {
+        State state = State::FREE;
+        std::uint64_t steps = 0;
+        std::uint64_t builtin_calls = 0;
+        std::uint64_t bytes_read = 0;
+        std::uint64_t bytes_written = 0;
+        std::uint64_t heap_live = 0;
+        std::uint64_t heap_peak = 0;
+        std::uint64_t exit_code = 0;
+        std::uint64_t started_ns = 0;  // steady_clock(CLOCK_MONOTONIC)なので、同じマシンの他のプロセスと比べられる
+        std::uint64_t updated_ns = 0;
+        std::string name;
+    };
+    struct Summary {
+        std::uint64_t pid;
+        std::uint64_t started_ns;
+        std::uint64_t num_slots;
+        std::uint64_t jobs_started;
+        std::uint64_t jobs_finished;
+        std::uint64_t jobs_failed;
+    };
+
+    // 書く側。intervalごとにdue()がtrueになる
+    static std::shared_ptr<MetricsFile> create(const std::string &path, std::size_t num_slots,
+                                               std::chrono::milliseconds interval);
+    // 読む側
+    static std::shared_ptr<MetricsFile> open(const std::string &path);
+    ~MetricsFile();
+    MetricsFile(const MetricsFile &) = delete;
+    MetricsFile &operator=(const MetricsFile &) = delete;
+
+    // FREEか、一番古いFINISHED、FAILEDのスロットを取る。空きが無ければnullopt
+    std::optional<std::size_t> acquire(const std::string &name);
+    void publish(std::size_t slot, const Values &values);
+    bool due(std::uint64_t &last_tick) const {
+        auto tick = this->tick_.load(std::memory_order_relaxed);
+        if (tick == last_tick) {
+            return false;
+        }
+        last_tick = tick;
+        return true;
+    }
+    std::uint64_t tick() const { return this->tick_.load(std::memory_order_relaxed); }
+
+    Summary summary() const;
+    Values read(std::size_t slot) const;  // 書きかけなら読み直す
+    static std::uint64_t now_ns();
+
+   private:
+    struct Header;
+    struct Slot;
+    int fd_;
+    std::size_t size_;
+    Header *header_;
+    Slot *slots_;
+    std::mutex acquire_mutex_;
+
+    std::chrono::milliseconds interval_{0};
+    std::atomic<std::uint64_t> tick_ = 0;
+    std::thread timer_;
+    std::mutex timer_mutex_;
+    std::condition_variable timer_cv_;
+    bool stopping_ = false;
+
+    MetricsFile(int fd, std::size_t size, void *mapping);
+    Slot &slot_at(std::size_t slot) const;
+};
+}  // namespace nyulan
+#endif
@@ -1,18 +1,30 @@
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <boost/program_options.hpp>
 #include <boost/stacktrace.hpp>
 #include <cassert>
+#include <cctype>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <limits>
 #include <magic_enum.hpp>
+#include <optional>
+#include <set>
 #include <sstream>
 #include <thread>
 #include <tuple>
+#include <vector>
 
+#include "checkpoint.hpp"
 #include "container_printer.hpp"
+#include "linetable.hpp"
 #include "logging.hpp"
 #include "objectfile.hpp"
+#include "sourcefile.hpp"
+#include "trace.hpp"
 #include "vm.hpp"
 namespace bpo = boost::program_options;
 namespace stdfsys = std::filesystem;
@@ -22,83 +34,138 @@ enum class OutputType {
     ADDR2SRC,
 };
 namespace ndb {
-std::string getline_at(std::istream *, std::uint64_t line);
-namespace debugSection {
-using Section = std::shared_ptr<nyulan::ObjectFile::OptionalSection>;
-struct FilenumAndLine {
-    std::uint64_t filenum;
-    std::uint64_t line;
-
-    FilenumAndLine(std::uint64_t filenum, std::uint64_t line) : filenum(filenum), line(line) {}
-};
-FilenumAndLine addr2line(Section section, nyulan::Address step_address);
-std::vector<std::string> filenames(Section section);
-std::uint64_t bytes_to_value(Section section, std::vector<std::uint8_t> data, size_t bitwidth);
-}  // namespace debugSection
-
 namespace callbacks {
 namespace addr2line {
 class OnLoopHead {
-    nyulan::ObjectFile &objectfile_;
-    debugSection::Section section_addr2line_;
-    debugSection::Section section_srcfiles_;
+    std::shared_ptr<const nyulan::LineTable> line_table_;
+    std::vector<std::string> filenames_;  // 出力する形(ディレクトリを除いて引用符で囲んだもの)にしておく
+    std::size_t hint_ = 0;
 
    public:
-    OnLoopHead(nyulan::ObjectFile &objectfile) : objectfile_(objectfile) {
-        section_addr2line_ = (objectfile_.find_section("debug.addr2line"));
-        section_srcfiles_ = (objectfile_.find_section("debug.sourcefiles"));
+    OnLoopHead(std::shared_ptr<const nyulan::LineTable> line_table) : line_table_(std::move(line_table)) {
+        for (const auto &filename : line_table_->files()) {
+            std::ostringstream quoted;
+            quoted << stdfsys::path(filename).filename();
+            filenames_.push_back(quoted.str());
+        }
     }
     void operator()(nyulan::Address addr, nyulan::OneStep) {
-        auto filenum = ndb::debugSection::addr2line(section_addr2line_, addr).filenum;
-        auto line = ndb::debugSection::addr2line(section_addr2line_, addr).line;
-        auto filenames = ndb::debugSection::filenames(section_srcfiles_);
-        stdfsys::path filepath(filenames[filenum]);
-        std::cout << "@" << filepath.filename() << " line: " << line << std::endl;
+        auto location = line_table_->find(addr.value(), hint_);
+        if (location == nullptr || location->file >= filenames_.size()) {
+            std::cout << "@" << addr.value() << " line: unknown\n";
+            return;
+        }
+        std::cout << "@" << filenames_[location->file] << " line: " << location->line << '\n';
     }
 };
 }  // namespace addr2line
 namespace addr2src {
 class OnLoopHead {
-    nyulan::ObjectFile &objectfile_;
-    debugSection::Section section_addr2line_;
-    debugSection::Section section_srcfiles_;
-    std::vector<std::shared_ptr<std::ifstream>> sourcefiles_;
+    std::shared_ptr<const nyulan::LineTable> line_table_;
+    std::vector<std::shared_ptr<const nyulan::SourceFile>> sourcefiles_;
+    std::size_t hint_ = 0;
 
    public:
-    OnLoopHead(nyulan::ObjectFile &objectfile) : objectfile_(objectfile) {
-        section_addr2line_ = (objectfile_.find_section("debug.addr2line"));
-        section_srcfiles_ = (objectfile_.find_section("debug.sourcefiles"));
-        for (const auto &filename : ndb::debugSection::filenames(section_srcfiles_)) {
+    OnLoopHead(std::shared_ptr<const nyulan::LineTable> line_table) : line_table_(std::move(line_table)) {
+        for (const auto &filename : line_table_->files()) {
             TRIVIAL_LOG_WITH_FUNCNAME(debug) << filename;
-            sourcefiles_.emplace_back(new std::ifstream(filename));
+            sourcefiles_.push_back(std::make_shared<const nyulan::SourceFile>(filename));
             TRIVIAL_LOG_WITH_FUNCNAME(debug) << std::boolalpha << sourcefiles_.back()->is_open();
+            if (not sourcefiles_.back()->is_open()) {
+                std::cerr << "warn: failed to open sourcefile " << filename
+                          << ", causing alternate output to be enabled." << std::endl;
+            }
         }
     }
     void operator()(nyulan::Address addr, nyulan::OneStep) {
-        auto filenum_and_line = ndb::debugSection::addr2line(section_addr2line_, addr);
-        auto filenum = filenum_and_line.filenum;
-        auto line = filenum_and_line.line;
-        auto sourcefile = sourcefiles_.at(filenum).get();
-        if (not sourcefile->is_open()) {
-            std::cout << "filenum:" << filenum << "line:" << line << std::endl;
-            std::cerr << "warn: failed to open sourcefile, causing alternate output to be enabled." << std::endl;
+        auto location = line_table_->find(addr.value(), hint_);
+        if (location == nullptr || location->line == 0) {
+            std::cout << "unknown\n";
+            return;
+        }
+        auto filenum = location->file;
+        auto line = location->line;
+        const auto &sourcefile = *sourcefiles_.at(filenum);
+        if (not sourcefile.is_open()) {
+            std::cout << "filenum:" << filenum << "line:" << line << '\n';
         } else {
-            std::cout << ndb::getline_at(sourcefile, line) << std::endl;
+            std::cout << sourcefile.line(line).value_or("") << '\n';
         }
     }
 };
 }  // namespace addr2src
 }  // namespace callbacks
 
+// 対話的に実行する。実行しながらチェックポイントを取り、reverse-step、reverse-continueでは手前のものから実行し直す
+// ウォッチポイントはVMにページを保護させて捕まえ、書き込んだ命令だけを保護を外して実行して、中身を比べる
+// NOTE: 実行し直す間、ゲストの標準出力、標準エラー出力は捨てる。組み込み関数はもう一度呼ばれるので、
+//       標準入力から読んだところを跨いで戻ると、同じ実行にはならない
+class Session {
+   public:
+    Session(nyulan::ObjectFile &objectfile, std::shared_ptr<const nyulan::LineTable> line_table,
+            nyulan::CallBacks callbacks, nyulan::Checkpoints::Limits limits);
+    void run(std::istream &commands);
+
+   private:
+    struct Termination {
+        nyulan::ExecStatus status;
+        std::uint64_t exit_code;
+        std::string error;  // 例外で止まったときだけ
+    };
+    nyulan::CallBacks callbacks_;
+    std::shared_ptr<const nyulan::LineTable> line_table_;
+    std::unique_ptr<nyulan::VirtualMachine> vm_;
+    nyulan::Checkpoints checkpoints_;
+    std::uint64_t position_ = 0;  // 実行したステップ数
+    std::chrono::nanoseconds ran_{0};  // 前回のチェックポイントから実行にかかった時間
+    std::optional<Termination> terminated_ = std::nullopt;
+    std::vector<nyulan::ObjectFile::Label> labels_;
+    std::set<std::uint64_t> breakpoints_;  // VMのコードにBREAKを書き込んであるアドレス
+    struct Watchpoint {
+        std::uint64_t address;
+        std::uint64_t size;
+        std::optional<std::vector<std::uint8_t>> value;  // 最後に確かめたときの中身。確保されていなければnullopt
+        bool by_page;  // VMがページの保護で捕まえる。falseなら1ステップごとに比べる
+    };
+    std::vector<Watchpoint> watchpoints_;
+    bool check_every_step_ = false;  // by_pageでないウォッチポイントがある
+
+    // position_がlimitになるか、プログラムが終わるか、(stop_at_breakpointsなら)ブレークポイントに着くか
+    // ウォッチポイントの中身が変わるまで実行する
+    void forward(std::uint64_t limit, bool stop_at_breakpoints);
+    // 手前のチェックポイントから実行し直して、targetステップ目の状態にする
+    void travel(std::uint64_t target);
+    // 今より前で最後にブレークポイントに止まったところに戻る。無ければ最初に戻る
+    void reverse_continue();
+    void locate_termination();
+    // "@アドレス"、"ファイル:行"、ラベル名のどれか
+    std::vector<std::uint64_t> resolve(const std::string &where) const;
+    void install_breakpoints(nyulan::VirtualMachine &vm) const;
+    void install_watchpoints();
+    // 中身が変わったウォッチポイントを表示する。writerはその直前に実行した命令。変わったものがあればtrue
+    bool check_watchpoints(std::uint64_t writer);
+    std::optional<std::vector<std::uint8_t>> read_memory(std::uint64_t address, std::uint64_t size) const;
+    void report();
+    std::string location(std::uint64_t address) const;
+};
 }  // namespace ndb
 using namespace nyulan::container_ostream;
 int main(int argc, char **argv) {
     std::set_terminate(terminate_with_stacktrace);
+    // NOTE: 命令ごとの出力はまとめて書き出す。ゲストの出力もstd::coutを通るので、順番は変わらない
+    std::ios::sync_with_stdio(false);
     bpo::options_description opt("option");
     std::stringstream output_type_description;
     output_type_description << "type of output " << magic_enum::enum_names<OutputType>();
     opt.add_options()("help,h", "show this help")("objectfile,s", bpo::value<std::string>(), "object file")(
         "output-type,t", bpo::value<std::string>(), output_type_description.str().c_str())(
+        "record", bpo::value<std::string>(), "record a binary trace of the run here (see nyutrace)")(
+        "replay", bpo::value<std::string>(), "re-execute a recorded run, taking builtin results from the trace")(
+        "interactive,i", "read commands from stdin (step, continue, reverse-step, reverse-continue, watch, ...)")(
+        "checkpoint-memory", bpo::value<std::uint64_t>()->default_value(256),
+        "MiB of checkpoints kept for reverse execution")(
+        "checkpoint-overhead", bpo::value<double>()->default_value(5.0),
+        "percentage of run time that may be spent taking checkpoints")(
         "debug,d", "enable features for debugging this debugger");
 
     bpo::variables_map varmap;
@@ -126,35 +193,115 @@ int main(int argc, char **argv) {
         std::cerr << except->what() << std::endl;
         exit(EXIT_FAILURE);
     }
-    if (!varmap.count("output-type")) {
+    if (varmap.count("record") && varmap.count("replay")) {
+        std::cerr << "error: --record and --replay can't be used together" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (varmap.count("interactive") && (varmap.count("record") || varmap.count("replay"))) {
+        std::cerr << "error: --interactive can't be used with --record or --replay" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!varmap.count("output-type") && !varmap.count("record") && !varmap.count("replay") &&
+        !varmap.count("interactive")) {
         std::cerr << "missing output type" << std::endl;
         std::cerr << opt << std::endl;
         exit(EXIT_FAILURE);
     }
-    auto output_type = magic_enum::enum_cast<OutputType>(varmap["output-type"].as<std::string>());
-    if (!output_type) {
-        std::cerr << "can't understand output type \"" << varmap["output-type"].as<std::string>() << "\"";
-        std::cerr << opt << std::endl;
+    std::shared_ptr<const nyulan::LineTable> line_table;
+    try {
+        line_table = std::make_shared<const nyulan::LineTable>(objectfile);
+    } catch (const std::exception &except) {
+        std::cerr << except.what() << std::endl;
         exit(EXIT_FAILURE);
     }
     nyulan::CallBacks debug_outputs;
-    switch (output_type.value()) {
-        case OutputType::ADDR2LINE:
-            debug_outputs.on_loop_head = ndb::callbacks::addr2line::OnLoopHead(objectfile);
-            break;
-        case OutputType::ADDR2SRC:
-            debug_outputs.on_loop_head = std::move(ndb::callbacks::addr2src::OnLoopHead(objectfile));
-            break;
-        default:
-            std::cerr << "currently not supported" << std::endl;
+    if (varmap.count("output-type")) {
+        auto output_type = magic_enum::enum_cast<OutputType>(varmap["output-type"].as<std::string>());
+        if (!output_type) {
+            std::cerr << "can't understand output type \"" << varmap["output-type"].as<std::string>() << "\"";
+            std::cerr << opt << std::endl;
             exit(EXIT_FAILURE);
+        }
+        switch (output_type.value()) {
+            case OutputType::ADDR2LINE:
+                debug_outputs.on_loop_head = ndb::callbacks::addr2line::OnLoopHead(line_table);
+                break;
+            case OutputType::ADDR2SRC:
+                debug_outputs.on_loop_head = ndb::callbacks::addr2src::OnLoopHead(line_table);
+                break;
+            default:
+                std::cerr << "currently not supported" << std::endl;
+                exit(EXIT_FAILURE);
+        }
     }
+    if (varmap.count("interactive")) {
+        nyulan::Checkpoints::Limits limits;
+        limits.max_bytes = varmap["checkpoint-memory"].as<std::uint64_t>() * 1024 * 1024;
+        limits.max_overhead = varmap["checkpoint-overhead"].as<double>() / 100;
+        ndb::Session session(objectfile, line_table, debug_outputs, limits);
+        session.run(std::cin);
+        return EXIT_SUCCESS;
+    }
+    auto entry_point = objectfile.find_label("_start").label_address;
     nyulan::VirtualMachine VM(objectfile.literal_datas, true);
+    VM.map_static_segments(objectfile.filename, objectfile.static_segments);
     VM.install_callbacks(debug_outputs);
-    VM.exec(objectfile.code, objectfile.find_label("_start").label_address);
-    return 0;
+    std::shared_ptr<nyulan::TraceRecorder> recorder = nullptr;
+    std::shared_ptr<nyulan::TraceReplayer> replayer = nullptr;
+    try {
+        if (varmap.count("record")) {
+            recorder = std::make_shared<nyulan::TraceRecorder>(varmap["record"].as<std::string>(), objectfile.code,
+                                                               entry_point);
+            VM.attach_trace_recorder(recorder);
+        }
+        if (varmap.count("replay")) {
+            replayer = std::make_shared<nyulan::TraceReplayer>(varmap["replay"].as<std::string>(), objectfile.code);
+            VM.attach_trace_replayer(replayer);
+        }
+    } catch (const std::exception &except) {
+        std::cerr << except.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    nyulan::ExecResult result{nyulan::ExecStatus::FINISHED, 0};
+    auto status = nyulan::trace::EndStatus::FINISHED;
+    std::string failure;
+    try {
+        result = VM.exec(objectfile.code, entry_point);
+        if (result.status == nyulan::ExecStatus::EXITED) {
+            status = nyulan::trace::EndStatus::EXITED;
+        }
+    } catch (const std::exception &except) {
+        if (recorder == nullptr && replayer == nullptr) {
+            throw;
+        }
+        status = nyulan::trace::EndStatus::FAILED;
+        failure = except.what();
+    }
+    auto exit_code = status == nyulan::trace::EndStatus::EXITED ? result.value.value() : 0;
+    try {
+        if (recorder != nullptr) {
+            recorder->finish(VM.get_program_counter(), status, exit_code);
+            TRIVIAL_LOG_WITH_FUNCNAME(info) << "recorded " << recorder->bytes_written() << " bytes of trace";
+        }
+        if (replayer != nullptr) {
+            replayer->finish(VM.get_program_counter(), status, exit_code);
+            TRIVIAL_LOG_WITH_FUNCNAME(info) << "replayed " << replayer->num_builtins() << " builtin calls";
+        }
+    } catch (const std::exception &except) {
+        if (not failure.empty()) {
+            std::cerr << failure << std::endl;
+        }
+        std::cerr << except.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (not failure.empty()) {
+        std::cerr << failure << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return static_cast<int>(exit_code);
 }
 [[noreturn]] void terminate_with_stacktrace() noexcept {
+    std::cout << std::flush;
     std::cerr << "terminate() has called!" << std::endl;
     std::cerr << "---- stacktrace ----" << std::endl;
     std::cerr << boost::stacktrace::stacktrace() << std::endl;
@@ -164,69 +311,406 @@ int main(int argc, char **argv) {
     std::abort();
 }
 namespace ndb {
-std::string getline_at(std::istream *stream, std::uint64_t line) {
-    if (line == 0) {
-        return "unknown";
-    }
-    stream->seekg(0);
-    for (size_t i = 0; i < line - 1; i++) {
-        stream->ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    }
-    std::string result;
-    std::getline(*stream, result);
-    return result;
-}
-namespace debugSection {
-FilenumAndLine addr2line(Section section, nyulan::Address step_address) {
-    if (section->name != "debug.addr2line") {
-        throw std::invalid_argument("addr2line() can only parse \"debug.addr2line\" section");
-    }
-    auto src_bitwidth = section->data[0];
-    auto line_bitwidth = section->data[1];
-    auto data_bitwidth = src_bitwidth + line_bitwidth;
-    auto data_index = 2 + (data_bitwidth / 8) * step_address.value();
-    auto src_begin = section->data.begin() + data_index;
-    auto src_end = src_begin + (src_bitwidth / 8);
-    auto line_begin = src_end;
-    auto line_end = line_begin + (line_bitwidth / 8);
+namespace {
+class NullBuffer : public std::streambuf {
+   protected:
+    int overflow(int c) override { return traits_type::not_eof(c); }
+};
+// 生きている間、std::cout、std::cerrへの出力を捨てる
+class Quiet {
+    NullBuffer null_;
+    std::streambuf *out_;
+    std::streambuf *err_;
 
-    auto src_filenum = bytes_to_value(section, std::vector(src_begin, src_end), src_bitwidth);
-    auto linenum = bytes_to_value(section, std::vector(line_begin, line_end), line_bitwidth);
-    return FilenumAndLine(src_filenum, linenum);
-}
-std::uint64_t bytes_to_value(Section section, std::vector<std::uint8_t> data, size_t bitwidth) {
-    switch (bitwidth) {
-        case 8:
-            return data[0];
-        case 16:
-            return section->parent->bytes_to_value<std::uint16_t>(data);
-        case 32:
-            return section->parent->bytes_to_value<std::uint32_t>(data);
-        case 64:
-            return section->parent->bytes_to_value<std::uint64_t>(data);
-        default:
-            throw std::invalid_argument("bitwidth of " + std::to_string(bitwidth) + " is too big");
-    }
-}
-std::vector<std::string> filenames(Section section) {
-    if (section->name != "debug.sourcefiles") {
-        throw std::invalid_argument("filenames() can only parse \"debug.sourcefiles\" section");
-    }
-    std::vector<std::string> result;
-    std::string tmp;
-    for (const auto &datum : section->data) {
-        if (datum != '\0') {
-            tmp.push_back(datum);
+   public:
+    Quiet() : out_(std::cout.rdbuf(&null_)), err_(std::cerr.rdbuf(&null_)) {}
+    ~Quiet() {
+        std::cout.rdbuf(out_);
+        std::cerr.rdbuf(err_);
+    }
+};
+std::uint64_t parse_address(const std::string &text) {
+    return std::stoull(text.starts_with("@") ? text.substr(1) : text, nullptr, 0);
+}
+// 8バイトまでなら、リトルエンディアンの整数として表示する
+std::string format_bytes(const std::optional<std::vector<std::uint8_t>> &bytes) {
+    if (not bytes) {
+        return "(not allocated)";
+    }
+    std::ostringstream result;
+    result << std::hex;
+    if (bytes->size() <= sizeof(std::uint64_t)) {
+        std::uint64_t value = 0;
+        for (std::size_t i = 0; i < bytes->size(); i++) {
+            value |= static_cast<std::uint64_t>((*bytes)[i]) << (8 * i);
+        }
+        result << "0x" << value;
+        return result.str();
+    }
+    for (auto byte : *bytes) {
+        result << (result.tellp() == 0 ? "" : " ") << static_cast<int>(byte);
+    }
+    return result.str();
+}
+}  // namespace
+Session::Session(nyulan::ObjectFile &objectfile, std::shared_ptr<const nyulan::LineTable> line_table,
+                 nyulan::CallBacks callbacks, nyulan::Checkpoints::Limits limits)
+    : callbacks_(std::move(callbacks)),
+      line_table_(std::move(line_table)),
+      vm_(std::make_unique<nyulan::VirtualMachine>(objectfile.literal_datas, true)),
+      checkpoints_(limits),
+      labels_(objectfile.global_labels) {
+    // NOTE: 動的メモリをページ単位で保護できるように、ガードページの領域に置く
+    this->vm_->enable_guard_pages();
+    this->vm_->map_static_segments(objectfile.filename, objectfile.static_segments);
+    this->vm_->install_callbacks(this->callbacks_);
+    this->vm_->load_code(objectfile.code);
+    this->vm_->start(objectfile.find_label("_start").label_address);
+}
+void Session::run(std::istream &commands) {
+    bool prompt = ::isatty(STDIN_FILENO);
+    this->report();
+    std::string line;
+    while (true) {
+        if (prompt) {
+            std::cout << "(ndb) " << std::flush;
+        }
+        if (not std::getline(commands, line)) {
+            break;
+        }
+        std::istringstream words(line);
+        std::string command;
+        std::string argument;
+        words >> command >> argument;
+        if (command.empty()) {
+            continue;
+        }
+        try {
+            if (command == "quit" || command == "q") {
+                break;
+            } else if (command == "step" || command == "s") {
+                auto count = argument.empty() ? 1 : std::stoull(argument);
+                if (not this->terminated_) {
+                    this->forward(this->position_ + count, false);
+                }
+                this->report();
+            } else if (command == "continue" || command == "c") {
+                if (not this->terminated_) {
+                    this->forward(std::numeric_limits<std::uint64_t>::max(), true);
+                }
+                this->report();
+            } else if (command == "reverse-step" || command == "rs") {
+                auto count = argument.empty() ? 1 : std::stoull(argument);
+                this->travel(this->position_ - std::min<std::uint64_t>(count, this->position_));
+                this->report();
+            } else if (command == "reverse-continue" || command == "rc") {
+                this->reverse_continue();
+                this->report();
+            } else if (command == "goto") {  // ステップ数を指定して、前にも後ろにも動く
+                auto target = std::stoull(argument);
+                if (target < this->position_ || this->terminated_) {
+                    this->travel(target);
+                } else {
+                    this->forward(target, false);
+                }
+                this->report();
+            } else if (command == "break" || command == "b") {
+                for (auto address : this->resolve(argument)) {
+                    this->vm_->set_breakpoint(address);
+                    this->breakpoints_.insert(address);
+                    std::cout << "breakpoint at " << this->location(address) << std::endl;
+                }
+            } else if (command == "delete" || command == "d") {
+                auto addresses = argument.empty() ? std::vector(this->breakpoints_.begin(), this->breakpoints_.end())
+                                                  : this->resolve(argument);
+                for (auto address : addresses) {
+                    this->vm_->clear_breakpoint(address);
+                    this->breakpoints_.erase(address);
+                }
+            } else if (command == "watch" || command == "w") {
+                auto address = parse_address(argument);
+                std::uint64_t size = sizeof(std::uint64_t);
+                if (std::string word; words >> word) {
+                    size = std::stoull(word, nullptr, 0);
+                }
+                bool by_page = this->vm_->watch(address, size);
+                this->watchpoints_.push_back(Watchpoint{address, size, this->read_memory(address, size), by_page});
+                this->check_every_step_ = this->check_every_step_ || not by_page;
+                std::cout << "watchpoint @" << address << " (" << size << " bytes)"
+                          << (by_page ? "" : ", checked after every step") << std::endl;
+            } else if (command == "unwatch" || command == "uw") {
+                auto address = argument.empty() ? 0 : parse_address(argument);
+                std::erase_if(this->watchpoints_, [&](const Watchpoint &watchpoint) {
+                    if (not argument.empty() && watchpoint.address != address) {
+                        return false;
+                    }
+                    try {
+                        this->vm_->unwatch(watchpoint.address, watchpoint.size);
+                    } catch (const std::runtime_error &) {
+                        // NOTE: 戻ったところで確保されていなかったので、VMには置いていない
+                    }
+                    return true;
+                });
+                this->check_every_step_ = std::ranges::any_of(
+                    this->watchpoints_, [](const Watchpoint &watchpoint) { return not watchpoint.by_page; });
+            } else if (command == "info" || command == "i") {
+                this->report();
+                std::cout << this->vm_->stringify_vm_state() << std::dec;
+                std::cout << this->checkpoints_.list().size() << " checkpoints (" << this->checkpoints_.bytes() / 1024
+                          << " KiB) every " << this->checkpoints_.interval() << " steps:";
+                for (const auto &checkpoint : this->checkpoints_.list()) {
+                    std::cout << " " << checkpoint.position;
+                }
+                std::cout << std::endl;
+                for (auto address : this->breakpoints_) {
+                    std::cout << "breakpoint at " << this->location(address) << std::endl;
+                }
+                for (const auto &watchpoint : this->watchpoints_) {
+                    std::cout << "watchpoint @" << watchpoint.address << " (" << watchpoint.size
+                              << " bytes): " << format_bytes(watchpoint.value) << std::endl;
+                }
+            } else {
+                std::cout << "unknown command \"" << command << "\"" << std::endl;
+            }
+        } catch (const std::logic_error &except) {  // stoull()
+            std::cout << "can't understand \"" << line << "\"" << std::endl;
+        } catch (const std::runtime_error &except) {
+            std::cout << except.what() << std::endl;
+        }
+    }
+}
+void Session::forward(std::uint64_t limit, bool stop_at_breakpoints) {
+    auto started_at = this->position_;
+    bool on_watchpoint = false;  // WATCHPOINTで止まった命令をまだ実行していない
+    while (this->position_ < limit && not this->terminated_) {
+        if (this->position_ >= this->checkpoints_.next_position()) {
+            this->checkpoints_.take(*this->vm_, this->position_, this->ran_);
+            this->ran_ = std::chrono::nanoseconds(0);
+        }
+        auto chunk = std::min(limit, this->checkpoints_.next_position()) - this->position_;
+        // ブレークポイントの上からは、元の命令に戻して1ステップだけ実行する
+        auto program_counter = this->vm_->get_program_counter();
+        bool on_breakpoint = this->breakpoints_.contains(program_counter.value());
+        if (on_breakpoint) {
+            if (stop_at_breakpoints && this->position_ != started_at) {
+                return;
+            }
+            this->vm_->clear_breakpoint(program_counter);
+            chunk = 1;
+        }
+        // ウォッチポイントで止まった命令は、保護を外して1ステップだけ実行する
+        // NOTE: フックは止まる前に呼ばれているので、二度呼ばないように外しておく
+        if (on_watchpoint) {
+            this->vm_->disarm_watches();
+            this->vm_->install_callbacks(nyulan::CallBacks());
+        }
+        if (on_watchpoint || this->check_every_step_) {
+            chunk = 1;
+        }
+        std::optional<nyulan::ExecResult> result = std::nullopt;
+        std::string error;
+        auto started = std::chrono::steady_clock::now();
+        try {
+            result = this->vm_->resume(chunk);
+        } catch (const std::exception &except) {
+            error = except.what();
+        }
+        this->ran_ += std::chrono::steady_clock::now() - started;
+        if (on_breakpoint) {
+            this->vm_->set_breakpoint(program_counter);
+        }
+        if (on_watchpoint) {
+            this->vm_->install_callbacks(this->callbacks_);
+            this->vm_->arm_watches();
+        }
+        if (result && result->status == nyulan::ExecStatus::SUSPENDED) {
+            this->position_ += chunk;
+            if ((on_watchpoint || this->check_every_step_) && this->check_watchpoints(program_counter.value()) &&
+                stop_at_breakpoints) {
+                return;
+            }
+            on_watchpoint = false;
+            continue;
+        }
+        if (result && result->status == nyulan::ExecStatus::BREAKPOINT) {
+            this->position_ += result->value.value();
+            continue;  // 止まるか越えるかは、次の周で決める
+        }
+        if (result && result->status == nyulan::ExecStatus::WATCHPOINT) {
+            this->position_ += result->value.value();
+            on_watchpoint = true;
+            continue;
+        }
+        if (result) {
+            this->terminated_ = Termination{result->status, result->value.value(), ""};
+        } else {
+            this->terminated_ = Termination{nyulan::ExecStatus::FINISHED, 0, error};
+        }
+        if (chunk == 1) {
+            if (result) {
+                this->position_++;  // NOTE: 例外なら、その命令は実行し終わっていない
+            }
         } else {
-            result.push_back(tmp);
-            tmp.clear();
+            this->locate_termination();
         }
     }
-    std::stringstream res;
-    res << result;
-    TRIVIAL_LOG_WITH_FUNCNAME(debug) << res.str();
-    return result;
 }
-
-}  // namespace debugSection
+void Session::locate_termination() {
+    // チャンクのどこで終わったかは分からないので、チャンクの初めに戻って1ステップずつ実行し直す
+    auto position = this->position_;
+    this->travel(position);
+    Quiet quiet;
+    while (not this->terminated_) {
+        this->forward(this->position_ + 1, false);
+    }
+}
+void Session::travel(std::uint64_t target) {
+    auto checkpoint = this->checkpoints_.before(target);
+    if (checkpoint == nullptr) {
+        throw std::runtime_error("error: no checkpoint to go back to");
+    }
+    this->checkpoints_.discard_after(target);
+    this->vm_ = checkpoint->snapshot->instantiate(true);
+    this->vm_->install_callbacks(this->callbacks_);
+    this->install_breakpoints(*this->vm_);
+    this->position_ = checkpoint->position;
+    this->ran_ = std::chrono::nanoseconds(0);
+    this->terminated_ = std::nullopt;
+    // NOTE: ウォッチポイントは、見張るメモリがまだ確保されていないかもしれないので、着いてから置く
+    this->check_every_step_ = false;
+    {
+        Quiet quiet;
+        this->forward(target, false);
+    }
+    this->install_watchpoints();
+}
+void Session::reverse_continue() {
+    // チェックポイントの間を新しい方から順に、ブレークポイントを置いた別のVMで実行し直して探す
+    auto end = this->position_;
+    while (end > 0) {
+        auto checkpoint = this->checkpoints_.before(end - 1);
+        if (checkpoint == nullptr) {
+            break;
+        }
+        auto vm = checkpoint->snapshot->instantiate(true);
+        this->install_breakpoints(*vm);
+        std::optional<std::uint64_t> found = std::nullopt;
+        {
+            Quiet quiet;
+            try {
+                for (auto position = checkpoint->position; position < end;) {
+                    auto program_counter = vm->get_program_counter();
+                    if (this->breakpoints_.contains(program_counter.value())) {
+                        found = position;
+                        vm->clear_breakpoint(program_counter);
+                        auto result = vm->resume(1);
+                        vm->set_breakpoint(program_counter);
+                        if (result.status != nyulan::ExecStatus::SUSPENDED) {
+                            break;
+                        }
+                        position++;
+                        continue;
+                    }
+                    auto result = vm->resume(end - position);
+                    if (result.status != nyulan::ExecStatus::BREAKPOINT) {
+                        break;
+                    }
+                    position += result.value.value();
+                }
+            } catch (const std::exception &) {
+                // NOTE: 止まったところまでに見つけたものを使う
+            }
+        }
+        if (found) {
+            this->travel(found.value());
+            return;
+        }
+        end = checkpoint->position;
+    }
+    this->travel(0);
+}
+std::vector<std::uint64_t> Session::resolve(const std::string &where) const {
+    if (where.empty()) {
+        throw std::runtime_error("error: where?");
+    }
+    if (where.starts_with("@") || std::isdigit(static_cast<unsigned char>(where.front()))) {
+        return {parse_address(where)};
+    }
+    if (auto colon = where.rfind(':'); colon != std::string::npos) {
+        auto addresses = this->line_table_->find_line(where.substr(0, colon), std::stoull(where.substr(colon + 1)));
+        if (addresses.empty()) {
+            throw std::runtime_error("error: no code at " + where);
+        }
+        return addresses;
+    }
+    for (const auto &label : this->labels_) {
+        if (label.real_name == where) {
+            return {label.label_address};
+        }
+    }
+    throw std::runtime_error("error: label \"" + where + "\" not found");
+}
+void Session::install_breakpoints(nyulan::VirtualMachine &vm) const {
+    for (auto address : this->breakpoints_) {
+        vm.set_breakpoint(address);
+    }
+}
+void Session::install_watchpoints() {
+    this->check_every_step_ = false;
+    for (auto &watchpoint : this->watchpoints_) {
+        try {
+            watchpoint.by_page = this->vm_->watch(watchpoint.address, watchpoint.size);
+        } catch (const std::runtime_error &) {
+            watchpoint.by_page = false;  // 確保されていない
+        }
+        watchpoint.value = this->read_memory(watchpoint.address, watchpoint.size);
+        this->check_every_step_ = this->check_every_step_ || not watchpoint.by_page;
+    }
+}
+bool Session::check_watchpoints(std::uint64_t writer) {
+    bool changed = false;
+    for (auto &watchpoint : this->watchpoints_) {
+        auto value = this->read_memory(watchpoint.address, watchpoint.size);
+        if (value == watchpoint.value) {
+            continue;
+        }
+        std::cout << "step " << this->position_ << ": watchpoint @" << watchpoint.address << " written by "
+                  << this->location(writer) << ": " << format_bytes(watchpoint.value) << " -> "
+                  << format_bytes(value) << std::endl;
+        watchpoint.value = std::move(value);
+        changed = true;
+    }
+    return changed;
+}
+std::optional<std::vector<std::uint8_t>> Session::read_memory(std::uint64_t address, std::uint64_t size) const {
+    try {
+        return this->vm_->load_memory(address, size);
+    } catch (const std::runtime_error &) {
+        return std::nullopt;
+    }
+}
+void Session::report() {
+    if (this->terminated_) {
+        const auto &termination = this->terminated_.value();
+        std::cout << "step " << this->position_ << ": ";
+        if (not termination.error.empty()) {
+            std::cout << "failed at " << this->location(this->vm_->get_program_counter().value()) << ": "
+                      << termination.error << std::endl;
+        } else if (termination.status == nyulan::ExecStatus::EXITED) {
+            std::cout << "exited with code " << termination.exit_code << std::endl;
+        } else {
+            std::cout << "finished" << std::endl;
+        }
+        return;
+    }
+    std::cout << "step " << this->position_ << " " << this->location(this->vm_->get_program_counter().value())
+              << std::endl;
+}
+std::string Session::location(std::uint64_t address) const {
+    auto description = this->line_table_->describe(address);
+    if (description.starts_with("@")) {
+        return description;
+    }
+    return "@" + std::to_string(address) + " " + description;
+}
 }  // namespace ndb
@@ -14,7 +14,7 @@ struct Address : public utils::Phantom<Address_, std::uint64_t> {
     using super::PhantomBase_;
     Address(Register value) : super::PhantomBase_(static_cast<std::uint64_t>(value)) {}
 };
-constexpr std::uint64_t CURRENT_INSTRUCTION_SET_VERSION = 1;
+constexpr std::uint64_t CURRENT_INSTRUCTION_SET_VERSION = 2;
 enum class Instruction : std::uint8_t {
     NOP = 0,
     MOV,      // dst,src
@@ -58,16 +58,47 @@ enum class Instruction : std::uint8_t {
     GOTO,     // addr
     CALL,     // addr ;アドレスの上位1bitが1のものは全て予約されている
     RET,      // コールスタックの最上位にジャンプする
+    // ここからv2 アトミック命令は全て64bitで、アトミック命令どうしは逐次一貫 通常のLOAD、STOREとの順序は保証しない
+    ALOAD,   // dst,addr ;addrレジスタの中身のさすメモリ上の8バイトをアトミックにロードする
+    ASTORE,  // addr,src ;アトミックにストアする
+    CAS,     // addr,src ;メモリ上の8バイトがr0と等しければsrcに置き換える r0には元の値が入る
+    FADD,    // addr,src ;メモリ上の8バイトにsrcを足す srcには元の値が入る
+
+    // オブジェクトファイルには現れない。デバッガがブレークポイントの命令をこれに書き換える
+    BREAK = 0x7f,
 };
 
 enum class BuiltinFuncs : Register::ValueType {  //これの最上位ビットを立てたものが実際にコードで指定される値
     READ = 0,
     WRITE = 1,
-    OPEN = 2,
-    CLOSE = 3,
+    OPEN = 2,   // fname,flags ;NUL終端のファイル名を開き、fdを返す 失敗したら-1 flagsはO_RDONLY(0),O_WRONLY(1),O_RDWR(2)
+    CLOSE = 3,  // fd
+    SPAWN = 56,  // entry_point,arg ;entry_pointをr0=argで呼ぶゲストスレッドを作り、スレッドIDを返す
     EXIT = 60,
+    JOIN = 61,  // thread_id ;スレッドの終了を待ち、r0(EXITしたなら終了コード)を返す
+    // 非同期I/O offsetに-1を渡すと、ファイルの現在位置から読み書きする
+    AIO_READ = 256,   // fd,buf,len,offset ;読み込みを開始し、チケットを返す bufはAIO_WAITまで書き込まれない
+    AIO_WRITE = 257,  // fd,buf,len,offset ;bufの内容をコピーして書き込みを開始し、チケットを返す
+    AIO_POLL = 258,   // ticket ;完了していれば1、まだなら0を返す
+    AIO_WAIT = 259,   // ticket ;完了を待ち、読み書きしたバイト数か-errnoを返す チケットはこれで解放される
+    // VM間のチャネル 送受信はメッセージ単位で、空き(メッセージ)がなければ待つ
+    CHANNEL_CREATE = 320,   // capacity,message_size,kind ;kindは0ならSPSC、1ならMPMC チャネルの番号を返す
+    CHANNEL_SEND = 321,     // channel,buf,len ;lenを返す 閉じられていれば-1
+    CHANNEL_RECEIVE = 322,  // channel,buf,len ;メッセージの長さを返す lenを超えた分は捨てる 閉じられていて空なら-1
+    CHANNEL_CLOSE = 323,    // channel
     MALLOC = 512,
     FREE = 513,
 };
+// オブジェクトファイルv4の静的セグメント。静的アドレス(最上位ビットが立ったもの)でアクセスする
+struct StaticSegment {
+    enum class Kind : std::uint8_t {
+        RODATA = 0,  // ファイル上のfile_offsetからsizeバイト。読み込み専用で、ファイルから直接mmapする
+        BSS = 1,     // 0で埋まったsizeバイト。触ったページだけが確保される
+    };
+    Kind kind;
+    std::uint64_t address;  // 最上位ビットを除いた静的アドレス
+    std::uint64_t size;
+    std::uint64_t file_offset;  // RODATAのみ
+};
 }  // namespace nyulan
 #endif
@@ -0,0 +1,494 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "emitter.hpp"
+#include "logging.hpp"
+#include "memory.hpp"
+#include "objectfile.hpp"
+#include "stats.hpp"
+#include "vm.hpp"
+namespace bpo = boost::program_options;
+namespace stdfsys = std::filesystem;
+namespace {
+using nyulan::BuiltinFuncs;
+using nyulan::Emitter;
+using nyulan::Instruction;
+
+// 生成するプログラムが共通で使うレジスタ
+constexpr int ONE = 13;         // 定数1
+constexpr int OUTER_HEAD = 14;  // 外側のループの先頭
+constexpr int INNER_HEAD = 12;  // 内側のループの先頭
+constexpr int TMP = 15;         // call_builtin()が壊す
+
+struct Program {
+    std::vector<nyulan::OneStep> code;
+    std::vector<std::uint8_t> literal_datas;
+};
+struct Workload {
+    std::string name;
+    std::string description;
+    std::function<Program(std::uint64_t scale)> generate;
+    bool writes_stdout = false;
+};
+
+void prologue(Emitter &e) { e.load_immediate(ONE, 1); }
+// checksumの下位8bitを終了コードにする
+void epilogue(Emitter &e, int checksum) {
+    e.load_immediate(TMP, 0b1111'1111);
+    e.emit(Instruction::AND, checksum, TMP);
+    e.emit(Instruction::PUSHR64, checksum);
+    e.call_builtin(BuiltinFuncs::EXIT);
+}
+// counterをnから数え下ろしながらbodyをn回(n>=1)繰り返す。headにはループの先頭のアドレスが入る
+void repeat(Emitter &e, int counter, int head, std::uint64_t n, const std::function<void()> &body) {
+    e.load_immediate(counter, n);
+    auto head_position = e.load_label(head);
+    e.patch(head_position, e.here());
+    body();
+    e.emit(Instruction::SUB, counter, ONE);
+    e.emit(Instruction::IFP, counter, head);  // NOTE: レジスタは符号なしなので、0でなければ戻る
+}
+
+// 整数演算だけのループ
+Program arithmetic(std::uint64_t scale) {
+    Emitter e;
+    prologue(e);
+    e.load_immediate(0, 88172645463325252ULL);
+    e.load_immediate(1, 6364136223846793005ULL);
+    e.load_immediate(2, 1442695040888963407ULL);
+    e.load_immediate(4, 29);
+    e.load_immediate(5, 0);
+    e.load_immediate(7, 0xffff'ffff);
+    repeat(e, 8, OUTER_HEAD, 500'000 * scale, [&] {
+        e.emit(Instruction::MUL, 0, 1);
+        e.emit(Instruction::ADD, 0, 2);
+        e.emit(Instruction::MOV, 3, 0);
+        e.emit(Instruction::RSHIFT, 3, 4);
+        e.emit(Instruction::XOR, 5, 3);
+        e.emit(Instruction::AND, 3, 7);
+        e.emit(Instruction::OR, 5, 3);
+        e.emit(Instruction::SUB, 5, 0);
+    });
+    epilogue(e, 5);
+    return {e.code, {}};
+}
+// 再帰するfib(24)を繰り返す。fibはr0を受け取りr0を返し、r1を壊す
+Program recursion(std::uint64_t scale) {
+    Emitter e;
+    prologue(e);
+    auto fib_position = e.load_label(11);
+    auto base_position = e.load_label(10);
+    e.load_immediate(9, 0);
+    repeat(e, 8, OUTER_HEAD, scale, [&] {
+        e.load_immediate(0, 24);
+        e.emit(Instruction::CALL, 11);
+        e.emit(Instruction::ADD, 9, 0);
+    });
+    epilogue(e, 9);
+
+    e.patch(fib_position, e.here());
+    e.emit(Instruction::MOV, 1, 0);
+    e.emit(Instruction::RSHIFT, 1, ONE);
+    e.emit(Instruction::IFZ, 1, 10);  // n < 2
+    e.emit(Instruction::PUSHR64, 0);
+    e.emit(Instruction::SUB, 0, ONE);
+    e.emit(Instruction::CALL, 11);  // fib(n-1)
+    e.emit(Instruction::POP64, 1);
+    e.emit(Instruction::PUSHR64, 0);
+    e.emit(Instruction::MOV, 0, 1);
+    e.emit(Instruction::SUB, 0, ONE);
+    e.emit(Instruction::SUB, 0, ONE);
+    e.emit(Instruction::CALL, 11);  // fib(n-2)
+    e.emit(Instruction::POP64, 1);
+    e.emit(Instruction::ADD, 0, 1);
+    e.emit(Instruction::RET);
+    e.patch(base_position, e.here());
+    e.emit(Instruction::RET);
+    return {e.code, {}};
+}
+// 幅の違うPUSH、POPを繰り返す
+Program stack_churn(std::uint64_t scale) {
+    Emitter e;
+    prologue(e);
+    e.load_immediate(1, 0x0123'4567'89ab'cdefULL);
+    e.load_immediate(2, 0x0fed'cba9ULL);
+    e.load_immediate(3, 0x1357);
+    e.load_immediate(4, 0x42);
+    e.load_immediate(5, 0);
+    repeat(e, 8, OUTER_HEAD, 60'000 * scale, [&] {
+        for (int i = 0; i < 4; i++) {
+            e.emit(Instruction::PUSHR64, 1);
+            e.emit(Instruction::PUSHR32, 2);
+            e.emit(Instruction::PUSHR16, 3);
+            e.emit(Instruction::PUSHR8, 4);
+        }
+        for (int i = 0; i < 4; i++) {
+            e.emit(Instruction::POP8, 6);
+            e.emit(Instruction::POP16, 6);
+            e.emit(Instruction::POP32, 6);
+            e.emit(Instruction::POP64, 6);
+            e.emit(Instruction::ADD, 5, 6);
+        }
+        e.emit(Instruction::ADD, 1, ONE);
+    });
+    epilogue(e, 5);
+    return {e.code, {}};
+}
+// MALLOCした1MiBに8バイトずつ書いてから読み直す
+Program memory_sweep(std::uint64_t scale) {
+    constexpr std::uint64_t WORDS = 1024 * 1024 / 8;
+    Emitter e;
+    prologue(e);
+    e.load_immediate(0, WORDS * 8);
+    e.emit(Instruction::PUSHR64, 0);
+    e.call_builtin(BuiltinFuncs::MALLOC);
+    e.emit(Instruction::POP64, 4);
+    e.load_immediate(3, 8);
+    e.load_immediate(7, 0);
+    repeat(e, 9, OUTER_HEAD, 2 * scale, [&] {
+        e.emit(Instruction::MOV, 5, 4);
+        repeat(e, 10, INNER_HEAD, WORDS, [&] {
+            e.emit(Instruction::MOV, 6, 10);
+            e.emit(Instruction::ADD, 6, 9);
+            e.emit(Instruction::STORE64, 5, 6);
+            e.emit(Instruction::ADD, 5, 3);
+        });
+        e.emit(Instruction::MOV, 5, 4);
+        repeat(e, 10, INNER_HEAD, WORDS, [&] {
+            e.emit(Instruction::LOAD64, 6, 5);
+            e.emit(Instruction::XOR, 7, 6);
+            e.emit(Instruction::ADD, 5, 3);
+        });
+    });
+    e.emit(Instruction::PUSHR64, 4);
+    e.call_builtin(BuiltinFuncs::FREE);
+    epilogue(e, 7);
+    return {e.code, {}};
+}
+// DADDからDMODまでを使うループ
+Program floating_point(std::uint64_t scale) {
+    Emitter e;
+    prologue(e);
+    e.load_immediate(1, std::bit_cast<std::uint64_t>(1.0));
+    e.load_immediate(2, std::bit_cast<std::uint64_t>(1.000001));
+    e.load_immediate(3, std::bit_cast<std::uint64_t>(0.5));
+    e.load_immediate(4, std::bit_cast<std::uint64_t>(3.0));
+    e.load_immediate(5, std::bit_cast<std::uint64_t>(0.0));
+    e.load_immediate(7, std::bit_cast<std::uint64_t>(0.0));
+    repeat(e, 8, OUTER_HEAD, 250'000 * scale, [&] {
+        e.emit(Instruction::DMUL, 1, 2);
+        e.emit(Instruction::DADD, 5, 1);
+        e.emit(Instruction::DSUB, 5, 3);
+        e.emit(Instruction::DDIV, 5, 4);
+        e.emit(Instruction::MOV, 6, 5);
+        e.emit(Instruction::DMOD, 6, 3);
+        e.emit(Instruction::DADD, 7, 6);
+    });
+    e.emit(Instruction::XOR, 7, 5);
+    epilogue(e, 7);
+    return {e.code, {}};
+}
+// 64バイトの行をWRITEで標準出力に書き続ける
+Program write_heavy(std::uint64_t scale) {
+    std::string line = "nyulan_bench: the quick brown fox jumps over the lazy dog 0123\n";
+    Emitter e;
+    prologue(e);
+    e.load_immediate(1, line.size());
+    e.load_immediate(2, nyulan::STATIC_ADDRESS_FLAG);
+    e.load_immediate(3, 1);
+    e.load_immediate(5, 0);
+    repeat(e, 8, OUTER_HEAD, 25'000 * scale, [&] {
+        e.emit(Instruction::PUSHR64, 1);  // NOTE: 引数は最後のものから積む
+        e.emit(Instruction::PUSHR64, 2);
+        e.emit(Instruction::PUSHR64, 3);
+        e.call_builtin(BuiltinFuncs::WRITE);
+        e.emit(Instruction::ADD, 5, 1);
+    });
+    epilogue(e, 5);
+    return {e.code, std::vector<std::uint8_t>(line.begin(), line.end())};
+}
+
+const std::vector<Workload> &workloads() {
+    static const std::vector<Workload> result = {
+        {"arithmetic", "integer ALU loop", arithmetic},
+        {"recursion", "recursive fib(24), CALL/RET heavy", recursion},
+        {"stack", "PUSH/POP of every width", stack_churn},
+        {"memory", "STORE64/LOAD64 sweeps over 1MiB", memory_sweep},
+        {"float", "DADD..DMOD kernel", floating_point},
+        {"write", "64 byte WRITEs to stdout", write_heavy, true},
+    };
+    return result;
+}
+
+// オブジェクトファイルv4(リトルエンディアン)として書く
+template <typename T>
+void write_value(std::ofstream &out, T value) {
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        out.put(static_cast<char>((static_cast<std::uint64_t>(value) >> (8 * i)) & 0b1111'1111));
+    }
+}
+void write_objectfile(const stdfsys::path &path, const Program &program) {
+    std::ofstream out(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (not out) {
+        throw std::runtime_error("error: failed to create " + path.string());
+    }
+    out.write("NYU", 3);
+    out.put(0x00).put(0x11);
+    write_value<std::uint64_t>(out, nyulan::CURRENT_OBJECTRILE_VERSION);
+    write_value<std::uint64_t>(out, program.literal_datas.size());
+    out.write(reinterpret_cast<const char *>(program.literal_datas.data()), program.literal_datas.size());
+    write_value<std::uint16_t>(out, 1);
+    out.write("_start", sizeof("_start"));
+    write_value<std::uint64_t>(out, 0);
+    write_value<std::uint64_t>(out, nyulan::CURRENT_INSTRUCTION_SET_VERSION);
+    write_value<std::uint64_t>(out, program.code.size());
+    for (auto step : program.code) {
+        write_value<std::uint16_t>(out, step.value());
+    }
+    write_value<std::uint64_t>(out, 0);  // optional sections
+    write_value<std::uint64_t>(out, 0);  // static segments
+    if (not out) {
+        throw std::runtime_error("error: failed to write " + path.string());
+    }
+}
+
+struct Run {
+    double seconds;
+    std::uint64_t exit_code;
+    std::uint64_t steps;  // countのときだけ
+};
+Run run_once(const nyulan::ObjectFile &objectfile, std::shared_ptr<const std::vector<nyulan::OneStep>> code,
+             nyulan::Address entry_point, int stdout_fd, bool count) {
+    nyulan::VirtualMachine vm(objectfile.literal_datas);
+    vm.load_code(code);
+    vm.map_static_segments(objectfile.filename, objectfile.static_segments);
+    vm.redirect_stdio(STDIN_FILENO, stdout_fd, STDERR_FILENO);
+    if (count) {
+        vm.enable_stats();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    vm.start(entry_point);
+    nyulan::ExecResult result;
+    do {
+        result = vm.resume();
+    } while (result.status == nyulan::ExecStatus::SUSPENDED || result.status == nyulan::ExecStatus::BLOCKED);
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    auto exit_code = result.status == nyulan::ExecStatus::EXITED ? result.value.value() : 0;
+    return Run{seconds, exit_code, count ? vm.stats()->steps() : 0};
+}
+
+struct Summary {
+    std::size_t reps;
+    double min;
+    double median;
+    double mean;
+    double stddev;
+    std::uint64_t steps;
+    std::uint64_t exit_code;
+};
+Summary summarize(std::vector<double> seconds, std::uint64_t steps, std::uint64_t exit_code) {
+    std::sort(seconds.begin(), seconds.end());
+    auto n = seconds.size();
+    auto median = n % 2 == 1 ? seconds[n / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+    auto mean = std::accumulate(seconds.begin(), seconds.end(), 0.0) / n;
+    double variance = 0;
+    for (auto value : seconds) {
+        variance += (value - mean) * (value - mean);
+    }
+    variance = n > 1 ? variance / (n - 1) : 0;  // 標本分散
+    return Summary{n, seconds.front(), median, mean, std::sqrt(variance), steps, exit_code};
+}
+
+void write_json(std::ostream &out, std::uint64_t scale, const std::vector<std::pair<std::string, Summary>> &results) {
+    out << "{\n";
+    out << "  \"format\": 1,\n";
+    out << "  \"scale\": " << scale << ",\n";
+    out << "  \"workloads\": {";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const auto &[name, summary] = results[i];
+        out << (i == 0 ? "\n" : ",\n") << std::setprecision(9);
+        out << "    \"" << name << "\": {\"reps\": " << summary.reps << ", \"min_s\": " << summary.min
+            << ", \"median_s\": " << summary.median << ", \"mean_s\": " << summary.mean
+            << ", \"stddev_s\": " << summary.stddev << ", \"steps\": " << summary.steps
+            << ", \"exit_code\": " << summary.exit_code << "}";
+    }
+    out << "\n  }\n}" << std::endl;
+}
+// write_json()が書いたものだけを読めればよい。workload名 => median_s
+std::map<std::string, double> read_baseline(const std::string &path, std::uint64_t &scale) {
+    std::ifstream in(path);
+    if (not in) {
+        throw std::runtime_error("error: failed to open baseline " + path);
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    auto text = buffer.str();
+    std::smatch match;
+    if (not std::regex_search(text, match, std::regex(R"("scale":\s*(\d+))"))) {
+        throw std::runtime_error("error: " + path + " is not a nyulan_bench baseline");
+    }
+    scale = std::stoull(match[1]);
+    std::map<std::string, double> result;
+    std::regex entry(R"re("(\w+)":\s*\{[^}]*"median_s":\s*([-+0-9.eE]+))re");
+    for (auto it = std::sregex_iterator(text.begin(), text.end(), entry); it != std::sregex_iterator(); it++) {
+        result[(*it)[1]] = std::stod((*it)[2]);
+    }
+    return result;
+}
+}  // namespace
+int main(int argc, char **argv) {
+    bpo::options_description opt("option");
+    opt.add_options()("help,h", "show this help")("list", "list workloads and exit")(
+        "workload,w", bpo::value<std::vector<std::string>>(), "run only these workloads (repeatable)")(
+        "scale,s", bpo::value<std::uint64_t>()->default_value(1), "multiply the work of every workload")(
+        "warmup", bpo::value<std::size_t>()->default_value(1), "untimed runs before measuring")(
+        "reps,r", bpo::value<std::size_t>()->default_value(5), "timed runs per workload")(
+        "out-dir,o", bpo::value<std::string>(), "where to write the generated objectfiles (default: a temp dir)")(
+        "save", bpo::value<std::string>(), "save the results as a JSON baseline")(
+        "baseline,b", bpo::value<std::string>(), "compare medians against a saved JSON baseline")(
+        "threshold", bpo::value<double>()->default_value(0.05),
+        "relative slowdown of the median reported as a regression")("debug,d", "enable debug outputs");
+
+    bpo::variables_map varmap;
+    bpo::store(bpo::parse_command_line(argc, argv, opt), varmap);
+    bpo::notify(varmap);
+    if (varmap.count("help")) {
+        std::cout << opt << std::endl;
+        std::exit(EXIT_SUCCESS);
+    }
+    nyulan::logging::init(varmap.count("debug") ? boost::log::trivial::debug : boost::log::trivial::warning);
+    if (varmap.count("list")) {
+        for (const auto &workload : workloads()) {
+            std::cout << std::left << std::setw(12) << workload.name << workload.description << std::endl;
+        }
+        std::exit(EXIT_SUCCESS);
+    }
+    std::vector<const Workload *> selected;
+    for (const auto &workload : workloads()) {
+        if (varmap.count("workload")) {
+            const auto &names = varmap["workload"].as<std::vector<std::string>>();
+            if (std::find(names.begin(), names.end(), workload.name) == names.end()) {
+                continue;
+            }
+        }
+        selected.push_back(&workload);
+    }
+    if (selected.empty()) {
+        std::cerr << "error: no workload selected (see --list)" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    auto scale = std::max<std::uint64_t>(varmap["scale"].as<std::uint64_t>(), 1);
+    auto warmup = varmap["warmup"].as<std::size_t>();
+    auto reps = std::max<std::size_t>(varmap["reps"].as<std::size_t>(), 1);
+    auto out_dir = varmap.count("out-dir") ? stdfsys::path(varmap["out-dir"].as<std::string>())
+                                           : stdfsys::temp_directory_path() / "nyulan_bench";
+    std::map<std::string, double> baseline;
+    std::uint64_t baseline_scale = scale;
+    try {
+        stdfsys::create_directories(out_dir);
+        if (varmap.count("baseline")) {
+            baseline = read_baseline(varmap["baseline"].as<std::string>(), baseline_scale);
+            if (baseline_scale != scale) {
+                std::cerr << "warning: the baseline was measured with --scale " << baseline_scale << std::endl;
+            }
+        }
+    } catch (const std::exception &except) {
+        std::cerr << except.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    int null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd == -1) {
+        std::cerr << "error: failed to open /dev/null" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    auto threshold = varmap["threshold"].as<double>();
+    std::vector<std::pair<std::string, Summary>> results;
+    std::size_t regressions = 0;
+    bool failed = false;
+    std::cout << std::left << std::setw(12) << "workload" << std::right << std::setw(12) << "steps" << std::setw(11)
+              << "min ms" << std::setw(11) << "median ms" << std::setw(11) << "mean ms" << std::setw(10) << "stddev"
+              << std::setw(12) << "Msteps/s" << (baseline.empty() ? "" : "  vs baseline") << std::endl;
+    for (const auto *workload : selected) {
+        try {
+            // 生成したファイルを読み直して、ローダーも通す
+            auto path = out_dir / (workload->name + ".nyu");
+            write_objectfile(path, workload->generate(scale));
+            nyulan::ObjectFile objectfile(path.string());
+            auto code = std::make_shared<const std::vector<nyulan::OneStep>>(objectfile.code);
+            auto entry_point = objectfile.find_label("_start").label_address;
+            int stdout_fd = workload->writes_stdout ? null_fd : STDOUT_FILENO;
+
+            auto counted = run_once(objectfile, code, entry_point, stdout_fd, true);
+            for (std::size_t i = 0; i < warmup; i++) {
+                run_once(objectfile, code, entry_point, stdout_fd, false);
+            }
+            std::vector<double> seconds;
+            for (std::size_t i = 0; i < reps; i++) {
+                auto run = run_once(objectfile, code, entry_point, stdout_fd, false);
+                if (run.exit_code != counted.exit_code) {
+                    throw std::runtime_error("error: exit code changed between runs (" +
+                                             std::to_string(counted.exit_code) + " => " +
+                                             std::to_string(run.exit_code) + ")");
+                }
+                seconds.push_back(run.seconds);
+            }
+            auto summary = summarize(seconds, counted.steps, counted.exit_code);
+            results.emplace_back(workload->name, summary);
+
+            std::cout << std::left << std::setw(12) << workload->name << std::right << std::setw(12) << summary.steps
+                      << std::fixed << std::setprecision(2) << std::setw(11) << summary.min * 1e3 << std::setw(11)
+                      << summary.median * 1e3 << std::setw(11) << summary.mean * 1e3 << std::setw(9)
+                      << (summary.mean == 0 ? 0.0 : summary.stddev / summary.mean * 100) << "%" << std::setw(12)
+                      << summary.steps / summary.median / 1e6;
+            if (auto found = baseline.find(workload->name); found != baseline.end() && found->second > 0) {
+                auto change = summary.median / found->second - 1;
+                std::cout << "  " << std::showpos << change * 100 << std::noshowpos << "%";
+                if (change > threshold) {
+                    std::cout << " REGRESSION";
+                    regressions++;
+                } else if (change < -threshold) {
+                    std::cout << " faster";
+                }
+            }
+            std::cout << std::endl;
+        } catch (const std::exception &except) {
+            std::cout << std::endl;
+            std::cerr << workload->name << ": " << except.what() << std::endl;
+            failed = true;
+        }
+    }
+    ::close(null_fd);
+    if (varmap.count("save")) {
+        std::ofstream out(varmap["save"].as<std::string>());
+        write_json(out, scale, results);
+        if (not out) {
+            std::cerr << "error: failed to save " << varmap["save"].as<std::string>() << std::endl;
+            failed = true;
+        }
+    }
+    if (regressions != 0) {
+        std::cerr << regressions << " workloads are slower than the baseline by more than " << threshold * 100 << "%"
+                  << std::endl;
+    }
+    return (failed || regressions != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#include "protocol.hpp"
+namespace bpo = boost::program_options;
+using nyulan::protocol::FrameType;
+// nyulanVM --serveで動いているサーバーにプログラムを実行させる
+// 起動を軽くするため、Boost.Logもオブジェクトファイルの読み込みも使わない
+int main(int argc, char **argv) {
+    bpo::options_description opt("option");
+    opt.add_options()("help,h", "show this help")("socket,S", bpo::value<std::string>(), "socket of the server")(
+        "objectfile,s", bpo::value<std::string>(), "object file (read by the server)")(
+        "hash", bpo::value<std::string>(), "hash of an object file the server has already loaded")(
+        "max-steps", bpo::value<std::uint64_t>(), "step limit")("timeout-ms", bpo::value<std::uint64_t>(),
+                                                                "time limit")(
+        "no-stdin", "don't send stdin to the program");
+
+    bpo::variables_map varmap;
+    bpo::store(bpo::parse_command_line(argc, argv, opt), varmap);
+    bpo::notify(varmap);
+    if (varmap.count("help")) {
+        std::cout << opt << std::endl;
+        std::exit(EXIT_SUCCESS);
+    }
+    if (not varmap.count("socket") || (varmap.count("objectfile") == varmap.count("hash"))) {
+        std::cerr << "error: specify --socket and either --objectfile or --hash" << std::endl;
+        std::cout << opt << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    auto socket_path = varmap["socket"].as<std::string>();
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "error: socket path is too long" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1) {
+        std::cerr << "error: failed to connect to " << socket_path << ": " << std::strerror(errno) << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    try {
+        // NOTE: サーバーは要求の途中でもERRORを送って切断することがあるので、送れなくなったらそれを読みに行く
+        bool connected = true;
+        auto send = [&](FrameType type, std::string_view payload) {
+            if (not connected) {
+                return;
+            }
+            errno = 0;
+            try {
+                nyulan::protocol::write_frame(fd, type, payload);
+            } catch (const std::exception &) {
+                if (errno != EPIPE && errno != ECONNRESET) {
+                    throw;  // 切断されたのでなければ、返事を待っても来ない
+                }
+                connected = false;
+            }
+        };
+        if (varmap.count("objectfile")) {
+            // NOTE: サーバーは別のディレクトリで動いているかもしれない
+            auto path = varmap["objectfile"].as<std::string>();
+            if (path.front() != '/') {
+                char *cwd = ::getcwd(nullptr, 0);
+                path = std::string(cwd) + "/" + path;
+                std::free(cwd);
+            }
+            send(FrameType::PROGRAM_PATH, path);
+        } else {
+            send(FrameType::PROGRAM_HASH, varmap["hash"].as<std::string>());
+        }
+        if (varmap.count("max-steps")) {
+            send(FrameType::MAX_STEPS, nyulan::protocol::encode_u64(varmap["max-steps"].as<std::uint64_t>()));
+        }
+        if (varmap.count("timeout-ms")) {
+            send(FrameType::TIMEOUT_MS, nyulan::protocol::encode_u64(varmap["timeout-ms"].as<std::uint64_t>()));
+        }
+        if (not varmap.count("no-stdin")) {
+            std::string input{std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>()};
+            // NOTE: サーバーは続けて送られたSTDINを繋げるので、フレームの上限ごとに分けて送る
+            std::string_view rest(input);
+            while (not rest.empty()) {
+                auto chunk = rest.substr(0, nyulan::protocol::MAX_PAYLOAD_SIZE);
+                send(FrameType::STDIN, chunk);
+                rest.remove_prefix(chunk.size());
+            }
+        }
+        send(FrameType::RUN, "");
+        while (auto frame = nyulan::protocol::read_frame(fd)) {
+            switch (frame->type) {
+                case FrameType::STDOUT:
+                    std::cout.write(frame->payload.data(), frame->payload.size()).flush();
+                    break;
+                case FrameType::STDERR:
+                    std::cerr.write(frame->payload.data(), frame->payload.size()).flush();
+                    break;
+                case FrameType::EXIT:
+                    return static_cast<int>(nyulan::protocol::decode_u64(frame->payload));
+                case FrameType::ERROR:
+                    std::cerr << frame->payload << std::endl;
+                    return EXIT_FAILURE;
+                default:
+                    std::cerr << "error: unexpected frame type " << static_cast<int>(frame->type) << std::endl;
+                    return EXIT_FAILURE;
+            }
+        }
+        std::cerr << "error: server closed the connection" << std::endl;
+    } catch (const std::exception &except) {
+        std::cerr << except.what() << std::endl;
+    }
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,142 @@
+#include <signal.h>
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "metrics.hpp"
+namespace bpo = boost::program_options;
+using nyulan::MetricsFile;
+// nyulanVM --metricsが書き出しているカウンタを、topのように表示する
+namespace {
+std::string state_name(MetricsFile::State state) {
+    switch (state) {
+        case MetricsFile::State::FREE:
+            return "free";
+        case MetricsFile::State::READY:
+            return "ready";
+        case MetricsFile::State::RUNNING:
+            return "running";
+        case MetricsFile::State::BLOCKED:
+            return "blocked";
+        case MetricsFile::State::FINISHED:
+            return "finished";
+        case MetricsFile::State::FAILED:
+            return "failed";
+    }
+    return "?";
+}
+std::string human(double value) {  // 1234567 => 1.2M
+    const char *units[] = {"", "k", "M", "G", "T"};
+    std::size_t unit = 0;
+    while (value >= 1000 && unit + 1 < std::size(units)) {
+        value /= 1000;
+        unit++;
+    }
+    std::ostringstream result;
+    result << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value << units[unit];
+    return result.str();
+}
+struct Previous {
+    std::uint64_t steps;
+    std::uint64_t updated_ns;
+};
+}  // namespace
+int main(int argc, char **argv) {
+    bpo::options_description opt("option");
+    opt.add_options()("help,h", "show this help")("file,f", bpo::value<std::string>(), "file given to --metrics")(
+        "interval,n", bpo::value<double>()->default_value(1.0), "seconds between updates")(
+        "once", "print once and exit")("all,a", "show finished and failed VMs too");
+    bpo::positional_options_description positional;
+    positional.add("file", 1);
+
+    bpo::variables_map varmap;
+    bpo::store(bpo::command_line_parser(argc, argv).options(opt).positional(positional).run(), varmap);
+    bpo::notify(varmap);
+    if (varmap.count("help") || not varmap.count("file")) {
+        std::cout << "usage: nyustat [option] FILE" << std::endl << opt << std::endl;
+        std::exit(varmap.count("help") ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    std::shared_ptr<MetricsFile> metrics;
+    try {
+        metrics = MetricsFile::open(varmap["file"].as<std::string>());
+    } catch (const std::exception &except) {
+        std::cerr << except.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    auto interval = std::chrono::duration<double>(varmap["interval"].as<double>());
+    bool once = varmap.count("once");
+    bool show_all = varmap.count("all");
+    std::map<std::pair<std::size_t, std::uint64_t>, Previous> previous;  // (スロット, 開始時刻) => 前回の値
+    while (true) {
+        auto summary = metrics->summary();
+        auto now = MetricsFile::now_ns();
+        bool alive = ::kill(static_cast<pid_t>(summary.pid), 0) == 0;
+        std::ostringstream screen;
+        if (not once) {
+            screen << "\x1b[H\x1b[2J";  // 画面を消して左上から
+        }
+        screen << "nyulanVM pid " << summary.pid << (alive ? "" : " (exited)") << ", up " << std::fixed
+               << std::setprecision(1) << (now - summary.started_ns) / 1e9 << " s, jobs: " << summary.jobs_started
+               << " started, " << summary.jobs_finished << " finished, " << summary.jobs_failed << " failed"
+               << std::endl;
+        screen << std::setw(5) << "SLOT" << std::setw(10) << "STATE" << std::setw(10) << "STEPS/S" << std::setw(9)
+               << "STEPS" << std::setw(9) << "BUILTINS" << std::setw(8) << "READ" << std::setw(8) << "WRITTEN"
+               << std::setw(8) << "HEAP" << std::setw(8) << "PEAK" << std::setw(7) << "EXIT" << std::setw(8)
+               << "TIME" << "  NAME" << std::endl;
+        double total_rate = 0;
+        for (std::size_t slot = 0; slot < summary.num_slots; slot++) {
+            auto values = metrics->read(slot);
+            if (values.state == MetricsFile::State::FREE) {
+                continue;
+            }
+            auto key = std::pair{slot, values.started_ns};
+            // 前回からの差分。初めて見たものは開始からの平均
+            auto since = Previous{0, values.started_ns};
+            if (auto found = previous.find(key); found != previous.end()) {
+                since = found->second;
+            }
+            double rate = 0;
+            if (values.updated_ns > since.updated_ns) {
+                rate = (values.steps - since.steps) * 1e9 / (values.updated_ns - since.updated_ns);
+            }
+            previous[key] = Previous{values.steps, values.updated_ns};
+            bool finished = values.state == MetricsFile::State::FINISHED || values.state == MetricsFile::State::FAILED;
+            if (finished) {
+                rate = 0;
+            } else {
+                total_rate += rate;
+            }
+            if (finished && not show_all) {
+                continue;
+            }
+            auto end_ns = finished ? values.updated_ns : now;
+            screen << std::setw(5) << slot << std::setw(10) << state_name(values.state) << std::setw(10) << human(rate)
+                   << std::setw(9) << human(values.steps) << std::setw(9) << human(values.builtin_calls)
+                   << std::setw(8) << human(values.bytes_read) << std::setw(8) << human(values.bytes_written)
+                   << std::setw(8) << human(values.heap_live) << std::setw(8) << human(values.heap_peak)
+                   << std::setw(7);
+            if (finished) {
+                screen << values.exit_code;
+            } else {
+                screen << "-";
+            }
+            screen << std::setw(8) << std::setprecision(1) << (end_ns - values.started_ns) / 1e9 << "  " << values.name
+                   << std::endl;
+        }
+        screen << "total " << human(total_rate) << " steps/s" << std::endl;
+        std::cout << screen.str() << std::flush;
+        if (once || not alive) {
+            break;
+        }
+        std::this_thread::sleep_for(interval);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "logging.hpp"
+#include "objectfile.hpp"
+#include "trace.hpp"
+namespace bpo = boost::program_options;
+// ndb --recordで記録したトレースを、オブジェクトファイルのdebug.addr2lineで行に直して表示する
+namespace {
+struct Symbolizer {
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> lines;
+    std::vector<std::string> files;
+
+    std::string operator()(std::uint64_t address) const {
+        if (address >= this->lines.size() || this->lines[address].first >= this->files.size()) {
+            return "@" + std::to_string(address);
+        }
+        return this->files[this->lines[address].first] + ":" + std::to_string(this->lines[address].second);
+    }
+};
+std::string end_name(nyulan::trace::EndStatus status) {
+    switch (status) {
+        case nyulan::trace::EndStatus::FINISHED:
+            return "finished";
+        case nyulan::trace::EndStatus::EXITED:
+            return "exited";
+        case nyulan::trace::EndStatus::FAILED:
+            return "failed";
+    }
+    return "?";
+}
+}  // namespace
+int main(int argc, char **argv) {
+    bpo::options_description opt("option");
+    opt.add_options()("help,h", "show this help")("objectfile,s", bpo::value<std::string>(), "object file")(
+        "trace,t", bpo::value<std::string>(), "trace recorded by ndb --record")(
+        "addresses,a", "print every executed instruction instead of every change of line")(
+        "builtins,b", "print builtin calls and their results")(
+        "summary", "print the most executed lines instead of the execution order")(
+        "top", bpo::value<std::size_t>()->default_value(20), "number of lines in --summary");
+    bpo::positional_options_description positional;
+    positional.add("trace", 1);
+
+    bpo::variables_map varmap;
+    bpo::store(bpo::command_line_parser(argc, argv).options(opt).positional(positional).run(), varmap);
+    bpo::notify(varmap);
+    if (varmap.count("help") || not varmap.count("objectfile") || not varmap.count("trace")) {
+        std::cout << "usage: nyutrace -s OBJECTFILE [option] TRACE" << std::endl << opt << std::endl;
+        std::exit(varmap.count("help") ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    nyulan::logging::init(boost::log::trivial::warning);
+    nyulan::ObjectFile objectfile;
+    try {
+        objectfile = nyulan::ObjectFile(varmap["objectfile"].as<std::string>());
+    } catch (std::exception *except) {
+        std::cerr << "failed to read objectfile" << std::endl;
+        std::cerr << except->what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    Symbolizer symbolize{objectfile.source_lines(), objectfile.source_files()};
+    bool addresses = varmap.count("addresses");
+    bool builtins = varmap.count("builtins");
+    bool summary = varmap.count("summary");
+
+    std::uint64_t num_steps = 0;
+    std::uint64_t num_builtins = 0;
+    std::map<std::string, std::uint64_t> hits;  // 行 => 実行した命令の数
+    std::string previous_line;
+    std::optional<nyulan::trace::End> end;
+    try {
+        nyulan::TraceReader reader(varmap["trace"].as<std::string>());
+        if (reader.code_hash() != nyulan::trace::hash_code(objectfile.code)) {
+            std::cerr << "error: the trace was recorded with a different program" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        // NOTE: 一行ごとにフラッシュしない
+        end = reader.walk(
+            objectfile.code,
+            [&](std::uint64_t address) {
+                num_steps++;
+                auto line = symbolize(address);
+                if (summary) {
+                    hits[line]++;
+                } else if (addresses) {
+                    std::cout << std::setw(8) << address << "  " << line << "\n";
+                } else if (line != previous_line) {
+                    std::cout << line << "\n";
+                }
+                previous_line = std::move(line);
+            },
+            [&](const nyulan::trace::Builtin &builtin) {
+                num_builtins++;
+                if (builtins && not summary) {
+                    std::cout << "  builtin " << builtin.number;
+                    if (builtin.result) {
+                        std::cout << " => " << builtin.result.value();
+                    }
+                    for (const auto &input : builtin.inputs) {
+                        std::cout << " (" << input.bytes.size() << " bytes to @" << input.address << ")";
+                    }
+                    std::cout << "\n";
+                }
+            });
+    } catch (const std::exception &except) {
+        std::cout << std::flush;
+        std::cerr << except.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    if (summary) {
+        std::vector<std::pair<std::string, std::uint64_t>> sorted(hits.begin(), hits.end());
+        std::stable_sort(sorted.begin(), sorted.end(),
+                         [](const auto &a, const auto &b) { return a.second > b.second; });
+        sorted.resize(std::min(sorted.size(), varmap["top"].as<std::size_t>()));
+        for (const auto &[line, count] : sorted) {
+            std::cout << std::setw(12) << count << "  " << line << "\n";
+        }
+    }
+    std::cout << std::flush;
+    std::cerr << num_steps << " steps, " << num_builtins << " builtin calls, ";
+    if (end) {
+        std::cerr << end_name(end->status) << " at @" << end->program_counter;
+        if (end->status == nyulan::trace::EndStatus::EXITED) {
+            std::cerr << " with exit code " << end->exit_code;
+        }
+        std::cerr << std::endl;
+    } else {
+        std::cerr << "the trace is truncated" << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -11,6 +11,7 @@
 #include <string>
 #include <utility>
 
+#include "linetable.hpp"
 #include "logging.hpp"
 namespace nyulan {
 std::vector<std::uint8_t> read_file(std::ifstream&, size_t);
@@ -52,10 +53,14 @@ ObjectFile::ObjectFile(std::string objectfilename) {
     }
     this->version = this->file_to_value<decltype(this->version)>(objectfile);
     TRIVIAL_LOG_WITH_FUNCNAME(debug) << this->version;
-    this->literal_data_size = this->file_to_value<decltype(this->literal_data_size)>(objectfile);
     if (this->version > CURRENT_OBJECTRILE_VERSION) {
         throw std::runtime_error("the format is newer than this program");
     }
+    if (this->version >= 4) {
+        this->literal_data_size = this->file_to_value<decltype(this->literal_data_size)>(objectfile);
+    } else {
+        this->literal_data_size = this->file_to_value<std::uint16_t>(objectfile);  // NOTE: obj-v3までは16bit
+    }
 
     TRIVIAL_LOG_WITH_FUNCNAME(debug) << this->literal_data_size;
     this->literal_datas = read_file(objectfile, this->literal_data_size);
@@ -99,9 +104,36 @@ ObjectFile::ObjectFile(std::string objectfilename) {
         section->data = read_file(objectfile, section->datasize);
         this->optional_sections.push_back(section);
     }
+    if (this->version >= 4) {
+        this->num_static_segments = this->file_to_value<decltype(this->num_static_segments)>(objectfile);
+    } else {
+        this->num_static_segments = 0;  // NOTE: obj-v3までは静的セグメントはなかった
+    }
+    auto position = objectfile.tellg();
+    objectfile.seekg(0, std::ios_base::end);
+    std::uint64_t file_size = objectfile.tellg();
+    objectfile.seekg(position);
+    for (size_t i = 0; i < this->num_static_segments; i++) {
+        StaticSegment segment;
+        segment.kind = static_cast<StaticSegment::Kind>(this->file_to_value<std::uint8_t>(objectfile));
+        segment.address = this->file_to_value<decltype(segment.address)>(objectfile);
+        segment.size = this->file_to_value<decltype(segment.size)>(objectfile);
+        segment.file_offset = this->file_to_value<decltype(segment.file_offset)>(objectfile);
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "static segment " << magic_enum::enum_name(segment.kind) << " @"
+                                         << segment.address << " size:" << segment.size;
+        if (segment.kind != StaticSegment::Kind::RODATA && segment.kind != StaticSegment::Kind::BSS) {
+            throw std::runtime_error("unknown static segment kind " + std::to_string(static_cast<int>(segment.kind)));
+        }
+        if (segment.kind == StaticSegment::Kind::RODATA &&
+            (segment.file_offset > file_size || segment.size > file_size - segment.file_offset)) {
+            throw std::runtime_error("static segment @" + std::to_string(segment.address) + " is out of the file");
+        }
+        this->static_segments.push_back(segment);
+    }
+    this->filename = objectfilename;
     objectfile.close();
 }  // namespace nyulan
-ObjectFile::Label ObjectFile::find_label(std::string name) {
+ObjectFile::Label ObjectFile::find_label(std::string name) const {
     for (const auto& label : this->global_labels) {
         if (label.real_name == name) {
             return label;
@@ -119,6 +151,62 @@ std::shared_ptr<ObjectFile::OptionalSection> ObjectFile::find_section(std::strin
     }
     throw std::runtime_error("section \"" + name + "\" not found");
 }
+std::vector<std::pair<std::uint64_t, std::uint64_t>> ObjectFile::source_lines() const {
+    for (const auto& section : this->optional_sections) {
+        if (section->name == LineTable::SECTION_NAME) {
+            return LineTable(*this).expand();
+        }
+    }
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> result;
+    for (const auto& section : this->optional_sections) {
+        if (section->name != "debug.addr2line" || section->data.size() < 2) {
+            continue;
+        }
+        auto to_value = [this](auto begin, std::size_t bitwidth) -> std::uint64_t {
+            std::vector<std::uint8_t> bytes(begin, begin + bitwidth / 8);
+            switch (bitwidth) {
+                case 8:
+                    return bytes[0];
+                case 16:
+                    return this->bytes_to_value<std::uint16_t>(bytes);
+                case 32:
+                    return this->bytes_to_value<std::uint32_t>(bytes);
+                case 64:
+                    return this->bytes_to_value<std::uint64_t>(bytes);
+                default:
+                    throw std::runtime_error("error: unsupported bitwidth " + std::to_string(bitwidth) +
+                                             " in debug.addr2line");
+            }
+        };
+        std::size_t src_bitwidth = section->data[0];
+        std::size_t line_bitwidth = section->data[1];
+        auto entry_size = (src_bitwidth + line_bitwidth) / 8;
+        for (std::size_t offset = 2; entry_size != 0 && offset + entry_size <= section->data.size();
+             offset += entry_size) {
+            auto entry = section->data.begin() + offset;
+            result.emplace_back(to_value(entry, src_bitwidth), to_value(entry + src_bitwidth / 8, line_bitwidth));
+        }
+    }
+    return result;
+}
+std::vector<std::string> ObjectFile::source_files() const {
+    std::vector<std::string> result;
+    for (const auto& section : this->optional_sections) {
+        if (section->name != "debug.sourcefiles") {
+            continue;
+        }
+        std::string filename;
+        for (auto datum : section->data) {
+            if (datum != '\0') {
+                filename.push_back(datum);
+            } else {
+                result.push_back(filename);
+                filename.clear();
+            }
+        }
+    }
+    return result;
+}
 std::string ObjectFile::pretty() {
     std::stringstream result;
     result << "nyulan objectfile v" << this->version << std::endl;
@@ -172,8 +260,82 @@ std::string ObjectFile::pretty() {
         result << "section \"" << section->name << "\""
                << " datasize:" << section->datasize << std::endl;
     }
+    for (const auto& segment : this->static_segments) {
+        result << "static segment " << magic_enum::enum_name(segment.kind) << " @" << std::dec << segment.address
+               << " size:" << segment.size;
+        if (segment.kind == StaticSegment::Kind::RODATA) {
+            result << " file offset:" << segment.file_offset;
+        }
+        result << std::endl;
+    }
     return result.str();
 }
+void ObjectFile::save(const std::string& path) const {
+    std::vector<std::uint8_t> out;
+    auto put = [&out](const std::vector<std::uint8_t>& bytes) { out.insert(out.end(), bytes.begin(), bytes.end()); };
+    auto put_string = [&out](const std::string& value) {
+        out.insert(out.end(), value.begin(), value.end());
+        out.push_back('\0');
+    };
+    out.insert(out.end(), {'N', 'Y', 'U'});
+    if (this->endian == Endian::LITTLE) {
+        out.insert(out.end(), {0x00, 0x11});
+    } else {
+        out.insert(out.end(), {0x11, 0x00});
+    }
+    put(this->value_to_bytes<std::uint64_t>(CURRENT_OBJECTRILE_VERSION));
+    put(this->value_to_bytes<std::uint64_t>(this->literal_datas.size()));
+    put(this->literal_datas);
+    put(this->value_to_bytes<std::uint16_t>(this->global_labels.size()));
+    for (const auto& label : this->global_labels) {
+        put_string(label.real_name);
+        put(this->value_to_bytes<std::uint64_t>(label.label_address));
+    }
+    put(this->value_to_bytes<std::uint64_t>(this->instruction_set_version));
+    put(this->value_to_bytes<std::uint64_t>(this->code.size()));
+    for (auto step : this->code) {
+        put(this->value_to_bytes<OneStep::ValueType>(step.value()));
+    }
+    put(this->value_to_bytes<std::uint64_t>(this->optional_sections.size()));
+    for (const auto& section : this->optional_sections) {
+        put_string(section->name);
+        put(this->value_to_bytes<std::uint64_t>(section->data.size()));
+        put(section->data);
+    }
+    put(this->value_to_bytes<std::uint64_t>(this->static_segments.size()));
+    // NOTE: RODATAの中身は表の直後に順に置く。位置が変わるので、元のファイルから読んで写す
+    constexpr std::size_t SEGMENT_ENTRY_SIZE = 1 + 3 * sizeof(std::uint64_t);
+    std::uint64_t position = out.size() + SEGMENT_ENTRY_SIZE * this->static_segments.size();
+    std::vector<std::uint8_t> contents;
+    std::ifstream original;
+    for (const auto& segment : this->static_segments) {
+        auto file_offset = segment.file_offset;
+        if (segment.kind == StaticSegment::Kind::RODATA) {
+            if (not original.is_open()) {
+                original.open(this->filename, std::ios_base::in | std::ios_base::binary);
+            }
+            original.seekg(static_cast<std::streamoff>(segment.file_offset));
+            auto data = read_file(original, segment.size);
+            if (not original) {
+                throw std::runtime_error("error: couldn't read RODATA @" + std::to_string(segment.address) +
+                                         " from " + this->filename);
+            }
+            file_offset = position + contents.size();
+            contents.insert(contents.end(), data.begin(), data.end());
+        }
+        out.push_back(static_cast<std::uint8_t>(segment.kind));
+        put(this->value_to_bytes<std::uint64_t>(segment.address));
+        put(this->value_to_bytes<std::uint64_t>(segment.size));
+        put(this->value_to_bytes<std::uint64_t>(file_offset));
+    }
+    put(contents);
+
+    std::ofstream file(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+    if (not file) {
+        throw std::runtime_error("error: couldn't write objectfile " + path);
+    }
+}
 std::vector<std::uint8_t> read_file(std::ifstream& file, size_t n) {
     std::vector<std::uint8_t> result;
     result.reserve(n);
@@ -16,13 +16,13 @@ enum class Endian {
     BIG,
 };
 
-constexpr std::uint64_t CURRENT_OBJECTRILE_VERSION = 3;
+constexpr std::uint64_t CURRENT_OBJECTRILE_VERSION = 4;
 struct ObjectFile {
     char magic[3 + 1];        //{'N','Y','U','\0'}(NULは読み取り時に追記される)
     std::uint8_t bom[2 + 1];  // 0x1100
     Endian endian;
     std::uint64_t version;
-    std::uint16_t literal_data_size;
+    std::uint64_t literal_data_size;  // obj-v3までは16bit
     std::vector<std::uint8_t> literal_datas;
     std::uint16_t global_label_num;
     struct Label {
@@ -42,17 +42,28 @@ struct ObjectFile {
         std::vector<std::uint8_t> data;
     };
     std::vector<std::shared_ptr<OptionalSection>> optional_sections;
+    // ここからv4 RODATAの中身は、file_offsetの指すファイル上の位置にある(この表の後ろに置くのがよい)
+    std::uint64_t num_static_segments;
+    std::vector<StaticSegment> static_segments;  // 各要素はkind(8bit),address,size,file_offset(各64bit)
+    std::string filename;  // NOTE: RODATAをmmapするのに必要なだけで、実際のファイル上には無い
 
     ObjectFile(std::string objectfilename);
     ObjectFile() = default;
 
-    Label find_label(std::string name);
+    Label find_label(std::string name) const;
     std::shared_ptr<OptionalSection> find_section(std::string name);
+    // debug.addr2line(かdebug.linetable)、debug.sourcefilesを展開したもの。セクションが無ければ空
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> source_lines() const;  // アドレスごとの(ファイル番号, 行)
+    std::vector<std::string> source_files() const;
     std::string pretty();
+    // 今の内容をobj-v4で書き出す。RODATAの中身は、読み込んだファイル(filename)から写す
+    void save(const std::string &path) const;
 
     template <typename T>
     T bytes_to_value(
         std::vector<std::uint8_t> bytes) const;  //中で変更するかもなので、参照ではなくコピーを受ける！必ず！
+    template <typename T>
+    std::vector<std::uint8_t> value_to_bytes(T value) const;  // bytes_to_value()の逆
    private:
     template <typename T>
     T file_to_value(std::ifstream &);  //ファイルを読んだことによる変更を外に波及させたいので、参照
@@ -1,5 +1,7 @@
 #ifndef NYULAN_OBJECTFILE_TEMPLATES
 #define NYULAN_OBJECTFILE_TEMPLATES
+#include <cstring>
+
 #include "objectfile.hpp"  //こっちからインクルードされるからいらないが、リンターのエラーを抑えるため
 namespace nyulan {
 template <typename T>
@@ -23,5 +25,14 @@ T ObjectFile::bytes_to_value(std::vector<std::uint8_t> bytes) const {
     }
     return *reinterpret_cast<T*>(bytes.data());
 }
+template <typename T>
+std::vector<std::uint8_t> ObjectFile::value_to_bytes(T value) const {
+    std::vector<std::uint8_t> bytes(sizeof(T));
+    std::memcpy(bytes.data(), &value, sizeof(T));
+    if (utils::native_endian != (this->endian == Endian::LITTLE ? utils::Endian::LITTLE : utils::Endian::BIG)) {
+        std::reverse(bytes.begin(), bytes.end());
+    }
+    return bytes;
+}
 }  // namespace nyulan
 #endif
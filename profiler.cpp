@@ -0,0 +1,174 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <iomanip>
+#include <set>
+
+namespace nyulan {
+namespace {
+// 多い順に上位top件
+template <class Key>
+std::vector<std::pair<Key, std::uint64_t>> top_of(const std::map<Key, std::uint64_t> &counts, std::size_t top) {
+    std::vector<std::pair<Key, std::uint64_t>> result(counts.begin(), counts.end());
+    std::stable_sort(result.begin(), result.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    result.resize(std::min(result.size(), top));
+    return result;
+}
+void write_percent(std::ostream &out, std::uint64_t count, std::uint64_t total) {
+    out << std::fixed << std::setprecision(2) << std::setw(7) << (total == 0 ? 0.0 : 100.0 * count / total) << "% "
+        << std::setw(9) << count << "  ";
+}
+}  // namespace
+
+void Profiler::Symbols::find_blocks(const std::vector<OneStep> &code) {
+    this->code_size = code.size();
+    std::set<std::uint64_t> starts{0};
+    for (const auto &[address, name] : this->functions) {
+        starts.insert(address);
+    }
+    for (std::uint64_t address = 0; address < code.size(); address++) {
+        switch (static_cast<Instruction>(((code[address] & 0b1111'1111'0000'0000) >> 8).value())) {
+            case Instruction::IFZ:
+            case Instruction::IFP:
+            case Instruction::IFN:
+            case Instruction::GOTO:
+            case Instruction::CALL:
+            case Instruction::RET:
+                starts.insert(address + 1);
+                break;
+            default:
+                break;
+        }
+    }
+    this->block_starts.assign(starts.begin(), starts.end());
+}
+std::string Profiler::Symbols::function_of(std::uint64_t address, bool with_offset) const {
+    auto next = std::upper_bound(this->functions.begin(), this->functions.end(), address,
+                                 [](std::uint64_t address, const auto &function) { return address < function.first; });
+    if (next == this->functions.begin()) {
+        return "@" + std::to_string(address);
+    }
+    auto function = std::prev(next);
+    if (not with_offset || function->first == address) {
+        return function->second;
+    }
+    return function->second + "+" + std::to_string(address - function->first);
+}
+std::string Profiler::Symbols::line_of(std::uint64_t address) const {
+    if (address >= this->lines.size()) {
+        return "";
+    }
+    auto [filenum, line] = this->lines[address];
+    auto filename = filenum < this->sourcefiles.size()
+                        ? std::filesystem::path(this->sourcefiles[filenum]).filename().string()
+                        : "#" + std::to_string(filenum);
+    return filename + ":" + std::to_string(line);
+}
+std::pair<std::uint64_t, std::uint64_t> Profiler::Symbols::block_of(std::uint64_t address) const {
+    auto next = std::upper_bound(this->block_starts.begin(), this->block_starts.end(), address);
+    auto begin = next == this->block_starts.begin() ? 0 : *std::prev(next);
+    auto end = next == this->block_starts.end() ? std::max(this->code_size, address + 1) : *next;
+    return {begin, end};
+}
+
+Profiler::Profiler(std::chrono::microseconds interval, std::uint64_t period_steps)
+    : interval_(std::max(interval, std::chrono::microseconds(1))), period_steps_(period_steps) {
+    if (this->period_steps_ != 0) {
+        return;  // タイマーはいらない
+    }
+    this->timer_ = std::thread([this] {
+        std::unique_lock lock(this->timer_mutex_);
+        auto next = std::chrono::steady_clock::now() + this->interval_;
+        while (not this->timer_cv_.wait_until(lock, next, [this] { return this->stopping_; })) {
+            this->tick_.fetch_add(1, std::memory_order_relaxed);
+            next += this->interval_;
+        }
+    });
+}
+Profiler::~Profiler() {
+    if (this->timer_.joinable()) {
+        {
+            std::lock_guard lock(this->timer_mutex_);
+            this->stopping_ = true;
+        }
+        this->timer_cv_.notify_all();
+        this->timer_.join();
+    }
+}
+void Profiler::sample(Address program_counter, const std::stack<Address> &call_stack) {
+    auto callers = call_stack;  // NOTE: サンプルを取るときだけなので、コピーしてよい
+    auto depth = std::min(callers.size(), MAX_DEPTH - 1);
+    std::vector<std::uint64_t> frames(depth + 1);
+    frames[depth] = program_counter.value();
+    for (auto i = depth; i > 0; i--) {
+        frames[i - 1] = callers.top().value();
+        callers.pop();
+    }
+    std::lock_guard lock(this->mutex_);
+    this->num_samples_++;
+    this->stacks_[std::move(frames)]++;
+}
+std::uint64_t Profiler::num_samples() const {
+    std::lock_guard lock(this->mutex_);
+    return this->num_samples_;
+}
+
+void Profiler::write_report(std::ostream &out, const Symbols &symbols, std::size_t top) const {
+    std::lock_guard lock(this->mutex_);
+    std::map<std::uint64_t, std::uint64_t> addresses;
+    std::map<std::uint64_t, std::uint64_t> blocks;
+    std::map<std::string, std::uint64_t> self;
+    std::map<std::string, std::uint64_t> total;  // 再帰していても、一つのサンプルは一度だけ数える
+    for (const auto &[frames, count] : this->stacks_) {
+        addresses[frames.back()] += count;
+        blocks[symbols.block_of(frames.back()).first] += count;
+        self[symbols.function_of(frames.back(), false)] += count;
+        std::set<std::string> seen;
+        for (auto frame : frames) {
+            if (seen.insert(symbols.function_of(frame, false)).second) {
+                total[symbols.function_of(frame, false)] += count;
+            }
+        }
+    }
+    out << "samples: " << this->num_samples_ << " (";
+    if (this->period_steps_ != 0) {
+        out << "every " << this->period_steps_ << " steps)" << std::endl;
+    } else {
+        out << "every " << this->interval_.count() << " us)" << std::endl;
+    }
+    out << std::endl << "hot addresses:" << std::endl;
+    for (const auto &[address, count] : top_of(addresses, top)) {
+        write_percent(out, count, this->num_samples_);
+        out << "@" << address << "  " << symbols.function_of(address) << "  " << symbols.line_of(address) << std::endl;
+    }
+    out << std::endl << "hot basic blocks:" << std::endl;
+    for (const auto &[begin, count] : top_of(blocks, top)) {
+        auto end = symbols.block_of(begin).second;
+        write_percent(out, count, this->num_samples_);
+        out << "@" << begin << "-@" << end - 1 << "  " << symbols.function_of(begin) << "  " << symbols.line_of(begin)
+            << std::endl;
+    }
+    out << std::endl << "hot functions (self, total):" << std::endl;
+    for (const auto &[name, count] : top_of(self, top)) {
+        write_percent(out, count, this->num_samples_);
+        write_percent(out, total[name], this->num_samples_);
+        out << name << std::endl;
+    }
+}
+void Profiler::write_collapsed(std::ostream &out, const Symbols &symbols) const {
+    std::lock_guard lock(this->mutex_);
+    std::map<std::string, std::uint64_t> collapsed;  // 関数名にすると同じになるスタックをまとめる
+    for (const auto &[frames, count] : this->stacks_) {
+        std::string line;
+        for (auto frame : frames) {
+            line += (line.empty() ? "" : ";") + symbols.function_of(frame, false);
+        }
+        collapsed[line] += count;
+    }
+    for (const auto &[line, count] : collapsed) {
+        out << line << " " << count << "\n";
+    }
+    out.flush();
+}
+}  // namespace nyulan
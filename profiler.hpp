@@ -0,0 +1,89 @@
+#ifndef NYULAN_PROFILER
+#define NYULAN_PROFILER
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stack>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "nyulan.hpp"
+namespace nyulan {
+// プログラムカウンタとコールスタックのサンプリングプロファイラ
+// VMは命令ごとにdue()を確かめ、trueのときだけsample()を呼ぶ。サンプルを取らない命令ではロックも取らない
+// NOTE: タイマーは実時間なので、BLOCKEDで止まっている間の分は再開後の命令に付く。Schedulerで待たされている分は付かない
+class Profiler {
+   public:
+    static constexpr std::size_t MAX_DEPTH = 256;  // これより深いコールスタックは、内側だけを残す
+
+    // 表示用の情報。オブジェクトファイルから作る
+    struct Symbols {
+        std::vector<std::pair<std::uint64_t, std::string>> functions;  // グローバルラベル。アドレス順
+        std::vector<std::string> sourcefiles;
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> lines;  // アドレスごとの(ファイル番号, 行) 無ければ空
+        std::vector<std::uint64_t> block_starts;                     // 基本ブロックの先頭。アドレス順
+        std::uint64_t code_size = 0;
+
+        // ラベル、分岐命令の次を基本ブロックの先頭とする
+        // NOTE: 分岐先はレジスタで与えられるので、ラベルの付いていない分岐先では区切れない
+        void find_blocks(const std::vector<OneStep> &code);
+        std::string function_of(std::uint64_t address, bool with_offset = true) const;  // ラベル+オフセット
+        std::string line_of(std::uint64_t address) const;  // ファイル名:行 分からなければ空
+        std::pair<std::uint64_t, std::uint64_t> block_of(std::uint64_t address) const;  // [先頭, 末尾)
+    };
+    struct Clock {  // VMごとの状態
+        std::uint64_t countdown;
+        std::uint64_t last_tick;
+    };
+
+    // period_stepsが0でなければその命令数ごとに、そうでなければintervalごとにサンプルを取る
+    Profiler(std::chrono::microseconds interval, std::uint64_t period_steps = 0);
+    ~Profiler();  // タイマーを止める
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    Clock start_clock() const { return Clock{this->period_steps_, this->tick_.load(std::memory_order_relaxed)}; }
+    bool due(Clock &clock) const {
+        if (this->period_steps_ != 0) {
+            if (--clock.countdown != 0) {
+                return false;
+            }
+            clock.countdown = this->period_steps_;
+            return true;
+        }
+        auto tick = this->tick_.load(std::memory_order_relaxed);
+        if (tick == clock.last_tick) {
+            return false;
+        }
+        clock.last_tick = tick;
+        return true;
+    }
+    void sample(Address program_counter, const std::stack<Address> &call_stack);
+    std::uint64_t num_samples() const;
+
+    // アドレス、基本ブロック、関数ごとの上位top件
+    void write_report(std::ostream &out, const Symbols &symbols, std::size_t top) const;
+    // flamegraph.plなどが読む「呼び出し元;...;関数 サンプル数」の形式
+    void write_collapsed(std::ostream &out, const Symbols &symbols) const;
+
+   private:
+    std::chrono::microseconds interval_;
+    std::uint64_t period_steps_;
+    std::atomic<std::uint64_t> tick_ = 0;
+    std::thread timer_;
+    std::mutex timer_mutex_;
+    std::condition_variable timer_cv_;
+    bool stopping_ = false;
+
+    mutable std::mutex mutex_;
+    std::uint64_t num_samples_ = 0;
+    std::map<std::vector<std::uint64_t>, std::uint64_t> stacks_;  // 外側の呼び出し元から順に、最後がPC => サンプル数
+};
+}  // namespace nyulan
+#endif
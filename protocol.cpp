@@ -0,0 +1,112 @@
+#include "protocol.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace nyulan {
+namespace protocol {
+namespace {
+// 全部読めたらtrue、最初のバイトの前で閉じられていればfalse
+bool read_exactly(int fd, char *buffer, std::size_t len) {
+    std::size_t done = 0;
+    while (done < len) {
+        auto result = ::read(fd, buffer + done, len - done);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1) {
+            throw std::runtime_error(std::string("error: failed to read frame: ") + std::strerror(errno));
+        }
+        if (result == 0) {
+            if (done == 0) {
+                return false;
+            }
+            throw std::runtime_error("error: connection closed in the middle of a frame");
+        }
+        done += result;
+    }
+    return true;
+}
+void write_exactly(int fd, const char *buffer, std::size_t len) {
+    std::size_t done = 0;
+    while (done < len) {
+        // NOTE: 相手が先に閉じてもSIGPIPEで落ちないように
+        auto result = ::send(fd, buffer + done, len - done, MSG_NOSIGNAL);
+        if (result == -1 && errno == ENOTSOCK) {
+            result = ::write(fd, buffer + done, len - done);
+        }
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1) {
+            throw std::runtime_error(std::string("error: failed to write frame: ") + std::strerror(errno));
+        }
+        done += result;
+    }
+}
+}  // namespace
+std::optional<Frame> read_frame(int fd) {
+    char header[5];
+    if (not read_exactly(fd, header, sizeof(header))) {
+        return std::nullopt;
+    }
+    std::uint32_t len = 0;
+    for (std::size_t i = 0; i < 4; i++) {
+        len |= static_cast<std::uint32_t>(static_cast<std::uint8_t>(header[1 + i])) << (8 * i);
+    }
+    if (len > MAX_PAYLOAD_SIZE) {
+        throw std::runtime_error("error: frame of " + std::to_string(len) + " bytes is too large");
+    }
+    Frame frame{static_cast<FrameType>(header[0]), std::string(len, '\0')};
+    if (len != 0 && not read_exactly(fd, frame.payload.data(), len)) {
+        throw std::runtime_error("error: connection closed in the middle of a frame");
+    }
+    return frame;
+}
+void write_frame(int fd, FrameType type, std::string_view payload) {
+    if (payload.size() > MAX_PAYLOAD_SIZE) {
+        throw std::runtime_error("error: frame of " + std::to_string(payload.size()) + " bytes is too large");
+    }
+    std::string frame(5, '\0');
+    frame[0] = static_cast<char>(type);
+    for (std::size_t i = 0; i < 4; i++) {
+        frame[1 + i] = static_cast<char>((payload.size() >> (8 * i)) & 0b1111'1111);
+    }
+    frame.append(payload);  // NOTE: 一度のsendで送るため
+    write_exactly(fd, frame.data(), frame.size());
+}
+std::string encode_u64(std::uint64_t value) {
+    std::string result(8, '\0');
+    for (std::size_t i = 0; i < 8; i++) {
+        result[i] = static_cast<char>((value >> (8 * i)) & 0b1111'1111);
+    }
+    return result;
+}
+std::uint64_t decode_u64(std::string_view bytes) {
+    if (bytes.size() != 8) {
+        throw std::runtime_error("error: expected 8 bytes but got " + std::to_string(bytes.size()));
+    }
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < 8; i++) {
+        value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(bytes[i])) << (8 * i);
+    }
+    return value;
+}
+std::string hash_program(std::string_view bytes) {
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (auto byte : bytes) {
+        hash ^= static_cast<std::uint8_t>(byte);
+        hash *= 0x100000001b3;
+    }
+    std::stringstream result;
+    result << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return result.str();
+}
+}  // namespace protocol
+}  // namespace nyulan
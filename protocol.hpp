@@ -0,0 +1,40 @@
+#ifndef NYULAN_PROTOCOL
+#define NYULAN_PROTOCOL
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace nyulan {
+// nyulanVM --serveとクライアントの間の、Unixドメインソケット上のやり取り
+// フレームは 種類(1バイト) 長さ(4バイト、リトルエンディアン) 中身 の並び
+// クライアントはPROGRAM_PATHかPROGRAM_HASH、必要ならMAX_STEPS、TIMEOUT_MS、STDIN(何度でも)を送り、最後にRUNを送る
+// サーバーはSTDOUT、STDERRを出力されるたびに送り、最後にEXITかERRORを送る
+namespace protocol {
+enum class FrameType : std::uint8_t {
+    PROGRAM_PATH = 1,  // オブジェクトファイルのパス
+    PROGRAM_HASH = 2,  // 一度読み込まれたオブジェクトファイルのhash_program()の16進表記
+    MAX_STEPS = 3,     // u64
+    TIMEOUT_MS = 4,    // u64
+    STDIN = 5,
+    RUN = 6,
+    STDOUT = 64,
+    STDERR = 65,
+    EXIT = 66,   // u64 終了コード(EXITされなければ0)
+    ERROR = 67,  // メッセージ
+};
+struct Frame {
+    FrameType type;
+    std::string payload;
+};
+constexpr std::uint32_t MAX_PAYLOAD_SIZE = 64 * 1024 * 1024;
+
+// 相手が閉じていればnullopt
+std::optional<Frame> read_frame(int fd);
+void write_frame(int fd, FrameType type, std::string_view payload);
+std::string encode_u64(std::uint64_t value);
+std::uint64_t decode_u64(std::string_view bytes);
+std::string hash_program(std::string_view bytes);  // FNV-1a 64bit
+}  // namespace protocol
+}  // namespace nyulan
+#endif
@@ -2,6 +2,7 @@
 #include <boost/program_options.hpp>
 #include <iostream>
 
+#include "linetable.hpp"
 #include "logging.hpp"
 #include "objectfile.hpp"
 #include "utils.hpp"
@@ -9,7 +10,10 @@ namespace bpo = boost::program_options;
 int main(int argc, char **argv) {
     bpo::options_description opt("option");
     opt.add_options()("help,h", "show this help")("objectfile,s", bpo::value<std::string>(), "object file")(
-        "hexdump-sections,S", "dump sections' contents")("debug,d", "enable debug outputs");
+        "hexdump-sections,S", "dump sections' contents")(
+        "compact-line-table,c", bpo::value<std::string>(),
+        "write a copy of the objectfile here, with debug.addr2line replaced by the smaller debug.linetable")(
+        "debug,d", "enable debug outputs");
 
     bpo::variables_map varmap;
     bpo::store(bpo::parse_command_line(argc, argv, opt), varmap);
@@ -36,6 +40,31 @@ int main(int argc, char **argv) {
         std::cerr << except->what() << std::endl;
         exit(EXIT_FAILURE);
     }
+    if (varmap.count("compact-line-table")) {
+        try {
+            auto &sections = objectfile.optional_sections;
+            auto section = std::make_shared<nyulan::ObjectFile::OptionalSection>();
+            section->parent = &objectfile;
+            section->name = nyulan::LineTable::SECTION_NAME;
+            section->data = nyulan::LineTable(objectfile).encode();
+            section->datasize = section->data.size();
+            std::uint64_t old_size = 0;
+            std::erase_if(sections, [&old_size](const auto &existing) {
+                if (existing->name == "debug.addr2line" || existing->name == nyulan::LineTable::SECTION_NAME) {
+                    old_size += existing->datasize;
+                    return true;
+                }
+                return false;
+            });
+            sections.push_back(section);
+            objectfile.save(varmap["compact-line-table"].as<std::string>());
+            std::cout << "line table: " << old_size << " bytes => " << section->datasize << " bytes" << std::endl;
+        } catch (const std::exception &except) {
+            std::cerr << except.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
     if (not varmap.count("hexdump-sections")) {
         std::cout << objectfile.pretty() << std::endl;
     } else {
@@ -0,0 +1,288 @@
+#include "scheduler.hpp"
+
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+#include "logging.hpp"
+namespace nyulan {
+namespace {
+std::vector<int> allowed_cpus() {
+    cpu_set_t set;
+    std::vector<int> result;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                result.push_back(cpu);
+            }
+        }
+    }
+    return result;
+}
+// /sys/devices/system/cpu/cpu<N>/node<M> から。分からなければ0
+int node_of_cpu(int cpu) {
+    std::error_code error;
+    auto directory = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    for (const auto &entry : std::filesystem::directory_iterator(directory, error)) {
+        auto name = entry.path().filename().string();
+        if (name.starts_with("node") && name.size() > 4 &&
+            std::all_of(name.begin() + 4, name.end(), [](char c) { return '0' <= c && c <= '9'; })) {
+            return std::stoi(name.substr(4));
+        }
+    }
+    return 0;
+}
+}  // namespace
+Scheduler::Scheduler(std::size_t num_workers, std::uint64_t quantum, bool pin_workers) : quantum_(quantum) {
+    this->epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd_ == -1) {
+        throw std::runtime_error(std::string("error: failed to create epoll: ") + std::strerror(errno));
+    }
+    this->wakeup_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (this->wakeup_fd_ == -1) {
+        ::close(this->epoll_fd_);
+        throw std::runtime_error(std::string("error: failed to create eventfd: ") + std::strerror(errno));
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = this->wakeup_fd_;
+    epoll_ctl(this->epoll_fd_, EPOLL_CTL_ADD, this->wakeup_fd_, &event);
+
+    num_workers = std::max<std::size_t>(num_workers, 1);
+    auto cpus = pin_workers ? allowed_cpus() : std::vector<int>{};
+    std::vector<std::pair<int, int>> placements(num_workers, {-1, -1});  // ワーカーごとの(CPU, ノード)
+    for (size_t i = 0; i < num_workers && not cpus.empty(); i++) {
+        auto cpu = cpus[i % cpus.size()];
+        auto node = node_of_cpu(cpu);
+        placements[i] = {cpu, node};
+        // NOTE: ワーカーが動き出してから大きさを変えないように、先に決める
+        this->node_ready_.resize(std::max<std::size_t>(this->node_ready_.size(), node + 1));
+    }
+    for (auto [cpu, node] : placements) {
+        this->workers_.emplace_back([this, cpu, node] { this->work(cpu, node); });
+    }
+    this->poller_ = std::thread([this] { this->poll(); });
+}
+Scheduler::~Scheduler() {
+    this->wait_all();
+    {
+        std::lock_guard lock(this->mutex_);
+        this->stopping_ = true;
+    }
+    this->ready_cv_.notify_all();
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(this->wakeup_fd_, &one, sizeof(one));
+    for (auto &worker : this->workers_) {
+        worker.join();
+    }
+    this->poller_.join();
+    ::close(this->wakeup_fd_);
+    ::close(this->epoll_fd_);
+}
+Scheduler::TaskId Scheduler::submit(std::unique_ptr<VirtualMachine> vm, OnFinish on_finish) {
+    vm->suspend_on_channel_wait(true);  // ワーカースレッドを止めないように
+    auto task = new Task{0, std::move(vm), std::move(on_finish)};
+    TaskId id;
+    {
+        std::lock_guard lock(this->mutex_);
+        id = task->id = this->next_id_++;
+        this->live_tasks_++;
+        this->ready_.push_back(task);
+        this->num_ready_++;
+    }
+    this->ready_cv_.notify_one();
+    return id;  // NOTE: taskはもう終わって消えているかもしれない
+}
+void Scheduler::wait_all() {
+    std::unique_lock lock(this->mutex_);
+    this->idle_cv_.wait(lock, [this] { return this->live_tasks_ == 0; });
+}
+
+void Scheduler::work(int cpu, int node) {
+    if (cpu != -1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            TRIVIAL_LOG_WITH_FUNCNAME(warning) << "failed to pin worker to cpu " << cpu << ": " << std::strerror(errno);
+        }
+    }
+    while (true) {
+        Task *task;
+        {
+            std::unique_lock lock(this->mutex_);
+            this->ready_cv_.wait(lock, [this] { return this->stopping_ || this->num_ready_ != 0; });
+            if (this->num_ready_ == 0) {
+                return;
+            }
+            task = this->pop_ready(node);
+        }
+        if (task->node == -1 && node != -1) {
+            // NOTE: まだ触っていないページは、このノードに置かれる
+            task->node = node;
+            task->vm->prefer_memory_node(node);
+        }
+        // NOTE: finish()はtaskを消すので、resume()が投げたものだけを捕まえる
+        ExecResult result;
+        try {
+            result = task->vm->resume(this->quantum_);
+        } catch (...) {
+            this->finish(task, ExecResult{ExecStatus::FINISHED, 0}, std::current_exception());
+            continue;
+        }
+        switch (result.status) {
+            case ExecStatus::SUSPENDED:
+                this->make_ready(task);  // 後ろに並び直す
+                break;
+            case ExecStatus::BLOCKED:
+                this->wait_io(task, task->vm->blocked_on().value());
+                break;
+            default:
+                this->finish(task, result, nullptr);
+                break;
+        }
+    }
+}
+void Scheduler::poll() {
+    constexpr int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        auto num_events = epoll_wait(this->epoll_fd_, events, MAX_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno != EINTR) {
+                TRIVIAL_LOG_WITH_FUNCNAME(error) << "epoll_wait failed: " << std::strerror(errno);
+            }
+            continue;
+        }
+        for (int i = 0; i < num_events; i++) {
+            auto fd = events[i].data.fd;
+            if (fd == this->wakeup_fd_) {
+                return;  // デストラクタから起こされた
+            }
+            std::vector<Task *> ready;
+            {
+                std::lock_guard lock(this->io_mutex_);
+                auto waiters = this->fd_waiters_.find(fd);
+                if (waiters == this->fd_waiters_.end()) {
+                    continue;
+                }
+                auto happened = events[i].events;
+                auto failed = (happened & (EPOLLERR | EPOLLHUP)) != 0;  // どちらを待っていても起こす
+                auto take = [&ready](std::vector<Task *> &tasks) {
+                    ready.insert(ready.end(), tasks.begin(), tasks.end());
+                    tasks.clear();
+                };
+                if (failed || (happened & EPOLLIN) != 0) {
+                    take(waiters->second.readers);
+                }
+                if (failed || (happened & EPOLLOUT) != 0) {
+                    take(waiters->second.writers);
+                }
+                if (waiters->second.readers.empty() && waiters->second.writers.empty()) {
+                    epoll_ctl(this->epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+                    this->fd_waiters_.erase(waiters);
+                } else {
+                    this->watch_fd_unlocked(fd, waiters->second, EPOLL_CTL_MOD);  // 残りのために登録し直す
+                }
+            }
+            for (auto task : ready) {
+                this->make_ready(task);
+            }
+        }
+    }
+}
+// 自分のノードのもの、まだ割り当てていないもの、他のノードのものの順に探す。呼ぶ前にmutex_を取り、num_ready_を確かめること
+Scheduler::Task *Scheduler::pop_ready(int node) {
+    auto pop = [this](std::deque<Task *> &queue) {
+        auto task = queue.front();
+        queue.pop_front();
+        this->num_ready_--;
+        return task;
+    };
+    if (node != -1 && not this->node_ready_[node].empty()) {
+        return pop(this->node_ready_[node]);
+    }
+    if (not this->ready_.empty()) {
+        return pop(this->ready_);
+    }
+    for (auto &queue : this->node_ready_) {
+        if (not queue.empty()) {
+            return pop(queue);  // 遊ばせるよりは、遠いメモリでも動かす
+        }
+    }
+    throw std::logic_error("error: no ready task");
+}
+void Scheduler::make_ready(Task *task) {
+    {
+        std::lock_guard lock(this->mutex_);
+        (task->node == -1 ? this->ready_ : this->node_ready_[task->node]).push_back(task);
+        this->num_ready_++;
+    }
+    this->ready_cv_.notify_one();
+}
+void Scheduler::wait_io(Task *task, IoWait wait) {
+    int error_number;
+    {
+        std::lock_guard lock(this->io_mutex_);
+        auto [waiters, added] = this->fd_waiters_.try_emplace(wait.fd);
+        auto &tasks = wait.for_write ? waiters->second.writers : waiters->second.readers;
+        tasks.push_back(task);
+        if (this->watch_fd_unlocked(wait.fd, waiters->second, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD)) {
+            return;
+        }
+        error_number = errno;
+        tasks.pop_back();
+        if (added) {
+            this->fd_waiters_.erase(waiters);
+        }
+    }
+    if (error_number == EPERM) {  // 通常のファイルなどepollできないものは、いつでも読み書きできる
+        this->make_ready(task);
+        return;
+    }
+    auto error = std::make_exception_ptr(std::runtime_error("error: failed to wait for fd " + std::to_string(wait.fd) +
+                                                            ": " + std::strerror(error_number)));
+    this->finish(task, ExecResult{ExecStatus::BLOCKED, 0}, error);
+}
+// EPOLLONESHOTなので、起こされるたびに待っている向きで登録し直す
+bool Scheduler::watch_fd_unlocked(int fd, const FdWaiters &waiters, int op) {
+    epoll_event event{};
+    event.events = EPOLLONESHOT;
+    if (not waiters.readers.empty()) {
+        event.events |= EPOLLIN;
+    }
+    if (not waiters.writers.empty()) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.fd = fd;
+    return epoll_ctl(this->epoll_fd_, op, fd, &event) == 0;
+}
+void Scheduler::finish(Task *task, ExecResult result, std::exception_ptr error) {
+    std::unique_ptr<Task> owned(task);
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << "task " << task->id << " finished";
+    if (owned->on_finish) {
+        // NOTE: 投げてもタスクは終わらせる。ワーカーから外に出すとプロセスが落ちる
+        try {
+            owned->on_finish(owned->id, std::move(owned->vm), result, error);
+        } catch (const std::exception &e) {
+            TRIVIAL_LOG_WITH_FUNCNAME(error) << "on_finish of task " << owned->id << " threw: " << e.what();
+        } catch (...) {
+            TRIVIAL_LOG_WITH_FUNCNAME(error) << "on_finish of task " << owned->id << " threw";
+        }
+    }
+    owned.reset();
+    {
+        std::lock_guard lock(this->mutex_);
+        this->live_tasks_--;
+    }
+    this->idle_cv_.notify_all();
+}
+}  // namespace nyulan
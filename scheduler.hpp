@@ -0,0 +1,74 @@
+#ifndef NYULAN_SCHEDULER
+#define NYULAN_SCHEDULER
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.hpp"
+namespace nyulan {
+// 多数のVirtualMachineを少数のOSスレッドで協調的に動かす
+// VMはquantumステップごとと、組み込み関数がI/Oを待つときに中断される。待っているfdはepollで監視する
+// pin_workersなら、ワーカーを一つずつCPUに固定する。VMは最初に動かしたワーカーのNUMAノードに割り当て、
+// そのメモリをそのノードに置き、以後はできるだけ同じノードのワーカーで動かす
+class Scheduler {
+   public:
+    using TaskId = std::uint64_t;
+    // errorが空でなければ、実行中に例外が投げられた
+    using OnFinish = std::function<void(TaskId, std::unique_ptr<VirtualMachine>, ExecResult, std::exception_ptr error)>;
+
+    explicit Scheduler(std::size_t num_workers = std::thread::hardware_concurrency(), std::uint64_t quantum = 10000,
+                       bool pin_workers = false);
+    ~Scheduler();  // 全てのタスクの終了を待つ
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    // vmはstart()かstart_call()済みであること
+    TaskId submit(std::unique_ptr<VirtualMachine> vm, OnFinish on_finish = nullptr);
+    void wait_all();
+
+   private:
+    struct Task {
+        TaskId id;
+        std::unique_ptr<VirtualMachine> vm;
+        OnFinish on_finish;
+        int node = -1;  // まだどのノードにも割り当てていなければ-1
+    };
+    std::uint64_t quantum_;
+    int epoll_fd_;
+    int wakeup_fd_;  // pollerを止めるためのeventfd
+    std::mutex mutex_;
+    std::condition_variable ready_cv_;
+    std::condition_variable idle_cv_;
+    std::deque<Task *> ready_;                    // ノードに割り当てていないもの
+    std::vector<std::deque<Task *>> node_ready_;  // ノードごと
+    std::size_t num_ready_ = 0;
+    std::size_t live_tasks_ = 0;
+    TaskId next_id_ = 1;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+    std::thread poller_;
+    // 同じfdを複数のタスクが待つことがある(全てのVMに渡す標準エラー出力など)ので、fdごとに登録する
+    struct FdWaiters {
+        std::vector<Task *> readers;
+        std::vector<Task *> writers;
+    };
+    std::mutex io_mutex_;
+    std::unordered_map<int, FdWaiters> fd_waiters_;  // epollに登録しているfd => 待っているタスク
+
+    void work(int cpu, int node);
+    Task *pop_ready(int node);
+    void poll();
+    void make_ready(Task *task);
+    void wait_io(Task *task, IoWait wait);
+    bool watch_fd_unlocked(int fd, const FdWaiters &waiters, int op);  // 失敗したらerrnoを残してfalse
+    void finish(Task *task, ExecResult result, std::exception_ptr error);
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,281 @@
+#include "server.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+
+#include "logging.hpp"
+#include "objectfile.hpp"
+#include "protocol.hpp"
+namespace nyulan {
+namespace stdfsys = std::filesystem;
+using protocol::FrameType;
+Server::Server(std::string socket_path, Options options)
+    : socket_path_(std::move(socket_path)), options_(options) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (this->socket_path_.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("error: socket path " + this->socket_path_ + " is too long");
+    }
+    std::strcpy(address.sun_path, this->socket_path_.c_str());
+    this->listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (this->listen_fd_ == -1) {
+        throw std::runtime_error(std::string("error: failed to create socket: ") + std::strerror(errno));
+    }
+    ::unlink(this->socket_path_.c_str());  // NOTE: 前回のサーバーが残したもの
+    if (::bind(this->listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1 ||
+        ::listen(this->listen_fd_, SOMAXCONN) == -1) {
+        auto error = std::string("error: failed to listen on ") + this->socket_path_ + ": " + std::strerror(errno);
+        ::close(this->listen_fd_);
+        throw std::runtime_error(error);
+    }
+}
+Server::~Server() {
+    ::close(this->listen_fd_);
+    ::unlink(this->socket_path_.c_str());
+}
+void Server::serve() {
+    TRIVIAL_LOG_WITH_FUNCNAME(info) << "listening on " << this->socket_path_;
+    while (true) {
+        int client_fd = ::accept4(this->listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                TRIVIAL_LOG_WITH_FUNCNAME(error) << "accept failed: " << std::strerror(errno);
+            }
+            continue;
+        }
+        std::thread([this, client_fd] {
+            this->handle(client_fd);
+            ::close(client_fd);
+        }).detach();
+    }
+}
+
+std::shared_ptr<Server::Program> Server::load(const std::string &path) {
+    auto canonical = stdfsys::canonical(path).string();
+    auto modified = stdfsys::last_write_time(canonical);
+    {
+        std::lock_guard lock(this->cache_mutex_);
+        auto cached = this->by_path_.find(canonical);
+        if (cached != this->by_path_.end() && cached->second.modified == modified) {
+            return cached->second.program;
+        }
+    }
+    std::ifstream file(canonical, std::ios_base::binary);
+    std::string bytes{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    auto program = std::make_shared<Program>();
+    program->hash = protocol::hash_program(bytes);
+    ObjectFile objectfile;
+    try {
+        objectfile = ObjectFile(canonical);
+    } catch (std::exception *except) {  // NOTE: ObjectFileはポインタを投げることがある
+        std::unique_ptr<std::exception> owned(except);
+        throw std::runtime_error(owned->what());
+    }
+    program->code = std::make_shared<const std::vector<OneStep>>(std::move(objectfile.code));
+    program->static_datas = std::move(objectfile.literal_datas);
+    program->path = canonical;
+    program->static_segments = std::move(objectfile.static_segments);
+    program->entry_point = objectfile.find_label("_start").label_address;
+    this->refill(*program);
+    TRIVIAL_LOG_WITH_FUNCNAME(info) << "loaded " << canonical << " (" << program->hash << ")";
+
+    std::lock_guard lock(this->cache_mutex_);
+    auto [existing, inserted] = this->by_hash_.emplace(program->hash, program);
+    if (not inserted) {
+        program = existing->second;  // 内容が同じなら、準備済みのVMも共有する
+    }
+    this->by_path_.insert_or_assign(canonical, CachedPath{modified, program});
+    return program;
+}
+std::shared_ptr<Server::Program> Server::find(const std::string &hash) {
+    std::lock_guard lock(this->cache_mutex_);
+    auto program = this->by_hash_.find(hash);
+    return program == this->by_hash_.end() ? nullptr : program->second;
+}
+std::unique_ptr<VirtualMachine> Server::take_vm(Program &program) {
+    {
+        std::lock_guard lock(program.mutex);
+        if (not program.idle.empty()) {
+            auto vm = std::move(program.idle.back());
+            program.idle.pop_back();
+            return vm;
+        }
+    }
+    return this->prepare_vm(program);
+}
+std::unique_ptr<VirtualMachine> Server::prepare_vm(const Program &program) {
+    auto vm = std::make_unique<VirtualMachine>(program.static_datas);
+    vm->load_code(program.code);
+    vm->map_static_segments(program.path, program.static_segments);
+    return vm;
+}
+void Server::refill(Program &program) {
+    while (true) {
+        {
+            std::lock_guard lock(program.mutex);
+            if (program.idle.size() >= this->options_.pool_size) {
+                return;
+            }
+        }
+        auto vm = this->prepare_vm(program);
+        std::lock_guard lock(program.mutex);
+        program.idle.push_back(std::move(vm));
+    }
+}
+
+void Server::handle(int client_fd) {
+    try {
+        std::shared_ptr<Program> program;
+        std::string input;
+        auto max_steps = this->options_.max_steps;
+        auto timeout_ms = this->options_.timeout_ms;
+        // NOTE: 0は制限なしなので、小さい方をとるときは0を最大として扱う
+        auto tighter = [](std::uint64_t current, std::uint64_t requested) {
+            if (current == 0 || requested == 0) {
+                return std::max(current, requested);
+            }
+            return std::min(current, requested);
+        };
+        while (true) {
+            auto frame = protocol::read_frame(client_fd);
+            if (not frame) {
+                return;  // 何もせずに切断された
+            }
+            if (frame->type == FrameType::RUN) {
+                break;
+            }
+            switch (frame->type) {
+                case FrameType::PROGRAM_PATH:
+                    program = this->load(frame->payload);
+                    break;
+                case FrameType::PROGRAM_HASH:
+                    program = this->find(frame->payload);
+                    if (not program) {
+                        throw std::runtime_error("error: no program with hash " + frame->payload + " is loaded");
+                    }
+                    break;
+                case FrameType::MAX_STEPS:
+                    max_steps = tighter(max_steps, protocol::decode_u64(frame->payload));
+                    break;
+                case FrameType::TIMEOUT_MS:
+                    timeout_ms = tighter(timeout_ms, protocol::decode_u64(frame->payload));
+                    break;
+                case FrameType::STDIN:
+                    input += frame->payload;
+                    break;
+                default:
+                    throw std::runtime_error("error: unexpected frame type " +
+                                             std::to_string(static_cast<int>(frame->type)));
+            }
+        }
+        if (not program) {
+            throw std::runtime_error("error: no program specified");
+        }
+        this->run(client_fd, *program, input, max_steps, timeout_ms);
+        this->refill(*program);  // NOTE: 返事を送った後なので、待ち時間に入らない
+    } catch (const std::exception &except) {
+        TRIVIAL_LOG_WITH_FUNCNAME(info) << except.what();
+        try {
+            protocol::write_frame(client_fd, FrameType::ERROR, except.what());
+        } catch (const std::exception &) {
+            // クライアントがもういない
+        }
+    }
+}
+namespace {
+// 読めるだけ読んでクライアントに送る
+void forward(int from_fd, int client_fd, FrameType type) {
+    char buffer[64 * 1024];
+    while (true) {
+        auto len = ::read(from_fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            return;
+        }
+        protocol::write_frame(client_fd, type, std::string_view(buffer, len));
+    }
+}
+struct Fds {
+    int input = -1;
+    int output[2] = {-1, -1};
+    int error[2] = {-1, -1};
+    ~Fds() {
+        for (auto fd : {input, output[0], output[1], error[0], error[1]}) {
+            if (fd != -1) {
+                ::close(fd);
+            }
+        }
+    }
+};
+}  // namespace
+void Server::run(int client_fd, Program &program, const std::string &input, std::uint64_t max_steps,
+                 std::uint64_t timeout_ms) {
+    Fds fds;
+    // NOTE: 標準入力はメモリ上のファイルにしておけば、読み込みで止まらない
+    fds.input = memfd_create("nyulan-stdin", MFD_CLOEXEC);
+    if (fds.input == -1 || ::pipe2(fds.output, O_NONBLOCK | O_CLOEXEC) == -1 ||
+        ::pipe2(fds.error, O_NONBLOCK | O_CLOEXEC) == -1) {
+        throw std::runtime_error(std::string("error: failed to prepare stdio: ") + std::strerror(errno));
+    }
+    for (std::size_t done = 0; done < input.size();) {
+        auto written = ::write(fds.input, input.data() + done, input.size() - done);
+        if (written == -1) {
+            throw std::runtime_error(std::string("error: failed to write stdin: ") + std::strerror(errno));
+        }
+        done += written;
+    }
+    ::lseek(fds.input, 0, SEEK_SET);
+
+    auto vm = this->take_vm(program);
+    vm->redirect_stdio(fds.input, fds.output[1], fds.error[1]);
+    vm->suspend_on_channel_wait(true);  // 待っている間も時間切れを確かめられるように
+    vm->start(program.entry_point);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    auto remaining = max_steps == 0 ? std::numeric_limits<std::uint64_t>::max() : max_steps;
+    while (true) {
+        auto budget = std::min(this->options_.quantum, remaining);
+        auto result = vm->resume(budget);
+        forward(fds.output[0], client_fd, FrameType::STDOUT);
+        forward(fds.error[0], client_fd, FrameType::STDERR);
+        switch (result.status) {
+            case ExecStatus::SUSPENDED:
+                remaining -= budget;
+                if (remaining == 0) {
+                    throw std::runtime_error("error: step limit of " + std::to_string(max_steps) + " exceeded");
+                }
+                break;
+            case ExecStatus::BLOCKED: {
+                // 出力のパイプが一杯なら今空けた。それ以外(チャネルなど)は少し待つ
+                auto wait = vm->blocked_on().value();
+                if (wait.fd != fds.output[1] && wait.fd != fds.error[1]) {
+                    pollfd event{wait.fd, static_cast<short>(wait.for_write ? POLLOUT : POLLIN), 0};
+                    ::poll(&event, 1, 10);
+                }
+                break;
+            }
+            default:
+                protocol::write_frame(
+                    client_fd, FrameType::EXIT,
+                    protocol::encode_u64(result.status == ExecStatus::EXITED ? result.value.value() : 0));
+                return;
+        }
+        if (timeout_ms != 0 && std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error("error: timeout of " + std::to_string(timeout_ms) + " ms exceeded");
+        }
+    }
+}
+}  // namespace nyulan
@@ -0,0 +1,63 @@
+#ifndef NYULAN_SERVER
+#define NYULAN_SERVER
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "vm.hpp"
+namespace nyulan {
+// nyulanVM --serve
+// 読み込んだプログラムと、それ用に準備済みのVMを持っておき、Unixドメインソケットから来た実行要求に答える
+// やり取りはprotocol.hppのとおり。接続ごとにスレッドを立て、そのスレッドでVMを動かす
+class Server {
+   public:
+    struct Options {
+        std::size_t pool_size = 4;      // プログラムごとに準備しておくVMの数
+        std::uint64_t quantum = 10000;  // この歩数ごとに出力を送り、制限を確かめる
+        std::uint64_t max_steps = 0;    // 0なら制限なし。要求でもっと小さい値が指定されればそちら
+        std::uint64_t timeout_ms = 0;
+    };
+
+    Server(std::string socket_path, Options options);
+    ~Server();
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+    [[noreturn]] void serve();
+
+   private:
+    struct Program {
+        std::string hash;
+        std::shared_ptr<const std::vector<OneStep>> code;
+        std::vector<std::uint8_t> static_datas;
+        std::string path;  // 静的セグメントをmmapするため
+        std::vector<StaticSegment> static_segments;
+        Address entry_point;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<VirtualMachine>> idle;  // 準備済みのVM
+    };
+    struct CachedPath {
+        std::filesystem::file_time_type modified;
+        std::shared_ptr<Program> program;
+    };
+    std::string socket_path_;
+    Options options_;
+    int listen_fd_;
+    std::mutex cache_mutex_;
+    std::map<std::string, CachedPath> by_path_;
+    std::map<std::string, std::shared_ptr<Program>> by_hash_;
+
+    std::shared_ptr<Program> load(const std::string &path);
+    std::shared_ptr<Program> find(const std::string &hash);
+    std::unique_ptr<VirtualMachine> take_vm(Program &program);
+    std::unique_ptr<VirtualMachine> prepare_vm(const Program &program);
+    void refill(Program &program);
+    void handle(int client_fd);
+    void run(int client_fd, Program &program, const std::string &input, std::uint64_t max_steps,
+             std::uint64_t timeout_ms);
+};
+}  // namespace nyulan
+#endif
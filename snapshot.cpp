@@ -0,0 +1,434 @@
+#include "snapshot.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <stack>
+#include <stdexcept>
+#include <string_view>
+
+#include "logging.hpp"
+namespace nyulan {
+namespace {
+constexpr char MAGIC[8] = {'N', 'Y', 'U', 'S', 'N', 'A', 'P', '\0'};
+constexpr std::uint64_t HEADER_SIZE = sizeof(MAGIC) + 2 * sizeof(std::uint64_t);  // magic version meta_size
+constexpr std::uint64_t BLOCK_ALIGNMENT = 16;
+
+std::runtime_error system_error(const std::string &what) {
+    return std::runtime_error("error: " + what + ": " + std::strerror(errno));
+}
+class Writer {
+   public:
+    std::string buffer;
+
+    void put_u64(std::uint64_t value) {
+        for (std::size_t i = 0; i < sizeof(value); i++) {
+            this->buffer.push_back(static_cast<char>((value >> (8 * i)) & 0b1111'1111));
+        }
+    }
+    void put_bytes(const void *data, std::size_t len) {
+        this->put_u64(len);
+        this->buffer.append(static_cast<const char *>(data), len);
+    }
+    void put_string(std::string_view value) { this->put_bytes(value.data(), value.size()); }
+};
+class Reader {
+   public:
+    explicit Reader(std::string_view buffer) : buffer_(buffer) {}
+    std::uint64_t get_u64() {
+        auto bytes = this->take(sizeof(std::uint64_t));
+        std::uint64_t value = 0;
+        for (std::size_t i = 0; i < sizeof(value); i++) {
+            value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(bytes[i])) << (8 * i);
+        }
+        return value;
+    }
+    std::string_view get_bytes() { return this->take(this->get_u64()); }
+    std::string_view get_raw(std::uint64_t len) { return this->take(len); }
+
+   private:
+    std::string_view buffer_;
+    std::size_t position_ = 0;
+
+    std::string_view take(std::uint64_t len) {
+        if (len > this->buffer_.size() - this->position_) {
+            throw std::runtime_error("error: snapshot is truncated");
+        }
+        auto result = this->buffer_.substr(this->position_, len);
+        this->position_ += len;
+        return result;
+    }
+};
+template <typename T>
+std::vector<T> drain_stack(std::stack<T> stack) {  // NOTE: コピーを受けて、底から順に並べる
+    std::vector<T> result(stack.size());
+    for (auto element = result.rbegin(); element != result.rend(); ++element) {
+        *element = stack.top();
+        stack.pop();
+    }
+    return result;
+}
+void write_all(int fd, const void *data, std::size_t len, std::uint64_t offset) {
+    for (std::size_t done = 0; done < len;) {
+        auto written = ::pwrite(fd, static_cast<const char *>(data) + done, len - done, offset + done);
+        if (written == -1) {
+            throw system_error("failed to write snapshot");
+        }
+        done += written;
+    }
+}
+// 0だけのページは書かずに穴にしておく。大きいBSSのほとんどは触られていない
+void write_sparse(int fd, const std::uint8_t *data, std::size_t len, std::uint64_t offset, std::size_t page_size) {
+    std::vector<std::uint8_t> zeros(page_size, 0);
+    for (std::size_t done = 0; done < len; done += page_size) {
+        auto chunk = std::min(page_size, len - done);
+        if (std::memcmp(data + done, zeros.data(), chunk) != 0) {
+            write_all(fd, data + done, chunk, offset + done);
+        }
+    }
+}
+void read_all(int fd, void *data, std::size_t len, std::uint64_t offset) {
+    for (std::size_t done = 0; done < len;) {
+        auto result = ::pread(fd, static_cast<char *>(data) + done, len - done, offset + done);
+        if (result == -1) {
+            throw system_error("failed to read snapshot");
+        }
+        if (result == 0) {
+            throw std::runtime_error("error: snapshot is truncated");
+        }
+        done += result;
+    }
+}
+}  // namespace
+
+Snapshot::Snapshot(int fd, std::uint64_t size, Image image) : fd_(fd), size_(size), image_(std::move(image)) {}
+Snapshot::~Snapshot() { ::close(this->fd_); }
+
+std::shared_ptr<Snapshot> Snapshot::take(VirtualMachine &vm) {
+    if (not vm.threads.empty()) {
+        throw std::runtime_error("error: can't take a snapshot while guest threads are running");
+    }
+    if (not vm.pending_io.empty()) {
+        throw std::runtime_error("error: can't take a snapshot while async io is in flight");
+    }
+    if (vm.io_wait || vm.channel_wait) {
+        throw std::runtime_error("error: can't take a snapshot of a blocked vm");
+    }
+    Image image;
+    for (std::size_t i = 0; i < image.registers.size(); i++) {
+        image.registers[i] = vm.registers[i].value();
+    }
+    image.program_counter = vm.program_counter.value();
+    image.calculation_stack = drain_stack(vm.calculation_stack);
+    for (auto address : drain_stack(vm.call_stack)) {
+        image.call_stack.push_back(address.value());
+    }
+    if (vm.return_depth) {
+        image.return_depth = vm.return_depth.value();
+    }
+    image.code = vm.unpatched_code();
+    image.next_fd = vm.next_fd;
+    for (const auto &[guest_fd, file] : vm.files) {
+        if (not file.owned) {
+            continue;  // redirect_stdio()したもの
+        }
+        auto offset = ::lseek(file.fd, 0, SEEK_CUR);
+        image.files.push_back(File{guest_fd, file.path, file.flags, offset, file.input_buffer, file.input_eof});
+    }
+
+    auto &memory = *vm.memory;
+    std::shared_lock lock(memory.mutex_);
+    image.static_datas = memory.static_datas_;
+    image.next_address = memory.next_address_;
+    for (const auto &[start, block] : memory.blocks_) {
+        image.blocks.push_back(Region{start, block.size, 0});
+    }
+    for (const auto &[start, segment] : memory.static_segments_) {
+        image.static_segments.push_back(Region{start, segment.size, 0, segment.read_only});
+    }
+    auto serialize = [&image] {
+        Writer meta;
+        for (auto value : image.registers) {
+            meta.put_u64(value);
+        }
+        meta.put_u64(image.program_counter);
+        meta.put_bytes(image.calculation_stack.data(), image.calculation_stack.size());
+        meta.put_u64(image.call_stack.size());
+        for (auto address : image.call_stack) {
+            meta.put_u64(address);
+        }
+        meta.put_u64(image.return_depth ? 1 : 0);
+        meta.put_u64(image.return_depth.value_or(0));
+        meta.put_u64(image.code->size());
+        for (auto step : *image.code) {
+            meta.buffer.push_back(static_cast<char>(step.value() & 0b1111'1111));
+            meta.buffer.push_back(static_cast<char>(step.value() >> 8));
+        }
+        meta.put_bytes(image.static_datas.data(), image.static_datas.size());
+        meta.put_u64(image.next_address);
+        meta.put_u64(image.blocks.size());
+        for (const auto &region : image.blocks) {
+            meta.put_u64(region.start);
+            meta.put_u64(region.size);
+            meta.put_u64(region.file_offset);
+        }
+        meta.put_u64(image.static_segments.size());
+        for (const auto &region : image.static_segments) {
+            meta.put_u64(region.start);
+            meta.put_u64(region.size);
+            meta.put_u64(region.file_offset);
+            meta.put_u64(region.read_only ? 1 : 0);
+        }
+        meta.put_u64(image.files.size());
+        for (const auto &file : image.files) {
+            meta.put_u64(file.guest_fd);
+            meta.put_string(file.path);
+            meta.put_u64(static_cast<std::uint64_t>(file.flags));
+            meta.put_u64(static_cast<std::uint64_t>(file.offset));
+            meta.put_string(file.input_buffer);
+            meta.put_u64(file.input_eof ? 1 : 0);
+        }
+        meta.put_u64(image.next_fd);
+        return meta.buffer;
+    };
+    // NOTE: ブロックの位置が変わってもmetaの大きさは変わらないので、一度大きさを測ってから位置を決める
+    auto position = HEADER_SIZE + serialize().size();
+    // NOTE: 読み込み専用のセグメントはmprotect()するので、静的セグメントはページ境界から置き、後ろもページ境界に揃える
+    auto page_size = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+    for (auto &region : image.static_segments) {
+        position = (position + page_size - 1) / page_size * page_size;
+        region.file_offset = position;
+        position += region.size;
+    }
+    position = (position + page_size - 1) / page_size * page_size;
+    for (auto &region : image.blocks) {
+        position = (position + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+        region.file_offset = position;
+        position += region.size;
+    }
+    auto meta = serialize();
+
+    int fd = memfd_create("nyulan-snapshot", MFD_CLOEXEC);
+    if (fd == -1) {
+        throw system_error("failed to create snapshot");
+    }
+    try {
+        Writer header;
+        header.buffer.append(MAGIC, sizeof(MAGIC));
+        header.put_u64(FORMAT_VERSION);
+        header.put_u64(meta.size());
+        write_all(fd, header.buffer.data(), header.buffer.size(), 0);
+        write_all(fd, meta.data(), meta.size(), HEADER_SIZE);
+        for (const auto &region : image.blocks) {
+            write_all(fd, memory.blocks_.at(region.start).data.get(), region.size, region.file_offset);
+        }
+        for (const auto &region : image.static_segments) {
+            write_sparse(fd, memory.static_segments_.at(region.start).data.get(), region.size, region.file_offset,
+                         page_size);
+        }
+        if (::ftruncate(fd, position) == -1) {
+            throw system_error("failed to write snapshot");
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << "took snapshot of " << position << " bytes @" << image.program_counter;
+    return std::shared_ptr<Snapshot>(new Snapshot(fd, position, std::move(image)));
+}
+std::shared_ptr<Snapshot> Snapshot::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw system_error("failed to open snapshot " + path);
+    }
+    try {
+        struct stat status;
+        if (::fstat(fd, &status) == -1) {
+            throw system_error("failed to stat snapshot " + path);
+        }
+        auto size = static_cast<std::uint64_t>(status.st_size);
+        return std::shared_ptr<Snapshot>(new Snapshot(fd, size, read_image(fd, size)));
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+Snapshot::Image Snapshot::read_image(int fd, std::uint64_t size) {
+    if (size < HEADER_SIZE) {
+        throw std::runtime_error("error: snapshot is truncated");
+    }
+    std::string header(HEADER_SIZE, '\0');
+    read_all(fd, header.data(), header.size(), 0);
+    if (std::memcmp(header.data(), MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error("error: given file is not nyulan snapshot");
+    }
+    Reader header_reader(std::string_view(header).substr(sizeof(MAGIC)));
+    if (header_reader.get_u64() != FORMAT_VERSION) {
+        throw std::runtime_error("error: unsupported snapshot version");
+    }
+    auto meta_size = header_reader.get_u64();
+    if (meta_size > size - HEADER_SIZE) {
+        throw std::runtime_error("error: snapshot is truncated");
+    }
+    std::string meta(meta_size, '\0');
+    read_all(fd, meta.data(), meta.size(), HEADER_SIZE);
+
+    Reader reader(meta);
+    Image image;
+    for (auto &value : image.registers) {
+        value = reader.get_u64();
+    }
+    image.program_counter = reader.get_u64();
+    auto calculation_stack = reader.get_bytes();
+    image.calculation_stack.assign(calculation_stack.begin(), calculation_stack.end());
+    image.call_stack.resize(reader.get_u64());
+    for (auto &address : image.call_stack) {
+        address = reader.get_u64();
+    }
+    auto has_return_depth = reader.get_u64() != 0;
+    auto return_depth = reader.get_u64();
+    if (has_return_depth) {
+        image.return_depth = return_depth;
+    }
+    std::vector<OneStep> code(reader.get_u64());
+    for (auto &step : code) {
+        auto bytes = reader.get_raw(2);
+        step = static_cast<std::uint16_t>(static_cast<std::uint8_t>(bytes[0]) |
+                                          (static_cast<std::uint8_t>(bytes[1]) << 8));
+    }
+    image.code = std::make_shared<const std::vector<OneStep>>(std::move(code));
+    auto static_datas = reader.get_bytes();
+    image.static_datas.assign(static_datas.begin(), static_datas.end());
+    image.next_address = reader.get_u64();
+    image.blocks.resize(reader.get_u64());
+    for (auto &region : image.blocks) {
+        region.start = reader.get_u64();
+        region.size = reader.get_u64();
+        region.file_offset = reader.get_u64();
+        if (region.file_offset > size || region.size > size - region.file_offset) {
+            throw std::runtime_error("error: snapshot is truncated");
+        }
+    }
+    image.static_segments.resize(reader.get_u64());
+    for (auto &region : image.static_segments) {
+        region.start = reader.get_u64();
+        region.size = reader.get_u64();
+        region.file_offset = reader.get_u64();
+        region.read_only = reader.get_u64() != 0;
+        if (region.file_offset > size || region.size > size - region.file_offset) {
+            throw std::runtime_error("error: snapshot is truncated");
+        }
+    }
+    image.files.resize(reader.get_u64());
+    for (auto &file : image.files) {
+        file.guest_fd = reader.get_u64();
+        file.path = reader.get_bytes();
+        file.flags = static_cast<std::int64_t>(reader.get_u64());
+        file.offset = static_cast<std::int64_t>(reader.get_u64());
+        file.input_buffer = reader.get_bytes();
+        file.input_eof = reader.get_u64() != 0;
+    }
+    image.next_fd = reader.get_u64();
+    return image;
+}
+void Snapshot::save(const std::string &path) const {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw system_error("failed to open " + path);
+    }
+    try {
+        // NOTE: 書かなかった穴(触っていないBSSなど)は飛ばして、保存先でも穴のままにする
+        std::vector<char> buffer(1024 * 1024);
+        for (off_t data = 0; static_cast<std::uint64_t>(data) < this->size_;) {
+            data = ::lseek(this->fd_, data, SEEK_DATA);
+            if (data == -1) {
+                break;  // ENXIO 後ろは全部穴
+            }
+            auto hole = ::lseek(this->fd_, data, SEEK_HOLE);
+            for (auto done = static_cast<std::uint64_t>(data); done < static_cast<std::uint64_t>(hole);) {
+                auto len = std::min<std::uint64_t>(buffer.size(), hole - done);
+                read_all(this->fd_, buffer.data(), len, done);
+                write_all(fd, buffer.data(), len, done);
+                done += len;
+            }
+            data = hole;
+        }
+        if (::ftruncate(fd, this->size_) == -1) {
+            throw system_error("failed to write " + path);
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+std::unique_ptr<VirtualMachine> Snapshot::instantiate(bool enable_debug) const {
+    auto vm = std::make_unique<VirtualMachine>(this->image_.static_datas, enable_debug);
+    vm->load_code(this->image_.code);
+    for (std::size_t i = 0; i < this->image_.registers.size(); i++) {
+        vm->registers[i] = this->image_.registers[i];
+    }
+    vm->program_counter = this->image_.program_counter;
+    vm->calculation_stack = std::stack<std::uint8_t>(
+        std::deque<std::uint8_t>(this->image_.calculation_stack.begin(), this->image_.calculation_stack.end()));
+    for (auto address : this->image_.call_stack) {
+        vm->call_stack.push(address);
+    }
+    if (this->image_.return_depth) {
+        vm->return_depth = this->image_.return_depth.value();
+    }
+
+    if (not this->image_.blocks.empty() || not this->image_.static_segments.empty()) {
+        // NOTE: MAP_PRIVATEなので、ゲストが書き込んでもスナップショット自体は変わらない
+        auto base = ::mmap(nullptr, this->size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, this->fd_, 0);
+        if (base == MAP_FAILED) {
+            throw system_error("failed to map snapshot");
+        }
+        auto size = this->size_;
+        std::shared_ptr<std::uint8_t> mapping(static_cast<std::uint8_t *>(base),
+                                              [size](std::uint8_t *pointer) { ::munmap(pointer, size); });
+        auto &memory = *vm->memory;
+        for (const auto &region : this->image_.static_segments) {
+            if (region.read_only && region.size != 0 &&
+                ::mprotect(mapping.get() + region.file_offset, region.size, PROT_READ) == -1) {
+                throw system_error("failed to protect static segment");
+            }
+            memory.add_static_segment(region.start, region.size,
+                                      std::shared_ptr<std::uint8_t[]>(mapping, mapping.get() + region.file_offset),
+                                      region.read_only);
+        }
+        std::unique_lock lock(memory.mutex_);
+        for (const auto &region : this->image_.blocks) {
+            // 全てのブロックがmappingを共有し、最後のブロックが解放されたときにmunmapする
+            std::shared_ptr<std::uint8_t[]> data(mapping, mapping.get() + region.file_offset);
+            memory.blocks_.emplace(region.start, Memory::Block{region.size, std::move(data), true});
+            memory.count_allocation(region.size);
+        }
+    }
+    vm->memory->next_address_ = this->image_.next_address;
+
+    for (const auto &file : this->image_.files) {
+        int fd = ::open(file.path.c_str(), static_cast<int>(file.flags), 0644);
+        if (fd == -1 || ::lseek(fd, file.offset, SEEK_SET) == -1) {
+            auto error = system_error("failed to reopen " + file.path);
+            if (fd != -1) {
+                ::close(fd);
+            }
+            throw error;
+        }
+        vm->files.emplace(file.guest_fd,
+                          VirtualMachine::HostFile{fd, true, file.input_buffer, file.input_eof, file.path,
+                                                   static_cast<int>(file.flags)});
+    }
+    vm->next_fd = this->image_.next_fd;
+    return vm;
+}
+}  // namespace nyulan
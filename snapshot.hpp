@@ -0,0 +1,70 @@
+#ifndef NYULAN_SNAPSHOT
+#define NYULAN_SNAPSHOT
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "nyulan.hpp"
+#include "vm.hpp"
+namespace nyulan {
+// VirtualMachineのある時点の状態(レジスタ、スタック、コールスタック、コード、メモリ、静的セグメント、OPENしたファイル)
+// ファイルの先頭にメモリ以外をまとめ、その後ろにヒープのブロックを並べる
+// instantiate()はファイル全体をMAP_PRIVATEでmmapし、ヒープはそこを直接使う。書き込まれたページだけがコピーされるので、
+// 同じスナップショットから作ったVMは、書き換えていないページを共有する
+// NOTE: ゲストスレッド、実行中の非同期I/O、チャネルの待ちがあるときは取れない。redirect_stdio()したfdは含まない
+class Snapshot {
+   public:
+    static constexpr std::uint64_t FORMAT_VERSION = 2;
+
+    // 状態をメモリ上のファイル(memfd)に書き出す
+    static std::shared_ptr<Snapshot> take(VirtualMachine &vm);
+    static std::shared_ptr<Snapshot> open(const std::string &path);
+    ~Snapshot();
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    void save(const std::string &path) const;
+    std::unique_ptr<VirtualMachine> instantiate(bool enable_debug = false) const;
+    std::uint64_t file_size() const { return this->size_; }
+
+   private:
+    struct Region {
+        std::uint64_t start;  // ゲストのアドレス
+        std::uint64_t size;
+        std::uint64_t file_offset;
+        bool read_only = false;  // 静的セグメントのRODATA
+    };
+    struct File {
+        std::uint64_t guest_fd;
+        std::string path;
+        std::int64_t flags;
+        std::int64_t offset;
+        std::string input_buffer;
+        bool input_eof;
+    };
+    struct Image {
+        std::array<std::uint64_t, 16> registers;
+        std::uint64_t program_counter;
+        std::vector<std::uint8_t> calculation_stack;  // 底から順に
+        std::vector<std::uint64_t> call_stack;        // 底から順に
+        std::optional<std::uint64_t> return_depth;
+        std::shared_ptr<const std::vector<OneStep>> code;
+        std::vector<std::uint8_t> static_datas;
+        std::uint64_t next_address;
+        std::vector<Region> blocks;
+        std::vector<Region> static_segments;  // startは最上位ビットを除いた静的アドレス。ページ境界に置く
+        std::vector<File> files;
+        std::uint64_t next_fd;
+    };
+    int fd_;
+    std::uint64_t size_;
+    Image image_;
+
+    Snapshot(int fd, std::uint64_t size, Image image);
+    static Image read_image(int fd, std::uint64_t size);
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,59 @@
+#include "sourcefile.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "logging.hpp"
+namespace nyulan {
+SourceFile::SourceFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "failed to open " << path << ": " << std::strerror(errno);
+        return;
+    }
+    struct stat status;
+    if (::fstat(fd, &status) == -1) {
+        ::close(fd);
+        return;
+    }
+    this->size_ = static_cast<std::size_t>(status.st_size);
+    if (this->size_ != 0) {
+        auto mapped = ::mmap(nullptr, this->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            TRIVIAL_LOG_WITH_FUNCNAME(debug) << "failed to map " << path << ": " << std::strerror(errno);
+            ::close(fd);
+            this->size_ = 0;
+            return;
+        }
+        this->data_ = static_cast<const char *>(mapped);
+        ::madvise(mapped, this->size_, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+    this->open_ = true;
+
+    // NOTE: memchr()はlibcがSIMDで実装しているので、一文字ずつ見るよりずっと速い
+    this->line_starts_.clear();
+    this->line_starts_.push_back(0);
+    const char *position = this->data_;
+    const char *end = this->data_ + this->size_;
+    while (position < end) {
+        auto newline = static_cast<const char *>(std::memchr(position, '\n', end - position));
+        if (newline == nullptr) {
+            this->line_starts_.push_back(this->size_ + 1);  // 改行で終わっていない最後の行
+            break;
+        }
+        position = newline + 1;
+        this->line_starts_.push_back(position - this->data_);
+    }
+}
+SourceFile::~SourceFile() {
+    if (this->data_ != nullptr) {
+        ::munmap(const_cast<char *>(this->data_), this->size_);
+    }
+}
+}  // namespace nyulan
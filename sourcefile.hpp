@@ -0,0 +1,37 @@
+#ifndef NYULAN_SOURCEFILE
+#define NYULAN_SOURCEFILE
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace nyulan {
+// ソースファイルをmmapし、開いたときに一度だけ行の先頭の位置を調べておく。行を引くのはO(1)で、コピーもしない
+class SourceFile {
+   public:
+    explicit SourceFile(const std::string &path);  // 開けなくても例外は投げず、is_open()がfalseになる
+    ~SourceFile();
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    bool is_open() const { return this->open_; }
+    // numberは1始まり。改行は含まない。ファイルより後ろの行ならnullopt
+    std::optional<std::string_view> line(std::uint64_t number) const {
+        if (number == 0 || number >= this->line_starts_.size()) {
+            return std::nullopt;
+        }
+        auto begin = this->line_starts_[number - 1];
+        return std::string_view(this->data_ + begin, this->line_starts_[number] - 1 - begin);
+    }
+    std::size_t num_lines() const { return this->line_starts_.size() - 1; }
+
+   private:
+    const char *data_ = nullptr;
+    std::size_t size_ = 0;
+    bool open_ = false;
+    // 行の先頭の位置。最後に、最後の行の改行の次の位置(改行で終わっていなければファイルの大きさ+1)を置く
+    std::vector<std::size_t> line_starts_{0};  // 開けなければ0行
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,164 @@
+#include "stats.hpp"
+
+#include <bit>
+#include <iomanip>
+#include <magic_enum.hpp>
+#include <numeric>
+#include <string>
+
+namespace nyulan {
+namespace {
+std::string opcode_name(std::uint8_t opcode) {
+    auto instruction = magic_enum::enum_cast<Instruction>(opcode);
+    return instruction ? std::string(magic_enum::enum_name(instruction.value())) : "#" + std::to_string(opcode);
+}
+// NOTE: BuiltinFuncsの値はmagic_enumの範囲を超えるので、自前で引く
+std::string builtin_name(Register::ValueType number) {
+    switch (static_cast<BuiltinFuncs>(number)) {
+        case BuiltinFuncs::READ:
+            return "READ";
+        case BuiltinFuncs::WRITE:
+            return "WRITE";
+        case BuiltinFuncs::OPEN:
+            return "OPEN";
+        case BuiltinFuncs::CLOSE:
+            return "CLOSE";
+        case BuiltinFuncs::SPAWN:
+            return "SPAWN";
+        case BuiltinFuncs::EXIT:
+            return "EXIT";
+        case BuiltinFuncs::JOIN:
+            return "JOIN";
+        case BuiltinFuncs::AIO_READ:
+            return "AIO_READ";
+        case BuiltinFuncs::AIO_WRITE:
+            return "AIO_WRITE";
+        case BuiltinFuncs::AIO_POLL:
+            return "AIO_POLL";
+        case BuiltinFuncs::AIO_WAIT:
+            return "AIO_WAIT";
+        case BuiltinFuncs::CHANNEL_CREATE:
+            return "CHANNEL_CREATE";
+        case BuiltinFuncs::CHANNEL_SEND:
+            return "CHANNEL_SEND";
+        case BuiltinFuncs::CHANNEL_RECEIVE:
+            return "CHANNEL_RECEIVE";
+        case BuiltinFuncs::CHANNEL_CLOSE:
+            return "CHANNEL_CLOSE";
+        case BuiltinFuncs::MALLOC:
+            return "MALLOC";
+        case BuiltinFuncs::FREE:
+            return "FREE";
+    }
+    return "#" + std::to_string(number);
+}
+std::uint64_t nanoseconds(ExecStats::Clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+double steps_per_second(std::uint64_t steps, ExecStats::Clock::duration elapsed) {
+    auto seconds = std::chrono::duration<double>(elapsed).count();
+    return seconds > 0 ? steps / seconds : 0;
+}
+}  // namespace
+
+void ExecStats::builtin(Register::ValueType number, Clock::duration latency) {
+    auto &stats = this->builtins_[number];
+    stats.calls++;
+    stats.total += latency;
+    auto ns = std::max<std::uint64_t>(nanoseconds(latency), 1);
+    stats.latency[std::min<std::size_t>(std::bit_width(ns) - 1, LATENCY_BUCKETS - 1)]++;
+}
+std::uint64_t ExecStats::steps() const {
+    return std::accumulate(this->opcodes_.begin(), this->opcodes_.end(), std::uint64_t(0));
+}
+std::vector<std::pair<std::pair<std::uint8_t, std::uint8_t>, std::uint64_t>> ExecStats::top_pairs(
+    std::size_t top) const {
+    std::vector<std::pair<std::pair<std::uint8_t, std::uint8_t>, std::uint64_t>> result;
+    for (std::size_t i = 0; i < this->pairs_.size(); i++) {
+        if (this->pairs_[i] != 0) {
+            result.push_back({{i / NUM_OPCODES, i % NUM_OPCODES}, this->pairs_[i]});
+        }
+    }
+    std::stable_sort(result.begin(), result.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    result.resize(std::min(result.size(), top));
+    return result;
+}
+
+void ExecStats::write_text(std::ostream &out, const Memory::Usage &memory, std::size_t top) const {
+    auto steps = this->steps();
+    out << "steps: " << steps << " in " << std::chrono::duration<double>(this->elapsed_).count() << " s ("
+        << std::fixed << std::setprecision(0) << steps_per_second(steps, this->elapsed_) << " steps/s)" << std::endl;
+    out << "max stack depth: calculation " << this->max_calculation_stack_ << " bytes, call "
+        << this->max_call_stack_ << std::endl;
+    out << "dynamic memory: " << memory.live_bytes << " bytes in " << memory.live_blocks << " blocks live, peak "
+        << memory.peak_bytes << " bytes, " << memory.allocations << " allocations" << std::endl;
+
+    out << std::endl << "instructions:" << std::endl;
+    std::vector<std::pair<std::uint8_t, std::uint64_t>> opcodes;
+    for (std::size_t opcode = 0; opcode < NUM_OPCODES; opcode++) {
+        if (this->opcodes_[opcode] != 0) {
+            opcodes.emplace_back(opcode, this->opcodes_[opcode]);
+        }
+    }
+    std::stable_sort(opcodes.begin(), opcodes.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    for (const auto &[opcode, count] : opcodes) {
+        out << std::setw(16) << count << std::setprecision(2) << std::setw(8) << 100.0 * count / steps << "%  "
+            << opcode_name(opcode) << std::endl;
+    }
+    out << std::endl << "instruction pairs:" << std::endl;
+    for (const auto &[pair, count] : this->top_pairs(top)) {
+        out << std::setw(16) << count << std::setprecision(2) << std::setw(8) << 100.0 * count / steps << "%  "
+            << opcode_name(pair.first) << " " << opcode_name(pair.second) << std::endl;
+    }
+    out << std::endl << "builtins (latency histogram: [2^i, 2^(i+1)) ns => calls):" << std::endl;
+    for (const auto &[number, stats] : this->builtins_) {
+        out << std::setw(16) << stats.calls << "  " << builtin_name(number) << ", mean "
+            << nanoseconds(stats.total) / std::max<std::uint64_t>(stats.calls, 1) << " ns" << std::endl;
+        out << std::setw(18) << "";
+        for (std::size_t i = 0; i < LATENCY_BUCKETS; i++) {
+            if (stats.latency[i] != 0) {
+                out << " 2^" << i << ":" << stats.latency[i];
+            }
+        }
+        out << std::endl;
+    }
+    out << std::defaultfloat;
+}
+void ExecStats::write_json(std::ostream &out, const Memory::Usage &memory, std::size_t top) const {
+    auto steps = this->steps();
+    out << "{\"steps\":" << steps << ",\"elapsed_ns\":" << nanoseconds(this->elapsed_)
+        << ",\"steps_per_second\":" << std::fixed << std::setprecision(0) << steps_per_second(steps, this->elapsed_)
+        << std::defaultfloat;
+    out << ",\"max_calculation_stack\":" << this->max_calculation_stack_
+        << ",\"max_call_stack\":" << this->max_call_stack_;
+    out << ",\"memory\":{\"live_bytes\":" << memory.live_bytes << ",\"peak_bytes\":" << memory.peak_bytes
+        << ",\"live_blocks\":" << memory.live_blocks << ",\"allocations\":" << memory.allocations << "}";
+    out << ",\"instructions\":{";
+    bool first = true;
+    for (std::size_t opcode = 0; opcode < NUM_OPCODES; opcode++) {
+        if (this->opcodes_[opcode] != 0) {
+            out << (first ? "" : ",") << "\"" << opcode_name(opcode) << "\":" << this->opcodes_[opcode];
+            first = false;
+        }
+    }
+    out << "},\"pairs\":[";
+    first = true;
+    for (const auto &[pair, count] : this->top_pairs(top)) {
+        out << (first ? "" : ",") << "[\"" << opcode_name(pair.first) << "\",\"" << opcode_name(pair.second) << "\","
+            << count << "]";
+        first = false;
+    }
+    out << "],\"builtins\":{";
+    first = true;
+    for (const auto &[number, stats] : this->builtins_) {
+        out << (first ? "" : ",") << "\"" << builtin_name(number) << "\":{\"calls\":" << stats.calls
+            << ",\"total_ns\":" << nanoseconds(stats.total) << ",\"latency_log2_ns\":[";
+        for (std::size_t i = 0; i < LATENCY_BUCKETS; i++) {
+            out << (i == 0 ? "" : ",") << stats.latency[i];
+        }
+        out << "]}";
+        first = false;
+    }
+    out << "}}" << std::endl;
+}
+}  // namespace nyulan
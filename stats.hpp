@@ -0,0 +1,74 @@
+#ifndef NYULAN_STATS
+#define NYULAN_STATS
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <vector>
+
+#include "memory.hpp"
+#include "nyulan.hpp"
+namespace nyulan {
+// 実行の統計。VirtualMachine::enable_stats()で有効にしたときだけ数える
+// 命令ごとの回数、連続する二命令の組の回数、組み込み関数ごとの回数と所要時間の分布、スタックの最大の深さ
+class ExecStats {
+   public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::size_t NUM_OPCODES = 256;
+    static constexpr std::size_t LATENCY_BUCKETS = 40;  // i番目は[2^i, 2^(i+1))ナノ秒。最後はそれ以上全て
+
+    struct BuiltinStats {
+        std::uint64_t calls = 0;
+        Clock::duration total{0};
+        std::array<std::uint64_t, LATENCY_BUCKETS> latency{};
+    };
+    // run()の間の実時間を足す
+    class Running {
+       public:
+        explicit Running(ExecStats &stats) : stats_(stats), begin_(Clock::now()) {}
+        ~Running() { this->stats_.elapsed_ += Clock::now() - this->begin_; }
+        Running(const Running &) = delete;
+        Running &operator=(const Running &) = delete;
+
+       private:
+        ExecStats &stats_;
+        Clock::time_point begin_;
+    };
+
+    ExecStats() : pairs_(NUM_OPCODES * NUM_OPCODES, 0) {}
+    void step(std::uint8_t opcode, std::size_t calculation_stack_depth, std::size_t call_stack_depth) {
+        this->opcodes_[opcode]++;
+        this->pairs_[this->previous_opcode_ * NUM_OPCODES + opcode]++;
+        this->previous_opcode_ = opcode;
+        this->max_calculation_stack_ = std::max(this->max_calculation_stack_, calculation_stack_depth);
+        this->max_call_stack_ = std::max(this->max_call_stack_, call_stack_depth);
+    }
+    void builtin(Register::ValueType number, Clock::duration latency);
+
+    std::uint64_t steps() const;
+    Clock::duration elapsed() const { return this->elapsed_; }
+    std::uint64_t count(Instruction instruction) const {
+        return this->opcodes_[static_cast<std::uint8_t>(instruction)];
+    }
+    // 多い順に上位top組。((先の命令, 後の命令), 回数)
+    std::vector<std::pair<std::pair<std::uint8_t, std::uint8_t>, std::uint64_t>> top_pairs(std::size_t top) const;
+    const std::map<Register::ValueType, BuiltinStats> &builtins() const { return this->builtins_; }
+    std::size_t max_calculation_stack() const { return this->max_calculation_stack_; }
+    std::size_t max_call_stack() const { return this->max_call_stack_; }
+
+    void write_text(std::ostream &out, const Memory::Usage &memory, std::size_t top) const;
+    void write_json(std::ostream &out, const Memory::Usage &memory, std::size_t top) const;
+
+   private:
+    std::array<std::uint64_t, NUM_OPCODES> opcodes_{};
+    std::vector<std::uint64_t> pairs_;  // 先の命令 * NUM_OPCODES + 後の命令
+    std::size_t previous_opcode_ = static_cast<std::uint8_t>(Instruction::NOP);  // NOTE: 最初の命令はNOPの後とする
+    std::map<Register::ValueType, BuiltinStats> builtins_;
+    std::size_t max_calculation_stack_ = 0;
+    std::size_t max_call_stack_ = 0;
+    Clock::duration elapsed_{0};
+};
+}  // namespace nyulan
+#endif
@@ -0,0 +1,451 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+namespace nyulan {
+namespace trace {
+namespace {
+std::uint64_t zigzag(std::int64_t value) {
+    return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+}
+std::int64_t unzigzag(std::uint64_t value) {
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+constexpr std::uint64_t NO_TARGET = UINT64_MAX;
+constexpr std::uint8_t FLAG_NATIVE = 0b01;
+constexpr std::uint8_t FLAG_RESULT = 0b10;
+}  // namespace
+BranchKind branch_kind(OneStep step, Register callee) {
+    switch (static_cast<Instruction>((step.value() >> 8) & 0b1111'1111)) {
+        case Instruction::IFZ:
+        case Instruction::IFP:
+        case Instruction::IFN:
+            return BranchKind::CONDITIONAL;
+        case Instruction::GOTO:
+            return BranchKind::JUMP;
+        case Instruction::CALL:
+            return (callee.value() & (UINT64_C(1) << 63)) != 0 ? BranchKind::NONE : BranchKind::JUMP;
+        case Instruction::RET:
+            return BranchKind::RETURN;
+        default:
+            return BranchKind::NONE;
+    }
+}
+bool is_call(OneStep step) { return ((step.value() >> 8) & 0b1111'1111) == static_cast<int>(Instruction::CALL); }
+bool replays_natively(Register::ValueType number) {
+    switch (static_cast<BuiltinFuncs>(number)) {
+        case BuiltinFuncs::EXIT:
+        case BuiltinFuncs::MALLOC:
+        case BuiltinFuncs::FREE:
+            return true;
+        default:
+            return false;
+    }
+}
+std::uint64_t hash_code(const std::vector<OneStep> &code) {  // FNV-1a
+    std::uint64_t hash = 0xcbf2'9ce4'8422'2325ULL;
+    for (auto step : code) {
+        for (auto byte : {step.value() & 0xff, step.value() >> 8}) {
+            hash = (hash ^ byte) * 0x100'0000'01b3ULL;
+        }
+    }
+    return hash;
+}
+}  // namespace trace
+
+TraceRecorder::TraceRecorder(const std::string &path, const std::vector<OneStep> &code, Address entry_point)
+    : out_(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc),
+      last_targets_(code.size(), trace::NO_TARGET) {
+    if (not this->out_) {
+        throw std::runtime_error("error: failed to create trace " + path);
+    }
+    for (auto &chunk : this->ring_) {
+        chunk.reserve(CHUNK_SIZE);
+    }
+    for (auto c : trace::MAGIC) {
+        this->put_byte(static_cast<std::uint8_t>(c));
+    }
+    this->put_varint(trace::FORMAT_VERSION);
+    this->put_varint(trace::hash_code(code));
+    this->put_varint(code.size());
+    this->put_varint(entry_point.value());
+    this->writer_ = std::thread([this] { this->write_loop(); });
+}
+TraceRecorder::~TraceRecorder() {
+    if (not this->finished_) {
+        this->flush_bits();  // NOTE: ENDが無いので、読む側は途中で切れたトレースとして扱う
+    }
+    this->close();
+}
+std::uint64_t TraceRecorder::bytes_written() const {
+    std::lock_guard lock(this->mutex_);
+    return this->bytes_written_;
+}
+
+void TraceRecorder::resolve(std::uint64_t program_counter) {
+    auto from = this->pending_address_;
+    auto kind = this->pending_kind_;
+    this->pending_kind_ = trace::BranchKind::NONE;
+    if (kind == trace::BranchKind::CONDITIONAL) {
+        auto taken = program_counter != from + 1;
+        this->put_bit(taken);
+        if (not taken) {
+            return;
+        }
+    }
+    if (this->last_targets_[from] == program_counter) {
+        this->put_bit(true);
+        return;
+    }
+    this->put_bit(false);
+    this->flush_bits();
+    this->put_byte(static_cast<std::uint8_t>(trace::Tag::TARGET));
+    this->put_varint(trace::zigzag(static_cast<std::int64_t>(program_counter - from)));
+    this->last_targets_[from] = program_counter;
+}
+void TraceRecorder::input(Address address, std::vector<std::uint8_t> bytes) {
+    if (not bytes.empty()) {
+        this->inputs_.push_back(trace::Input{address.value(), std::move(bytes)});
+    }
+}
+void TraceRecorder::builtin(Register::ValueType number, std::size_t arg_bytes, const std::optional<Register> &result) {
+    this->flush_bits();
+    this->put_byte(static_cast<std::uint8_t>(trace::Tag::BUILTIN));
+    this->put_varint(number);
+    this->put_varint(arg_bytes);
+    this->put_byte((trace::replays_natively(number) ? trace::FLAG_NATIVE : 0) | (result ? trace::FLAG_RESULT : 0));
+    if (result) {
+        this->put_varint(result.value().value());
+    }
+    this->put_varint(this->inputs_.size());
+    for (const auto &input : this->inputs_) {
+        this->put_varint(input.address);
+        this->put_varint(input.bytes.size());
+        for (auto byte : input.bytes) {
+            this->put_byte(byte);
+        }
+    }
+    this->inputs_.clear();
+}
+void TraceRecorder::finish(Address program_counter, trace::EndStatus status, std::uint64_t exit_code) {
+    if (this->finished_) {
+        return;
+    }
+    if (this->pending_kind_ != trace::BranchKind::NONE) {
+        this->resolve(program_counter.value());
+    }
+    this->flush_bits();
+    this->put_byte(static_cast<std::uint8_t>(trace::Tag::END));
+    this->put_varint(program_counter.value());
+    this->put_byte(static_cast<std::uint8_t>(status));
+    this->put_varint(exit_code);
+    this->finished_ = true;
+    this->close();
+    if (this->write_failed_) {
+        throw std::runtime_error("error: failed to write the trace");
+    }
+}
+
+void TraceRecorder::put_bit(bool bit) {
+    this->bits_ |= static_cast<std::uint64_t>(bit) << this->num_bits_;
+    if (++this->num_bits_ == 64) {
+        this->flush_bits();
+    }
+}
+void TraceRecorder::flush_bits() {
+    if (this->num_bits_ == 0) {
+        return;
+    }
+    this->put_byte(static_cast<std::uint8_t>(trace::Tag::BITS));
+    this->put_varint(this->num_bits_);
+    for (std::size_t i = 0; i < (this->num_bits_ + 7) / 8; i++) {
+        this->put_byte(static_cast<std::uint8_t>(this->bits_ >> (8 * i)));
+    }
+    this->bits_ = 0;
+    this->num_bits_ = 0;
+}
+void TraceRecorder::put_varint(std::uint64_t value) {
+    while (value >= 0b1000'0000) {
+        this->put_byte(static_cast<std::uint8_t>(value | 0b1000'0000));
+        value >>= 7;
+    }
+    this->put_byte(static_cast<std::uint8_t>(value));
+}
+void TraceRecorder::submit() {
+    std::unique_lock lock(this->mutex_);
+    this->head_++;
+    this->filled_cv_.notify_one();
+    // NOTE: 次に埋めるチャンクが書き出し待ちでなくなるまで待つ
+    this->drained_cv_.wait(lock, [this] { return this->head_ - this->tail_ < NUM_CHUNKS; });
+}
+void TraceRecorder::write_loop() {
+    std::unique_lock lock(this->mutex_);
+    while (true) {
+        this->filled_cv_.wait(lock, [this] { return this->tail_ < this->head_ || this->stopping_; });
+        if (this->tail_ == this->head_) {
+            break;
+        }
+        auto &chunk = this->ring_[this->tail_ % NUM_CHUNKS];
+        lock.unlock();
+        this->out_.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+        lock.lock();
+        this->write_failed_ = this->write_failed_ || not this->out_;
+        this->bytes_written_ += chunk.size();
+        chunk.clear();
+        this->tail_++;
+        this->drained_cv_.notify_all();
+    }
+    this->out_.flush();
+    this->write_failed_ = this->write_failed_ || not this->out_;
+}
+void TraceRecorder::close() {
+    if (not this->writer_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard lock(this->mutex_);
+        if (not this->ring_[this->head_ % NUM_CHUNKS].empty()) {
+            this->head_++;
+        }
+        this->stopping_ = true;
+    }
+    this->filled_cv_.notify_one();
+    this->writer_.join();
+    this->out_.close();
+}
+
+TraceReader::TraceReader(const std::string &path) {
+    std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+    if (not in) {
+        throw std::runtime_error("error: failed to open trace " + path);
+    }
+    this->data_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (this->data_.size() < sizeof(trace::MAGIC) ||
+        std::memcmp(this->data_.data(), trace::MAGIC, sizeof(trace::MAGIC)) != 0) {
+        throw std::runtime_error("error: " + path + " is not a nyulan trace");
+    }
+    this->position_ = sizeof(trace::MAGIC);
+    try {
+        auto version = this->get_varint();
+        if (version != trace::FORMAT_VERSION) {
+            throw std::runtime_error("error: " + path + " is a trace of unknown version " + std::to_string(version));
+        }
+        this->code_hash_ = this->get_varint();
+        this->code_size_ = this->get_varint();
+        this->entry_point_ = this->get_varint();
+    } catch (const std::out_of_range &) {
+        throw std::runtime_error("error: the header of " + path + " is truncated");
+    }
+}
+std::uint8_t TraceReader::get_byte() {
+    if (this->position_ >= this->data_.size()) {
+        throw std::out_of_range("error: the trace is truncated");
+    }
+    return this->data_[this->position_++];
+}
+std::uint64_t TraceReader::get_varint() {
+    std::uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        auto byte = this->get_byte();
+        result |= static_cast<std::uint64_t>(byte & 0b0111'1111) << shift;
+        if ((byte & 0b1000'0000) == 0) {
+            return result;
+        }
+    }
+    throw std::runtime_error("error: broken trace: too long varint");
+}
+void TraceReader::expect(trace::Tag tag) {
+    auto found = this->get_byte();
+    if (found != static_cast<std::uint8_t>(tag)) {
+        throw std::runtime_error("error: broken trace: expected event " + std::to_string(static_cast<int>(tag)) +
+                                 " but found " + std::to_string(found) + " at offset " +
+                                 std::to_string(this->position_ - 1));
+    }
+}
+bool TraceReader::at(trace::Tag tag) const {
+    return this->bits_left_ == 0 && this->position_ < this->data_.size() &&
+           this->data_[this->position_] == static_cast<std::uint8_t>(tag);
+}
+
+bool TraceReader::read_bit() {
+    if (this->bits_left_ == 0) {
+        this->expect(trace::Tag::BITS);
+        this->bits_left_ = this->get_varint();
+        if (this->bits_left_ == 0 || this->bits_left_ > 64) {
+            throw std::runtime_error("error: broken trace: " + std::to_string(this->bits_left_) + " bits in a BITS");
+        }
+        this->bits_ = 0;
+        for (std::size_t i = 0; i < (this->bits_left_ + 7) / 8; i++) {
+            this->bits_ |= static_cast<std::uint64_t>(this->get_byte()) << (8 * i);
+        }
+    }
+    bool result = this->bits_ & 1;
+    this->bits_ >>= 1;
+    this->bits_left_--;
+    return result;
+}
+std::int64_t TraceReader::read_target_offset() {
+    this->expect(trace::Tag::TARGET);
+    return trace::unzigzag(this->get_varint());
+}
+trace::Builtin TraceReader::read_builtin() {
+    this->expect(trace::Tag::BUILTIN);
+    trace::Builtin result;
+    result.number = this->get_varint();
+    result.arg_bytes = this->get_varint();
+    auto flags = this->get_byte();
+    result.native = (flags & trace::FLAG_NATIVE) != 0;
+    if ((flags & trace::FLAG_RESULT) != 0) {
+        result.result = this->get_varint();
+    }
+    auto num_inputs = this->get_varint();
+    for (std::uint64_t i = 0; i < num_inputs; i++) {
+        trace::Input input;
+        input.address = this->get_varint();
+        auto size = this->get_varint();
+        if (size > this->data_.size() - this->position_) {
+            throw std::out_of_range("error: the trace is truncated");
+        }
+        input.bytes.assign(this->data_.begin() + this->position_, this->data_.begin() + this->position_ + size);
+        this->position_ += size;
+        result.inputs.push_back(std::move(input));
+    }
+    return result;
+}
+trace::End TraceReader::read_end() {
+    this->expect(trace::Tag::END);
+    trace::End result;
+    result.program_counter = this->get_varint();
+    result.status = static_cast<trace::EndStatus>(this->get_byte());
+    result.exit_code = this->get_varint();
+    return result;
+}
+
+std::optional<trace::End> TraceReader::walk(const std::vector<OneStep> &code,
+                                            const std::function<void(std::uint64_t)> &visit,
+                                            const std::function<void(const trace::Builtin &)> &on_builtin) {
+    std::vector<std::uint64_t> last_targets(code.size(), trace::NO_TARGET);
+    std::vector<std::uint64_t> call_stack;
+    std::optional<trace::End> end;
+    auto target_of = [&](std::uint64_t from) {
+        if (not this->read_bit()) {
+            last_targets[from] = from + this->read_target_offset();
+        }
+        return last_targets[from];
+    };
+    std::uint64_t program_counter = this->entry_point_;
+    try {
+        while (true) {
+            if (not end && this->at(trace::Tag::END)) {
+                end = this->read_end();
+            }
+            // NOTE: ENDの後は分岐の無い命令しか無いので、ENDの位置に初めて来たところで止まる
+            if (end && program_counter == end->program_counter) {
+                if (end->status == trace::EndStatus::FAILED && program_counter < code.size()) {
+                    visit(program_counter);  // 例外を投げた命令
+                }
+                return end;
+            }
+            if (program_counter >= code.size()) {
+                return end;
+            }
+            visit(program_counter);
+            auto step = code[program_counter];
+            switch (trace::branch_kind(step, 0)) {
+                case trace::BranchKind::CONDITIONAL:
+                    program_counter = this->read_bit() ? target_of(program_counter) : program_counter + 1;
+                    break;
+                case trace::BranchKind::JUMP:
+                    if (trace::is_call(step)) {
+                        if (this->at(trace::Tag::BUILTIN)) {
+                            auto builtin = this->read_builtin();
+                            if (on_builtin) {
+                                on_builtin(builtin);
+                            }
+                            program_counter++;
+                            break;
+                        }
+                        call_stack.push_back(program_counter);
+                    }
+                    program_counter = target_of(program_counter);
+                    break;
+                case trace::BranchKind::RETURN:
+                    if (call_stack.empty()) {
+                        return end;
+                    }
+                    program_counter = call_stack.back() + 1;
+                    call_stack.pop_back();
+                    break;
+                case trace::BranchKind::NONE:
+                    program_counter++;
+                    break;
+            }
+        }
+    } catch (const std::out_of_range &) {
+        return std::nullopt;
+    }
+}
+
+TraceReplayer::TraceReplayer(const std::string &path, const std::vector<OneStep> &code)
+    : reader_(path), last_targets_(code.size(), trace::NO_TARGET) {
+    if (this->reader_.code_hash() != trace::hash_code(code) || this->reader_.code_size() != code.size()) {
+        throw std::runtime_error("error: " + path + " was recorded with a different program");
+    }
+}
+void TraceReplayer::verify(std::uint64_t program_counter) {
+    auto from = this->pending_address_;
+    auto kind = this->pending_kind_;
+    this->pending_kind_ = trace::BranchKind::NONE;
+    auto diverged = [from](const std::string &what) {
+        return std::runtime_error("error: replay diverged at @" + std::to_string(from) + ": " + what);
+    };
+    if (kind == trace::BranchKind::CONDITIONAL) {
+        auto taken = this->reader_.read_bit();
+        if (taken != (program_counter != from + 1)) {
+            throw diverged(taken ? "the branch was taken in the trace" : "the branch was not taken in the trace");
+        }
+        if (not taken) {
+            return;
+        }
+    }
+    if (not this->reader_.read_bit()) {
+        this->last_targets_[from] = from + this->reader_.read_target_offset();
+    }
+    if (this->last_targets_[from] != program_counter) {
+        throw diverged("jumped to @" + std::to_string(program_counter) + " but @" +
+                       std::to_string(this->last_targets_[from]) + " in the trace");
+    }
+}
+trace::Builtin TraceReplayer::next_builtin(Register::ValueType number) {
+    if (not this->reader_.at(trace::Tag::BUILTIN)) {
+        throw std::runtime_error("error: replay diverged: builtin " + std::to_string(number) +
+                                 " was called where the trace has no call");
+    }
+    auto result = this->reader_.read_builtin();
+    if (result.number != number) {
+        throw std::runtime_error("error: replay diverged: builtin " + std::to_string(number) + " was called but " +
+                                 std::to_string(result.number) + " in the trace");
+    }
+    this->num_builtins_++;
+    return result;
+}
+void TraceReplayer::finish(Address program_counter, trace::EndStatus status, std::uint64_t exit_code) {
+    if (this->pending_kind_ != trace::BranchKind::NONE) {
+        this->verify(program_counter.value());
+    }
+    if (not this->reader_.at(trace::Tag::END)) {
+        throw std::runtime_error("error: replay ended at @" + std::to_string(program_counter.value()) +
+                                 " before the end of the trace");
+    }
+    auto end = this->reader_.read_end();
+    if (end.status != status || end.exit_code != exit_code || end.program_counter != program_counter.value()) {
+        throw std::runtime_error("error: replay ended at @" + std::to_string(program_counter.value()) +
+                                 " with exit code " + std::to_string(exit_code) + " but the trace ended at @" +
+                                 std::to_string(end.program_counter) + " with exit code " +
+                                 std::to_string(end.exit_code));
+    }
+}
+}  // namespace nyulan
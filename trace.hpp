@@ -0,0 +1,202 @@
+#ifndef NYULAN_TRACE
+#define NYULAN_TRACE
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nyulan.hpp"
+namespace nyulan {
+// 実行のトレース。分岐の結果と、組み込み関数の結果、組み込み関数がゲストのメモリに書き込んだ入力だけを記録する
+// コードと合わせれば実行した命令を全て辿れ(TraceReader::walk())、同じ実行をVMでやり直せる(TraceReplayer)
+//
+// ファイルはヘッダの後ろにイベントが並ぶ。数値は全てLEB128
+//   BITS n ビット列  分岐ごとに、条件分岐なら分岐したか、分岐したら分岐先がその分岐命令の前回と同じか
+//   TARGET 分岐先-分岐命令のアドレス(zigzag)  前回と違ったときだけ
+//   BUILTIN 番号 引数のバイト数 フラグ [結果] 入力の数 (アドレス 長さ バイト列)...
+//   END 最後のプログラムカウンタ 終わり方 終了コード
+// RETの戻り先はCALLから分かるので記録しない。組み込み関数のCALLとゲストのCALLは、BUILTINが続くかで見分ける
+// NOTE: 記録するのはVM一つ分だけ。SPAWNしたスレッドの実行とそのメモリへの書き込みは含まない
+namespace trace {
+constexpr char MAGIC[8] = {'N', 'Y', 'U', 'T', 'R', 'A', 'C', 'E'};
+constexpr std::uint64_t FORMAT_VERSION = 1;
+enum class Tag : std::uint8_t {
+    BITS = 0,
+    TARGET = 1,
+    BUILTIN = 2,
+    END = 3,
+};
+enum class BranchKind : std::uint8_t {
+    NONE,
+    CONDITIONAL,  // IFZ、IFP、IFN
+    JUMP,         // GOTO、ゲストの関数へのCALL
+    RETURN,
+};
+// calleeはCALLのときのアドレスのレジスタの値
+BranchKind branch_kind(OneStep step, Register callee);
+bool is_call(OneStep step);
+// 記録した結果を使わず、再生するときも実際に呼ぶ組み込み関数(VMの中だけで完結し、決定的なもの)
+bool replays_natively(Register::ValueType number);
+std::uint64_t hash_code(const std::vector<OneStep> &code);
+
+struct Input {
+    std::uint64_t address;
+    std::vector<std::uint8_t> bytes;
+};
+struct Builtin {
+    Register::ValueType number;
+    std::uint64_t arg_bytes;
+    bool native;
+    std::optional<Register::ValueType> result;
+    std::vector<Input> inputs;
+};
+enum class EndStatus : std::uint8_t {
+    FINISHED = 0,  // コードの末尾を越えた
+    EXITED = 1,
+    FAILED = 2,  // 例外で止まった
+};
+struct End {
+    std::uint64_t program_counter;
+    EndStatus status;
+    std::uint64_t exit_code;
+};
+}  // namespace trace
+
+// VMが命令ごとに呼ぶ。書き出しはリングバッファを介して裏のスレッドが行うので、ファイルへの書き込みを待たない
+class TraceRecorder {
+   public:
+    static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+    static constexpr std::size_t NUM_CHUNKS = 16;  // 書き出しが追いつかなければ、空くまで待つ
+
+    TraceRecorder(const std::string &path, const std::vector<OneStep> &code, Address entry_point);
+    ~TraceRecorder();  // finish()されていなくても、そこまでを書き出す
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+    // 命令を実行する前
+    void step(Address program_counter, trace::BranchKind kind) {
+        if (this->pending_kind_ != trace::BranchKind::NONE) {
+            this->resolve(program_counter.value());
+        }
+        if (kind == trace::BranchKind::CONDITIONAL || kind == trace::BranchKind::JUMP) {
+            this->pending_kind_ = kind;
+            this->pending_address_ = program_counter.value();
+        }
+    }
+    void input(Address address, std::vector<std::uint8_t> bytes);  // 組み込み関数の中で
+    void builtin(Register::ValueType number, std::size_t arg_bytes, const std::optional<Register> &result);
+    // 未解決の分岐を片付けてENDを書き、ファイルを閉じる
+    void finish(Address program_counter, trace::EndStatus status, std::uint64_t exit_code);
+    std::uint64_t bytes_written() const;
+
+   private:
+    std::ofstream out_;
+    std::vector<std::uint64_t> last_targets_;  // 分岐命令ごとの前回の分岐先
+    trace::BranchKind pending_kind_ = trace::BranchKind::NONE;
+    std::uint64_t pending_address_ = 0;
+    std::uint64_t bits_ = 0;
+    std::size_t num_bits_ = 0;
+    std::vector<trace::Input> inputs_;
+    bool finished_ = false;
+
+    std::array<std::vector<std::uint8_t>, NUM_CHUNKS> ring_;
+    std::size_t head_ = 0;  // 次に埋めるチャンク。これより前で、tail_以降のものが書き出し待ち
+    std::size_t tail_ = 0;
+    std::uint64_t bytes_written_ = 0;
+    mutable std::mutex mutex_;
+    std::condition_variable filled_cv_;
+    std::condition_variable drained_cv_;
+    bool stopping_ = false;
+    bool write_failed_ = false;
+    std::thread writer_;
+
+    void resolve(std::uint64_t program_counter);
+    void put_bit(bool bit);
+    void flush_bits();
+    void put_byte(std::uint8_t byte) {
+        auto &chunk = this->ring_[this->head_ % NUM_CHUNKS];
+        chunk.push_back(byte);
+        if (chunk.size() >= CHUNK_SIZE) [[unlikely]] {
+            this->submit();
+        }
+    }
+    void put_varint(std::uint64_t value);
+    void submit();
+    void write_loop();
+    void close();  // 残りを書き出し、書き出すスレッドを止める
+};
+
+// トレースのファイルを頭から読む
+class TraceReader {
+   public:
+    explicit TraceReader(const std::string &path);
+
+    std::uint64_t code_hash() const { return this->code_hash_; }
+    std::uint64_t code_size() const { return this->code_size_; }
+    std::uint64_t entry_point() const { return this->entry_point_; }
+
+    bool read_bit();
+    std::int64_t read_target_offset();
+    trace::Builtin read_builtin();
+    trace::End read_end();
+    // 今のBITSを読み切っていて、次がtagのイベントか
+    bool at(trace::Tag tag) const;
+    bool at_end_of_file() const { return this->bits_left_ == 0 && this->position_ >= this->data_.size(); }
+
+    // codeを辿り、実行した命令ごとにvisitを呼ぶ。組み込み関数を呼んだらon_builtinも呼ぶ
+    // トレースが途中で切れていれば、そこまでで止めてnulloptを返す
+    std::optional<trace::End> walk(const std::vector<OneStep> &code,
+                                   const std::function<void(std::uint64_t program_counter)> &visit,
+                                   const std::function<void(const trace::Builtin &)> &on_builtin = nullptr);
+
+   private:
+    std::vector<std::uint8_t> data_;
+    std::size_t position_ = 0;
+    std::uint64_t code_hash_ = 0;
+    std::uint64_t code_size_ = 0;
+    std::uint64_t entry_point_ = 0;
+    std::uint64_t bits_ = 0;
+    std::size_t bits_left_ = 0;
+
+    std::uint8_t get_byte();
+    std::uint64_t get_varint();
+    void expect(trace::Tag tag);
+};
+
+// 記録した実行をVMでやり直す。分岐がトレースと食い違ったら例外を投げる
+class TraceReplayer {
+   public:
+    TraceReplayer(const std::string &path, const std::vector<OneStep> &code);
+
+    void step(Address program_counter, trace::BranchKind kind) {
+        if (this->pending_kind_ != trace::BranchKind::NONE) {
+            this->verify(program_counter.value());
+        }
+        if (kind == trace::BranchKind::CONDITIONAL || kind == trace::BranchKind::JUMP) {
+            this->pending_kind_ = kind;
+            this->pending_address_ = program_counter.value();
+        }
+    }
+    // 次の組み込み関数の呼び出し。nativeでなければ、呼ばずに引数を捨て、入力を書き込んで結果を積むこと
+    trace::Builtin next_builtin(Register::ValueType number);
+    // 記録した終わり方と同じか確かめる
+    void finish(Address program_counter, trace::EndStatus status, std::uint64_t exit_code);
+    std::uint64_t num_builtins() const { return this->num_builtins_; }
+
+   private:
+    TraceReader reader_;
+    std::vector<std::uint64_t> last_targets_;
+    trace::BranchKind pending_kind_ = trace::BranchKind::NONE;
+    std::uint64_t pending_address_ = 0;
+    std::uint64_t num_builtins_ = 0;
+
+    void verify(std::uint64_t program_counter);
+};
+}  // namespace nyulan
+#endif
@@ -4,7 +4,9 @@
 #include <algorithm>
 #include <bitset>
 #include <cassert>
+#include <cerrno>
 #include <cmath>
+#include <cstring>
 #include <functional>
 #include <ios>
 #include <iostream>
@@ -12,10 +14,18 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <variant>
+#include <utility>
 #include <vector>
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <poll.h>
+#    include <sys/eventfd.h>
+#    include <unistd.h>
+#endif
 
+#include "builtin.hpp"
 #include "logging.hpp"
+#include "objectfile.hpp"
 namespace nyulan {
 namespace {
 Register treat_as_double(Register reg0, Register reg1, std::function<double(double, double)> operation) {
@@ -58,34 +68,235 @@ T pop_as(std::stack<std::uint8_t> &stack) {
 }
 }  // namespace
 VirtualMachine::VirtualMachine(std::vector<std::uint8_t> static_datas, bool enable_debug)
-    : debug_enabled(enable_debug) {
-    Address head_addr = 0;
-    for (const auto &byte : static_datas) {
-        this->static_datas[head_addr] = byte;
-        head_addr++;
-    }
+    : memory(std::make_shared<Memory>(std::move(static_datas))),
+      debug_enabled(enable_debug),
+      code(std::make_shared<const std::vector<OneStep>>()),
+      builtins(builtin::Registry::defaults()),
+      channels(std::make_shared<ChannelTable>()) {
     this->registers.fill(0);
 }
+namespace {
+std::vector<std::uint8_t> flatten(const std::unordered_map<Address, std::uint8_t, Address::Hash> &static_datas) {
+    std::vector<std::uint8_t> result;
+    for (const auto &[addr, byte] : static_datas) {
+        if (addr.value() >= result.size()) {
+            result.resize(addr.value() + 1, 0);
+        }
+        result[addr.value()] = byte;
+    }
+    return result;
+}
+}  // namespace
 VirtualMachine::VirtualMachine(std::unordered_map<Address, std::uint8_t, Address::Hash> static_datas, bool enable_debug)
-    : static_datas(static_datas), debug_enabled(enable_debug) {
+    : VirtualMachine(flatten(static_datas), enable_debug) {}
+VirtualMachine::VirtualMachine(std::shared_ptr<Memory> memory, std::shared_ptr<const std::vector<OneStep>> code,
+                               std::shared_ptr<const builtin::Registry> builtins,
+                               std::shared_ptr<ChannelTable> channels, bool enable_debug)
+    : memory(std::move(memory)),
+      debug_enabled(enable_debug),
+      code(std::move(code)),
+      builtins(std::move(builtins)),
+      channels(std::move(channels)) {
     this->registers.fill(0);
 }
+VirtualMachine::~VirtualMachine() {
+    for (auto &[id, guest_thread] : this->threads) {
+        guest_thread.thread.join();
+    }
+    for (auto &[fd, file] : this->files) {
+        if (file.owned) {
+            ::close(file.fd);
+        }
+    }
+    this->finish_channel_wait();
+    if (this->channel_eventfd != -1) {
+        ::close(this->channel_eventfd);
+    }
+}
 void VirtualMachine::install_callbacks(CallBacks callbacks) { this->callbacks = callbacks; }
+void VirtualMachine::install_builtins(std::shared_ptr<const builtin::Registry> builtins) {
+    this->builtins = std::move(builtins);
+}
+void VirtualMachine::share_channels(std::shared_ptr<ChannelTable> channels) {
+    this->channels = std::move(channels);
+    this->channel_cache.clear();
+}
+void VirtualMachine::suspend_on_channel_wait(bool enable) { this->suspend_on_channel_wait_ = enable; }
+void VirtualMachine::enable_guard_pages(std::uint64_t reserve, Memory::HugePages huge_pages) {
+    this->memory->enable_guard_pages(reserve, huge_pages);
+}
+void VirtualMachine::prefer_memory_node(int node) { this->memory->prefer_node(node); }
+void VirtualMachine::attach_profiler(std::shared_ptr<Profiler> profiler) {
+    this->profile_clock = profiler->start_clock();
+    this->profiler = std::move(profiler);
+    this->instrumented = true;
+}
+void VirtualMachine::attach_call_graph(std::shared_ptr<CallGraphProfiler> call_graph) {
+    this->call_graph = std::move(call_graph);
+    this->instrumented = true;
+}
+void VirtualMachine::attach_coverage(std::shared_ptr<Coverage> coverage) {
+    this->coverage = std::move(coverage);
+    this->instrumented = true;
+}
+void VirtualMachine::attach_trace_recorder(std::shared_ptr<TraceRecorder> recorder) {
+    this->trace_recorder = std::move(recorder);
+    this->instrumented = true;
+}
+void VirtualMachine::attach_trace_replayer(std::shared_ptr<TraceReplayer> replayer) {
+    this->trace_replayer = std::move(replayer);
+    this->instrumented = true;
+}
+void VirtualMachine::enable_stats() {
+    this->exec_stats = std::make_unique<ExecStats>();
+    this->instrumented = true;
+}
+const ExecStats *VirtualMachine::stats() const { return this->exec_stats.get(); }
+Memory::Usage VirtualMachine::memory_usage() { return this->memory->usage(); }
+void VirtualMachine::attach_metrics(std::shared_ptr<MetricsFile> metrics, std::size_t slot) {
+    this->metrics_tick = metrics->tick();
+    this->metrics = std::move(metrics);
+    this->metrics_slot = slot;
+    this->metrics_started_ns = MetricsFile::now_ns();
+    this->instrumented = true;
+}
+void VirtualMachine::publish_metrics(MetricsFile::State state) {
+    auto usage = this->memory->usage();  // NOTE: 共有ロックを取るが、間隔ごとに一度だけ
+    MetricsFile::Values values;
+    values.state = state;
+    values.steps = this->metrics_steps;
+    values.builtin_calls = this->io_counters.builtin_calls;
+    values.bytes_read = this->io_counters.bytes_read;
+    values.bytes_written = this->io_counters.bytes_written;
+    values.heap_live = usage.live_bytes;
+    values.heap_peak = usage.peak_bytes;
+    values.exit_code = this->exit_code ? this->exit_code->value() : 0;
+    values.started_ns = this->metrics_started_ns;
+    values.updated_ns = MetricsFile::now_ns();
+    values.name = this->metrics->read(this->metrics_slot).name;
+    this->metrics->publish(this->metrics_slot, values);
+}
+void VirtualMachine::map_static_segments(const std::string &path, const std::vector<StaticSegment> &segments) {
+    this->memory->map_static_segments(path, segments);
+}
 using namespace magic_enum::ostream_operators;  // enumをこの名前空間内でストリームに流すため
-void VirtualMachine::exec(std::vector<OneStep> steps, Address entry_point) {
-    program_counter = entry_point;
-    while (program_counter < steps.size()) {
-        const auto &step = steps.at(static_cast<size_t>(program_counter));
+void VirtualMachine::load_code(std::vector<OneStep> code) {
+    this->load_code(std::make_shared<const std::vector<OneStep>>(std::move(code)));
+}
+void VirtualMachine::load_code(std::shared_ptr<const std::vector<OneStep>> code) {
+    this->code = std::move(code);
+    this->original_code = nullptr;
+    this->breakpoints.clear();
+}
+ExecResult VirtualMachine::exec(std::vector<OneStep> steps, Address entry_point) {
+    this->load_code(std::move(steps));
+    this->start(entry_point);
+    return this->resume();
+}
+ExecResult VirtualMachine::call(Address function, std::span<const Register> args) {
+    this->start_call(function, args);
+    return this->resume();
+}
+ExecResult VirtualMachine::call(const ObjectFile &objectfile, const std::string &label,
+                                std::span<const Register> args) {
+    return this->call(objectfile.find_label(label).label_address, args);
+}
+void VirtualMachine::start(Address entry_point) {
+    this->program_counter = entry_point;
+    this->return_depth = std::nullopt;
+    this->io_wait = std::nullopt;
+    this->step_instrumented = false;
+    if (this->call_graph != nullptr) {
+        this->call_graph->enter(entry_point.value(), std::nullopt);
+    }
+}
+void VirtualMachine::start_call(Address function, std::span<const Register> args) {
+    if (args.size() > this->registers.size()) {
+        throw std::invalid_argument("error: too many arguments(" + std::to_string(args.size()) + ") for call");
+    }
+    std::copy(args.begin(), args.end(), this->registers.begin());
+    this->program_counter = function;
+    this->return_depth = this->call_stack.size();
+    this->io_wait = std::nullopt;
+    this->step_instrumented = false;
+    if (this->call_graph != nullptr) {
+        this->call_graph->enter(function.value(), std::nullopt);
+    }
+}
+ExecResult VirtualMachine::resume(std::uint64_t max_steps) {
+    this->io_wait = std::nullopt;
+    if (this->metrics == nullptr) {
+        return this->run(max_steps);
+    }
+    try {
+        auto result = this->run(max_steps);
+        switch (result.status) {
+            case ExecStatus::SUSPENDED:
+                this->publish_metrics(MetricsFile::State::READY);
+                break;
+            case ExecStatus::BLOCKED:
+                this->publish_metrics(MetricsFile::State::BLOCKED);
+                break;
+            default:
+                this->publish_metrics(MetricsFile::State::FINISHED);
+                break;
+        }
+        return result;
+    } catch (...) {
+        this->publish_metrics(MetricsFile::State::FAILED);
+        throw;
+    }
+}
+std::optional<IoWait> VirtualMachine::blocked_on() const { return this->io_wait; }
+void VirtualMachine::redirect_stdio(int in_fd, int out_fd, int err_fd) {
+    for (const auto &[guest_fd, host_fd] : {std::pair{0, in_fd}, {1, out_fd}, {2, err_fd}}) {
+        this->files.insert_or_assign(guest_fd, HostFile{host_fd, false, ""});
+    }
+}
+ExecResult VirtualMachine::run(std::uint64_t max_steps) {
+    // NOTE: 見張っているページへの書き込みは、SIGSEGVハンドラから命令の途中でWatchFaultとして投げられる
+    auto remaining = max_steps;
+    try {
+        return this->run_steps(remaining);
+    } catch (const WatchFault &fault) {
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "write to watched page @" << fault.address;
+        this->step_instrumented = this->instrumented;
+        return ExecResult{ExecStatus::WATCHPOINT, max_steps - remaining};
+    }
+}
+ExecResult VirtualMachine::run_steps(std::uint64_t &max_steps) {
+    const auto budget = max_steps;
+    this->exit_code = std::nullopt;
+    const auto &code = *this->code;
+    std::optional<ExecStats::Running> running;
+    if (this->exec_stats != nullptr) {
+        running.emplace(*this->exec_stats);
+    }
+    for (; program_counter < code.size(); max_steps--) {
+        if (max_steps == 0) {
+            return ExecResult{ExecStatus::SUSPENDED, 0};
+        }
+        const auto &step = code[static_cast<size_t>(program_counter)];
+        // NOTE: フックより前に確かめて、ブレークポイントを越えるときに同じ命令を二度数えないようにする
+        if ((step.value() >> 8) == static_cast<std::uint8_t>(Instruction::BREAK)) [[unlikely]] {
+            if (this->breakpoints.contains(program_counter.value())) {
+                return ExecResult{ExecStatus::BREAKPOINT, budget - max_steps};
+            }
+        }
+        if (this->instrumented) [[unlikely]] {
+            if (not std::exchange(this->step_instrumented, false)) {
+                this->instrument_step(step);
+            }
+        }
         auto instruction = (step & 0b1111'1111'0000'0000) >> 8;
         int operand[] = {static_cast<int>((step & 0b1111'0000) >> 4), static_cast<int>((step & 0b1111))};
         std::optional<Address> next_program_counter = std::nullopt;
         BOOST_LOG_TRIVIAL(debug) << stringify_vm_state();
-        std::stringstream debug_msg;
-        debug_msg << "@" << static_cast<int>(program_counter) << " opecode"
-                  << std::to_string(static_cast<int>(instruction)) << "("
-                  << magic_enum::enum_cast<Instruction>(static_cast<int>(instruction)).value() << ") " << operand[0]
-                  << "," << operand[1];
-        BOOST_LOG_TRIVIAL(debug) << debug_msg.str();
+        // NOTE: ストリームに直接流せば、debugが無効のときは整形されない
+        BOOST_LOG_TRIVIAL(debug) << "@" << static_cast<int>(program_counter) << " opecode"
+                                 << std::to_string(static_cast<int>(instruction)) << "("
+                                 << magic_enum::enum_name(static_cast<Instruction>(instruction.value())) << ") "
+                                 << operand[0] << "," << operand[1];
         this->callbacks.on_loop_head(this->program_counter, step);
         switch (instruction.value()) {
             case static_cast<uint8_t>(Instruction::MOV):
@@ -232,37 +443,38 @@ void VirtualMachine::exec(std::vector<OneStep> steps, Address entry_point) {
             }
 
             case static_cast<uint8_t>(Instruction::STORE8):
-                access_memory(this->registers[operand[0]]) =
-                    static_cast<uint8_t>(this->registers[operand[1]] & 0b1111'1111);
+                store_byte(this->registers[operand[0]],
+                           static_cast<uint8_t>(this->registers[operand[1]] & 0b1111'1111));
                 break;
             case static_cast<uint8_t>(Instruction::STORE16):
                 for (size_t i = 0; i < sizeof(uint16_t); i++) {
-                    access_memory(this->registers[operand[0]]) =
-                        static_cast<uint8_t>((this->registers[operand[1]] >> (8 * i)) & 0b1111'1111);
+                    store_byte(this->registers[operand[0]].value() + i,
+                               static_cast<uint8_t>((this->registers[operand[1]] >> (8 * i)) & 0b1111'1111));
                 }
                 break;
             case static_cast<uint8_t>(Instruction::STORE32):
                 for (size_t i = 0; i < sizeof(uint32_t); i++) {
-                    access_memory(this->registers[operand[0]]) =
-                        static_cast<uint8_t>((this->registers[operand[1]] >> (8 * i)) & 0b1111'1111);
+                    store_byte(this->registers[operand[0]].value() + i,
+                               static_cast<uint8_t>((this->registers[operand[1]] >> (8 * i)) & 0b1111'1111));
                 }
                 break;
             case static_cast<uint8_t>(Instruction::STORE64):
                 for (size_t i = 0; i < sizeof(uint64_t); i++) {
-                    access_memory(this->registers[operand[0]]) =
-                        static_cast<uint8_t>((this->registers[operand[1]] >> (8 * i)) & 0b1111'1111);
+                    store_byte(this->registers[operand[0]].value() + i,
+                               static_cast<uint8_t>((this->registers[operand[1]] >> (8 * i)) & 0b1111'1111));
                 }
                 break;
 
             case static_cast<uint8_t>(Instruction::LOAD8):
                 this->registers[operand[0]] ^= (this->registers[operand[0]] & 0b1111'1111);
-                this->registers[operand[0]] |= access_memory(this->registers[operand[1]]);
+                this->registers[operand[0]] |= load_byte(this->registers[operand[1]]);
                 break;
             case static_cast<uint8_t>(Instruction::LOAD16): {
                 this->registers[operand[0]] ^= (this->registers[operand[0]] & (~static_cast<std::uint16_t>(0)));
                 uint16_t value = 0;
                 for (size_t i = 0; i < sizeof(uint16_t); i++) {
-                    value |= access_memory(this->registers[operand[1] + i]) << (8 * i);
+                    value |= static_cast<uint16_t>(load_byte(this->registers[operand[1]].value() + i))
+                             << (8 * i);
                 }
                 this->registers[operand[0]] |= value;
                 break;
@@ -271,7 +483,8 @@ void VirtualMachine::exec(std::vector<OneStep> steps, Address entry_point) {
                 this->registers[operand[0]] ^= (this->registers[operand[0]] & (~static_cast<std::uint32_t>(0)));
                 uint32_t value = 0;
                 for (size_t i = 0; i < sizeof(uint32_t); i++) {
-                    value |= access_memory(this->registers[operand[1] + i]) << (8 * i);
+                    value |= static_cast<uint32_t>(load_byte(this->registers[operand[1]].value() + i))
+                             << (8 * i);
                 }
                 this->registers[operand[0]] |= value;
                 break;
@@ -281,7 +494,8 @@ void VirtualMachine::exec(std::vector<OneStep> steps, Address entry_point) {
                 uint64_t value = 0;
                 for (size_t i = 0; i < sizeof(uint64_t); i++) {
                     TRIVIAL_LOG_WITH_FUNCNAME(debug) << "access @" << (this->registers[operand[1]] + i).value();
-                    value |= access_memory(this->registers[operand[1]] + i) << (8 * i);
+                    value |= static_cast<uint64_t>(load_byte(this->registers[operand[1]].value() + i))
+                             << (8 * i);
                 }
                 this->registers[operand[0]] |= value;
                 break;
@@ -314,25 +528,69 @@ void VirtualMachine::exec(std::vector<OneStep> steps, Address entry_point) {
             case static_cast<uint8_t>(Instruction::CALL):
                 if (registers[operand[0]] & ((Register)0b1 << 63)) {
                     // built_in
-                    auto result =
-                        this->invoke_builtin(registers[operand[0]] & ~((Register)0b1 << 63));  //最上位ビットのみを抽出
+                    if (this->memory->watching()) [[unlikely]] {
+                        // NOTE: 組み込み関数は途中から実行し直せないので、保護を外して呼んでもらう
+                        this->step_instrumented = this->instrumented;
+                        return ExecResult{ExecStatus::WATCHPOINT, budget - max_steps};
+                    }
+                    std::optional<Register> result;
+                    auto called_at =
+                        this->exec_stats != nullptr ? ExecStats::Clock::now() : ExecStats::Clock::time_point();
+                    try {
+                        result = this->invoke_builtin(registers[operand[0]] &
+                                                      ~((Register)0b1 << 63));  //最上位ビットのみを抽出
+                    } catch (const builtin::WouldBlock &would_block) {
+                        this->io_wait = would_block.wait;  // 引数は積み直されているので、再開時にこのCALLをやり直す
+                        this->step_instrumented = this->instrumented;
+                        return ExecResult{ExecStatus::BLOCKED, 0};
+                    }
+                    if (this->exec_stats != nullptr) {
+                        this->exec_stats->builtin((registers[operand[0]] & ~((Register)0b1 << 63)).value(),
+                                                  ExecStats::Clock::now() - called_at);
+                    }
                     if (result) {
-                        for (size_t i = 0; i < sizeof(Register::ValueType); i++) {
-                            std::uint8_t byte =
-                                static_cast<uint8_t>((result.value() & (0b1111'1111 << (i * 8))) >> (i * 8));
-                            calculation_stack.push(byte);
-                        }
+                        this->push_argument(result.value().value());
+                    }
+                    if (this->exit_code) {
+                        this->program_counter++;  // 再開されたときはEXITの次から
+                        return ExecResult{ExecStatus::EXITED, this->exit_code.value()};
                     }
                     break;  //プログラムカウンタは普通に進む
                 } else {
                     this->call_stack.push(program_counter);
                     next_program_counter = this->registers[operand[0]];
+                    if (this->call_graph != nullptr) {
+                        this->call_graph->enter(next_program_counter->value(), program_counter.value());
+                    }
                 }
                 break;
             case static_cast<uint8_t>(Instruction::RET):
+                if (this->call_graph != nullptr) {
+                    this->call_graph->leave();
+                }
+                if (this->return_depth && this->call_stack.size() == this->return_depth.value()) {  // call()で呼んだ関数から戻る
+                    return ExecResult{ExecStatus::RETURNED, this->registers[0]};
+                }
+                if (this->call_stack.empty()) {
+                    throw std::runtime_error("error: tried to return with empty call stack");
+                }
                 next_program_counter = this->call_stack.top().value() + 1;  //呼出の次の命令から再開
                 this->call_stack.pop();
                 break;
+            case static_cast<uint8_t>(Instruction::ALOAD):
+                this->registers[operand[0]] = this->memory->atomic_load(this->registers[operand[1]]);
+                break;
+            case static_cast<uint8_t>(Instruction::ASTORE):
+                this->memory->atomic_store(this->registers[operand[0]], this->registers[operand[1]].value());
+                break;
+            case static_cast<uint8_t>(Instruction::CAS):
+                this->registers[0] = this->memory->compare_exchange(
+                    this->registers[operand[0]], this->registers[0].value(), this->registers[operand[1]].value());
+                break;
+            case static_cast<uint8_t>(Instruction::FADD):
+                this->registers[operand[1]] =
+                    this->memory->fetch_add(this->registers[operand[0]], this->registers[operand[1]].value());
+                break;
             default: {
                 std::stringstream err_msg;
                 err_msg << "@" << static_cast<int>(program_counter) << " can't understand opecode"
@@ -350,112 +608,447 @@ void VirtualMachine::exec(std::vector<OneStep> steps, Address entry_point) {
         }
         this->callbacks.on_program_counter_updated(this->program_counter);
     }
+    return ExecResult{ExecStatus::FINISHED, 0};
+}
+void VirtualMachine::instrument_step(OneStep step) {
+    if (this->coverage != nullptr) {
+        this->coverage->hit(this->program_counter.value());
+    }
+    if (this->trace_recorder != nullptr || this->trace_replayer != nullptr) {
+        auto kind = trace::branch_kind(step, this->registers[(step & 0b1111'0000).value() >> 4]);
+        if (this->trace_recorder != nullptr) {
+            this->trace_recorder->step(this->program_counter, kind);
+        } else {
+            this->trace_replayer->step(this->program_counter, kind);
+        }
+    }
+    if (this->profiler != nullptr && this->profiler->due(this->profile_clock)) {
+        this->profiler->sample(this->program_counter, this->call_stack);
+    }
+    if (this->call_graph != nullptr) {
+        this->call_graph->step();
+    }
+    if (this->metrics != nullptr) {
+        this->metrics_steps++;
+        if (this->metrics->due(this->metrics_tick)) {
+            this->publish_metrics(MetricsFile::State::RUNNING);
+        }
+    }
+    if (this->exec_stats != nullptr) {
+        this->exec_stats->step(((step & 0b1111'1111'0000'0000) >> 8).value(), this->calculation_stack.size(),
+                               this->call_stack.size());
+    }
 }
 std::optional<Register> VirtualMachine::invoke_builtin(Address func_addr) {
     TRIVIAL_LOG_WITH_FUNCNAME(debug) << "called" << func_addr.value();
-    // std::vector<std::variant<Register::ValueType, Address::ValueType, size_t>> args;
-    std::vector<std::variant<size_t>> args;  // currently, all types above is the same
-    std::optional<Register> result = std::nullopt;
-    switch (func_addr.value()) {
-        case static_cast<uint8_t>(BuiltinFuncs::READ):
-            args.push_back(pop_as<Register::ValueType>(this->calculation_stack));
-            args.push_back(pop_as<Address::ValueType>(this->calculation_stack));
-            args.push_back(pop_as<size_t>(this->calculation_stack));
-            result = this->read(std::get<Register::ValueType>(args[0]), std::get<Address::ValueType>(args[1]),
-                                std::get<size_t>(args[2]));
-            break;
-        case static_cast<uint8_t>(BuiltinFuncs::WRITE):
-            args.push_back(pop_as<Register::ValueType>(this->calculation_stack));
-            args.push_back(pop_as<Address::ValueType>(this->calculation_stack));
-            args.push_back(pop_as<size_t>(this->calculation_stack));
-            this->write(std::get<Register::ValueType>(args[0]), std::get<Address::ValueType>(args[1]),
-                        std::get<size_t>(args[2]));
-            break;
-        case static_cast<uint8_t>(BuiltinFuncs::EXIT):
-            args.push_back(pop_as<Register::ValueType>(this->calculation_stack));
-            this->exit(std::get<Register::ValueType>(args[0]));
-            break;
-        default: {
-            std::stringstream err_msg;
-            err_msg << "can't invoke built in function" << func_addr.value();
-            throw std::runtime_error(err_msg.str());
+    const auto *handler = this->builtins->find(func_addr.value());
+    if (handler == nullptr) {
+        std::stringstream err_msg;
+        err_msg << "can't invoke built in function" << func_addr.value();
+        throw std::runtime_error(err_msg.str());
+    }
+    this->io_counters.builtin_calls++;
+    if (this->trace_replayer != nullptr) {
+        auto replayed = this->trace_replayer->next_builtin(func_addr.value());
+        if (not replayed.native) {
+            for (std::size_t i = 0; i < replayed.arg_bytes; i++) {
+                this->calculation_stack.pop();
+            }
+            for (const auto &input : replayed.inputs) {
+                this->memory->store_bytes(input.address, input.bytes.data(), input.bytes.size());
+            }
+            return replayed.result ? std::optional<Register>(replayed.result.value()) : std::nullopt;
         }
     }
+    auto depth = this->calculation_stack.size();
+    auto result = (*handler)(*this);
+    if (this->trace_recorder != nullptr) {
+        this->trace_recorder->builtin(func_addr.value(), depth - this->calculation_stack.size(), result);
+    }
     return result;
 }
+void VirtualMachine::trace_input(Address buf, std::size_t len) {
+    if (this->trace_recorder == nullptr) {
+        return;
+    }
+    std::vector<std::uint8_t> bytes(len);
+    for (std::size_t i = 0; i < len; i++) {
+        bytes[i] = this->load_byte(Address(buf + i));
+    }
+    this->trace_recorder->input(buf, std::move(bytes));
+}
+Register::ValueType VirtualMachine::pop_argument() { return pop_as<Register::ValueType>(this->calculation_stack); }
+void VirtualMachine::push_argument(Register::ValueType value) {
+    for (size_t i = 0; i < sizeof(Register::ValueType); i++) {  // PUSHR64と同じ順
+        this->calculation_stack.push(static_cast<std::uint8_t>((value >> (i * 8)) & 0b1111'1111));
+    }
+}
 Register VirtualMachine::read(Register fd, Address buf, std::size_t len) {
     TRIVIAL_LOG_WITH_FUNCNAME(debug) << "built-in read invoked";
-    Register result;
-    // TODO: fd0とそれ以外の処理が、cinかfstream*かしか違わず、ほぼ同じコード。きれいにまとめられるはず
-    if (fd.value() == 0) {
-        for (size_t i = 0; i < len; i++) {
-            auto new_char = std::cin.get();
-            access_memory(Address(buf + i)) = new_char;
-            result = i + 1;  // NOTE: iは序数なので0始まり、結果は基数なので1始まり
-            if (new_char == '\n') {
-                break;  // NOTE: resultは、途中でここに入ったらそのときの値のままで、最後まで行ったらちゃんとlen+1になる
-            }
-        }
-    } else if (fd.value() < 3) {
+    if (fd.value() == 1 || fd.value() == 2) {
         throw std::runtime_error("error: neither stdout nor stderr is readable");
-    } else {
-        for (size_t i = 0; i < len; i++) {
-            auto new_char = this->fd_to_file.at(fd)->get();
-            access_memory(Address(buf + i)) = new_char;
-            result = i + 1;  // NOTE: iは序数なので0始まり、結果は基数なので1始まり
-            if (new_char == '\n') {
-                break;
-            }
+    }
+    auto file = this->files.find(fd.value());
+    if (file != this->files.end()) {
+        return this->read_host(file->second, buf, len);
+    }
+    if (fd.value() != 0) {
+        throw std::runtime_error("error: fd " + std::to_string(fd.value()) + " is not opened");
+    }
+    Register result = 0;
+    for (size_t i = 0; i < len; i++) {
+        auto new_char = std::cin.get();
+        if (new_char == std::char_traits<char>::eof()) {
+            break;  // NOTE: EOFなら読めた分だけ返す
+        }
+        store_byte(Address(buf + i), new_char);
+        result = i + 1;  // NOTE: iは序数なので0始まり、結果は基数なので1始まり
+        if (new_char == '\n') {
+            break;  // NOTE: resultは、途中でここに入ったらそのときの値のままで、最後まで行ったらちゃんとlen+1になる
         }
     }
+    this->io_counters.bytes_read += result.value();
+    this->trace_input(buf, result.value());
     return result;
 }
 void VirtualMachine::write(Register fd, Address buf, std::size_t len) {
     TRIVIAL_LOG_WITH_FUNCNAME(debug) << "built-in write invoked";
     TRIVIAL_LOG_WITH_FUNCNAME(debug) << "fd:" << fd.value() << "buf:" << buf.value() << "len:" << len;
     TRIVIAL_LOG_WITH_FUNCNAME(debug) << "write into " << fd.value();
+    if (fd.value() == 0) {
+        throw std::runtime_error("error: stdin is not writable");
+    }
+    auto file = this->files.find(fd.value());
+    if (file != this->files.end()) {
+        return this->write_host(file->second.fd, buf, len);
+    }
     switch (fd.value()) {
-        case 0:
-            throw std::runtime_error("error: stdin is not readable");
-            break;
         case 1:
             for (size_t i = 0; i < len; i++) {
-                std::cout.put(access_memory(Address(buf + i)));
+                std::cout.put(load_byte(Address(buf + i)));
             }
             break;
         case 2:
             for (size_t i = 0; i < len; i++) {
-                std::cerr.put(access_memory(Address(buf + i)));
+                std::cerr.put(load_byte(Address(buf + i)));
             }
             break;
         default:
-            for (size_t i = 0; i < len; i++) {
-                this->fd_to_file.at(fd)->put(access_memory(Address(buf + i)));
+            throw std::runtime_error("error: fd " + std::to_string(fd.value()) + " is not opened");
+    }
+    this->io_counters.bytes_written += len;
+}
+Register VirtualMachine::read_host(HostFile &file, Address buf, std::size_t len) {
+    // NOTE: std::cinのときと同じく、改行までかlenバイトまでを読む
+    auto newline = file.input_buffer.find('\n');
+    while (newline == std::string::npos && file.input_buffer.size() < len && not file.input_eof) {
+        char chunk[4096];
+        auto read_size = ::read(file.fd, chunk, sizeof(chunk));
+        if (read_size > 0) {
+            file.input_buffer.append(chunk, read_size);
+            newline = file.input_buffer.find('\n');
+        } else if (read_size == 0) {
+            file.input_eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            throw builtin::WouldBlock{IoWait{file.fd, false}};
+        } else if (errno != EINTR) {
+            throw std::runtime_error(std::string("error: failed to read: ") + std::strerror(errno));
+        }
+    }
+    auto available = (newline == std::string::npos) ? file.input_buffer.size() : newline + 1;
+    auto result = std::min(len, available);
+    for (size_t i = 0; i < result; i++) {
+        store_byte(Address(buf + i), static_cast<std::uint8_t>(file.input_buffer[i]));
+    }
+    file.input_buffer.erase(0, result);
+    this->io_counters.bytes_read += result;
+    this->trace_input(buf, result);
+    return result;
+}
+void VirtualMachine::write_host(int fd, Address buf, std::size_t len) {
+    std::string data(len, '\0');
+    for (size_t i = 0; i < len; i++) {
+        data[i] = static_cast<char>(load_byte(Address(buf + i)));
+    }
+    // NOTE: BLOCKEDから再開されたときは、書き込み済みの分を飛ばす
+    while (this->write_progress < len) {
+        auto written = ::write(fd, data.data() + this->write_progress, len - this->write_progress);
+        if (written >= 0) {
+            this->write_progress += written;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            throw builtin::WouldBlock{IoWait{fd, true}};
+        } else if (errno != EINTR) {
+            this->write_progress = 0;
+            throw std::runtime_error(std::string("error: failed to write: ") + std::strerror(errno));
+        }
+    }
+    this->write_progress = 0;
+    this->io_counters.bytes_written += len;
+}
+void VirtualMachine::configure_async_io(unsigned queue_depth, AsyncIo::Backend backend) {
+    if (this->async_io) {
+        throw std::logic_error("error: async io is already in use");
+    }
+    this->async_io_depth = queue_depth;
+    this->async_io_backend = backend;
+}
+int VirtualMachine::host_fd_of(Register fd) {
+    auto file = this->files.find(fd.value());
+    if (file != this->files.end()) {
+        return file->second.fd;
+    }
+    if (fd.value() < 3) {
+        return static_cast<int>(fd.value());  // redirect_stdio()されていなければ、そのまま
+    }
+    throw std::runtime_error("error: fd " + std::to_string(fd.value()) + " is not opened");
+}
+Register VirtualMachine::aio_submit(Register fd, Address buf, std::size_t len, Register offset, bool is_write) {
+    if (not this->async_io) {
+        this->async_io = AsyncIo::create(this->async_io_depth, this->async_io_backend);
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "async io backend: " << this->async_io->backend_name();
+    }
+    auto host_fd = this->host_fd_of(fd);
+    this->memory->check_range(buf, len);  // NOTE: lenはゲストが決めるので、ホストのバッファを確保する前に確かめる
+    auto ticket = this->next_ticket++;
+    auto &pending =
+        this->pending_io.emplace(ticket, PendingIo{buf, is_write, std::vector<std::uint8_t>(len)}).first->second;
+    if (is_write) {
+        this->memory->load_bytes(buf, pending.buffer.data(), len);
+    }
+    this->async_io->submit(
+        AsyncIo::Request{ticket, host_fd, is_write, pending.buffer.data(), len, static_cast<std::uint64_t>(offset)});
+    return ticket;
+}
+void VirtualMachine::record_completion(AsyncIo::Completion completion) {
+    auto pending = this->pending_io.find(completion.ticket);
+    if (pending != this->pending_io.end()) {
+        pending->second.result = completion.result;
+        if (completion.result > 0) {
+            (pending->second.is_write ? this->io_counters.bytes_written : this->io_counters.bytes_read) +=
+                completion.result;
+        }
+    }
+}
+Register VirtualMachine::aio_poll(Register ticket) {
+    auto pending = this->pending_io.find(ticket.value());
+    if (pending == this->pending_io.end()) {
+        throw std::runtime_error("error: there is no async io with ticket " + std::to_string(ticket.value()));
+    }
+    while (not pending->second.result) {
+        auto completion = this->async_io->poll();
+        if (not completion) {
+            return 0;
+        }
+        this->record_completion(completion.value());
+    }
+    return 1;
+}
+Register VirtualMachine::aio_wait(Register ticket) {
+    auto pending = this->pending_io.find(ticket.value());
+    if (pending == this->pending_io.end()) {
+        throw std::runtime_error("error: there is no async io with ticket " + std::to_string(ticket.value()));
+    }
+    if (this->suspend_on_channel_wait_) {
+        // NOTE: 完了を待つ間ワーカーを塞がないように、終わっていなければ完了通知のeventfdでBLOCKEDになる
+        std::uint64_t count;
+        [[maybe_unused]] auto drained = ::read(this->async_io->completion_fd(), &count, sizeof(count));
+        while (not pending->second.result) {
+            auto completion = this->async_io->poll();
+            if (not completion) {
+                throw builtin::WouldBlock{IoWait{this->async_io->completion_fd(), false}};
             }
-            break;
+            this->record_completion(completion.value());
+        }
+    }
+    while (not pending->second.result) {
+        this->record_completion(this->async_io->wait());
+    }
+    auto result = pending->second.result.value();
+    if (not pending->second.is_write) {
+        if (result > 0) {  // NOTE: 失敗したときは負なので、何もしない
+            this->memory->store_bytes(pending->second.guest_buffer, pending->second.buffer.data(), result);
+        }
+        this->trace_input(pending->second.guest_buffer, std::max<std::int64_t>(result, 0));
+    }
+    this->pending_io.erase(pending);
+    return static_cast<Register::ValueType>(result);
+}
+Register VirtualMachine::open(Address fname, Register flags) {
+    std::string host_fname;
+    for (Address addr = fname; load_byte(addr) != '\0'; ++addr) {
+        host_fname.push_back(static_cast<char>(load_byte(addr)));
+    }
+    // NOTE: flagsはO_RDONLY、O_WRONLY、O_RDWRのどれか。書き込むときは無ければ作る
+    int host_flags = static_cast<int>(flags.value() & O_ACCMODE) | O_CLOEXEC;
+    if ((host_flags & O_ACCMODE) == O_WRONLY) {
+        host_flags |= O_CREAT | O_TRUNC;
+    } else if ((host_flags & O_ACCMODE) == O_RDWR) {
+        host_flags |= O_CREAT;
+    }
+    auto host_fd = ::open(host_fname.c_str(), host_flags, 0644);
+    if (host_fd == -1) {
+        TRIVIAL_LOG_WITH_FUNCNAME(debug) << "failed to open " << host_fname << ": " << std::strerror(errno);
+        return ~static_cast<Register::ValueType>(0);  // -1
+    }
+    auto guest_fd = this->next_fd++;
+    // NOTE: 開き直すときに中身を消さないように、O_TRUNCは覚えない
+    this->files.emplace(guest_fd, HostFile{host_fd, true, "", false, host_fname, host_flags & ~O_TRUNC});
+    return guest_fd;
+}
+void VirtualMachine::close(Register fd) {
+    auto file = this->files.find(fd.value());
+    if (file == this->files.end()) {
+        throw std::runtime_error("error: fd " + std::to_string(fd.value()) + " is not opened");
     }
+    if (file->second.owned) {
+        ::close(file->second.fd);
+    }
+    this->files.erase(file);
 }
-Register VirtualMachine::open(Address fname) {}
-void VirtualMachine::close(Register fd) {}
-void VirtualMachine::exit(Register exit_code) { ::exit(exit_code.value()); }
+void VirtualMachine::exit(Register exit_code) { this->exit_code = exit_code; }  // ホストのプロセスは終了させない
 
-std::uint8_t &VirtualMachine::access_memory(Address addr) {
-    std::stringstream debug_msg;
-    debug_msg << std::bitset<8 * sizeof(addr.value())>(addr.value());
-    TRIVIAL_LOG_WITH_FUNCNAME(debug) << debug_msg.str();
-    TRIVIAL_LOG_WITH_FUNCNAME(debug) << (addr.value() & (UINT64_C(1) << 63));
-    TRIVIAL_LOG_WITH_FUNCNAME(debug) << (addr.value() & ~(UINT64_C(1) << 63));
-    try {
-        if ((addr.value() & (UINT64_C(1) << 63)) == 0) {  //最上位ビットが立ってない
-            return this->memory.at(addr);
-        } else {
-            return this->static_datas.at((addr.value() & ~(UINT64_C(1) << 63)));
+Register VirtualMachine::spawn(Address entry_point, Register arg) {
+    auto thread_id = this->next_thread_id++;
+    auto &guest_thread = this->threads[thread_id];
+    guest_thread.vm.reset(
+        new VirtualMachine(this->memory, this->unpatched_code(), this->builtins, this->channels, this->debug_enabled));
+    if (this->profiler != nullptr) {
+        guest_thread.vm->attach_profiler(this->profiler);
+    }
+    if (this->coverage != nullptr) {
+        guest_thread.vm->attach_coverage(this->coverage);
+    }
+    guest_thread.thread = std::thread([&guest_thread, entry_point, arg] {
+        try {
+            Register args[] = {arg};
+            guest_thread.result = guest_thread.vm->call(entry_point, args);
+        } catch (...) {
+            guest_thread.error = std::current_exception();  // joinしたスレッドで投げ直す
         }
-    } catch (std::out_of_range) {
-        std::string type = ((addr.value() & (UINT64_C(1) << 63)) == 0) ? "dynamic" : "static";
-        throw std::runtime_error("invalid memory access to " + type +
-                                 " address:" + std::to_string(addr.value() & ~(UINT64_C(1) << 63)));
+    });
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << "spawned thread " << thread_id << " @" << entry_point.value();
+    return thread_id;
+}
+Register VirtualMachine::join(Register thread_id) {
+    auto guest_thread = this->threads.find(thread_id.value());
+    if (guest_thread == this->threads.end()) {
+        throw std::runtime_error("error: there is no joinable thread with id " + std::to_string(thread_id.value()));
+    }
+    guest_thread->second.thread.join();
+    auto result = guest_thread->second.result;
+    auto error = guest_thread->second.error;
+    this->threads.erase(guest_thread);
+    if (this->memory.use_count() == 1) {  // 他にメモリを触るスレッドがいない
+        this->memory->reclaim_retired();
     }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return result.value;
+}
+Address VirtualMachine::malloc(std::size_t size) { return this->memory->allocate(size); }
+void VirtualMachine::free(Address addr) { this->memory->deallocate(addr, this->memory.use_count() == 1); }
+
+Register VirtualMachine::channel_create(std::size_t capacity, std::size_t message_size, Register kind) {
+    auto channel_kind = magic_enum::enum_cast<Channel::Kind>(static_cast<int>(kind.value()));
+    if (not channel_kind) {
+        throw std::runtime_error("error: unknown channel kind " + std::to_string(kind.value()));
+    }
+    return this->channels->create(capacity, message_size, channel_kind.value());
+}
+std::shared_ptr<Channel> VirtualMachine::channel_of(Register channel_id) {
+    auto cached = this->channel_cache.find(channel_id.value());
+    if (cached != this->channel_cache.end()) {
+        return cached->second;
+    }
+    auto channel = this->channels->find(channel_id.value());
+    if (not channel) {
+        throw std::runtime_error("error: there is no channel with id " + std::to_string(channel_id.value()));
+    }
+    this->channel_cache.emplace(channel_id.value(), channel);
+    return channel;
+}
+Register VirtualMachine::channel_send(Register channel_id, Address buf, std::size_t len) {
+    auto channel = this->channel_of(channel_id);
+    if (len > channel->message_size()) {
+        throw std::runtime_error("error: message of " + std::to_string(len) + " bytes is too large for channel " +
+                                 std::to_string(channel_id.value()));
+    }
+    auto fill = [&](std::uint8_t *slot) {
+        this->memory->load_bytes(buf, slot, len);
+        return len;
+    };
+    while (true) {
+        this->finish_channel_wait();
+        if (channel->try_send(fill)) {
+            return len;
+        }
+        if (channel->closed()) {
+            return ~static_cast<Register::ValueType>(0);  // -1
+        }
+        this->wait_channel(channel, Channel::Side::SENDER);
+    }
+}
+Register VirtualMachine::channel_receive(Register channel_id, Address buf, std::size_t len) {
+    auto channel = this->channel_of(channel_id);
+    auto drain = [&](const std::uint8_t *slot, std::size_t size) {
+        this->memory->store_bytes(buf, slot, std::min(size, len));
+    };
+    while (true) {
+        this->finish_channel_wait();
+        if (auto size = channel->try_receive(drain)) {
+            this->trace_input(buf, std::min(size.value(), len));
+            return size.value();
+        }
+        if (channel->closed()) {
+            // NOTE: 閉じられる直前に送られたものが残っているかもしれない
+            auto size = channel->try_receive(drain);
+            if (size) {
+                this->trace_input(buf, std::min(size.value(), len));
+            }
+            return size ? size.value() : ~static_cast<Register::ValueType>(0);
+        }
+        this->wait_channel(channel, Channel::Side::RECEIVER);
+    }
+}
+void VirtualMachine::channel_close(Register channel_id) { this->channel_of(channel_id)->close(); }
+void VirtualMachine::wait_channel(const std::shared_ptr<Channel> &channel, Channel::Side side) {
+    if (this->channel_eventfd == -1) {
+        this->channel_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->channel_eventfd == -1) {
+            throw std::runtime_error(std::string("error: failed to create eventfd: ") + std::strerror(errno));
+        }
+    }
+    channel->add_waiter(side, this->channel_eventfd);
+    this->channel_wait = std::pair{channel, side};
+    if (side == Channel::Side::SENDER ? channel->can_send() : channel->can_receive()) {
+        return;  // 登録している間に状態が変わった
+    }
+    if (this->suspend_on_channel_wait_) {
+        throw builtin::WouldBlock{IoWait{this->channel_eventfd, false}};
+    }
+    pollfd event{this->channel_eventfd, POLLIN, 0};
+    while (::poll(&event, 1, -1) == -1 && errno == EINTR) {
+    }
+}
+void VirtualMachine::finish_channel_wait() {
+    if (not this->channel_wait) {
+        return;
+    }
+    auto &[channel, side] = this->channel_wait.value();
+    channel->remove_waiter(side, this->channel_eventfd);  // NOTE: 起こされていれば、もう外されている
+    std::uint64_t count;
+    [[maybe_unused]] auto read_size = ::read(this->channel_eventfd, &count, sizeof(count));
+    this->channel_wait = std::nullopt;
+}
+
+std::uint8_t VirtualMachine::load_byte(Address addr) {
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << std::bitset<8 * sizeof(addr.value())>(addr.value());
+    return this->memory->load(addr);
+}
+void VirtualMachine::store_byte(Address addr, std::uint8_t value) {
+    TRIVIAL_LOG_WITH_FUNCNAME(debug) << std::bitset<8 * sizeof(addr.value())>(addr.value());
+    this->memory->store(addr, value);
 }
 
 std::string VirtualMachine::stringify_vm_state() {
@@ -470,6 +1063,46 @@ std::string VirtualMachine::stringify_vm_state() {
 
 // REVIEW: 読み込んでいるだけなので、マルチスレッドはないままで大丈夫？
 Address VirtualMachine::get_program_counter() { return this->program_counter; }
+std::vector<std::uint8_t> VirtualMachine::load_memory(Address addr, std::size_t len) {
+    std::vector<std::uint8_t> result(len);
+    this->memory->load_bytes(addr, result.data(), len);
+    return result;
+}
+void VirtualMachine::set_breakpoint(Address address) {
+    if (this->code == nullptr || address.value() >= this->code->size()) {
+        throw std::out_of_range("error: breakpoint @" + std::to_string(address.value()) + " is out of the code");
+    }
+    if (this->breakpoints.contains(address.value())) {
+        return;
+    }
+    if (this->original_code == nullptr) {
+        this->original_code = this->code;
+        this->code = std::make_shared<const std::vector<OneStep>>(*this->original_code);
+    }
+    // NOTE: codeは上で作った複製なので、書き換えてよい
+    auto &patched = const_cast<std::vector<OneStep> &>(*this->code);
+    this->breakpoints.emplace(address.value(), patched[address.value()]);
+    patched[address.value()] = static_cast<std::uint16_t>(static_cast<std::uint16_t>(Instruction::BREAK) << 8);
+}
+void VirtualMachine::clear_breakpoint(Address address) {
+    auto found = this->breakpoints.find(address.value());
+    if (found == this->breakpoints.end()) {
+        return;
+    }
+    const_cast<std::vector<OneStep> &>(*this->code)[address.value()] = found->second;
+    this->breakpoints.erase(found);
+    if (this->breakpoints.empty()) {
+        this->code = this->original_code;
+        this->original_code = nullptr;
+    }
+}
+bool VirtualMachine::watch(Address address, std::uint64_t size) { return this->memory->watch(address, size); }
+void VirtualMachine::unwatch(Address address, std::uint64_t size) { this->memory->unwatch(address, size); }
+void VirtualMachine::disarm_watches() { this->memory->disarm_watches(); }
+void VirtualMachine::arm_watches() { this->memory->arm_watches(); }
+std::shared_ptr<const std::vector<OneStep>> VirtualMachine::unpatched_code() const {
+    return this->original_code != nullptr ? this->original_code : this->code;
+}
 
 // TODO: マルチスレッドに対応した実装
 /*
@@ -1,18 +1,36 @@
 #ifndef NYULAN_VM
 #define NYULAN_VM
 #include <array>
-#include <fstream>
+#include <exception>
 #include <functional>
+#include <limits>
 #include <map>
 #include <memory>
 #include <optional>
+#include <span>
 #include <stack>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "async_io.hpp"
+#include "callgraph.hpp"
+#include "channel.hpp"
+#include "coverage.hpp"
+#include "memory.hpp"
+#include "metrics.hpp"
 #include "nyulan.hpp"
+#include "profiler.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 namespace nyulan {
+namespace builtin {
+class Registry;
+}
+class LockstepEngine;
+class Snapshot;
+struct ObjectFile;
 template <class R, class... Args>
 R NOP(Args...) {
     return R();  // TODO:デフォルトコンストラクタがない型をどうにかする?
@@ -24,39 +42,213 @@ struct CallBacks {
     std::function<void(Address)> on_program_counter_updated = NOP<void, Address>;
     std::function<void(Address, OneStep)> on_loop_head = NOP<void, Address, OneStep>;
 };
+enum class ExecStatus {
+    FINISHED,  // プログラムカウンタがコードの末尾を越えた
+    RETURNED,  // call()で呼んだ関数がRETした
+    EXITED,    // EXITが呼ばれた
+    SUSPENDED,  // resume()に渡したステップ数を使い切った
+    BLOCKED,    // 組み込み関数がI/Oを待っている。blocked_on()が待っているfdを返す
+    BREAKPOINT,  // set_breakpoint()したアドレスに来た。プログラムカウンタはその命令を指したまま
+    WATCHPOINT,  // 見張っているページに書き込もうとしたか、組み込み関数を呼ぼうとした。その命令はまだ実行していない
+};
+struct ExecResult {
+    ExecStatus status;
+    Register value;  // EXITEDなら終了コード、RETURNEDならr0、BREAKPOINT、WATCHPOINTならそこまでに実行したステップ数
+};
+struct IoWait {
+    int fd;  // ホストのfd
+    bool for_write;
+};
 class VirtualMachine {
    public:
     VirtualMachine(std::vector<std::uint8_t>, bool enable_debug = false);
     VirtualMachine(std::unordered_map<Address, std::uint8_t, Address::Hash>, bool enable_debug = false);
+    ~VirtualMachine();  // 実行中のゲストスレッドを待ち、開いたファイルを閉じる
     void install_callbacks(CallBacks callbacks);
-    void exec(std::vector<OneStep>, Address entry_point = 0);
+    void load_code(std::vector<OneStep> code);
+    void load_code(std::shared_ptr<const std::vector<OneStep>> code);  // 他のVMと共有する
+    ExecResult exec(std::vector<OneStep>, Address entry_point = 0);
+    // load_code()済みのコードの関数を呼び、対応するRETで戻る。引数はr0から順に渡す
+    // レジスタ、スタック、メモリは呼び出しの間で保持される
+    ExecResult call(Address function, std::span<const Register> args = {});
+    // objectfileの大域ラベルlabelの関数を呼ぶ。objectfileはload_code()したコードのものであること
+    // NOTE: ラベルは呼ぶたびに探すので、何度も呼ぶならアドレスを覚えておいてcall(Address)を使う
+    ExecResult call(const ObjectFile &objectfile, const std::string &label, std::span<const Register> args = {});
+    // exec()、call()と同じ準備だけをして、実行はresume()で行う
+    void start(Address entry_point);
+    void start_call(Address function, std::span<const Register> args = {});
+    // 最大max_stepsステップ実行する。SUSPENDED、BLOCKEDで戻ったら、もう一度呼べば続きから実行される
+    ExecResult resume(std::uint64_t max_steps = std::numeric_limits<std::uint64_t>::max());
+    std::optional<IoWait> blocked_on() const;
+    // ゲストのfd0,1,2をホストのfdに繋ぐ。O_NONBLOCKなfdが読み書きできないと、BLOCKEDで戻る
+    void redirect_stdio(int in_fd, int out_fd, int err_fd);
+    // 非同期I/Oの設定。最初のAIO_READ、AIO_WRITEより前に呼ぶこと
+    void configure_async_io(unsigned queue_depth, AsyncIo::Backend backend = AsyncIo::Backend::AUTO);
+    void install_builtins(std::shared_ptr<const builtin::Registry> builtins);
+    // 同じ表を渡したVMの間で、チャネルの番号が共有される。SPAWNしたスレッドは親の表を使う
+    void share_channels(std::shared_ptr<ChannelTable> channels);
+    // trueなら、チャネルやAIO_WAITで待つときにホストのスレッドを止めずにBLOCKEDで戻る(Schedulerで動かすとき)
+    void suspend_on_channel_wait(bool enable);
+    // 動的メモリをガードページで守られた仮想領域に置き、アクセスごとの範囲確認をなくす。最初のMALLOCより前に呼ぶこと
+    void enable_guard_pages(std::uint64_t reserve = Memory::DEFAULT_GUARD_RESERVE,
+                            Memory::HugePages huge_pages = Memory::HugePages::NONE);
+    void prefer_memory_node(int node);  // Memory::prefer_node()
+    // オブジェクトファイルv4の静的セグメントを置く。load_code()と同じく、実行前に呼ぶこと
+    void map_static_segments(const std::string &path, const std::vector<StaticSegment> &segments);
+    // サンプリングプロファイラを付ける。SPAWNしたスレッドにも引き継ぐ
+    void attach_profiler(std::shared_ptr<Profiler> profiler);
+    // CALL、RETを数える。start()、start_call()より前に呼ぶこと。SPAWNしたスレッドには引き継がない
+    void attach_call_graph(std::shared_ptr<CallGraphProfiler> call_graph);
+    // 実行した命令をビットマップに記録する。SPAWNしたスレッドにも引き継ぐ
+    void attach_coverage(std::shared_ptr<Coverage> coverage);
+    // 分岐と組み込み関数の結果を記録する。TraceReplayerを付けると、組み込み関数を呼ばずに記録した結果を使う
+    // start()より前に、どちらか一方だけを付けること。SPAWNしたスレッドには引き継がない
+    void attach_trace_recorder(std::shared_ptr<TraceRecorder> recorder);
+    void attach_trace_replayer(std::shared_ptr<TraceReplayer> replayer);
+    // 実行の統計(ExecStats)を数え始める。SPAWNしたスレッドの分は含まない
+    void enable_stats();
+    const ExecStats *stats() const;  // enable_stats()していなければnullptr
+    Memory::Usage memory_usage();
+    // カウンタを共有メモリのslotに、MetricsFileの間隔ごとと、resume()から戻るときに書き出す
+    void attach_metrics(std::shared_ptr<MetricsFile> metrics, std::size_t slot);
+    void publish_metrics(MetricsFile::State state);
+
+    // for builtins
+    Register::ValueType pop_argument();
+    void push_argument(Register::ValueType value);
+    // ゲストのLOAD、STOREと同じ(Memory::load()、Memory::store())
+    std::uint8_t load_byte(Address addr);
+    void store_byte(Address addr, std::uint8_t value);
 
     // for debugging
     std::string stringify_vm_state();
     Address get_program_counter();
     void set_program_counter(Address new_value);
+    // 確保されていないところを含むなら、何も読まずに投げる(Memory::load_bytes())
+    std::vector<std::uint8_t> load_memory(Address addr, std::size_t len);
+    // コードを複製し、addressの命令をBREAKに書き換える。命令ごとに確かめるものは増えない
+    // ブレークポイントから続けるときは、clear_breakpoint()して1ステップ実行してから、また置くこと
+    // NOTE: SPAWNしたスレッドとスナップショットは、書き換える前のコードを使う
+    void set_breakpoint(Address address);
+    void clear_breakpoint(Address address);
+    // addressからsizeバイトを含むページを書き込み禁止にし、書き込む命令の前でWATCHPOINTで止まる
+    // 見張っていないメモリへのアクセスは遅くならない。ページを保護できない部分があればfalse(Memory::watch())
+    // 止まったら、disarm_watches()して1ステップ実行してから、arm_watches()すること
+    // NOTE: 組み込み関数は途中からやり直せないので、見張っている間は書き込むかどうかに関わらず、呼ぶ前に止まる
+    bool watch(Address address, std::uint64_t size);
+    void unwatch(Address address, std::uint64_t size);
+    void disarm_watches();
+    void arm_watches();
 
    private:
     std::array<Register, 16> registers;
     std::stack<std::uint8_t> calculation_stack;
     std::stack<Address> call_stack;
-    std::map<Register, std::unique_ptr<std::fstream>> fd_to_file;
-    std::unordered_map<Address, std::uint8_t, Address::Hash> memory;
-    std::unordered_map<Address, std::uint8_t, Address::Hash> static_datas;
+    std::shared_ptr<Memory> memory;  // ゲストスレッド間で共有
     bool debug_enabled;
     Address program_counter;
+    std::shared_ptr<const std::vector<OneStep>> code;
+    // ブレークポイントがあるときだけ、書き換える前のコード。codeはその複製を書き換えたもの
+    std::shared_ptr<const std::vector<OneStep>> original_code = nullptr;
+    std::map<std::uint64_t, OneStep> breakpoints;  // アドレス => 元の命令
+    std::optional<Register> exit_code = std::nullopt;
+    std::optional<std::size_t> return_depth = std::nullopt;  // call()されたときの、戻り先のコールスタックの深さ
+    std::optional<IoWait> io_wait = std::nullopt;
+    struct HostFile {
+        int fd;
+        bool owned;                // OPENで開いたもの。CLOSEかデストラクタで閉じる
+        std::string input_buffer;  // ホストのfdから読んだが、まだゲストに渡していない分
+        bool input_eof = false;
+        std::string path = "";  // OPENで開いたもの。スナップショットから復元するときに開き直す
+        int flags = 0;
+    };
+    std::map<Register::ValueType, HostFile> files;  // ゲストのfd => ホストのfd 0,1,2はredirect_stdio()されたときだけ
+    Register::ValueType next_fd = 3;
+    std::size_t write_progress = 0;  // BLOCKEDになったWRITEで、書き込み済みのバイト数
+    struct PendingIo {
+        Address guest_buffer;
+        bool is_write;
+        std::vector<std::uint8_t> buffer;  // ゲストがFREEしても大丈夫なように、ホスト側のバッファを使う
+        std::optional<std::int64_t> result = std::nullopt;
+    };
+    std::map<Register::ValueType, PendingIo> pending_io;  // チケット => 要求
+    std::unique_ptr<AsyncIo> async_io;                   // NOTE: pending_ioのバッファより先に破棄されるように後に置く
+    unsigned async_io_depth = 64;
+    AsyncIo::Backend async_io_backend = AsyncIo::Backend::AUTO;
+    Register::ValueType next_ticket = 1;
     CallBacks callbacks = CallBacks();
+    std::shared_ptr<const builtin::Registry> builtins;
+    struct GuestThread {
+        std::unique_ptr<VirtualMachine> vm;  // 独自のレジスタ、スタックを持ち、メモリとコードは共有する
+        std::thread thread;
+        ExecResult result;
+        std::exception_ptr error;
+    };
+    std::map<Register::ValueType, GuestThread> threads;
+    Register::ValueType next_thread_id = 1;
+    std::shared_ptr<ChannelTable> channels;
+    std::map<Register::ValueType, std::shared_ptr<Channel>> channel_cache;  // 表のロックを毎回取らないように
+    int channel_eventfd = -1;                                               // チャネルを待つときに起こしてもらう
+    std::optional<std::pair<std::shared_ptr<Channel>, Channel::Side>> channel_wait = std::nullopt;
+    bool suspend_on_channel_wait_ = false;
+    std::shared_ptr<Profiler> profiler = nullptr;
+    Profiler::Clock profile_clock{};
+    std::shared_ptr<CallGraphProfiler> call_graph = nullptr;
+    std::shared_ptr<Coverage> coverage = nullptr;
+    std::shared_ptr<TraceRecorder> trace_recorder = nullptr;
+    std::shared_ptr<TraceReplayer> trace_replayer = nullptr;
+    std::unique_ptr<ExecStats> exec_stats = nullptr;
+    std::shared_ptr<MetricsFile> metrics = nullptr;
+    std::size_t metrics_slot = 0;
+    std::uint64_t metrics_tick = 0;
+    std::uint64_t metrics_started_ns = 0;
+    std::uint64_t metrics_steps = 0;  // metricsがあるときだけ数える
+    bool instrumented = false;       // 上のどれかがある。無ければ、命令ごとに確かめるのはこれだけ
+    bool step_instrumented = false;  // BLOCKED、WATCHPOINTで途中から戻った命令。やり直すときにフックを呼ばない
+    struct IoCounters {              // 常に数える
+        std::uint64_t builtin_calls = 0;
+        std::uint64_t bytes_read = 0;
+        std::uint64_t bytes_written = 0;
+    };
+    IoCounters io_counters;
 
+    // ゲストスレッド用
+    VirtualMachine(std::shared_ptr<Memory> memory, std::shared_ptr<const std::vector<OneStep>> code,
+                   std::shared_ptr<const builtin::Registry> builtins, std::shared_ptr<ChannelTable> channels,
+                   bool enable_debug);
+    ExecResult run(std::uint64_t max_steps);
+    ExecResult run_steps(std::uint64_t &max_steps);  // run()の本体。実行したステップ数はmax_stepsの減り方で分かる
+    std::shared_ptr<const std::vector<OneStep>> unpatched_code() const;
+    void instrument_step(OneStep step);
     std::optional<Register> invoke_builtin(Address);
+    void trace_input(Address buf, std::size_t len);  // 組み込み関数がゲストのメモリに書き込んだ入力を記録する
     // builtins
     Register read(Register fd, Address buf, std::size_t len);
+    Register read_host(HostFile &file, Address buf, std::size_t len);
     void write(Register fd, Address buf, std::size_t len);
-    Register open(Address fname);
+    void write_host(int fd, Address buf, std::size_t len);
+    Register open(Address fname, Register flags);
     void close(Register fd);
+    Register aio_submit(Register fd, Address buf, std::size_t len, Register offset, bool is_write);
+    Register aio_poll(Register ticket);
+    Register aio_wait(Register ticket);
+    int host_fd_of(Register fd);
+    void record_completion(AsyncIo::Completion completion);
     void exit(Register exit_code);
-
-    // wrapper
-    std::uint8_t& access_memory(Address addr);
+    Register spawn(Address entry_point, Register arg);
+    Register join(Register thread_id);
+    Address malloc(std::size_t size);
+    void free(Address addr);
+    Register channel_create(std::size_t capacity, std::size_t message_size, Register kind);
+    Register channel_send(Register channel_id, Address buf, std::size_t len);
+    Register channel_receive(Register channel_id, Address buf, std::size_t len);
+    void channel_close(Register channel_id);
+    std::shared_ptr<Channel> channel_of(Register channel_id);
+    void wait_channel(const std::shared_ptr<Channel> &channel, Channel::Side side);
+    void finish_channel_wait();
+    friend class builtin::Registry;
+    friend class LockstepEngine;  // ベクトル化しない命令を、レーンごとにこのVMで1ステップずつ実行する
+    friend class Snapshot;
 };
 }  // namespace nyulan
 #endif